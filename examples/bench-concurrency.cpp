@@ -0,0 +1,170 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Measures how rendering a shared chat_template scales with threads (run from the repository's root for the default files):
+
+        bench-concurrency [--threads 16] [--seconds 1] [--repeat 4] [--context tests/contexts/tool_use.json] [template.jinja...]
+
+    Each template (by default the Qwen3-Coder and the synthetic DeepSeek V3.2 DSML ones) is rendered from 1, 2, 4... threads
+    with the context's conversation repeated --repeat times, in stages that isolate the usual contention points:
+
+        apply         the whole chat_template::apply
+        prepare       polyfills, conversion of the inputs to minja values and Context::builtins()
+        render        rendering inputs prepared once and shared by all threads (shared AST and input values: refcounts)
+        builtins      Context::builtins() alone (allocator)
+        strftime_now  a template only calling strftime_now (localtime)
+
+    Stages whose throughput per thread drops below 70% of the single-threaded one are flagged as contended.
+*/
+#include <minja/chat-template.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static std::string read_file(const std::string & path) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Failed to open %s\n", path.c_str());
+        exit(1);
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+    return ss.str();
+}
+
+// Runs op on n threads for the given duration, returning the number of ops per second.
+static double throughput(size_t n, std::chrono::duration<double> duration, const std::function<void()> & op) {
+    std::atomic<bool> stop {false};
+    std::atomic<size_t> ready {0};
+    std::vector<size_t> counts(n, 0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n; t++) {
+        threads.emplace_back([&, t]() {
+            ready++;
+            while (ready < n) std::this_thread::yield();
+            size_t count = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                op();
+                count++;
+            }
+            counts[t] = count;
+        });
+    }
+    while (ready < n) std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto & thread : threads) thread.join();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t total = 0;
+    for (auto count : counts) total += count;
+    return total / elapsed;
+}
+
+int main(int argc, char ** argv) {
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double seconds = 1;
+    size_t repeat = 4;
+    std::string context_path = "tests/contexts/tool_use.json";
+    std::vector<std::string> templates;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--threads") {
+            max_threads = std::max<size_t>(1, std::stoul(next()));
+        } else if (arg == "--seconds") {
+            seconds = std::stod(next());
+        } else if (arg == "--repeat") {
+            repeat = std::max<size_t>(1, std::stoul(next()));
+        } else if (arg == "--context") {
+            context_path = next();
+        } else if (arg.rfind("--", 0) != 0) {
+            templates.push_back(arg);
+        } else {
+            fprintf(stderr, "Usage: %s [--threads N] [--seconds S] [--repeat N] [--context context.json] [template.jinja...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (templates.empty()) {
+        templates = {"tests_files/Qwen-Qwen3-Coder-30B-A3B-Instruct.jinja", "tests/synthetic-deepseek-v3.2-dsml.jinja"};
+    }
+
+    auto context = json::parse(read_file(context_path));
+    minja::chat_template_inputs inputs;
+    inputs.messages = json::array();
+    for (size_t i = 0; i < repeat; i++) {
+        for (const auto & message : context.at("messages")) inputs.messages.push_back(message);
+    }
+    inputs.tools = context.value("tools", json());
+    inputs.add_generation_prompt = context.value("add_generation_prompt", true);
+    inputs.extra_context = json::object();
+    for (const auto & item : context.items()) {
+        if (item.key() != "messages" && item.key() != "tools" && item.key() != "add_generation_prompt") {
+            inputs.extra_context[item.key()] = item.value();
+        }
+    }
+
+    std::vector<size_t> thread_counts;
+    for (size_t n = 1; n < max_threads; n *= 2) thread_counts.push_back(n);
+    thread_counts.push_back(max_threads);
+
+    auto duration = std::chrono::duration<double>(seconds);
+    if (max_threads > std::thread::hardware_concurrency()) {
+        fprintf(stderr, "Warning: more threads than the %u hardware threads, efficiency will drop regardless of contention\n", std::thread::hardware_concurrency());
+    }
+
+    printf("%-40s  %-12s  %7s  %12s  %8s  %10s\n", "template", "stage", "threads", "ops/s", "speedup", "efficiency");
+    size_t contended = 0;
+    auto measure = [&](const std::string & name, const char * stage, const std::function<void()> & op) {
+        double single = 0;
+        for (auto n : thread_counts) {
+            auto ops = throughput(n, duration, op);
+            if (n == 1) single = ops;
+            auto speedup = single > 0 ? ops / single : 0;
+            auto efficiency = speedup / n;
+            bool flag = n > 1 && efficiency < 0.7;
+            contended += flag ? 1 : 0;
+            printf("%-40s  %-12s  %7zu  %12.1f  %7.2fx  %9.0f%%%s\n", name.c_str(), stage, n, ops, speedup, efficiency * 100,
+                   flag ? "  <- contention?" : "");
+        }
+    };
+    for (const auto & path : templates) {
+        minja::chat_template tmpl(read_file(path), "<s>", "</s>");
+        auto prepared = tmpl.prepare(inputs);
+        auto name = path.substr(path.find_last_of('/') + 1);
+        measure(name, "apply", [&]() { tmpl.apply(inputs); });
+        measure(name, "prepare", [&]() { tmpl.prepare(inputs); });
+        measure(name, "render", [&]() { tmpl.render(prepared); });
+    }
+    // Shared by all templates.
+    measure("-", "builtins", []() { minja::Context::builtins(); });
+    minja::chat_template clock_tmpl("{{ strftime_now('%d %b %Y %H:%M') }}", "", "");
+    auto clock_prepared = clock_tmpl.prepare(inputs);
+    measure("-", "strftime_now", [&]() { clock_tmpl.render(clock_prepared); });
+
+    if (contended) {
+        printf("\n%zu measurements scaled below 70%% efficiency (also check the machine has that many idle cores).\n", contended);
+    }
+}
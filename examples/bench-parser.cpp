@@ -0,0 +1,197 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Measures Parser::parse throughput on generated templates of several shapes and sizes:
+
+        bench-parser [--min-size 16384] [--max-size 1048576] [--seconds 0.2] [--depth 32] [--lazy] [--dump-dir dir] [shape...]
+
+    Shapes:
+
+        text         long runs of plain text, with stray single braces and JSON snippets
+        tags         thousands of small {{ x }} tags between short text runs
+        expressions  tags holding longer expressions (filters, tests, ternaries, subscripts, calls)
+        nesting      blocks of --depth nested for / if tags, with whitespace control
+        strings      long string literals with escapes
+        comments     many {# comments #} between short text runs
+
+    Each shape is generated at sizes from --min-size to --max-size bytes (quadrupling), and parsed repeatedly for at least
+    --seconds. Since parsing should be linear, a shape whose MB/s at a larger size drops below half of its MB/s at the smallest
+    size is flagged (regex backtracking, quadratic tokenization...). --dump-dir writes the generated templates, to profile one.
+*/
+#include <minja/minja.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+// Appends numbered chunks to a template until it reaches the given size (in whole chunks).
+static std::string generate(size_t size, const std::function<void(std::string &, size_t)> & chunk) {
+    std::string out;
+    out.reserve(size + 1024);
+    for (size_t i = 0; out.size() < size; i++) {
+        chunk(out, i);
+    }
+    return out;
+}
+
+static std::string gen_text(size_t size, size_t) {
+    return generate(size, [](std::string & out, size_t i) {
+        out += "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore.\n";
+        out += i % 2 ? "A { single brace } and a lone } or { in prose, and {\"json\": [1, 2, {\"nested\": true}]}.\n"
+                     : "  Indented line\twith tabs, punctuation (%, #, -) and numbers " + std::to_string(i) + ".\n";
+    });
+}
+
+static std::string gen_tags(size_t size, size_t) {
+    return generate(size, [](std::string & out, size_t i) {
+        out += "x";
+        out += "{{ v" + std::to_string(i % 100) + " }}";
+        out += i % 8 ? " " : "\n";
+    });
+}
+
+static std::string gen_expressions(size_t size, size_t) {
+    return generate(size, [](std::string & out, size_t i) {
+        auto n = std::to_string(i);
+        out += "{{ (a" + n + " + b.c[" + n + "] * 2) | default(1) | string if x is defined and not y else z['k'](1, key=-" + n + ") }}\n";
+        out += "{%- set s" + n + " = [1, 2.5, 'x', none, true, {'k': v}] | selectattr('k') | list -%}\n";
+    });
+}
+
+static std::string gen_nesting(size_t size, size_t depth) {
+    return generate(size, [depth](std::string & out, size_t) {
+        for (size_t d = 0; d < depth; d++) {
+            out += std::string(d, ' ');
+            out += d % 2 ? "{%- if i" + std::to_string(d - 1) + " > 1 %}\n" : "{% for i" + std::to_string(d) + " in items -%}\n";
+        }
+        out += std::string(depth, ' ') + "{{ i0 }}\n";
+        for (size_t d = depth; d-- > 0;) {
+            out += std::string(d, ' ');
+            out += d % 2 ? "{% endif -%}\n" : "{%- endfor %}\n";
+        }
+    });
+}
+
+static std::string gen_strings(size_t size, size_t) {
+    return generate(size, [](std::string & out, size_t i) {
+        out += i % 2 ? "{{ \"" : "{{ '";
+        for (size_t j = 0; j < 64; j++) {
+            out += i % 2 ? "a long \\\"quoted\\\" string with escapes\\n and {{ tag-like }} text, " : "single quoted \\'text\\' with \\t tabs, ";
+        }
+        out += i % 2 ? "\" }}\n" : "' }}\n";
+    });
+}
+
+static std::string gen_comments(size_t size, size_t) {
+    return generate(size, [](std::string & out, size_t i) {
+        out += "text " + std::to_string(i);
+        out += i % 4 ? "{# a short comment #}" : "{#- a longer comment\nspanning lines, with {{ tags }} and {% blocks %} inside -#}";
+        out += "\n";
+    });
+}
+
+struct shape {
+    const char * name;
+    std::string (*generate)(size_t size, size_t depth);
+};
+
+static const std::vector<shape> shapes {
+    {"text", gen_text},
+    {"tags", gen_tags},
+    {"expressions", gen_expressions},
+    {"nesting", gen_nesting},
+    {"strings", gen_strings},
+    {"comments", gen_comments},
+};
+
+// Parses the template repeatedly for at least the given duration, returning the best time of a parse in seconds.
+static double time_parse(const std::string & tmpl, const minja::Options & options, double seconds) {
+    double best = 0;
+    auto start = clock_type::now();
+    do {
+        auto parse_start = clock_type::now();
+        auto root = minja::Parser::parse(tmpl, options);
+        auto elapsed = std::chrono::duration<double>(clock_type::now() - parse_start).count();
+        if (!root) {
+            fprintf(stderr, "Failed to parse the template\n");
+            exit(1);
+        }
+        if (best == 0 || elapsed < best) best = elapsed;
+    } while (std::chrono::duration<double>(clock_type::now() - start).count() < seconds);
+    return best;
+}
+
+int main(int argc, char ** argv) {
+    size_t min_size = 16 * 1024, max_size = 1024 * 1024, depth = 32;
+    double seconds = 0.2;
+    std::string dump_dir;
+    minja::Options options {};
+    std::vector<shape> selected;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--min-size") {
+            min_size = std::max<size_t>(1, std::stoul(next()));
+        } else if (arg == "--max-size") {
+            max_size = std::stoul(next());
+        } else if (arg == "--seconds") {
+            seconds = std::stod(next());
+        } else if (arg == "--depth") {
+            depth = std::max<size_t>(1, std::stoul(next()));
+        } else if (arg == "--lazy") {
+            options.lazy_bodies = true;
+        } else if (arg == "--dump-dir") {
+            dump_dir = next();
+        } else {
+            auto it = std::find_if(shapes.begin(), shapes.end(), [&](const shape & s) { return arg == s.name; });
+            if (it == shapes.end()) {
+                fprintf(stderr, "Usage: %s [--min-size BYTES] [--max-size BYTES] [--seconds S] [--depth N] [--lazy] [--dump-dir dir] [shape...]\n", argv[0]);
+                return 1;
+            }
+            selected.push_back(*it);
+        }
+    }
+    if (selected.empty()) selected = shapes;
+
+    printf("%-12s  %10s  %10s  %10s  %8s\n", "shape", "bytes", "ms", "MB/s", "scaling");
+    size_t superlinear = 0;
+    for (const auto & s : selected) {
+        double first_mbps = 0;
+        for (size_t size = min_size; size <= std::max(min_size, max_size); size *= 4) {
+            auto tmpl = s.generate(size, depth);
+            if (!dump_dir.empty()) {
+                std::ofstream(dump_dir + "/" + s.name + "-" + std::to_string(size) + ".jinja") << tmpl;
+            }
+            auto best = time_parse(tmpl, options, seconds);
+            auto mbps = tmpl.size() / best / 1e6;
+            if (first_mbps == 0) first_mbps = mbps;
+            auto scaling = mbps / first_mbps;
+            bool flag = scaling < 0.5;
+            superlinear += flag ? 1 : 0;
+            printf("%-12s  %10zu  %10.3f  %10.1f  %7.2fx%s\n", s.name, tmpl.size(), best * 1e3, mbps, scaling, flag ? "  <- superlinear?" : "");
+        }
+    }
+    if (superlinear) {
+        printf("\n%zu measurements parsed at less than half their shape's throughput at the smallest size.\n", superlinear);
+    }
+    return superlinear ? 2 : 0;
+}
@@ -0,0 +1,176 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Renders a chat template over JSON lines requests, on several threads:
+
+        minja-render --template tmpl.jinja [--bos <s>] [--eos </s>] [--threads N] [--batch 1024] [requests.jsonl|-] [--output prompts.jsonl]
+
+    Each request is an object with messages, and optionally tools, add_generation_prompt, extra_context, now (ms since the
+    epoch), options (chat_template_options flags) and id, i.e. the inputs of a minja::chat_template_capture's requests. Writes,
+    in the same order, one line per request with its id (or index), prompt (or error) and render time, and prints the
+    throughput to stderr: it's both an offline batch renderer and a throughput benchmark.
+*/
+#include <minja/chat-template.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+using clock_type = std::chrono::steady_clock;
+
+static const char * usage = "Usage: %s --template tmpl.jinja [--bos TOKEN] [--eos TOKEN] [--threads N] [--batch N] [requests.jsonl|-] [--output prompts.jsonl]\n";
+
+struct result {
+    std::string line;
+    bool failed = false;
+    size_t prompt_bytes = 0;
+    int64_t render_ns = 0;
+};
+
+// Renders one request line to an output line.
+static result render_line(const minja::chat_template & tmpl, const std::string & line, size_t index) {
+    result res;
+    json out;
+    auto start = clock_type::now();
+    try {
+        auto request = json::parse(line);
+        out["id"] = request.contains("id") ? request["id"] : json(index);
+        auto inputs = minja::chat_template_capture::inputs_from_json(request);
+        auto opts = minja::chat_template_capture::options_from_json(request.value("options", json::object()));
+        auto prompt = tmpl.apply(inputs, opts);
+        res.prompt_bytes = prompt.size();
+        out["prompt"] = std::move(prompt);
+    } catch (const std::exception & e) {
+        if (!out.contains("id")) out["id"] = index;
+        out["error"] = e.what();
+        res.failed = true;
+    }
+    res.render_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+    out["render_ns"] = res.render_ns;
+    res.line = out.dump(-1, ' ', false, json::error_handler_t::replace);
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    std::string template_path, bos_token, eos_token, input_path = "-", output_path;
+    size_t n_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t batch_size = 1024;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                fprintf(stderr, usage, argv[0]);
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--template") {
+            template_path = next();
+        } else if (arg == "--bos") {
+            bos_token = next();
+        } else if (arg == "--eos") {
+            eos_token = next();
+        } else if (arg == "--threads") {
+            n_threads = std::max<size_t>(1, std::stoul(next()));
+        } else if (arg == "--batch") {
+            batch_size = std::max<size_t>(1, std::stoul(next()));
+        } else if (arg == "--output") {
+            output_path = next();
+        } else if (arg == "-" || arg.rfind("--", 0) != 0) {
+            input_path = arg;
+        } else {
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    }
+    if (template_path.empty()) {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    std::ifstream template_file(template_path);
+    if (!template_file) {
+        fprintf(stderr, "Failed to open %s\n", template_path.c_str());
+        return 1;
+    }
+    std::stringstream source;
+    source << template_file.rdbuf();
+    minja::chat_template tmpl(source.str(), bos_token, eos_token);
+
+    std::ifstream input_file;
+    if (input_path != "-") {
+        input_file.open(input_path);
+        if (!input_file) {
+            fprintf(stderr, "Failed to open %s\n", input_path.c_str());
+            return 1;
+        }
+    }
+    std::istream & in = input_path == "-" ? std::cin : input_file;
+    std::ofstream output_file;
+    if (!output_path.empty()) {
+        output_file.open(output_path);
+        if (!output_file) {
+            fprintf(stderr, "Failed to open %s\n", output_path.c_str());
+            return 1;
+        }
+    }
+    std::ostream & out = output_path.empty() ? std::cout : output_file;
+
+    // Requests are read and written in batches, each rendered by all the threads.
+    size_t n_requests = 0, n_errors = 0, output_bytes = 0;
+    int64_t render_ns = 0;
+    auto start = clock_type::now();
+    std::vector<std::string> lines;
+    std::vector<result> results;
+    std::string line;
+    while (in) {
+        lines.clear();
+        while (lines.size() < batch_size && std::getline(in, line)) {
+            if (!line.empty()) lines.push_back(std::move(line));
+        }
+        if (lines.empty()) break;
+
+        results.assign(lines.size(), result());
+        std::atomic<size_t> next_line {0};
+        auto work = [&]() {
+            for (size_t i; (i = next_line++) < lines.size();) {
+                results[i] = render_line(tmpl, lines[i], n_requests + i);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < std::min(n_threads, lines.size()); t++) {
+            threads.emplace_back(work);
+        }
+        work();
+        for (auto & thread : threads) thread.join();
+
+        for (const auto & res : results) {
+            out << res.line << '\n';
+            n_errors += res.failed ? 1 : 0;
+            output_bytes += res.prompt_bytes;
+            render_ns += res.render_ns;
+        }
+        n_requests += lines.size();
+    }
+    out.flush();
+
+    auto wall_s = std::chrono::duration<double>(clock_type::now() - start).count();
+    fprintf(stderr, "%zu requests (%zu errors) in %.3f s on %zu threads: %.1f requests/s, %.1f MB/s of prompts, %.3f ms per render\n",
+            n_requests, n_errors, wall_s, n_threads, wall_s > 0 ? n_requests / wall_s : 0.0, wall_s > 0 ? output_bytes / wall_s / 1e6 : 0.0,
+            n_requests ? render_ns / 1e6 / n_requests : 0.0);
+    return n_errors ? 2 : 0;
+}
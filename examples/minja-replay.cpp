@@ -0,0 +1,178 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+/*
+    Replays the requests recorded by a minja::chat_template_capture, timing them:
+
+        minja-replay requests.jsonl [--iterations 10] [--warmup 1] [--top 10] [--save results.jsonl] [--baseline results.jsonl]
+
+    Prints the slowest requests, with their render time and the part of it spent building the context (polyfills, conversion
+    of the inputs), and checks the outputs against the captured hashes. --save writes each request's timings and output hash,
+    to compare another build's replay of the same file against them with --baseline.
+*/
+#include <minja/chat-template.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+using clock_type = std::chrono::steady_clock;
+
+struct timings {
+    int64_t context_ns = 0;
+    int64_t render_ns = 0;
+    size_t output_bytes = 0;
+    std::string output_hash;
+};
+
+static int64_t median(std::vector<int64_t> & values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static double ms(int64_t ns) { return ns / 1e6; }
+
+static timings time_request(const minja::chat_template_replay::request & request, int iterations, int warmup) {
+    std::vector<int64_t> context_ns, render_ns;
+    std::string output;
+    for (int i = 0; i < warmup + iterations; i++) {
+        auto start = clock_type::now();
+        request.tmpl->make_context(request.inputs, request.options);
+        auto context_end = clock_type::now();
+        output = request.tmpl->apply(request.inputs, request.options);
+        auto end = clock_type::now();
+        if (i >= warmup) {
+            context_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(context_end - start).count());
+            render_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - context_end).count());
+        }
+    }
+    timings res;
+    res.context_ns = median(context_ns);
+    res.render_ns = median(render_ns);
+    res.output_bytes = output.size();
+    res.output_hash = minja::chat_template_capture::hash(output);
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    std::string path, save_path, baseline_path;
+    int iterations = 10, warmup = 1;
+    size_t top = 10;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--iterations") {
+            iterations = std::max(1, std::stoi(next()));
+        } else if (arg == "--warmup") {
+            warmup = std::max(0, std::stoi(next()));
+        } else if (arg == "--top") {
+            top = std::stoul(next());
+        } else if (arg == "--save") {
+            save_path = next();
+        } else if (arg == "--baseline") {
+            baseline_path = next();
+        } else if (path.empty() && arg.rfind("--", 0) != 0) {
+            path = arg;
+        } else {
+            fprintf(stderr, "Usage: %s requests.jsonl [--iterations N] [--warmup N] [--top N] [--save results.jsonl] [--baseline results.jsonl]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (path.empty()) {
+        fprintf(stderr, "Usage: %s requests.jsonl [--iterations N] [--warmup N] [--top N] [--save results.jsonl] [--baseline results.jsonl]\n", argv[0]);
+        return 1;
+    }
+
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Failed to open %s\n", path.c_str());
+        return 1;
+    }
+    auto start = clock_type::now();
+    auto replay = minja::chat_template_replay::load(file);
+    printf("Loaded %zu requests of %zu templates in %.3f ms\n", replay.requests.size(), replay.templates.size(),
+           ms(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count()));
+
+    std::vector<timings> results;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < replay.requests.size(); i++) {
+        const auto & request = replay.requests[i];
+        results.push_back(time_request(request, iterations, warmup));
+        const auto & res = results.back();
+        if (!request.output_hash.empty() ? res.output_hash != request.output_hash : res.output_bytes != request.output_bytes) {
+            fprintf(stderr, "Request %zu: output differs from the captured one (%zu bytes, captured: %zu bytes)\n", i, res.output_bytes, request.output_bytes);
+            mismatches++;
+        }
+    }
+
+    std::vector<size_t> order(results.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return results[a].render_ns > results[b].render_ns; });
+    printf("\n%8s  %-16s  %8s  %10s  %12s  %12s  %12s\n", "request", "template", "messages", "bytes", "captured ms", "context ms", "render ms");
+    int64_t total_ns = 0;
+    for (const auto & res : results) total_ns += res.render_ns;
+    for (size_t k = 0; k < std::min(top, order.size()); k++) {
+        auto i = order[k];
+        const auto & request = replay.requests[i];
+        const auto & res = results[i];
+        printf("%8zu  %-16s  %8zu  %10zu  %12.3f  %12.3f  %12.3f\n", i, request.template_hash.c_str(), request.inputs.messages.size(),
+               res.output_bytes, ms(request.duration.count()), ms(res.context_ns), ms(res.render_ns));
+    }
+    printf("\nTotal: %.3f ms (median of %d renders per request), %zu output mismatches\n", ms(total_ns), iterations, mismatches);
+
+    if (!baseline_path.empty()) {
+        std::ifstream baseline_file(baseline_path);
+        if (!baseline_file) {
+            fprintf(stderr, "Failed to open %s\n", baseline_path.c_str());
+            return 1;
+        }
+        int64_t baseline_total_ns = 0, compared_total_ns = 0;
+        size_t changed = 0;
+        std::string line;
+        while (std::getline(baseline_file, line)) {
+            if (line.empty()) continue;
+            auto j = json::parse(line);
+            auto i = j.at("request").get<size_t>();
+            if (i >= results.size()) continue;
+            baseline_total_ns += j.at("render_ns").get<int64_t>();
+            compared_total_ns += results[i].render_ns;
+            if (j.at("output_hash").get<std::string>() != results[i].output_hash) {
+                fprintf(stderr, "Request %zu: output differs from the baseline's\n", i);
+                changed++;
+            }
+        }
+        printf("Baseline: %.3f ms, this build: %.3f ms (%.2fx), %zu outputs changed\n", ms(baseline_total_ns), ms(compared_total_ns),
+               compared_total_ns ? (double) baseline_total_ns / compared_total_ns : 0.0, changed);
+    }
+
+    if (!save_path.empty()) {
+        std::ofstream save(save_path);
+        for (size_t i = 0; i < results.size(); i++) {
+            save << json({
+                {"request", i},
+                {"context_ns", results[i].context_ns},
+                {"render_ns", results[i].render_ns},
+                {"output_bytes", results[i].output_bytes},
+                {"output_hash", results[i].output_hash},
+            }).dump() << '\n';
+        }
+    }
+    return mismatches ? 2 : 0;
+}
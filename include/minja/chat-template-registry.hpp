@@ -0,0 +1,281 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "chat-template.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace minja {
+
+// A chat template to load: its source text and special tokens.
+struct chat_template_source {
+    std::string name;
+    std::string source;
+    std::string bos_token;
+    std::string eos_token;
+};
+
+struct chat_template_load_result {
+    std::string name;
+    // Null if loading failed (see error).
+    std::shared_ptr<const chat_template> tmpl;
+    std::string error;
+    // Wall time spent parsing & probing the template capabilities.
+    std::chrono::microseconds load_time {0};
+};
+
+/*
+    Thread-safe name -> chat_template map, with bulk loaders that parse and probe
+    templates on a pool of threads (construction of a chat_template renders it a dozen times
+    to detect its capabilities, which adds up quickly when loading hundreds of them at startup).
+*/
+class chat_template_registry {
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<const chat_template>> templates_;
+
+    static std::string read_file(const std::filesystem::path & path) {
+        std::ifstream fs(path, std::ios_base::binary);
+        if (!fs.is_open()) {
+            MINJA_THROW(std::runtime_error("Failed to open file: " + path.string()));
+        }
+        return std::string((std::istreambuf_iterator<char>(fs)), std::istreambuf_iterator<char>());
+    }
+
+    static nlohmann::ordered_json parse_json(const std::string & content, const std::string & path) {
+        auto res = nlohmann::ordered_json::parse(content, nullptr, /* allow_exceptions= */ false);
+        if (res.is_discarded()) {
+            MINJA_THROW(std::runtime_error("Invalid JSON: " + path));
+        }
+        return res;
+    }
+
+    // Empty if missing or not a string.
+    static std::string json_string(const nlohmann::ordered_json & obj, const char * key) {
+        if (!obj.is_object()) return "";
+        auto it = obj.find(key);
+        return it != obj.end() && it->is_string() ? it->get<std::string>() : "";
+    }
+
+    // Special tokens are either strings or (in tokenizer_config.json) {"content": "<s>", ...} objects; empty if missing or null.
+    static std::string json_token(const nlohmann::ordered_json & obj, const char * key) {
+        if (!obj.is_object()) return "";
+        auto it = obj.find(key);
+        if (it != obj.end() && it->is_object()) return json_string(*it, "content");
+        return json_string(obj, key);
+    }
+
+    // A source read by load_directory / load_manifest, or the error reading it.
+    struct read_source {
+        std::string name;
+        Result<chat_template_source> source;
+    };
+
+    // Loads the sources that could be read, returning the results of all of them in the same order.
+    std::vector<chat_template_load_result> load_read(std::vector<read_source> && read, size_t n_threads) {
+        std::vector<chat_template_source> sources;
+        for (auto & entry : read) {
+            if (entry.source) sources.push_back(std::move(entry.source.value));
+        }
+        auto loaded = load(sources, n_threads);
+
+        std::vector<chat_template_load_result> results;
+        results.reserve(read.size());
+        auto next_loaded = loaded.begin();
+        for (auto & entry : read) {
+            if (entry.source) {
+                results.push_back(std::move(*next_loaded++));
+                continue;
+            }
+            chat_template_load_result res;
+            res.name = std::move(entry.name);
+            res.error = std::move(entry.source.error);
+            results.push_back(std::move(res));
+        }
+        return results;
+    }
+
+  public:
+    void add(const std::string & name, const std::shared_ptr<const chat_template> & tmpl) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        templates_[name] = tmpl;
+    }
+
+    // Returns null if no template is registered under that name.
+    std::shared_ptr<const chat_template> get(const std::string & name) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = templates_.find(name);
+        return it == templates_.end() ? nullptr : it->second;
+    }
+
+    bool contains(const std::string & name) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return templates_.find(name) != templates_.end();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return templates_.size();
+    }
+
+    std::vector<std::string> names() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::string> res;
+        res.reserve(templates_.size());
+        for (const auto & [name, _] : templates_) {
+            res.push_back(name);
+        }
+        return res;
+    }
+
+    /*
+        Parses & probes all the sources on n_threads threads (0 = hardware concurrency), and registers
+        the ones that loaded successfully (each is published as soon as it's ready).
+        Never throws for individual templates: check the error of each result (returned in input order).
+        Sources named like an earlier one fail without being loaded, so that the first one is registered.
+    */
+    std::vector<chat_template_load_result> load(const std::vector<chat_template_source> & sources, size_t n_threads = 0) {
+        std::vector<chat_template_load_result> results(sources.size());
+        std::vector<size_t> pending;
+        {
+            std::unordered_set<std::string> names;
+            for (size_t i = 0; i < sources.size(); i++) {
+                if (names.insert(sources[i].name).second) {
+                    pending.push_back(i);
+                } else {
+                    results[i].name = sources[i].name;
+                    results[i].error = "Duplicate chat template name: " + sources[i].name;
+                }
+            }
+        }
+        if (n_threads == 0) {
+            n_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+        }
+        n_threads = std::min(n_threads, pending.size());
+
+        std::atomic<size_t> next {0};
+        auto worker = [&]() {
+            for (size_t j; (j = next++) < pending.size();) {
+                auto i = pending[j];
+                const auto & src = sources[i];
+                auto & res = results[i];
+                res.name = src.name;
+                auto start = std::chrono::steady_clock::now();
+                auto created = chat_template::try_create(src.source, src.bos_token, src.eos_token);
+                res.tmpl = std::move(created.value);
+                res.error = std::move(created.error);
+                res.load_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+                if (res.tmpl) {
+                    add(src.name, res.tmpl);
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < n_threads; i++) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto & t : threads) {
+            t.join();
+        }
+        return results;
+    }
+
+    /*
+        Loads all the *.jinja files of a directory, registered by file stem.
+        Special tokens are read from an optional sibling <stem>.json file (e.g. a tokenizer_config.json),
+        using its "bos_token" / "eos_token" string fields. Results are sorted by name.
+    */
+    std::vector<chat_template_load_result> load_directory(const std::string & dir, size_t n_threads = 0) {
+        std::vector<read_source> read;
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            const auto & path = it->path();
+            std::error_code type_ec;
+            if (!it->is_regular_file(type_ec) || path.extension() != ".jinja") continue;
+
+            auto loaded = detail::try_call([&]() -> chat_template_source {
+                chat_template_source src;
+                src.name = path.stem().string();
+                src.source = read_file(path);
+                MINJA_CHECK();
+                auto tokens_path = path;
+                tokens_path.replace_extension(".json");
+                std::error_code exists_ec;
+                if (std::filesystem::exists(tokens_path, exists_ec)) {
+                    auto tokens = parse_json(read_file(tokens_path), tokens_path.string());
+                    MINJA_CHECK();
+                    src.bos_token = json_token(tokens, "bos_token");
+                    src.eos_token = json_token(tokens, "eos_token");
+                }
+                return src;
+            });
+            read.push_back({path.stem().string(), std::move(loaded)});
+        }
+        if (ec) {
+            MINJA_THROW(std::runtime_error("Failed to list directory " + dir + ": " + ec.message()));
+        }
+        std::sort(read.begin(), read.end(), [](const auto & a, const auto & b) { return a.name < b.name; });
+        return load_read(std::move(read), n_threads);
+    }
+
+    /*
+        Loads the templates listed in a JSON manifest:
+
+            [{"name": "...", "template": "path/to/template.jinja", "bos_token": "...", "eos_token": "..."}, ...]
+
+        Template paths are relative to the manifest's directory. Results are in the order of the manifest's entries
+        (see load for duplicate names). Throws if the manifest itself can't be read.
+    */
+    std::vector<chat_template_load_result> load_manifest(const std::string & manifest_path, size_t n_threads = 0) {
+        auto manifest = parse_json(read_file(manifest_path), manifest_path);
+        MINJA_CHECK();
+        if (!manifest.is_array()) {
+            MINJA_THROW(std::runtime_error("Chat template manifest must be an array: " + manifest_path));
+        }
+        auto base_dir = std::filesystem::path(manifest_path).parent_path();
+
+        std::vector<read_source> read;
+        for (const auto & entry : manifest) {
+            auto loaded = detail::try_call([&]() -> chat_template_source {
+                chat_template_source src;
+                src.name = json_string(entry, "name");
+                if (src.name.empty()) MINJA_THROW(std::runtime_error("Manifest entry has no name: " + entry.dump()));
+                auto template_path = json_string(entry, "template");
+                if (template_path.empty()) MINJA_THROW(std::runtime_error("Manifest entry has no template: " + entry.dump()));
+                src.source = read_file(base_dir / template_path);
+                src.bos_token = json_token(entry, "bos_token");
+                src.eos_token = json_token(entry, "eos_token");
+                return src;
+            });
+            read.push_back({json_string(entry, "name"), std::move(loaded)});
+        }
+        return load_read(std::move(read), n_threads);
+    }
+};
+
+}  // namespace minja
@@ -10,16 +10,23 @@
 
 #include "minja.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstddef>
 #include <cstdio>
 #include <ctime>
 #include <exception>
+#include <fstream>
+#include <functional>
 #include <iomanip>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <nlohmann/json.hpp>
@@ -28,6 +35,65 @@ using json = nlohmann::ordered_json;
 
 namespace minja {
 
+// Inputs are nlohmann::json objects: convert them to minja values (the core doesn't know about nlohmann::json with MINJA_NO_NLOHMANN_JSON).
+// Strings equal to one of the placeholders' keys are replaced by its value (e.g. a Value::stream).
+inline Value to_value(const json & j, const std::map<std::string, Value> & placeholders = {}) {
+#ifndef MINJA_NO_NLOHMANN_JSON
+    if (placeholders.empty()) {
+        return Value(j);
+    }
+#endif
+    if (j.is_object()) {
+        auto res = Value::object();
+        for (auto it = j.begin(); it != j.end(); ++it) {
+            res.set(it.key(), to_value(it.value(), placeholders));
+        }
+        return res;
+    }
+    if (j.is_array()) {
+        auto res = Value::array();
+        for (const auto & item : j) {
+            res.push_back(to_value(item, placeholders));
+        }
+        return res;
+    }
+    if (j.is_boolean()) return Value(j.get<bool>());
+    if (j.is_number_unsigned() && j.get<uint64_t>() > (uint64_t) std::numeric_limits<int64_t>::max()) return Value(j.get<double>());
+    if (j.is_number_integer()) return Value(j.get<int64_t>());
+    if (j.is_number()) return Value(j.get<double>());
+    if (j.is_string()) {
+        const auto & str = j.get_ref<const std::string &>();
+        auto it = placeholders.find(str);
+        return it == placeholders.end() ? Value(str) : it->second;
+    }
+    return Value();
+}
+
+// Converts values back to nlohmann::json (materializing streamed strings), e.g. to capture inputs given as values.
+inline json to_json(const Value & v) {
+#ifndef MINJA_NO_NLOHMANN_JSON
+    return v.get<json>();
+#else
+    if (v.is_array()) {
+        auto res = json::array();
+        for (size_t i = 0, n = v.size(); i < n; i++) {
+            res.push_back(to_json(v.at(i)));
+        }
+        return res;
+    }
+    if (v.is_object()) {
+        auto res = json::object();
+        v.for_each([&](Value & key) { res[key.is_string() ? key.get<std::string>() : key.dump()] = to_json(v.get(key)); });
+        return res;
+    }
+    if (v.is_boolean()) return v.get<bool>();
+    if (v.is_number_integer()) return v.get<int64_t>();
+    if (v.is_number_float()) return v.get<double>();
+    if (v.is_string()) return v.get<std::string>();
+    return json();
+#endif
+}
+
 struct chat_template_caps {
     bool supports_tools = false;
     bool supports_tool_calls = false;
@@ -50,6 +116,13 @@ struct chat_template_inputs {
     bool add_generation_prompt = true;
     nlohmann::ordered_json extra_context;
     std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+    // String values (in messages, tools and extra_context) to substitute, e.g. to pass a large attachment as a
+    // Value::stream: {"content": "<attachment>"} with placeholders = {{"<attachment>", Value::stream(...)}}.
+    // Polyfills that build a new content from it (merged system messages, tool calls and responses) materialize it.
+    std::map<std::string, Value> placeholders;
+    // Messages already converted to minja values, to set instead of messages (e.g. a conversation kept between turns and
+    // extended with push_back). They're passed to the template as they are, as a read-only array (polyfills change copies).
+    PersistentArray history;
 };
 
 struct chat_template_options {
@@ -67,6 +140,214 @@ struct chat_template_options {
     bool polyfill_typed_content = true;
 };
 
+// Context window constraints for chat_template::apply_truncated.
+struct chat_template_truncation {
+    // Max length of the prompt: in bytes, or as measured by count_tokens if set.
+    size_t budget = 0;
+    std::function<size_t(const std::string &)> count_tokens;
+    // Never drop the leading system message, nor the last user message and what follows it.
+    bool keep_system = true;
+    bool keep_last_user = true;
+    // Only drop whole turns, so the kept history starts with a user message (many templates expect alternating roles).
+    bool start_with_user = true;
+};
+
+struct chat_template_truncation_result {
+    std::string prompt;
+    // Length of the prompt (as measured by chat_template_truncation::count_tokens if set).
+    size_t length = 0;
+    // Number of (oldest) messages dropped.
+    size_t dropped_messages = 0;
+    // False if the prompt still exceeds the budget with all the droppable messages dropped.
+    bool fits = false;
+    // Number of times the template was rendered.
+    size_t renders = 0;
+};
+
+class chat_template;
+
+/*
+    Lifecycle events of chat templates, e.g. for telemetry. Observers are registered per template (in its constructor, to also
+    get the parse and capability probe events, or with set_observer) and / or globally (chat_template::set_global_observer):
+    both are notified. Each on_*_begin is followed by the matching on_*_end, or by on_error if it failed. The renders done to
+    probe the template's capabilities aren't reported as renders.
+
+    Callbacks may be called concurrently from several threads, and shouldn't throw. Without observers, the templates don't even read the clock.
+*/
+struct chat_template_observer {
+    virtual ~chat_template_observer() = default;
+    virtual void on_parse_begin(const chat_template &) {}
+    virtual void on_parse_end(const chat_template &, std::chrono::nanoseconds /* duration */) {}
+    // probe: the chat_template_caps field it determines (e.g. "supports_tools"), or "tool_call_example".
+    virtual void on_caps_probe(const chat_template &, const char * /* probe */, std::chrono::nanoseconds /* duration */) {}
+    // polyfill: the chat_template_options flag (e.g. "polyfill_system_role"), for each polyfill applied to the inputs of a render.
+    virtual void on_polyfill(const chat_template &, const char * /* polyfill */) {}
+    virtual void on_render_begin(const chat_template &) {}
+    virtual void on_render_end(const chat_template &, size_t /* output_bytes */, std::chrono::nanoseconds /* duration */) {}
+    virtual void on_error(const chat_template &, const std::string & /* error */) {}
+};
+
+namespace detail {
+
+struct chat_template_global_observer {
+    std::mutex mutex;
+    std::shared_ptr<chat_template_observer> observer;
+    std::atomic<bool> installed {false};
+};
+inline chat_template_global_observer & global_chat_template_observer() {
+    static chat_template_global_observer global;
+    return global;
+}
+
+// 64-bit FNV-1a, stable across builds and platforms (unlike std::hash), to identify templates and outputs in replay files.
+inline uint64_t fnv1a(std::string_view text, uint64_t hash = 14695981039346656037ULL) {
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Forwards its output to another sink, hashing it on the way.
+class hashing_sink : public OutputSink {
+    OutputSink & out_;
+    uint64_t hash_ = fnv1a("");
+  protected:
+    void do_write(std::string_view text) override {
+        hash_ = fnv1a(text, hash_);
+        out_.write(text);
+    }
+    void do_write_static(std::string_view text) override {
+        hash_ = fnv1a(text, hash_);
+        out_.write_static(text);
+    }
+    void do_write_owned(std::string && text) override {
+        hash_ = fnv1a(text, hash_);
+        out_.write_owned(std::move(text));
+    }
+  public:
+    explicit hashing_sink(OutputSink & out) : out_(out) {}
+    uint64_t hash() const { return hash_; }
+};
+
+}  // namespace detail
+
+/*
+    Records the requests rendered by chat templates (see chat_template::set_capture) to reproduce them offline, e.g. with
+    examples/minja-replay.cpp. Each render appends a JSON line with the hash of its template, its inputs and options, and its
+    output size and hash and duration; each template's source and special tokens are written once, before its first request.
+
+        auto capture = std::make_shared<minja::chat_template_capture>("requests.jsonl", minja::chat_template_capture::redact_content);
+        capture->min_duration = std::chrono::milliseconds(20); // Only the slow renders.
+        tmpl.set_capture(capture);
+
+    The redaction hook gets each request ({"template": ..., "inputs": ..., "options": ...}) before it's written and may
+    rewrite it; the output hash of requests it changed isn't recorded, as replays can't match it. Failed renders aren't
+    captured. Thread-safe.
+*/
+class chat_template_capture {
+  public:
+    using redactor = std::function<void(nlohmann::ordered_json & request)>;
+
+    // Renders faster than this aren't captured.
+    std::chrono::nanoseconds min_duration {0};
+
+    explicit chat_template_capture(std::ostream & out, redactor redact = nullptr) : out_(&out), redact_(std::move(redact)) {}
+    // Appends to the file at path.
+    explicit chat_template_capture(const std::string & path, redactor redact = nullptr)
+        : file_(std::make_unique<std::ofstream>(path, std::ios::app)), out_(file_.get()), redact_(std::move(redact))
+    {
+        if (!*file_) MINJA_THROW_VOID(std::runtime_error("Failed to open capture file: " + path));
+    }
+
+    // Masks the content of the messages (replacing its characters with 'x'), keeping its length so that replays take about
+    // as long. Tools, roles and tool calls are kept.
+    static void redact_content(nlohmann::ordered_json & request) {
+        auto redact = [](nlohmann::ordered_json & text) {
+            if (text.is_string()) text = std::string(text.get_ref<const std::string &>().size(), 'x');
+        };
+        auto & messages = request["inputs"]["messages"];
+        if (!messages.is_array()) return;
+        for (auto & message : messages) {
+            if (!message.is_object()) continue;
+            for (const auto * key : {"content", "reasoning_content"}) {
+                if (!message.contains(key)) continue;
+                auto & content = message[key];
+                if (content.is_array()) {
+                    for (auto & part : content) {
+                        if (part.is_object() && part.contains("text")) redact(part["text"]);
+                    }
+                } else {
+                    redact(content);
+                }
+            }
+        }
+    }
+
+    static std::string hash(std::string_view text) { return hex(detail::fnv1a(text)); }
+
+    static nlohmann::ordered_json inputs_to_json(const chat_template_inputs & inputs);
+    static chat_template_inputs inputs_from_json(const nlohmann::ordered_json & j);
+    static nlohmann::ordered_json options_to_json(const chat_template_options & opts);
+    static chat_template_options options_from_json(const nlohmann::ordered_json & j);
+
+    // Renders with render(sink) to out, capturing the request if it succeeds (see chat_template::apply).
+    template <typename F>
+    void capture(const chat_template & tmpl, const chat_template_inputs & inputs, const chat_template_options & opts, OutputSink & out, F && render);
+
+  private:
+    std::unique_ptr<std::ofstream> file_;
+    std::ostream * out_;
+    redactor redact_;
+    std::mutex mutex_;
+    // Templates whose source was already written.
+    std::unordered_set<std::string> templates_;
+
+    static const std::vector<std::pair<const char *, bool chat_template_options::*>> & option_flags() {
+        static const std::vector<std::pair<const char *, bool chat_template_options::*>> flags {
+            {"apply_polyfills", &chat_template_options::apply_polyfills},
+            {"use_bos_token", &chat_template_options::use_bos_token},
+            {"use_eos_token", &chat_template_options::use_eos_token},
+            {"define_strftime_now", &chat_template_options::define_strftime_now},
+            {"polyfill_tools", &chat_template_options::polyfill_tools},
+            {"polyfill_tool_call_examples", &chat_template_options::polyfill_tool_call_examples},
+            {"polyfill_tool_calls", &chat_template_options::polyfill_tool_calls},
+            {"polyfill_tool_responses", &chat_template_options::polyfill_tool_responses},
+            {"polyfill_system_role", &chat_template_options::polyfill_system_role},
+            {"polyfill_object_arguments", &chat_template_options::polyfill_object_arguments},
+            {"polyfill_typed_content", &chat_template_options::polyfill_typed_content},
+        };
+        return flags;
+    }
+
+    static std::string hex(uint64_t value) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) value);
+        return buf;
+    }
+
+    void write(const chat_template & tmpl, const chat_template_inputs & inputs, const chat_template_options & opts,
+               size_t output_bytes, uint64_t output_hash, std::chrono::nanoseconds duration);
+};
+
+/*
+    Inputs ready to be rendered by a chat template (see chat_template::prepare): polyfilled, converted to minja values and
+    set in a context along with the template's special tokens and helpers. Immutable, cheap to copy, and may be rendered
+    several times and from several threads (each render gets its own child context; only templates mutating their inputs
+    in place, e.g. with messages.pop(), would see each other's changes).
+*/
+class chat_template_prepared {
+    friend class chat_template;
+    const chat_template * tmpl_ = nullptr;
+    std::shared_ptr<Context> context_;
+    // Kept only for templates with a capture (see chat_template::set_capture).
+    std::shared_ptr<const chat_template_inputs> inputs_;
+    chat_template_options options_;
+  public:
+    explicit operator bool() const { return !!context_; }
+    // Context the template is rendered with (in a child context).
+    const std::shared_ptr<Context> & context() const { return context_; }
+};
+
 class chat_template {
 
   private:
@@ -76,6 +357,93 @@ class chat_template {
     std::string eos_token_;
     std::shared_ptr<minja::TemplateNode> template_root_;
     std::string tool_call_example_;
+    std::shared_ptr<chat_template_observer> observer_;
+    std::shared_ptr<chat_template_capture> capture_;
+    // Set while probing the capabilities in the constructor (these renders aren't reported).
+    bool probing_ = false;
+
+    // Copy of an object sharing its values.
+    static Value shallow_copy(const Value & object) {
+        auto res = Value::object();
+        object.for_each([&](Value & key) { res.set(key, object.get(key)); });
+        return res;
+    }
+
+    bool observed() const {
+        return observer_ || detail::global_chat_template_observer().installed.load(std::memory_order_acquire);
+    }
+
+    template <typename F>
+    void notify(F && f) const {
+        if (observer_) f(*observer_);
+        auto & global = detail::global_chat_template_observer();
+        if (global.installed.load(std::memory_order_acquire)) {
+            std::shared_ptr<chat_template_observer> observer;
+            {
+                std::lock_guard<std::mutex> lock(global.mutex);
+                observer = global.observer;
+            }
+            if (observer) f(*observer);
+        }
+    }
+
+    // Calls f, reporting its error if it fails.
+    template <typename F>
+    void notify_errors(F && f) const {
+#ifdef MINJA_NO_EXCEPTIONS
+        f();
+        if (detail::failed()) {
+            notify([&](chat_template_observer & o) { o.on_error(*this, detail::ErrorFrame::innermost()->error()); });
+        }
+#else
+        try {
+            f();
+        } catch (const std::exception & e) {
+            notify([&](chat_template_observer & o) { o.on_error(*this, e.what()); });
+            throw;
+        }
+#endif
+    }
+
+    // Renders to out with render(), reporting it to the observers, if any.
+    template <typename F>
+    void observe_render(OutputSink & out, F && render) const {
+        if (probing_ || !observed()) {
+            render();
+            return;
+        }
+        notify([&](chat_template_observer & o) { o.on_render_begin(*this); });
+        auto start = std::chrono::steady_clock::now();
+        auto size = out.size();
+        notify_errors(render);
+        MINJA_CHECK_VOID();
+        auto duration = std::chrono::steady_clock::now() - start;
+        notify([&](chat_template_observer & o) { o.on_render_end(*this, out.size() - size, duration); });
+    }
+
+    // Times the capability probes done by the constructor, one after the other (see chat_template_observer::on_caps_probe).
+    class probe_timer {
+        chat_template & tmpl_;
+        bool observed_;
+        const char * probe_ = nullptr;
+        std::chrono::steady_clock::time_point start_;
+      public:
+        explicit probe_timer(chat_template & tmpl) : tmpl_(tmpl), observed_(tmpl.observed()) { tmpl_.probing_ = true; }
+        ~probe_timer() {
+            next(nullptr);
+            tmpl_.probing_ = false;
+        }
+        // Ends the current probe, if any, and starts the next one.
+        void next(const char * probe) {
+            if (!observed_) return;
+            auto now = std::chrono::steady_clock::now();
+            if (probe_) {
+                tmpl_.notify([&](chat_template_observer & o) { o.on_caps_probe(tmpl_, probe_, now - start_); });
+            }
+            probe_ = probe;
+            start_ = now;
+        }
+    };
 
     std::string try_raw_render(
         const nlohmann::ordered_json & messages,
@@ -83,37 +451,51 @@ class chat_template {
         bool add_generation_prompt,
         const nlohmann::ordered_json & extra_context = nlohmann::ordered_json()) const
     {
-        try {
-            chat_template_inputs inputs;
-            inputs.messages = messages;
-            inputs.tools = tools;
-            inputs.add_generation_prompt = add_generation_prompt;
-            inputs.extra_context = extra_context;
-            // Use fixed date for tests
-            inputs.now = std::chrono::system_clock::from_time_t(0);
-
-            chat_template_options opts;
-            opts.apply_polyfills = false;
-
-            auto prompt = apply(inputs, opts);
-            // fprintf(stderr, "try_raw_render: %s\n", prompt.c_str());
-            return prompt;
-        } catch (const std::exception & e) {
-            // fprintf(stderr, "try_raw_render error: %s\n", e.what());
-            return "";
-        }
+        chat_template_inputs inputs;
+        inputs.messages = messages;
+        inputs.tools = tools;
+        inputs.add_generation_prompt = add_generation_prompt;
+        inputs.extra_context = extra_context;
+        // Use fixed date for tests
+        inputs.now = std::chrono::system_clock::from_time_t(0);
+
+        chat_template_options opts;
+        opts.apply_polyfills = false;
+
+        auto prompt = try_apply(inputs, opts);
+        // fprintf(stderr, "try_raw_render: %s\n", prompt.value.c_str());
+        return prompt.value;
     }
 
   public:
 
-    chat_template(const std::string & source, const std::string & bos_token, const std::string & eos_token)
-        : source_(source), bos_token_(bos_token), eos_token_(eos_token)
+    chat_template(const std::string & source, const std::string & bos_token, const std::string & eos_token,
+                  std::shared_ptr<chat_template_observer> observer = nullptr)
+        : source_(source), bos_token_(bos_token), eos_token_(eos_token), observer_(std::move(observer))
     {
-        template_root_ = minja::Parser::parse(source_, {
-            /* .trim_blocks = */ true,
-            /* .lstrip_blocks = */ true,
-            /* .keep_trailing_newline = */ false,
-        });
+        detail::ErrorScope error_scope;
+        auto parse = [&]() {
+            minja::Options options {
+                /* .trim_blocks = */ true,
+                /* .lstrip_blocks = */ true,
+                /* .keep_trailing_newline = */ false,
+            };
+            // For apply_generation_spans (only costs a node per generation block).
+            options.generation_spans = true;
+            template_root_ = minja::Parser::parse(source_, options);
+        };
+        if (observed()) {
+            notify([&](chat_template_observer & o) { o.on_parse_begin(*this); });
+            auto start = std::chrono::steady_clock::now();
+            notify_errors(parse);
+            MINJA_CHECK_VOID();
+            auto duration = std::chrono::steady_clock::now() - start;
+            notify([&](chat_template_observer & o) { o.on_parse_end(*this, duration); });
+        } else {
+            parse();
+        }
+        MINJA_CHECK_VOID();
+        probe_timer probe(*this);
 
         auto contains = [](const std::string & haystack, const std::string & needle) {
             return haystack.find(needle) != std::string::npos;
@@ -124,6 +506,7 @@ class chat_template {
         const json dummy_str_user_msg = {{"role", "user"}, {"content", user_needle}};
         const json dummy_typed_user_msg = {{"role", "user"}, {"content", json::array({{{"type", "text"}, {"text", user_needle}}})}};
 
+        probe.next("requires_typed_content");
         caps_.requires_typed_content =
             !contains(try_raw_render(json::array({dummy_str_user_msg}), {}, false), user_needle)
             && contains(try_raw_render(json::array({dummy_typed_user_msg}), {}, false), user_needle);
@@ -136,8 +519,10 @@ class chat_template {
             {"content", caps_.requires_typed_content ? json::array({{{"type", "text"}, {"text", sys_needle}}}) : json(sys_needle)},
         };
 
+        probe.next("supports_system_role");
         caps_.supports_system_role = contains(try_raw_render({needle_system_msg, dummy_user_msg,}, {}, false), sys_needle);
 
+        probe.next("supports_tools");
         auto out = try_raw_render(json::array({
             dummy_user_msg
         }), json::array({
@@ -169,6 +554,7 @@ class chat_template {
             // (to remove the <think> tag in all but the last message).
             return try_raw_render(json::array({dummy_user_msg, assistant_msg, dummy_user_msg, assistant_msg}), {}, false);
         };
+        probe.next("requires_non_null_content");
         auto out_empty = render_with_content("");
         auto out_null = render_with_content(json());
         caps_.requires_non_null_content = contains(out_empty, user_needle) && !contains(out_null, user_needle);
@@ -200,6 +586,7 @@ class chat_template {
         };
 
         // Note: the arguments are rendered in both cases, but may be double-escaped, which we don't want.
+        probe.next("supports_tool_calls");
         out = try_raw_render(json::array({
             dummy_user_msg,
             make_tool_calls_msg(json::array({make_tool_call("ipython", dummy_args_obj.dump())})),
@@ -218,12 +605,14 @@ class chat_template {
             auto dummy_args = caps_.requires_object_arguments ? dummy_args_obj : json(dummy_args_obj.dump());
             auto tc1 = make_tool_call("test_tool1", dummy_args);
             auto tc2 = make_tool_call("test_tool2", dummy_args);
+            probe.next("supports_parallel_tool_calls");
             auto out = try_raw_render(json::array({
                 dummy_user_msg,
                 make_tool_calls_msg(json::array({tc1, tc2})),
             }), {}, false);
             caps_.supports_parallel_tool_calls = contains(out, "test_tool1") && contains(out, "test_tool2");
 
+            probe.next("supports_tool_responses");
             out = try_raw_render(json::array({
                 dummy_user_msg,
                 make_tool_calls_msg(json::array({tc1})),
@@ -238,73 +627,115 @@ class chat_template {
             caps_.supports_tool_call_id = contains(out, "call_911_");
         }
 
-        try {
-            if (!caps_.supports_tools) {
-                const json user_msg {
-                    {"role", "user"},
-                    {"content", "Hey"},
-                };
-                const json args {
-                    {"arg1", "some_value"},
-                };
-                const json tool_call_msg {
-                    {"role", "assistant"},
-                    {"content", caps_.requires_non_null_content ? "" : j_null},
-                    {"tool_calls", json::array({
-                        {
-                            // TODO: detect if requires numerical id or fixed length == 6 like Nemo
-                            {"id", "call_1___"},
-                            {"type", "function"},
-                            {"function", {
-                                {"name", "tool_name"},
-                                {"arguments", (caps_.requires_object_arguments ? args : json(minja::Value(args).dump(-1, /* to_json= */ true)))},
-                            }},
-                        },
-                    })},
-                };
-                std::string prefix, full;
-                {
-                    chat_template_inputs inputs;
-                    inputs.messages = json::array({user_msg});
-                    inputs.add_generation_prompt = true;
-                    prefix = apply(inputs);
-                }
-                {
-                    chat_template_inputs inputs;
-                    inputs.messages = json::array({user_msg, tool_call_msg});
-                    inputs.add_generation_prompt = false;
-                    full = apply(inputs);
+        if (!caps_.supports_tools) {
+            probe.next("tool_call_example");
+            const json user_msg {
+                {"role", "user"},
+                {"content", "Hey"},
+            };
+            const json args {
+                {"arg1", "some_value"},
+            };
+            const json tool_call_msg {
+                {"role", "assistant"},
+                {"content", caps_.requires_non_null_content ? "" : j_null},
+                {"tool_calls", json::array({
+                    {
+                        // TODO: detect if requires numerical id or fixed length == 6 like Nemo
+                        {"id", "call_1___"},
+                        {"type", "function"},
+                        {"function", {
+                            {"name", "tool_name"},
+                            {"arguments", (caps_.requires_object_arguments ? args : json(to_value(args).dump(-1, /* to_json= */ true)))},
+                        }},
+                    },
+                })},
+            };
+            std::string prefix, full;
+            {
+                chat_template_inputs inputs;
+                inputs.messages = json::array({user_msg});
+                inputs.add_generation_prompt = true;
+                auto res = try_apply(inputs);
+                if (!res) {
+                    fprintf(stderr, "Failed to generate tool call example: %s\n", res.error.c_str());
+                    return;
                 }
-                auto eos_pos_last = full.rfind(eos_token_);
-                if (eos_pos_last == prefix.size() - eos_token_.size() ||
-                      (full[full.size() - 1] == '\n' && (eos_pos_last == full.size() - eos_token_.size() - 1))) {
-                    full = full.substr(0, eos_pos_last);
+                prefix = std::move(res.value);
+            }
+            {
+                chat_template_inputs inputs;
+                inputs.messages = json::array({user_msg, tool_call_msg});
+                inputs.add_generation_prompt = false;
+                auto res = try_apply(inputs);
+                if (!res) {
+                    fprintf(stderr, "Failed to generate tool call example: %s\n", res.error.c_str());
+                    return;
                 }
-                size_t common_prefix_length = 0;
-                for (size_t i = 0; i < prefix.size() && i < full.size(); ++i) {
-                    if (prefix[i] != full[i]) {
-                        break;
-                    }
-                    if (prefix[i] == '<') {
-                        // DeepSeek R1's template (as of 20250209) adds a trailing <think> if add_generation_prompt,
-                        // but it removes thinking tags for past messages.
-                        // The prefix and full strings diverge at <think> vs. <｜tool▁calls▁begin｜>, we avoid consuming the leading <.
-                        continue;
-                    }
-                    common_prefix_length = i + 1;
+                full = std::move(res.value);
+            }
+            auto eos_pos_last = full.rfind(eos_token_);
+            if (eos_pos_last == prefix.size() - eos_token_.size() ||
+                  (full[full.size() - 1] == '\n' && (eos_pos_last == full.size() - eos_token_.size() - 1))) {
+                full = full.substr(0, eos_pos_last);
+            }
+            size_t common_prefix_length = 0;
+            for (size_t i = 0; i < prefix.size() && i < full.size(); ++i) {
+                if (prefix[i] != full[i]) {
+                    break;
                 }
-                auto example = full.substr(common_prefix_length);
-                if (example.find("tool_name") == std::string::npos && example.find("some_value") == std::string::npos) {
-                    fprintf(stderr, "Failed to infer a tool call example (possible template bug)\n");
-                } else {
-                    tool_call_example_ = example;
+                if (prefix[i] == '<') {
+                    // DeepSeek R1's template (as of 20250209) adds a trailing <think> if add_generation_prompt,
+                    // but it removes thinking tags for past messages.
+                    // The prefix and full strings diverge at <think> vs. <｜tool▁calls▁begin｜>, we avoid consuming the leading <.
+                    continue;
                 }
+                common_prefix_length = i + 1;
+            }
+            auto example = full.substr(common_prefix_length);
+            if (example.find("tool_name") == std::string::npos && example.find("some_value") == std::string::npos) {
+                fprintf(stderr, "Failed to infer a tool call example (possible template bug)\n");
+            } else {
+                tool_call_example_ = example;
             }
-        } catch (const std::exception & e) {
-            fprintf(stderr, "Failed to generate tool call example: %s\n", e.what());
         }
     }
 
+    // Non-throwing variants of the constructor and of apply (see MINJA_NO_EXCEPTIONS in minja.hpp).
+    static Result<std::shared_ptr<chat_template>> try_create(const std::string & source, const std::string & bos_token, const std::string & eos_token,
+                                                            std::shared_ptr<chat_template_observer> observer = nullptr) {
+        return detail::try_call([&]() { return std::make_shared<chat_template>(source, bos_token, eos_token, observer); });
+    }
+
+    // Observer of this template's renders (see chat_template_observer), in addition to the global one. Not thread-safe: set it before rendering.
+    void set_observer(std::shared_ptr<chat_template_observer> observer) { observer_ = std::move(observer); }
+    const std::shared_ptr<chat_template_observer> & observer() const { return observer_; }
+    // Observer of all templates' events (null to remove it).
+    static void set_global_observer(std::shared_ptr<chat_template_observer> observer) {
+        auto & global = detail::global_chat_template_observer();
+        std::lock_guard<std::mutex> lock(global.mutex);
+        global.installed = observer != nullptr;
+        global.observer = std::move(observer);
+    }
+    // Records the requests rendered by apply for offline replay (see chat_template_capture; null to stop). Not thread-safe: set it before rendering.
+    void set_capture(std::shared_ptr<chat_template_capture> capture) { capture_ = std::move(capture); }
+    const std::shared_ptr<chat_template_capture> & capture() const { return capture_; }
+    Result<std::string> try_apply(
+        const chat_template_inputs & inputs,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        return detail::try_call([&]() { return apply(inputs, opts); });
+    }
+    Result<chat_template_prepared> try_prepare(
+        const chat_template_inputs & inputs,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        return detail::try_call([&]() { return prepare(inputs, opts); });
+    }
+    Result<std::string> try_render(const chat_template_prepared & prepared) const {
+        return detail::try_call([&]() { return render(prepared); });
+    }
+
     const std::string & source() const { return source_; }
     const std::string & bos_token() const { return bos_token_; }
     const std::string & eos_token() const { return eos_token_; }
@@ -336,20 +767,176 @@ class chat_template {
         const chat_template_inputs & inputs,
         const chat_template_options & opts = chat_template_options()) const
     {
-        json actual_messages;
+        std::string res;
+        StringSink out(res);
+        apply(inputs, out, opts);
+        return res;
+    }
+
+    // Renders to a sink, e.g. a minja::SegmentSink to get the prompt as segments without concatenating them.
+    // Same as render(prepare(inputs, opts), out), in one call.
+    void apply(
+        const chat_template_inputs & inputs,
+        OutputSink & out,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        detail::ErrorScope error_scope;
+        auto render = [&](OutputSink & sink) {
+            observe_render(sink, [&]() {
+                auto context = make_context(inputs, opts);
+                MINJA_CHECK_VOID();
+                if (!template_root_) MINJA_THROW_VOID(std::runtime_error("Template failed to parse"));
+                template_root_->render(sink, context);
+            });
+        };
+        if (capture_ && !probing_) {
+            capture_->capture(*this, inputs, opts, out, render);
+        } else {
+            render(out);
+        }
+    }
+
+    // First stage of apply: inspects and polyfills the inputs, converts them to minja values and sets up the context (special
+    // tokens, strftime_now, tools, extra_context), e.g. on I/O threads, to render them with render on compute threads.
+    chat_template_prepared prepare(
+        const chat_template_inputs & inputs,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        detail::ErrorScope error_scope;
+        chat_template_prepared prepared;
+        prepared.tmpl_ = this;
+        prepared.context_ = make_context(inputs, opts);
+        MINJA_CHECK();
+        if (capture_) {
+            prepared.inputs_ = std::make_shared<const chat_template_inputs>(inputs);
+            prepared.options_ = opts;
+        }
+        return prepared;
+    }
+
+    // Second stage of apply: renders inputs prepared by this template.
+    void render(const chat_template_prepared & prepared, OutputSink & out) const {
+        detail::ErrorScope error_scope;
+        if (prepared.tmpl_ != this || !prepared.context_) MINJA_THROW_VOID(std::runtime_error("Inputs weren't prepared by this template"));
+        auto render = [&](OutputSink & sink) {
+            observe_render(sink, [&]() {
+                if (!template_root_) MINJA_THROW_VOID(std::runtime_error("Template failed to parse"));
+                template_root_->render(sink, Context::make(Value::object(), prepared.context_));
+            });
+        };
+        if (capture_ && prepared.inputs_) {
+            capture_->capture(*this, *prepared.inputs_, prepared.options_, out, render);
+        } else {
+            render(out);
+        }
+    }
+
+    std::string render(const chat_template_prepared & prepared) const {
+        std::string res;
+        StringSink out(res);
+        render(prepared, out);
+        return res;
+    }
+
+    // Renders the prompt like apply, also returning the range of the prompt each message produced (see
+    // minja::TemplateNode::render_message_spans), e.g. for truncation or caching. Message indexes are those of the messages
+    // as passed to the template, i.e. after polyfills (which may e.g. merge the system message into the next one).
+    std::string apply_message_spans(
+        const chat_template_inputs & inputs,
+        std::vector<MessageSpan> & spans,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        detail::ErrorScope error_scope;
+        std::string res;
+        StringSink out(res);
+        observe_render(out, [&]() {
+            auto context = make_context(inputs, opts);
+            MINJA_CHECK_VOID();
+            if (!template_root_) MINJA_THROW_VOID(std::runtime_error("Template failed to parse"));
+            template_root_->render_message_spans(out, context, spans);
+        });
+        return res;
+    }
+
+    // Renders the prompt like apply, also returning the range of the prompt produced by each `{% generation %}` block, i.e.
+    // the assistant's generated text, e.g. for the loss masks of training data (see minja::Options::generation_spans).
+    std::string apply_generation_spans(
+        const chat_template_inputs & inputs,
+        std::vector<OutputSpan> & spans,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        detail::ErrorScope error_scope;
+        std::string res;
+        StringSink out(res);
+        observe_render(out, [&]() {
+            auto context = make_context(inputs, opts);
+            MINJA_CHECK_VOID();
+            if (!template_root_) MINJA_THROW_VOID(std::runtime_error("Template failed to parse"));
+            template_root_->render_generation_spans(out, context, spans);
+        });
+        return res;
+    }
+
+    // Renders the prompt like apply, also capturing a checkpoint before messages[message_index] (of the messages as passed
+    // to the template, i.e. after polyfills) for apply_from. checkpoint is left null if the template doesn't support it
+    // (see minja::TemplateNode::render_checkpoint).
+    std::string apply_checkpoint(
+        const chat_template_inputs & inputs,
+        size_t message_index,
+        std::shared_ptr<RenderCheckpoint> & checkpoint,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        detail::ErrorScope error_scope;
+        auto context = make_context(inputs, opts);
+        MINJA_CHECK();
+        if (!template_root_) MINJA_THROW(std::runtime_error("Template failed to parse"));
+        return template_root_->render_checkpoint(context, message_index, checkpoint);
+    }
+
+    // Renders inputs sharing the first messages (and the tools, options...) of the ones a checkpoint was taken on, without
+    // re-rendering these messages. Returns false, without writing anything, if the checkpoint doesn't apply (use apply then).
+    bool apply_from(
+        const RenderCheckpoint & checkpoint,
+        const chat_template_inputs & inputs,
+        OutputSink & out,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        detail::ErrorScope error_scope;
+        bool applied = false;
+        observe_render(out, [&]() {
+            auto context = make_context(inputs, opts);
+            MINJA_CHECK_VOID();
+            if (!template_root_) MINJA_THROW_VOID(std::runtime_error("Template failed to parse"));
+            applied = template_root_->render_from(checkpoint, out, context);
+        });
+        return applied;
+    }
+
+    // Context the template is rendered with: the inputs, after polyfills, and the template's special tokens.
+    std::shared_ptr<Context> make_context(
+        const chat_template_inputs & inputs,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        detail::ErrorScope error_scope;
+        if (!inputs.messages.empty() && !inputs.history.empty()) {
+            MINJA_THROW(std::runtime_error("Inputs can't have both messages and history"));
+        }
+        auto messages = inputs.history.empty() ? to_value(inputs.messages, inputs.placeholders) : inputs.history.to_value();
 
         auto has_tools = inputs.tools.is_array() && !inputs.tools.empty();
         auto has_tool_calls = false;
         auto has_tool_responses = false;
         auto has_string_content = false;
-        for (const auto & message : inputs.messages) {
-            if (message.contains("tool_calls") && !message["tool_calls"].is_null()) {
+        for (size_t i = 0, n = messages.is_array() ? messages.size() : 0; i < n; i++) {
+            const auto & message = messages.at(i);
+            if (!message.is_object()) continue;
+            if (!message.get("tool_calls").is_null()) {
                 has_tool_calls = true;
             }
-            if (message.contains("role") && message["role"] == "tool") {
+            if (message.get("role") == Value("tool")) {
                 has_tool_responses = true;
             }
-            if (message.contains("content") && message["content"].is_string()) {
+            if (message.get("content").is_string()) {
                 has_string_content = true;
             }
         }
@@ -371,18 +958,35 @@ class chat_template {
             || polyfill_typed_content
         );
 
+        if (needs_polyfills && !probing_ && observed()) {
+            for (const auto & polyfill : {
+                std::make_pair(polyfill_system_role, "polyfill_system_role"),
+                std::make_pair(polyfill_tools, "polyfill_tools"),
+                std::make_pair(polyfill_tool_call_example, "polyfill_tool_call_examples"),
+                std::make_pair(polyfill_tool_calls, "polyfill_tool_calls"),
+                std::make_pair(polyfill_tool_responses, "polyfill_tool_responses"),
+                std::make_pair(polyfill_object_arguments, "polyfill_object_arguments"),
+                std::make_pair(polyfill_typed_content, "polyfill_typed_content"),
+            }) {
+                if (polyfill.first) notify([&](chat_template_observer & o) { o.on_polyfill(*this, polyfill.second); });
+            }
+        }
+
+        auto actual_messages = messages;
         if (needs_polyfills) {
-            actual_messages = json::array();
-
-            auto add_message = [&](const json & msg) {
-                if (polyfill_typed_content && msg.contains("content") && !msg.at("content").is_null() && msg.at("content").is_string()) {
-                    actual_messages.push_back({
-                        {"role", msg.at("role")},
-                        {"content", {{
-                            {"type", "text"},
-                            {"text", msg.at("content")},
-                        }}},
-                    });
+            if (!messages.is_null() && !messages.is_array()) MINJA_THROW(std::runtime_error("messages must be an array: " + messages.dump()));
+            actual_messages = Value::array();
+
+            auto add_message = [&](const Value & msg) {
+                auto content = msg.get("content");
+                if (polyfill_typed_content && content.is_string()) {
+                    auto text = Value::object();
+                    text.set("type", "text");
+                    text.set("text", content);
+                    auto typed = Value::object();
+                    typed.set("role", msg.get("role"));
+                    typed.set("content", Value::array({text}));
+                    actual_messages.push_back(typed);
                 } else {
                     actual_messages.push_back(msg);
                 }
@@ -391,93 +995,109 @@ class chat_template {
             std::string pending_system;
             auto flush_sys = [&]() {
                 if (!pending_system.empty()) {
-                    add_message({
-                        {"role", "user"},
-                        {"content", pending_system},
-                    });
+                    auto msg = Value::object();
+                    msg.set("role", "user");
+                    msg.set("content", pending_system);
+                    add_message(msg);
                     pending_system.clear();
                 }
             };
 
-            json adjusted_messages;
+            Value adjusted_messages;
             if (polyfill_tools) {
-                adjusted_messages = add_system(inputs.messages,
-                    "You can call any of the following tools to satisfy the user's requests: " + minja::Value(inputs.tools).dump(2, /* to_json= */ true) +
+                adjusted_messages = add_system(messages,
+                    "You can call any of the following tools to satisfy the user's requests: " + to_value(inputs.tools).dump(2, /* to_json= */ true) +
                     (!polyfill_tool_call_example || tool_call_example_.empty() ? "" : "\n\nExample tool call syntax:\n\n" + tool_call_example_ + "\n\n"));
             } else {
-                adjusted_messages = inputs.messages;
+                adjusted_messages = messages;
             }
 
-            for (const auto & message_ : adjusted_messages) {
-                auto message = message_;
-                if (!message.contains("role") || (!message.contains("content") && !message.contains("tool_calls"))) {
-                    throw std::runtime_error("message must have 'role' and one of 'content' or 'tool_calls' fields: " + message.dump());
+            for (size_t i = 0, n = adjusted_messages.is_array() ? adjusted_messages.size() : 0; i < n; i++) {
+                const auto & message_ = adjusted_messages.at(i);
+                if (!message_.is_object() || !message_.contains("role") || (!message_.contains("content") && !message_.contains("tool_calls"))) {
+                    MINJA_THROW(std::runtime_error("message must have 'role' and one of 'content' or 'tool_calls' fields: " + message_.dump(-1, /* to_json= */ true)));
                 }
-                std::string role = message.at("role");
+                // The messages may be shared (e.g. by a history): polyfills change copies of them.
+                auto message = shallow_copy(message_);
+                auto role = message.get("role").get<std::string>();
 
                 if (message.contains("tool_calls")) {
                     if (polyfill_object_arguments || polyfill_tool_calls) {
-                        for (auto & tool_call : message.at("tool_calls")) {
-                            if (tool_call["type"] == "function") {
-                                auto & function = tool_call.at("function");
-                                auto & arguments = function.at("arguments");
+                        auto tool_calls = Value::array();
+                        message.get("tool_calls").for_each([&](Value & tool_call) {
+                            if (tool_call.get("type") == Value("function")) {
+                                auto function = tool_call.get("function");
+                                auto arguments = function.get("arguments");
                                 if (arguments.is_string()) {
-                                    try {
-                                        arguments = json::parse(arguments.get<std::string>());
-                                    } catch (const std::exception & ecvt) {
-                                        fprintf(stderr, "Failed to parse arguments: %s\n", ecvt.what());
+                                    auto parsed = detail::try_call([&]() { return Value::parse_json(arguments.get<std::string>()); });
+                                    if (!parsed) {
+                                        fprintf(stderr, "Failed to parse arguments: %s\n", arguments.get<std::string>().c_str());
+                                    } else {
+                                        auto parsed_function = shallow_copy(function);
+                                        parsed_function.set("arguments", parsed.value);
+                                        auto parsed_call = shallow_copy(tool_call);
+                                        parsed_call.set("function", parsed_function);
+                                        tool_calls.push_back(parsed_call);
+                                        return;
                                     }
                                 }
                             }
-                        }
+                            tool_calls.push_back(tool_call);
+                        });
+                        MINJA_CHECK();
+                        message.set("tool_calls", tool_calls);
                     }
                     if (polyfill_tool_calls) {
-                        auto tool_calls = json::array();
-                        for (const auto & tool_call : message.at("tool_calls")) {
-                            if (tool_call.at("type") != "function") {
-                                continue;
+                        auto tool_calls = Value::array();
+                        message.get("tool_calls").for_each([&](Value & tool_call) {
+                            if (tool_call.get("type") != Value("function")) {
+                                return;
                             }
-                            const auto & function = tool_call.at("function");
-                            auto tc = json {
-                                {"name", function.at("name")},
-                                {"arguments", function.at("arguments")},
-                            };
+                            auto function = tool_call.get("function");
+                            auto tc = Value::object();
+                            tc.set("name", function.get("name"));
+                            tc.set("arguments", function.get("arguments"));
                             if (tool_call.contains("id")) {
-                                tc["id"] = tool_call["id"];
+                                tc.set("id", tool_call.get("id"));
                             }
                             tool_calls.push_back(tc);
-                        }
-                        auto obj = json {
-                            {"tool_calls", tool_calls},
-                        };
+                        });
+                        MINJA_CHECK();
+                        auto obj = Value::object();
+                        obj.set("tool_calls", tool_calls);
                         if (message.contains("content")) {
-                            auto content = message.at("content");
-                            if (!content.is_null() && !content.empty()) {
-                                obj["content"] = content;
+                            auto content = message.get("content");
+                            // Like with nlohmann::json, only empty arrays and objects are left out (not empty strings).
+                            if (!content.is_null() && (content.is_primitive() || !content.empty())) {
+                                obj.set("content", content);
                             }
                         }
-                        message["content"] = obj.dump(2);
+                        message.set("content", obj.dump(2, /* to_json= */ true));
                         message.erase("tool_calls");
                     }
                 }
                 if (polyfill_tool_responses && role == "tool") {
-                    message["role"] = "user";
-                    auto obj = json {
-                        {"tool_response", json::object()},
-                    };
+                    message.set("role", "user");
+                    auto tool_response = Value::object();
                     if (message.contains("name")) {
-                        obj["tool_response"]["tool"] = message.at("name");
+                        tool_response.set("tool", message.get("name"));
                     }
-                    obj["tool_response"]["content"] = message.at("content");
+                    tool_response.set("content", message.get("content"));
                     if (message.contains("tool_call_id")) {
-                        obj["tool_response"]["tool_call_id"] = message.at("tool_call_id");
+                        tool_response.set("tool_call_id", message.get("tool_call_id"));
                     }
-                    message["content"] = obj.dump(2);
+                    auto obj = Value::object();
+                    obj.set("tool_response", tool_response);
+                    message.set("content", obj.dump(2, /* to_json= */ true));
                     message.erase("name");
                 }
 
-                if (!message["content"].is_null() && polyfill_system_role) {
-                    std::string content = message.at("content");
+                // Polyfilled messages always have a content (null for tool calls).
+                if (!message.contains("content")) {
+                    message.set("content", Value());
+                }
+                if (!message.get("content").is_null() && polyfill_system_role) {
+                    auto content = message.get("content").get<std::string>();
                     if (role == "system") {
                         if (!pending_system.empty()) pending_system += "\n";
                         pending_system += content;
@@ -485,7 +1105,7 @@ class chat_template {
                     } else {
                         if (role == "user") {
                             if (!pending_system.empty()) {
-                                message["content"] = pending_system + (content.empty() ? "" : "\n" + content);
+                                message.set("content", pending_system + (content.empty() ? "" : "\n" + content));
                                 pending_system.clear();
                             }
                         } else {
@@ -496,42 +1116,188 @@ class chat_template {
                 add_message(message);
             }
             flush_sys();
-        } else {
-            actual_messages = inputs.messages;
         }
 
-        auto context = minja::Context::make(json({
-            {"messages", actual_messages},
-            {"add_generation_prompt", inputs.add_generation_prompt},
-        }));
+        auto context = minja::Context::make(Value::object());
+        context->set("messages", actual_messages);
+        context->set("add_generation_prompt", inputs.add_generation_prompt);
         context->set("bos_token", opts.use_bos_token ? bos_token_ : "");
         context->set("eos_token", opts.use_eos_token ? eos_token_ : "");
         if (opts.define_strftime_now) {
             auto now = inputs.now;
-            context->set("strftime_now", Value::callable([now](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue & args) {
+            context->set("strftime_now", Value::callable([now](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue & args) -> Value {
                 args.expectArgs("strftime_now", {1, 1}, {0, 0});
+                MINJA_CHECK();
                 auto format = args.args[0].get<std::string>();
 
                 auto time = std::chrono::system_clock::to_time_t(now);
-                auto local_time = *std::localtime(&time);
+                // std::localtime returns a pointer to shared static storage: use the reentrant variants,
+                // as templates may be rendered (and probed) from several threads at once.
+                std::tm local_time {};
+#ifdef _WIN32
+                localtime_s(&local_time, &time);
+#else
+                localtime_r(&time, &local_time);
+#endif
                 std::ostringstream ss;
                 ss << std::put_time(&local_time, format.c_str());
                 return ss.str();
             }));
         }
         if (!inputs.tools.is_null()) {
-            context->set("tools", minja::Value(inputs.tools));
+            context->set("tools", to_value(inputs.tools, inputs.placeholders));
         }
         if (!inputs.extra_context.is_null()) {
             for (auto & kv : inputs.extra_context.items()) {
-                context->set(kv.key(), minja::Value(kv.value()));
+                context->set(kv.key(), to_value(kv.value(), inputs.placeholders));
             }
         }
 
-        auto ret = template_root_->render(context);
         // fprintf(stderr, "actual_messages: %s\n", actual_messages.dump(2).c_str());
-        // fprintf(stderr, "apply: %s\n\n", ret.c_str());
-        return ret;
+        return context;
+    }
+
+    // Renders the longest suffix of the messages (or of the history) that fits truncation.budget (besides the messages it says to keep).
+    // Instead of re-rendering after each dropped message, the first attempt is guided by the messages' JSON lengths
+    // (scaled by the full prompt's rendered length) and the search then bisects the remaining candidates, so it takes
+    // O(log(#messages)) renders. The returned prompt is the actual render of the chosen messages.
+    chat_template_truncation_result apply_truncated(
+        const chat_template_inputs & inputs,
+        const chat_template_truncation & truncation,
+        const chat_template_options & opts = chat_template_options()) const
+    {
+        detail::ErrorScope error_scope;
+        const auto & messages = inputs.messages;
+        const auto & history = inputs.history;
+        const bool use_history = !history.empty();
+        if (!use_history && !messages.is_array()) MINJA_THROW(std::runtime_error("messages must be an array"));
+        auto role_of = [&](size_t i) -> std::string {
+            if (use_history) {
+                auto message = history.at(i);
+                auto role = message.is_object() ? message.get("role") : Value();
+                return role.is_string() ? role.get<std::string>() : "";
+            }
+            const auto & message = messages[i];
+            return message.is_object() && message.contains("role") && message.at("role").is_string() ? message.at("role").get<std::string>() : "";
+        };
+
+        // Dropped messages are the ones in [first, start), for start among the candidates.
+        const size_t n = use_history ? history.size() : messages.size();
+        size_t first = truncation.keep_system && n > 0 && role_of(0) == "system" ? 1 : 0;
+        size_t last = n;
+        if (truncation.keep_last_user) {
+            for (size_t i = n; i > first; i--) {
+                if (role_of(i - 1) == "user") {
+                    last = i - 1;
+                    break;
+                }
+            }
+        }
+        std::vector<size_t> candidates;
+        for (size_t start = first; start <= last; start++) {
+            if (start == first || start == last || !truncation.start_with_user || role_of(start) == "user") {
+                candidates.push_back(start);
+            }
+        }
+
+        auto truncated_inputs = inputs;
+        size_t renders = 0;
+        auto render = [&](size_t start) {
+            if (use_history) {
+                PersistentArray truncated_history;
+                for (size_t i = 0; i < first; i++) {
+                    truncated_history = truncated_history.push_back(history.at(i));
+                }
+                for (size_t i = start; i < n; i++) {
+                    truncated_history = truncated_history.push_back(history.at(i));
+                }
+                truncated_inputs.history = std::move(truncated_history);
+            } else {
+                truncated_inputs.messages = json::array();
+                for (size_t i = 0; i < first; i++) {
+                    truncated_inputs.messages.push_back(messages[i]);
+                }
+                for (size_t i = start; i < n; i++) {
+                    truncated_inputs.messages.push_back(messages[i]);
+                }
+            }
+            chat_template_truncation_result res;
+            res.prompt = apply(truncated_inputs, opts);
+            res.length = truncation.count_tokens ? truncation.count_tokens(res.prompt) : res.prompt.size();
+            res.dropped_messages = start - first;
+            res.fits = res.length <= truncation.budget;
+            res.renders = ++renders;
+            return res;
+        };
+
+        auto res = render(candidates[0]);
+        MINJA_CHECK();
+        if (res.fits || candidates.size() == 1) {
+            return res;
+        }
+
+        // Estimated length of the prompt with messages [first, start) dropped.
+        std::vector<size_t> dropped_weight(n + 1, 0);
+        for (size_t i = first; i < n; i++) {
+            dropped_weight[i + 1] = dropped_weight[i] + (use_history ? history.at(i).dump(-1, /* to_json= */ true) : messages[i].dump()).size();
+        }
+        double length_per_weight = (double) res.length / std::max<size_t>(1, dropped_weight[n]);
+        auto estimate = [&](size_t start) {
+            return (double) res.length - length_per_weight * (double) dropped_weight[start];
+        };
+
+        // The answer is the first fitting candidate in [lo, hi) (hi if none fits).
+        size_t lo = 1, hi = candidates.size();
+        chat_template_truncation_result best, shortest;
+        bool guided = true;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (guided) {
+                guided = false;
+                mid = lo;
+                while (mid + 1 < hi && estimate(candidates[mid]) > (double) truncation.budget) {
+                    mid++;
+                }
+            }
+            auto attempt = render(candidates[mid]);
+            MINJA_CHECK();
+            if (attempt.fits) {
+                best = std::move(attempt);
+                hi = mid;
+            } else {
+                if (mid + 1 == candidates.size()) {
+                    shortest = std::move(attempt);
+                }
+                lo = mid + 1;
+            }
+        }
+        if (hi == candidates.size()) {
+            if (shortest.renders == 0) {
+                shortest = render(candidates.back());
+                MINJA_CHECK();
+            }
+            best = std::move(shortest);
+        }
+        best.renders = renders;
+        return best;
+    }
+
+    static Value add_system(const Value & messages, const std::string & system_prompt) {
+        auto messages_with_system = Value::array();
+        size_t i = 0;
+        auto system = Value::object();
+        system.set("role", "system");
+        if (!messages.is_null() && !messages.empty() && messages.at(0).get("role") == Value("system")) {
+            system.set("content", messages.at(0).get("content").get<std::string>() + "\n\n" + system_prompt);
+            i = 1;
+        } else {
+            system.set("content", system_prompt);
+        }
+        messages_with_system.push_back(system);
+        for (size_t n = messages.is_null() ? 0 : messages.size(); i < n; i++) {
+            messages_with_system.push_back(messages.at(i));
+        }
+        return messages_with_system;
     }
 
     static nlohmann::ordered_json add_system(const nlohmann::ordered_json & messages, const std::string & system_prompt) {
@@ -553,4 +1319,165 @@ class chat_template {
     }
 };
 
+inline nlohmann::ordered_json chat_template_capture::inputs_to_json(const chat_template_inputs & inputs) {
+    nlohmann::ordered_json res = {
+        // The history is passed to the template like the same messages would be.
+        {"messages", inputs.history.empty() ? inputs.messages : to_json(inputs.history.to_value())},
+        {"add_generation_prompt", inputs.add_generation_prompt},
+        {"now", std::chrono::duration_cast<std::chrono::milliseconds>(inputs.now.time_since_epoch()).count()},
+    };
+    if (!inputs.tools.is_null()) res["tools"] = inputs.tools;
+    if (!inputs.extra_context.is_null()) res["extra_context"] = inputs.extra_context;
+    if (!inputs.placeholders.empty()) {
+        auto & placeholders = res["placeholders"] = nlohmann::ordered_json::object();
+        for (const auto & placeholder : inputs.placeholders) {
+            placeholders[placeholder.first] = to_json(placeholder.second);
+        }
+    }
+    return res;
+}
+
+inline chat_template_inputs chat_template_capture::inputs_from_json(const nlohmann::ordered_json & j) {
+    chat_template_inputs inputs;
+    inputs.messages = j.value("messages", nlohmann::ordered_json());
+    inputs.tools = j.value("tools", nlohmann::ordered_json());
+    inputs.add_generation_prompt = j.value("add_generation_prompt", true);
+    inputs.extra_context = j.value("extra_context", nlohmann::ordered_json());
+    if (j.contains("now")) {
+        inputs.now = std::chrono::system_clock::time_point(std::chrono::milliseconds(j["now"].get<int64_t>()));
+    }
+    if (j.contains("placeholders")) {
+        for (const auto & placeholder : j["placeholders"].items()) {
+            inputs.placeholders[placeholder.key()] = to_value(placeholder.value());
+        }
+    }
+    return inputs;
+}
+
+// Only the flags that differ from the defaults are written.
+inline nlohmann::ordered_json chat_template_capture::options_to_json(const chat_template_options & opts) {
+    static const chat_template_options defaults;
+    auto res = nlohmann::ordered_json::object();
+    for (const auto & flag : option_flags()) {
+        if (opts.*flag.second != defaults.*flag.second) res[flag.first] = opts.*flag.second;
+    }
+    return res;
+}
+
+inline chat_template_options chat_template_capture::options_from_json(const nlohmann::ordered_json & j) {
+    chat_template_options opts;
+    for (const auto & flag : option_flags()) {
+        opts.*flag.second = j.value(flag.first, opts.*flag.second);
+    }
+    return opts;
+}
+
+template <typename F>
+void chat_template_capture::capture(const chat_template & tmpl, const chat_template_inputs & inputs, const chat_template_options & opts, OutputSink & out, F && render) {
+    detail::hashing_sink sink(out);
+    auto start = std::chrono::steady_clock::now();
+    render(sink);
+    MINJA_CHECK_VOID();
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    if (duration >= min_duration) {
+        write(tmpl, inputs, opts, sink.size(), sink.hash(), duration);
+    }
+}
+
+inline void chat_template_capture::write(const chat_template & tmpl, const chat_template_inputs & inputs, const chat_template_options & opts,
+                                         size_t output_bytes, uint64_t output_hash, std::chrono::nanoseconds duration) {
+    auto template_hash = hash(tmpl.bos_token() + '\0' + tmpl.eos_token() + '\0' + tmpl.source());
+    nlohmann::ordered_json request = {
+        {"template", template_hash},
+        {"inputs", inputs_to_json(inputs)},
+        {"options", options_to_json(opts)},
+    };
+    bool redacted = false;
+    if (redact_) {
+        auto original = request;
+        redact_(request);
+        redacted = request != original;
+    }
+    request["output"] = {{"bytes", output_bytes}};
+    if (!redacted) {
+        request["output"]["hash"] = hex(output_hash);
+    }
+    request["duration_ns"] = duration.count();
+    // Invalid UTF-8 is replaced rather than failing the render.
+    auto line = request.dump(-1, ' ', false, nlohmann::ordered_json::error_handler_t::replace);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (templates_.insert(template_hash).second) {
+        *out_ << nlohmann::ordered_json({
+            {"template", template_hash},
+            {"source", tmpl.source()},
+            {"bos_token", tmpl.bos_token()},
+            {"eos_token", tmpl.eos_token()},
+        }).dump(-1, ' ', false, nlohmann::ordered_json::error_handler_t::replace) << '\n';
+    }
+    *out_ << line << '\n';
+    out_->flush();
+}
+
+/*
+    Requests recorded by a chat_template_capture, read back to replay them (see examples/minja-replay.cpp):
+
+        std::ifstream file("requests.jsonl");
+        auto replay = minja::chat_template_replay::load(file);
+        for (const auto & request : replay.requests) {
+            auto prompt = request.tmpl->apply(request.inputs, request.options);
+        }
+*/
+struct chat_template_replay {
+    struct request {
+        std::shared_ptr<chat_template> tmpl;
+        std::string template_hash;
+        chat_template_inputs inputs;
+        chat_template_options options;
+        // As captured. The output hash is empty for redacted requests.
+        size_t output_bytes = 0;
+        std::string output_hash;
+        std::chrono::nanoseconds duration {0};
+    };
+    // By template hash.
+    std::map<std::string, std::shared_ptr<chat_template>> templates;
+    std::vector<request> requests;
+
+    // Parses the templates as they're read.
+    static chat_template_replay load(std::istream & in) {
+        chat_template_replay replay;
+        std::string line;
+        for (size_t line_number = 1; std::getline(in, line); line_number++) {
+            if (line.empty()) continue;
+            auto error = [&](const std::string & message) { return std::runtime_error("Invalid replay file, line " + std::to_string(line_number) + ": " + message); };
+            auto j = nlohmann::ordered_json::parse(line, nullptr, /* allow_exceptions= */ false);
+            if (j.is_discarded() || !j.is_object() || !j.contains("template") || !j["template"].is_string()) {
+                MINJA_THROW(error("expected a JSON object with a template hash"));
+            }
+            auto template_hash = j["template"].get<std::string>();
+            if (j.contains("source")) {
+                auto tmpl = std::make_shared<chat_template>(j.value("source", ""), j.value("bos_token", ""), j.value("eos_token", ""));
+                MINJA_CHECK();
+                replay.templates[template_hash] = tmpl;
+                continue;
+            }
+            auto it = replay.templates.find(template_hash);
+            if (it == replay.templates.end()) {
+                MINJA_THROW(error("unknown template " + template_hash));
+            }
+            request req;
+            req.tmpl = it->second;
+            req.template_hash = template_hash;
+            req.inputs = chat_template_capture::inputs_from_json(j.value("inputs", nlohmann::ordered_json::object()));
+            req.options = chat_template_capture::options_from_json(j.value("options", nlohmann::ordered_json::object()));
+            auto output = j.value("output", nlohmann::ordered_json::object());
+            req.output_bytes = output.value("bytes", (size_t) 0);
+            req.output_hash = output.value("hash", "");
+            req.duration = std::chrono::nanoseconds(j.value("duration_ns", (int64_t) 0));
+            replay.requests.push_back(std::move(req));
+        }
+        return replay;
+    }
+};
+
 }  // namespace minja
@@ -10,72 +10,611 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <clocale>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
+#include <cstdio>
 #include <exception>
 #include <functional>
-#include <iostream>
 #include <iterator>
 #include <limits>
 #include <map>
 #include <memory>
-#include <regex>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+/*
+    Values are backed by nlohmann::ordered_json, unless MINJA_NO_NLOHMANN_JSON is defined: minja then doesn't include
+    nlohmann/json.hpp at all, Value holds its own scalars and JSON is read by Value::parse_json and written by tojson / dump.
+    (chat-template.hpp still takes its inputs as nlohmann::ordered_json and converts them at the boundary)
+    Unlike nlohmann::json, which keeps them as unsigned 64-bit integers, integers above INT64_MAX are then read as floats,
+    and arrays and objects can't be nested more than 512 levels deep.
+*/
+#ifndef MINJA_NO_NLOHMANN_JSON
 #include <nlohmann/json.hpp>
 
 using json = nlohmann::ordered_json;
+#endif
+
+/*
+    minja is header-only by default. To compile its implementation only once instead of in each including translation unit,
+    define MINJA_COMPILED_LIB and link with the minja_impl library (cmake -DMINJA_HEADER_ONLY=OFF does both for the minja target):
+    this header then only declares the public API (Value, Context, Expression / TemplateNode bases, Parser::parse),
+    and the implementation is compiled in src/minja.cpp (which defines MINJA_IMPLEMENTATION).
+    All translation units of a program must use the same mode.
+*/
+#ifdef MINJA_COMPILED_LIB
+#define MINJA_INLINE
+#else
+#define MINJA_INLINE inline
+#endif
+
+/*
+    Errors are reported with exceptions, unless MINJA_NO_EXCEPTIONS is defined (it is by default when exceptions are disabled, e.g. with -fno-exceptions).
+    In that mode, errors are returned by the non-throwing entry points (Parser::try_parse, TemplateNode::try_render,
+    chat_template::try_create / try_apply...), which work in both modes, while the other entry points abort on error as an uncaught
+    exception would (unless they're called within one of the former, e.g. by a callable, whose call then fails).
+    Internally, Expression::evaluate and TemplateNode::render return whether they succeeded (see detail::Checked), and the functions
+    that can't (e.g. Value's accessors and operators) return a default value and record their error in the innermost try_* call
+    (detail::ErrorFrame), which their caller checks (MINJA_CHECK). Value accessors returning references abort instead.
+*/
+#if !defined(MINJA_NO_EXCEPTIONS) && !defined(__cpp_exceptions) && !defined(__EXCEPTIONS) && !defined(_CPPUNWIND)
+#define MINJA_NO_EXCEPTIONS
+#endif
+
+#ifdef MINJA_NO_EXCEPTIONS
+#define MINJA_THROW(...) return ::minja::detail::fail(__VA_ARGS__)
+#define MINJA_THROW_VOID(...) do { ::minja::detail::fail(__VA_ARGS__); return; } while (0)
+// For functions that return references, which have no value to fail with.
+#define MINJA_THROW_OR_ABORT(...) ::minja::detail::fatal(__VA_ARGS__)
+// Declares var with the value of a checked call (Expression::evaluate), returning early if it failed.
+#define MINJA_TRY(var, ...) \
+    auto var##_checked = (__VA_ARGS__); \
+    if (!var##_checked.ok) return ::minja::detail::Failure(); \
+    auto var = std::move(var##_checked.value)
+#define MINJA_TRY_VOID(var, ...) \
+    auto var##_checked = (__VA_ARGS__); \
+    if (!var##_checked.ok) return; \
+    auto var = std::move(var##_checked.value)
+// Makes a checked call whose value isn't needed (TemplateNode::render), returning early if it failed.
+#define MINJA_CHECKED(...) if (!(__VA_ARGS__)) return ::minja::detail::Failure()
+#define MINJA_CHECKED_VOID(...) if (!(__VA_ARGS__)) return
+// Returns early if one of the calls since the last check failed (after calls that can't return a status, e.g. Value::call).
+#define MINJA_CHECK() if (::minja::detail::failed()) return ::minja::detail::Failure()
+#define MINJA_CHECK_VOID() if (::minja::detail::failed()) return
+#else
+#define MINJA_THROW(...) throw __VA_ARGS__
+#define MINJA_THROW_VOID(...) throw __VA_ARGS__
+#define MINJA_THROW_OR_ABORT(...) throw __VA_ARGS__
+#define MINJA_TRY(var, ...) auto var = (__VA_ARGS__)
+#define MINJA_TRY_VOID(var, ...) auto var = (__VA_ARGS__)
+#define MINJA_CHECKED(...) (__VA_ARGS__)
+#define MINJA_CHECKED_VOID(...) (__VA_ARGS__)
+#define MINJA_CHECK()
+#define MINJA_CHECK_VOID()
+#endif
 
 namespace minja {
 
+enum class LoopControlType { Break, Continue };
+
+#ifndef MINJA_NO_EXCEPTIONS
+// Thrown by break / continue, up to the loop they're in (or out of render, when they're outside of a loop).
+class LoopControlException : public std::runtime_error {
+public:
+    LoopControlType control_type;
+    LoopControlException(const std::string & message, LoopControlType control_type) : std::runtime_error(message), control_type(control_type) {}
+    LoopControlException(LoopControlType control_type)
+      : std::runtime_error((control_type == LoopControlType::Continue ? "continue" : "break") + std::string(" outside of a loop")),
+        control_type(control_type) {}
+};
+#endif
+
+// Outcome of the non-throwing entry points: a value, or the error that prevented computing it.
+template <typename T>
+struct Result {
+    T value {};
+    bool failed = false;
+    std::string error;
+
+    explicit operator bool() const { return !failed; }
+};
+
+namespace detail {
+
+// Result of an evaluation without exceptions, whose value can't be used without checking it (see MINJA_TRY).
+template <typename T>
+struct [[nodiscard]] Checked {
+    T value;
+    bool ok = true;
+};
+#ifdef MINJA_NO_EXCEPTIONS
+template <typename T> using Evaluated = Checked<T>;
+#else
+template <typename T> using Evaluated = T;
+#endif
+
+#ifdef MINJA_NO_EXCEPTIONS
+// Holds the error of a try_* call (see try_call). Only the first error is kept: the next ones are its consequences.
+class ErrorFrame {
+    ErrorFrame * parent_;
+    bool failed_ = false;
+    std::string error_;
+
+    // Innermost frame of this thread.
+    static ErrorFrame *& innermost_slot();
+
+  public:
+    ErrorFrame() : parent_(innermost_slot()) { innermost_slot() = this; }
+    ~ErrorFrame() { innermost_slot() = parent_; }
+    ErrorFrame(const ErrorFrame &) = delete;
+    ErrorFrame & operator=(const ErrorFrame &) = delete;
+
+    static ErrorFrame * innermost() { return innermost_slot(); }
+
+    bool failed() const { return failed_; }
+    const std::string & error() const { return error_; }
+    void fail(const std::string & error) {
+        if (failed_) return;
+        failed_ = true;
+        error_ = error;
+    }
+    // Adds the location of the failed expression or node (see Expression::evaluate).
+    void append(const std::string & suffix) { error_ += suffix; }
+};
+
+[[noreturn]] inline void fatal(const std::string & error) {
+    std::fprintf(stderr, "minja: %s\n", error.c_str());
+    std::abort();
+}
+[[noreturn]] inline void fatal(const std::exception & e) { fatal(std::string(e.what())); }
+
+inline bool failed() {
+    auto frame = ErrorFrame::innermost();
+    return frame && frame->failed();
+}
+
+// Returned by failing functions in place of their result: converts to a default value of any type.
+struct Failure {
+    template <typename T>
+    operator T() const { return T(); }
+    template <typename T>
+    operator Checked<T>() const { return {T(), false}; }
+};
+
+// Errors raised outside of any try_* call abort, as uncaught exceptions would.
+inline Failure fail(const std::exception & e) {
+    auto frame = ErrorFrame::innermost();
+    if (!frame) fatal(e);
+    frame->fail(e.what());
+    return Failure();
+}
+
+template <typename T, typename Json>
+bool json_holds(const Json & j) {
+    if constexpr (std::is_same<T, bool>::value) return j.is_boolean();
+    else if constexpr (std::is_arithmetic<T>::value) return j.is_number() || j.is_boolean();
+    else if constexpr (std::is_same<T, std::string>::value) return j.is_string();
+    else return true;
+}
+#endif
+
+template <typename F>
+auto try_call(F && f) -> Result<decltype(f())> {
+    Result<decltype(f())> res;
+#ifdef MINJA_NO_EXCEPTIONS
+    ErrorFrame frame;
+    res.value = f();
+    if (frame.failed()) {
+        res = {};
+        res.failed = true;
+        res.error = frame.error();
+    }
+#else
+    try {
+        res.value = f();
+    } catch (const std::exception & e) {
+        res.failed = true;
+        res.error = e.what();
+    }
+#endif
+    return res;
+}
+
+// Held by the entry points: without exceptions, their errors fail the enclosing try_* call if any, otherwise they abort once it returns.
+class ErrorScope {
+#ifdef MINJA_NO_EXCEPTIONS
+    std::optional<ErrorFrame> frame_;
+#endif
+  public:
+    ErrorScope() {
+#ifdef MINJA_NO_EXCEPTIONS
+        if (!ErrorFrame::innermost()) frame_.emplace();
+#endif
+    }
+#ifdef MINJA_NO_EXCEPTIONS
+    ~ErrorScope() {
+        if (frame_ && frame_->failed()) fatal(frame_->error());
+    }
+#endif
+    ErrorScope(const ErrorScope &) = delete;
+    ErrorScope & operator=(const ErrorScope &) = delete;
+};
+
+// Returns the result of an evaluation, which fails without exceptions if one of the calls since the last check did.
+template <typename T>
+Evaluated<std::decay_t<T>> checked(T && value) {
+#ifdef MINJA_NO_EXCEPTIONS
+    return {std::forward<T>(value), !failed()};
+#else
+    return std::forward<T>(value);
+#endif
+}
+
+#ifdef MINJA_NO_NLOHMANN_JSON
+
+// Scalar held by a Value: null, boolean, integer, float or string. Implements the subset of the nlohmann::json API
+// used by Value, with the same comparison semantics and the same JSON output.
+class Primitive {
+  public:
+    enum class Type { Null, Boolean, Integer, Float, String };
+
+  private:
+    Type type_ = Type::Null;
+    union {
+        bool boolean_;
+        int64_t integer_ = 0;
+        double float_;
+    };
+    std::string string_;
+
+    const char * type_name() const {
+        switch (type_) {
+            case Type::Null: return "null";
+            case Type::Boolean: return "boolean";
+            case Type::String: return "string";
+            default: return "number";
+        }
+    }
+
+    static void dump_float(double value, std::string & out) {
+        if (!std::isfinite(value)) {
+            out += "null";
+            return;
+        }
+        // Shortest representation that reads back to the same double, as mantissa digits and exponent.
+        char buf[32];
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        auto buf_end = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::scientific).ptr;
+#else
+        char * buf_end = buf;
+        for (int precision = 0; precision <= 17; precision++) {
+            buf_end = buf + std::snprintf(buf, sizeof(buf), "%.*e", precision, value);
+            if (std::strtod(buf, nullptr) == value) break;
+        }
+#endif
+        std::string digits;
+        const char * p = buf;
+        if (*p == '-') {
+            out += '-';
+            p++;
+        }
+        for (; p != buf_end && *p != 'e' && *p != 'E'; p++) {
+            if (*p != '.') digits += *p;
+        }
+        int exponent = p != buf_end ? std::atoi(p + 1) : 0;
+        while (digits.size() > 1 && digits.back() == '0') digits.pop_back();
+
+        // Same layout as nlohmann::json: plain notation for decimal exponents in (-4, 15], with at least one decimal.
+        int k = (int) digits.size();
+        int n = exponent + 1;
+        if (k <= n && n <= 15) {
+            out += digits;
+            out.append(n - k, '0');
+            out += ".0";
+        } else if (0 < n && n <= 15) {
+            out.append(digits, 0, n);
+            out += '.';
+            out.append(digits, n, std::string::npos);
+        } else if (-4 < n && n <= 0) {
+            out += "0.";
+            out.append(-n, '0');
+            out += digits;
+        } else {
+            out += digits[0];
+            if (k > 1) {
+                out += '.';
+                out.append(digits, 1, std::string::npos);
+            }
+            auto e = n - 1;
+            out += e < 0 ? "e-" : "e+";
+            auto e_str = std::to_string(e < 0 ? -e : e);
+            if (e_str.size() < 2) out += '0';
+            out += e_str;
+        }
+    }
+
+    static void dump_string(const std::string & s, std::string & out) {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for (char c : s) {
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if ((unsigned char) c < 0x20) {
+                        out += "\\u00";
+                        out += hex[(c >> 4) & 0xf];
+                        out += hex[c & 0xf];
+                    } else {
+                        out += c;
+                    }
+            }
+        }
+        out += '"';
+    }
+
+  public:
+    Primitive() {}
+    Primitive(std::nullptr_t) {}
+    Primitive(bool v) : type_(Type::Boolean), boolean_(v) {}
+    Primitive(int64_t v) : type_(Type::Integer), integer_(v) {}
+    Primitive(double v) : type_(Type::Float), float_(v) {}
+    Primitive(const std::string & v) : type_(Type::String), string_(v) {}
+    Primitive(std::string && v) : type_(Type::String), string_(std::move(v)) {}
+    Primitive(const char * v) : type_(Type::String), string_(v) {}
+
+    Type type() const { return type_; }
+    bool is_null() const { return type_ == Type::Null; }
+    bool is_boolean() const { return type_ == Type::Boolean; }
+    bool is_number_integer() const { return type_ == Type::Integer; }
+    bool is_number_float() const { return type_ == Type::Float; }
+    bool is_number() const { return is_number_integer() || is_number_float(); }
+    bool is_string() const { return type_ == Type::String; }
+    // Like nlohmann::json, only null is empty.
+    bool empty() const { return is_null(); }
+
+    template <typename T>
+    T get() const {
+        if constexpr (std::is_same<T, Primitive>::value) {
+            return *this;
+        } else if constexpr (std::is_same<T, std::string>::value) {
+            if (!is_string()) MINJA_THROW(std::runtime_error(std::string("type must be string, but is ") + type_name()));
+            return string_;
+        } else if constexpr (std::is_same<T, bool>::value) {
+            if (!is_boolean()) MINJA_THROW(std::runtime_error(std::string("type must be boolean, but is ") + type_name()));
+            return boolean_;
+        } else {
+            static_assert(std::is_arithmetic<T>::value, "Unsupported type");
+            switch (type_) {
+                case Type::Boolean: return static_cast<T>(boolean_);
+                case Type::Integer: return static_cast<T>(integer_);
+                case Type::Float: return static_cast<T>(float_);
+                default: MINJA_THROW(std::runtime_error(std::string("type must be number, but is ") + type_name()));
+            }
+        }
+    }
+    template <typename T>
+    T get_ref() const {
+        static_assert(std::is_same<T, const std::string &>::value, "Unsupported type");
+        return string_;
+    }
+
+    std::string dump() const {
+        std::string out;
+        switch (type_) {
+            case Type::Null: out = "null"; break;
+            case Type::Boolean: out = boolean_ ? "true" : "false"; break;
+            case Type::Integer: out = std::to_string(integer_); break;
+            case Type::Float: dump_float(float_, out); break;
+            case Type::String: dump_string(string_, out); break;
+        }
+        return out;
+    }
+
+    bool operator==(const Primitive & other) const {
+        if (is_number() && other.is_number()) {
+            if (is_number_integer() && other.is_number_integer()) return integer_ == other.integer_;
+            return get<double>() == other.get<double>();
+        }
+        if (type_ != other.type_) return false;
+        switch (type_) {
+            case Type::Boolean: return boolean_ == other.boolean_;
+            case Type::String: return string_ == other.string_;
+            default: return true;
+        }
+    }
+    bool operator!=(const Primitive & other) const { return !(*this == other); }
+};
+
+// Insertion-ordered map with linear lookups, like nlohmann::ordered_map.
+template <typename Key, typename T>
+class ordered_map : public std::vector<std::pair<Key, T>> {
+    using Container = std::vector<std::pair<Key, T>>;
+  public:
+    using typename Container::iterator;
+    using typename Container::const_iterator;
+
+    iterator find(const Key & key) {
+        auto it = this->begin();
+        for (auto end = this->end(); it != end && !(it->first == key); ++it) {}
+        return it;
+    }
+    const_iterator find(const Key & key) const { return const_cast<ordered_map *>(this)->find(key); }
+    size_t count(const Key & key) const { return find(key) == this->end() ? 0 : 1; }
+
+    T & at(const Key & key) {
+        auto it = find(key);
+        if (it == this->end()) MINJA_THROW(std::out_of_range("key not found: " + key.dump()));
+        return it->second;
+    }
+    const T & at(const Key & key) const { return const_cast<ordered_map *>(this)->at(key); }
+    T & operator[](const Key & key) {
+        auto it = find(key);
+        if (it != this->end()) return it->second;
+        this->emplace_back(key, T());
+        return this->back().second;
+    }
+
+    iterator erase(iterator pos) { return Container::erase(pos); }
+    size_t erase(const Key & key) {
+        auto it = find(key);
+        if (it == this->end()) return 0;
+        Container::erase(it);
+        return 1;
+    }
+};
+
+#else
+
+using Primitive = nlohmann::ordered_json;
+template <typename Key, typename T>
+using ordered_map = nlohmann::ordered_map<Key, T>;
+
+#endif
+
+}  // namespace detail
+
 class Context;
+class TemplateNode;
 
 struct Options {
     bool trim_blocks;  // removes the first newline after a block
     bool lstrip_blocks;  // removes leading whitespace on the line of the block
     bool keep_trailing_newline;  // don't remove last newline
+    // Defers the parsing of macro bodies and of if / elif / else branches of at least lazy_branch_min_size bytes
+    // until they're first rendered. Only the balance of their block tags is checked upfront, other syntax errors are reported on render.
+    bool lazy_bodies = false;
+    size_t lazy_branch_min_size = 512;
+    // Memoizes the output of for loop iterations (across renders), keyed by their item and the values their body reads,
+    // e.g. for loops over long tool lists that rarely change. Only loops whose bodies call nothing but builtins and macros the
+    // template defined before the loop, which only read their parameters and their own variables, are memoized.
+    bool memoize_loops = false;
+    // Approximate memory each memoized loop may hold (outputs, keys and values read and set), in bytes: the oldest iterations
+    // are dropped beyond it. The memo is part of the parsed template (e.g. of a TemplateCache entry) and released with it.
+    size_t loop_memo_max_bytes = 16 << 20;
+    // Renders the iterations of for loops over at least that many items in parallel (0: never), in chunks on a shared pool of threads,
+    // when the loop body provably doesn't depend on its previous iterations: no namespace writes nor list / dict mutations, variables it
+    // sets are set before they're read, no break nor loop.cycle(), and calls only to builtins and to macros the template defined before the
+    // loop (with the same restrictions). The output is the same as when rendering sequentially. Not combined with memoize_loops.
+    size_t parallel_loop_min_items = 0;
+    // Parses `{% generation %}...{% endgeneration %}` blocks (which mark the assistant's generated text, e.g. for loss masks in
+    // training data) into nodes that report the range of the output they produce (see TemplateNode::render_generation_spans),
+    // rather than just rendering their body.
+    bool generation_spans = false;
+
+    bool operator==(const Options & other) const {
+        return trim_blocks == other.trim_blocks
+            && lstrip_blocks == other.lstrip_blocks
+            && keep_trailing_newline == other.keep_trailing_newline
+            && lazy_bodies == other.lazy_bodies
+            && lazy_branch_min_size == other.lazy_branch_min_size
+            && memoize_loops == other.memoize_loops
+            && loop_memo_max_bytes == other.loop_memo_max_bytes
+            && parallel_loop_min_items == other.parallel_loop_min_items
+            && generation_spans == other.generation_spans;
+    }
+    bool operator!=(const Options & other) const { return !(*this == other); }
 };
 
 struct ArgumentsValue;
 
-inline std::string normalize_newlines(const std::string & s) {
-#ifdef _WIN32
-  static const std::regex nl_regex("\r\n");
-  return std::regex_replace(s, nl_regex, "\n");
-#else
-  return s;
-#endif
-}
+// Approximate memory held by a Value and its elements (see Value::memory_usage), in bytes unless noted.
+// Arrays, objects, callables and streamed strings reached several times through the tree are counted once.
+struct ValueMemoryUsage {
+    // Counts.
+    size_t values = 0;
+    size_t arrays = 0;
+    size_t objects = 0;
+    size_t strings = 0;
+    size_t callables = 0;
+    // Slots of arrays (elements are Values), entries of objects (including their keys' characters), characters of strings
+    // (of streamed strings: once materialized).
+    size_t array_bytes = 0;
+    size_t object_bytes = 0;
+    size_t string_bytes = 0;
+    size_t total_bytes = 0;
+    // Split of total_bytes: what's only reachable through arrays, objects or streamed strings that have other references (e.g. from
+    // copies of the value, another request's values or a PersistentArray, or from elsewhere in the value), and the rest.
+    size_t shared_bytes = 0;
+    size_t unique_bytes = 0;
+};
 
 /* Values that behave roughly like in Python. */
 class Value {
 public:
   using CallableType = std::function<Value(const std::shared_ptr<Context> &, ArgumentsValue &)>;
   using FilterType = std::function<Value(const std::shared_ptr<Context> &, ArgumentsValue &)>;
+  using ChunkCallback = std::function<void(std::string_view)>;
+  // Calls its argument with each successive chunk of a string.
+  using ChunkProvider = std::function<void(const ChunkCallback &)>;
 
 private:
-  using ObjectType = nlohmann::ordered_map<json, Value>;  // Only contains primitive keys
+  using ObjectType = detail::ordered_map<detail::Primitive, Value>;  // Only contains primitive keys
   using ArrayType = std::vector<Value>;
 
   std::shared_ptr<ArrayType> array_;
   std::shared_ptr<ObjectType> object_;
   std::shared_ptr<CallableType> callable_;
-  json primitive_;
+  detail::Primitive primitive_;
+
+  class JsonReader;
+  friend class PersistentArray;
+  friend class Context;
+
+  // String produced by a chunk provider, only concatenated (once) when something needs the whole string.
+  class StreamedString;
+  std::shared_ptr<StreamedString> stream_;
+
+  const detail::Primitive & materialize_stream() const;
+  const detail::Primitive & primitive() const { return stream_ ? materialize_stream() : primitive_; }
+
+  // Deleter of the arrays that PersistentArray::to_value shares between its calls, which can't be resized.
+  struct SharedArrayDeleter {
+    void operator()(ArrayType * array) const { delete array; }
+  };
+  bool is_shared_array() const { return std::get_deleter<SharedArrayDeleter>(array_) != nullptr; }
+  // Deleter of the callables created with an identity (see callable_identity).
+  struct IdentifiedCallableDeleter {
+    const void * identity;
+    void operator()(CallableType * callable) const { delete callable; }
+  };
+  static std::string shared_array_error() { return "Cannot resize an array shared by a PersistentArray (copy it first, e.g. with items[:])"; }
 
   Value(const std::shared_ptr<ArrayType> & array) : array_(array) {}
   Value(const std::shared_ptr<ObjectType> & object) : object_(object) {}
   Value(const std::shared_ptr<CallableType> & callable) : object_(std::make_shared<ObjectType>()), callable_(callable) {}
 
+  // Finds a string key without building a json key (object_ must be set).
+  ObjectType::iterator find_key(std::string_view key) const {
+    auto it = object_->begin();
+    for (auto end = object_->end(); it != end; ++it) {
+      if (it->first.is_string() && it->first.get_ref<const std::string &>() == key) break;
+    }
+    return it;
+  }
+
   /* Python-style string repr */
-  static void dump_string(const json & primitive, std::ostringstream & out, char string_quote = '\'') {
-    if (!primitive.is_string()) throw std::runtime_error("Value is not a string: " + primitive.dump());
+  static void dump_string(const detail::Primitive & primitive, std::ostringstream & out, char string_quote = '\'') {
+    if (!primitive.is_string()) MINJA_THROW_VOID(std::runtime_error("Value is not a string: " + primitive.dump()));
     auto s = primitive.dump();
     if (string_quote == '"' || s.find('\'') != std::string::npos) {
       out << s;
@@ -111,6 +650,8 @@ private:
     auto string_quote = to_json ? '"' : '\'';
 
     if (is_null()) out << "null";
+    else if (array_ && array_->empty()) out << "[]";
+    else if (object_ && object_->empty() && !callable_) out << "{}";
     else if (array_) {
       out << "[";
       print_indent(level + 1);
@@ -136,13 +677,13 @@ private:
       print_indent(level);
       out << "}";
     } else if (callable_) {
-      throw std::runtime_error("Cannot dump callable to JSON");
+      MINJA_THROW_VOID(std::runtime_error("Cannot dump callable to JSON"));
     } else if (is_boolean() && !to_json) {
       out << (this->to_bool() ? "True" : "False");
     } else if (is_string() && !to_json) {
-      dump_string(primitive_, out, string_quote);
+      dump_string(primitive(), out, string_quote);
     } else {
-      out << primitive_.dump();
+      out << primitive().dump();
     }
   }
 
@@ -155,6 +696,9 @@ public:
   Value(const std::string & v) : primitive_(v) {}
   Value(const char * v) : primitive_(std::string(v)) {}
 
+#ifdef MINJA_NO_NLOHMANN_JSON
+  Value(const detail::Primitive & v) : primitive_(v) {}
+#else
   Value(const json & v) {
     if (v.is_object()) {
       auto object = std::make_shared<ObjectType>();
@@ -174,9 +718,31 @@ public:
       primitive_ = v;
     }
   }
+#endif
+
+  // Parses a JSON document (without going through nlohmann::json).
+  static Value parse_json(std::string_view str);
+
+  // String whose content is produced in chunks by provider (e.g. read from a file or a socket), without holding it in memory:
+  // printing it as is (`{{ content }}`) writes its chunks to the output as they come, while any other use (filters,
+  // comparisons, concatenation, tojson...) materializes it once. The provider is called again on each print until then.
+  static Value stream(ChunkProvider provider);
+  bool is_streamed() const { return !!stream_; }
+  // Address of the array or object that a value shares with its copies (e.g. with the items of slices of an array
+  // it's in), or null for other values.
+  const void * identity() const {
+    if (array_) return array_.get();
+    if (object_) return object_.get();
+    return nullptr;
+  }
+  // Walks the whole value, e.g. to enforce memory limits on request inputs.
+  ValueMemoryUsage memory_usage() const;
+  // Calls callback with the content of a string in one or more chunks (without materializing streamed strings).
+  void for_each_chunk(const ChunkCallback & callback) const;
+
 
   std::vector<Value> keys() {
-    if (!object_) throw std::runtime_error("Value is not an object: " + dump());
+    if (!object_) MINJA_THROW(std::runtime_error("Value is not an object: " + dump()));
     std::vector<Value> res;
     for (const auto& item : *object_) {
       res.push_back(item.first);
@@ -187,8 +753,8 @@ public:
   size_t size() const {
     if (is_object()) return object_->size();
     if (is_array()) return array_->size();
-    if (is_string()) return primitive_.get<std::string>().length();
-    throw std::runtime_error("Value is not an array or object: " + dump());
+    if (is_string()) return primitive().get<std::string>().length();
+    MINJA_THROW(std::runtime_error("Value is not an array or object: " + dump()));
   }
 
   static Value array(const std::vector<Value> values = {}) {
@@ -204,31 +770,46 @@ public:
   static Value callable(const CallableType & callable) {
     return Value(std::make_shared<CallableType>(callable));
   }
+  // Callable identified by what defines it (e.g. a macro's definition) rather than by itself, so that the callables that the
+  // same definition creates (e.g. in each render) are the same for callable_identity. identity must outlive the callable.
+  static Value callable(const CallableType & callable, const void * identity) {
+    return Value(std::shared_ptr<CallableType>(new CallableType(callable), IdentifiedCallableDeleter {identity}));
+  }
+  // Identity of a callable (see above), or null for other values.
+  const void * callable_identity() const {
+    if (!callable_) return nullptr;
+    auto deleter = std::get_deleter<IdentifiedCallableDeleter>(callable_);
+    return deleter ? deleter->identity : callable_.get();
+  }
 
   void insert(size_t index, const Value& v) {
     if (!array_)
-      throw std::runtime_error("Value is not an array: " + dump());
+      MINJA_THROW_VOID(std::runtime_error("Value is not an array: " + dump()));
+    if (is_shared_array()) MINJA_THROW_VOID(std::runtime_error(shared_array_error()));
     array_->insert(array_->begin() + index, v);
   }
   void push_back(const Value& v) {
     if (!array_)
-      throw std::runtime_error("Value is not an array: " + dump());
+      MINJA_THROW_VOID(std::runtime_error("Value is not an array: " + dump()));
+    if (is_shared_array()) MINJA_THROW_VOID(std::runtime_error(shared_array_error()));
     array_->push_back(v);
   }
   Value pop(const Value& index) {
     if (is_array()) {
+      if (is_shared_array())
+        MINJA_THROW(std::runtime_error(shared_array_error()));
       if (array_->empty())
-        throw std::runtime_error("pop from empty list");
+        MINJA_THROW(std::runtime_error("pop from empty list"));
       if (index.is_null()) {
         auto ret = array_->back();
         array_->pop_back();
         return ret;
       } else if (!index.is_number_integer()) {
-        throw std::runtime_error("pop index must be an integer: " + index.dump());
+        MINJA_THROW(std::runtime_error("pop index must be an integer: " + index.dump()));
       } else {
         auto i = index.get<int>();
         if (i < 0 || i >= static_cast<int>(array_->size()))
-          throw std::runtime_error("pop index out of range: " + index.dump());
+          MINJA_THROW(std::runtime_error("pop index out of range: " + index.dump()));
         auto it = array_->begin() + (i < 0 ? array_->size() + i : i);
         auto ret = *it;
         array_->erase(it);
@@ -236,51 +817,85 @@ public:
       }
     } else if (is_object()) {
       if (!index.is_hashable())
-        throw std::runtime_error("Unhashable type: " + index.dump());
-      auto it = object_->find(index.primitive_);
+        MINJA_THROW(std::runtime_error("Unhashable type: " + index.dump()));
+      auto it = object_->find(index.primitive());
       if (it == object_->end())
-        throw std::runtime_error("Key not found: " + index.dump());
+        MINJA_THROW(std::runtime_error("Key not found: " + index.dump()));
       auto ret = it->second;
       object_->erase(it);
       return ret;
     } else {
-      throw std::runtime_error("Value is not an array or object: " + dump());
+      MINJA_THROW(std::runtime_error("Value is not an array or object: " + dump()));
     }
   }
-  Value get(const Value& key) {
+  Value get(const Value& key) const {
     if (array_) {
       if (!key.is_number_integer()) {
         return Value();
       }
       auto index = key.get<int>();
-      return array_->at(index < 0 ? array_->size() + index : index);
+      auto i = index < 0 ? array_->size() + index : (size_t) index;
+      if (i >= array_->size()) MINJA_THROW(std::out_of_range("list index out of range: " + key.dump()));
+      return (*array_)[i];
     } else if (object_) {
-      if (!key.is_hashable()) throw std::runtime_error("Unhashable type: " + dump());
-      auto it = object_->find(key.primitive_);
+      if (!key.is_hashable()) MINJA_THROW(std::runtime_error("Unhashable type: " + dump()));
+      auto it = object_->find(key.primitive());
       if (it == object_->end()) return Value();
       return it->second;
     }
     return Value();
   }
   void set(const Value& key, const Value& value) {
-    if (!object_) throw std::runtime_error("Value is not an object: " + dump());
-    if (!key.is_hashable()) throw std::runtime_error("Unhashable type: " + dump());
-    (*object_)[key.primitive_] = value;
+    if (!object_) MINJA_THROW_VOID(std::runtime_error("Value is not an object: " + dump()));
+    if (!key.is_hashable()) MINJA_THROW_VOID(std::runtime_error("Unhashable type: " + dump()));
+    (*object_)[key.primitive()] = value;
   }
+
+  // String key overloads of get / set / at / contains, which don't allocate a key to look it up.
+  // (const char arrays get their own overload as they'd be ambiguous between std::string_view and Value)
+  Value get(std::string_view key) const {
+    if (!object_) return get(Value(std::string(key)));
+    auto it = find_key(key);
+    return it == object_->end() ? Value() : it->second;
+  }
+  Value get(const std::string & key) const { return get(std::string_view(key)); }
+  template <size_t N>
+  Value get(const char (&key)[N]) const { return get(std::string_view(key)); }
+  // The value of a key of an object, or null if it's missing or this isn't an object, in a single lookup.
+  const Value * find(std::string_view key) const {
+    if (!object_) return nullptr;
+    auto it = find_key(key);
+    return it == object_->end() ? nullptr : &it->second;
+  }
+  Value * find(std::string_view key) { return const_cast<Value *>(std::as_const(*this).find(key)); }
+
+  void set(std::string_view key, const Value& value) {
+    if (!object_) MINJA_THROW_VOID(std::runtime_error("Value is not an object: " + dump()));
+    auto it = find_key(key);
+    if (it != object_->end()) {
+      it->second = value;
+    } else {
+      object_->emplace_back(detail::Primitive(std::string(key)), value);
+    }
+  }
+  void set(const std::string & key, const Value& value) { set(std::string_view(key), value); }
+  template <size_t N>
+  void set(const char (&key)[N], const Value& value) { set(std::string_view(key), value); }
+
   Value call(const std::shared_ptr<Context> & context, ArgumentsValue & args) const {
-    if (!callable_) throw std::runtime_error("Value is not callable: " + dump());
+    if (!callable_) MINJA_THROW(std::runtime_error("Value is not callable: " + dump()));
     return (*callable_)(context, args);
   }
 
   bool is_object() const { return !!object_; }
   bool is_array() const { return !!array_; }
   bool is_callable() const { return !!callable_; }
-  bool is_null() const { return !object_ && !array_ && primitive_.is_null() && !callable_; }
+  bool is_null() const { return !object_ && !array_ && primitive_.is_null() && !callable_ && !stream_; }
   bool is_boolean() const { return primitive_.is_boolean(); }
   bool is_number_integer() const { return primitive_.is_number_integer(); }
   bool is_number_float() const { return primitive_.is_number_float(); }
   bool is_number() const { return primitive_.is_number(); }
-  bool is_string() const { return primitive_.is_string(); }
+  bool is_string() const { return stream_ || primitive_.is_string(); }
   bool is_iterable() const { return is_array() || is_object() || is_string(); }
 
   bool is_primitive() const { return !array_ && !object_ && !callable_; }
@@ -288,8 +903,8 @@ public:
 
   bool empty() const {
     if (is_null())
-      throw std::runtime_error("Undefined value or reference");
-    if (is_string()) return primitive_.empty();
+      MINJA_THROW(std::runtime_error("Undefined value or reference"));
+    if (is_string()) return primitive().empty();
     if (is_array()) return array_->empty();
     if (is_object()) return object_->empty();
     return false;
@@ -297,7 +912,7 @@ public:
 
   void for_each(const std::function<void(Value &)> & callback) const {
     if (is_null())
-      throw std::runtime_error("Undefined value or reference");
+      MINJA_THROW_VOID(std::runtime_error("Undefined value or reference"));
     if (array_) {
       for (auto& item : *array_) {
         callback(item);
@@ -308,12 +923,12 @@ public:
         callback(key);
       }
     } else if (is_string()) {
-      for (char c : primitive_.get<std::string>()) {
+      for (char c : primitive().get<std::string>()) {
         auto val = Value(std::string(1, c));
         callback(val);
       }
     } else {
-      throw std::runtime_error("Value is not iterable: " + dump());
+      MINJA_THROW_VOID(std::runtime_error("Value is not iterable: " + dump()));
     }
   }
 
@@ -331,30 +946,31 @@ public:
     if (is_boolean()) return get<bool>() ? 1 : 0;
     if (is_number()) return static_cast<int64_t>(get<double>());
     if (is_string()) {
-      try {
-        return std::stol(get<std::string>());
-      } catch (const std::exception &) {
-        return 0;
-      }
+      // Like std::stol, but returns 0 instead of throwing if there's no number or it overflows.
+      const auto & str = primitive().get_ref<const std::string &>();
+      char * str_end = nullptr;
+      errno = 0;
+      auto res = std::strtoll(str.c_str(), &str_end, 10);
+      return str_end == str.c_str() || errno == ERANGE ? 0 : res;
     }
     return 0;
   }
 
   bool operator<(const Value & other) const {
     if (is_null())
-      throw std::runtime_error("Undefined value or reference");
+      MINJA_THROW(std::runtime_error("Undefined value or reference"));
     if (is_number() && other.is_number()) return get<double>() < other.get<double>();
     if (is_string() && other.is_string()) return get<std::string>() < other.get<std::string>();
-    throw std::runtime_error("Cannot compare values: " + dump() + " < " + other.dump());
+    MINJA_THROW(std::runtime_error("Cannot compare values: " + dump() + " < " + other.dump()));
   }
   bool operator>=(const Value & other) const { return !(*this < other); }
 
   bool operator>(const Value & other) const {
     if (is_null())
-      throw std::runtime_error("Undefined value or reference");
+      MINJA_THROW(std::runtime_error("Undefined value or reference"));
     if (is_number() && other.is_number()) return get<double>() > other.get<double>();
     if (is_string() && other.is_string()) return get<std::string>() > other.get<std::string>();
-    throw std::runtime_error("Cannot compare values: " + dump() + " > " + other.dump());
+    MINJA_THROW(std::runtime_error("Cannot compare values: " + dump() + " > " + other.dump()));
   }
   bool operator<=(const Value & other) const { return !(*this > other); }
 
@@ -377,74 +993,112 @@ public:
       }
       return true;
     } else {
-      return primitive_ == other.primitive_;
+      return primitive() == other.primitive();
     }
   }
   bool operator!=(const Value & other) const { return !(*this == other); }
 
-  bool contains(const char * key) const { return contains(std::string(key)); }
-  bool contains(const std::string & key) const {
+  bool contains(const char * key) const { return contains(std::string_view(key)); }
+  bool contains(const std::string & key) const { return contains(std::string_view(key)); }
+  bool contains(std::string_view key) const {
     if (array_) {
       return false;
     } else if (object_) {
-      return object_->find(key) != object_->end();
+      return find_key(key) != object_->end();
     } else {
-      throw std::runtime_error("contains can only be called on arrays and objects: " + dump());
+      MINJA_THROW(std::runtime_error("contains can only be called on arrays and objects: " + dump()));
     }
   }
   bool contains(const Value & value) const {
     if (is_null())
-      throw std::runtime_error("Undefined value or reference");
+      MINJA_THROW(std::runtime_error("Undefined value or reference"));
     if (array_) {
       for (const auto& item : *array_) {
         if (item.to_bool() && item == value) return true;
       }
       return false;
     } else if (object_) {
-      if (!value.is_hashable()) throw std::runtime_error("Unhashable type: " + value.dump());
-      return object_->find(value.primitive_) != object_->end();
+      if (!value.is_hashable()) MINJA_THROW(std::runtime_error("Unhashable type: " + value.dump()));
+      return object_->find(value.primitive()) != object_->end();
     } else {
-      throw std::runtime_error("contains can only be called on arrays and objects: " + dump());
+      MINJA_THROW(std::runtime_error("contains can only be called on arrays and objects: " + dump()));
     }
   }
   void erase(size_t index) {
-    if (!array_) throw std::runtime_error("Value is not an array: " + dump());
+    if (!array_) MINJA_THROW_VOID(std::runtime_error("Value is not an array: " + dump()));
+    if (is_shared_array()) MINJA_THROW_VOID(std::runtime_error(shared_array_error()));
     array_->erase(array_->begin() + index);
   }
   void erase(const std::string & key) {
-    if (!object_) throw std::runtime_error("Value is not an object: " + dump());
+    if (!object_) MINJA_THROW_VOID(std::runtime_error("Value is not an object: " + dump()));
     object_->erase(key);
   }
   const Value& at(const Value & index) const {
     return const_cast<Value*>(this)->at(index);
   }
   Value& at(const Value & index) {
-    if (!index.is_hashable()) throw std::runtime_error("Unhashable type: " + dump());
-    if (is_array()) return array_->at(index.get<int>());
-    if (is_object()) return object_->at(index.primitive_);
-    throw std::runtime_error("Value is not an array or object: " + dump());
+    if (!index.is_hashable()) MINJA_THROW_OR_ABORT(std::runtime_error("Unhashable type: " + dump()));
+    if (is_array()) {
+      auto i = index.get<int>();
+      if (i < 0 || (size_t) i >= array_->size()) MINJA_THROW_OR_ABORT(std::out_of_range("list index out of range: " + index.dump()));
+      return (*array_)[i];
+    }
+    if (is_object()) {
+      auto it = object_->find(index.primitive());
+      if (it == object_->end()) MINJA_THROW_OR_ABORT(std::out_of_range("key not found: " + index.dump()));
+      return it->second;
+    }
+    MINJA_THROW_OR_ABORT(std::runtime_error("Value is not an array or object: " + dump()));
+  }
+  const Value& at(std::string_view key) const {
+    return const_cast<Value*>(this)->at(key);
+  }
+  Value& at(std::string_view key) {
+    if (!object_) return at(Value(std::string(key)));
+    auto it = find_key(key);
+    if (it == object_->end()) MINJA_THROW_OR_ABORT(std::out_of_range("key not found"));
+    return it->second;
   }
+  const Value& at(const std::string & key) const { return at(std::string_view(key)); }
+  Value& at(const std::string & key) { return at(std::string_view(key)); }
+  template <size_t N>
+  const Value& at(const char (&key)[N]) const { return at(std::string_view(key)); }
+  template <size_t N>
+  Value& at(const char (&key)[N]) { return at(std::string_view(key)); }
   const Value& at(size_t index) const {
     return const_cast<Value*>(this)->at(index);
   }
   Value& at(size_t index) {
     if (is_null())
-      throw std::runtime_error("Undefined value or reference");
-    if (is_array()) return array_->at(index);
-    if (is_object()) return object_->at(index);
-    throw std::runtime_error("Value is not an array or object: " + dump());
+      MINJA_THROW_OR_ABORT(std::runtime_error("Undefined value or reference"));
+    if (is_array()) {
+      if (index >= array_->size()) MINJA_THROW_OR_ABORT(std::out_of_range("list index out of range: " + std::to_string(index)));
+      return (*array_)[index];
+    }
+    if (is_object()) {
+      auto it = object_->find(detail::Primitive((int64_t) index));
+      if (it == object_->end()) MINJA_THROW_OR_ABORT(std::out_of_range("key not found: " + std::to_string(index)));
+      return it->second;
+    }
+    MINJA_THROW_OR_ABORT(std::runtime_error("Value is not an array or object: " + dump()));
   }
 
   template <typename T>
-  T get(const std::string & key, T default_value) const {
+  T get(std::string_view key, T default_value) const {
     if (!contains(key)) return default_value;
     return at(key).get<T>();
   }
 
   template <typename T>
   T get() const {
-    if (is_primitive()) return primitive_.get<T>();
-    throw std::runtime_error("get<T> not defined for this value type: " + dump());
+    if (is_primitive()) {
+#ifdef MINJA_NO_EXCEPTIONS
+      // nlohmann::json would abort on a type mismatch.
+      if (!detail::json_holds<T>(primitive())) MINJA_THROW(std::runtime_error("Value has the wrong type: " + dump()));
+#endif
+      return primitive().get<T>();
+    }
+    MINJA_THROW(std::runtime_error("get<T> not defined for this value type: " + dump()));
   }
 
   std::string dump(int indent=-1, bool to_json=false) const {
@@ -459,6 +1113,17 @@ public:
       else
         return -get<double>();
   }
+  // The string of a string value, moved out of it instead of copied (e.g. to write a temporary value to an OutputSink).
+  std::string take_string() {
+    if (stream_ || !primitive_.is_string()) return get<std::string>();
+    auto res = std::move(const_cast<std::string &>(primitive_.get_ref<const std::string &>()));
+    primitive_ = std::string();
+    return res;
+  }
+  // Same as to_str, moving strings out of the value (see take_string).
+  std::string take_str() {
+    return is_string() ? take_string() : to_str();
+  }
   std::string to_str() const {
     if (is_string()) return get<std::string>();
     if (is_number_integer()) return std::to_string(get<int64_t>());
@@ -501,13 +1166,18 @@ public:
         return get<double>() * rhs.get<double>();
   }
   Value operator/(const Value& rhs) const {
-      if (is_number_integer() && rhs.is_number_integer())
-        return get<int64_t>() / rhs.get<int64_t>();
-      else
+      if (is_number_integer() && rhs.is_number_integer()) {
+        auto divisor = rhs.get<int64_t>();
+        if (divisor == 0) MINJA_THROW(std::runtime_error("Division by zero"));
+        return get<int64_t>() / divisor;
+      } else
         return get<double>() / rhs.get<double>();
   }
   Value operator%(const Value& rhs) const {
-    return get<int64_t>() % rhs.get<int64_t>();
+    auto divisor = rhs.get<int64_t>();
+    MINJA_CHECK();
+    if (divisor == 0) MINJA_THROW(std::runtime_error("Modulo by zero"));
+    return get<int64_t>() % divisor;
   }
 };
 
@@ -515,14 +1185,14 @@ struct ArgumentsValue {
   std::vector<Value> args;
   std::vector<std::pair<std::string, Value>> kwargs;
 
-  bool has_named(const std::string & name) {
+  bool has_named(std::string_view name) {
     for (const auto & p : kwargs) {
       if (p.first == name) return true;
     }
     return false;
   }
 
-  Value get_named(const std::string & name) {
+  Value get_named(std::string_view name) {
     for (const auto & [key, value] : kwargs) {
       if (key == name) return value;
     }
@@ -537,14 +1207,15 @@ struct ArgumentsValue {
     if (args.size() < pos_count.first || args.size() > pos_count.second || kwargs.size() < kw_count.first || kwargs.size() > kw_count.second) {
       std::ostringstream out;
       out << method_name << " must have between " << pos_count.first << " and " << pos_count.second << " positional arguments and between " << kw_count.first << " and " << kw_count.second << " keyword arguments";
-      throw std::runtime_error(out.str());
+      MINJA_THROW_VOID(std::runtime_error(out.str()));
     }
   }
 };
 
+#ifndef MINJA_NO_NLOHMANN_JSON
 template <>
 inline json Value::get<json>() const {
-  if (is_primitive()) return primitive_;
+  if (is_primitive()) return primitive();
   if (is_null()) return json();
   if (array_) {
     std::vector<json> res;
@@ -561,7 +1232,7 @@ inline json Value::get<json>() const {
       } else if (key.is_primitive()) {
         res[key.dump()] = value.get<json>();
       } else {
-        throw std::runtime_error("Invalid key type for conversion to JSON: " + key.dump());
+        MINJA_THROW(std::runtime_error("Invalid key type for conversion to JSON: " + key.dump()));
       }
     }
     if (is_callable()) {
@@ -569,56 +1240,85 @@ inline json Value::get<json>() const {
     }
     return res;
   }
-  throw std::runtime_error("get<json> not defined for this value type: " + dump());
+  MINJA_THROW(std::runtime_error("get<json> not defined for this value type: " + dump()));
 }
+#endif
 
 } // namespace minja
 
 namespace std {
+#ifdef MINJA_NO_NLOHMANN_JSON
+  template <>
+  struct hash<minja::detail::Primitive> {
+    size_t operator()(const minja::detail::Primitive & v) const {
+      using Type = minja::detail::Primitive::Type;
+      switch (v.type()) {
+        case Type::Boolean: return std::hash<bool>()(v.get<bool>());
+        case Type::Integer: return std::hash<int64_t>()(v.get<int64_t>());
+        case Type::Float: return std::hash<double>()(v.get<double>());
+        case Type::String: return std::hash<std::string>()(v.get_ref<const std::string &>());
+        default: return 0;
+      }
+    }
+  };
+#endif
   template <>
   struct hash<minja::Value> {
     size_t operator()(const minja::Value & v) const {
       if (!v.is_hashable())
-        throw std::runtime_error("Unsupported type for hashing: " + v.dump());
-      return std::hash<json>()(v.get<json>());
+        MINJA_THROW(std::runtime_error("Unsupported type for hashing: " + v.dump()));
+      return std::hash<minja::detail::Primitive>()(v.get<minja::detail::Primitive>());
     }
   };
 } // namespace std
 
 namespace minja {
 
-static std::string error_location_suffix(const std::string & source, size_t pos) {
-  auto get_line = [&](size_t line) {
-    auto start = source.begin();
-    for (size_t i = 1; i < line; ++i) {
-      start = std::find(start, source.end(), '\n') + 1;
-    }
-    auto end = std::find(start, source.end(), '\n');
-    return std::string(start, end);
-  };
-  auto start = source.begin();
-  auto end = source.end();
-  auto it = start + pos;
-  auto line = std::count(start, it, '\n') + 1;
-  auto max_line = std::count(start, end, '\n') + 1;
-  auto col = pos - std::string(start, it).rfind('\n');
-  std::ostringstream out;
-  out << " at row " << line << ", column " << col << ":\n";
-  if (line > 1) out << get_line(line - 1) << "\n";
-  out << get_line(line) << "\n";
-  out << std::string(col - 1, ' ') << "^\n";
-  if (line < max_line) out << get_line(line + 1) << "\n";
+/*
+    Append-only array with structural sharing, e.g. to keep a conversation's messages between turns instead of converting
+    the whole history again on each request:
+
+        auto history = minja::PersistentArray().push_back(message1).push_back(message2);
+        auto next = history.push_back(message3);  // history still has 2 items, and shares them with next.
+
+    The versions share a buffer that each new version extends in place, as long as it extends the latest version (appending
+    to an older one copies its items' handles first). Versions are thread-safe.
+    to_value() returns the latest version's buffer itself rather than a copy (older versions copy their items' handles), as
+    a read-only array: like in the immutable sandbox chat templates are usually rendered in, templates can't append to it nor
+    pop from it. The buffer is only copied by a push_back while values of to_value() are still alive, so push_back and
+    to_value are O(1) (amortized) when each version is rendered before the next one is pushed. The items themselves are
+    shared: templates mutating them in place would change them in all versions.
+*/
+class PersistentArray {
+    struct Buffer;
+    std::shared_ptr<Buffer> buffer_;
+    size_t size_ = 0;
 
-  return out.str();
-}
+    PersistentArray(std::shared_ptr<Buffer> buffer, size_t size) : buffer_(std::move(buffer)), size_(size) {}
+
+    static std::shared_ptr<Value::ArrayType> make_items();
+
+public:
+    PersistentArray();
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    PersistentArray push_back(const Value & item) const;
+    Value at(size_t index) const;
+    Value to_value() const;
+};
 
 class Context {
   protected:
     Value values_;
     std::shared_ptr<Context> parent_;
+
+    // The string of a string key, borrowed rather than copied.
+    static std::string_view string_key(const Value & key) { return key.primitive().get_ref<const std::string &>(); }
   public:
     Context(Value && values, const std::shared_ptr<Context> & parent = nullptr) : values_(std::move(values)), parent_(parent) {
-        if (!values_.is_object()) throw std::runtime_error("Context values must be an object: " + values_.dump());
+        if (!values_.is_object()) MINJA_THROW_VOID(std::runtime_error("Context values must be an object: " + values_.dump()));
     }
     virtual ~Context() {}
 
@@ -628,24 +1328,58 @@ class Context {
     std::vector<Value> keys() {
         return values_.keys();
     }
+    // String keys go through the string key overloads below.
     virtual Value get(const Value & key) {
+        if (key.is_string()) return get(string_key(key));
         if (values_.contains(key)) return values_.at(key);
         if (parent_) return parent_->get(key);
         return Value();
     }
     virtual Value & at(const Value & key) {
+        if (key.is_string()) return at(string_key(key));
         if (values_.contains(key)) return values_.at(key);
         if (parent_) return parent_->at(key);
-        throw std::runtime_error("Undefined variable: " + key.dump());
+        MINJA_THROW_OR_ABORT(std::runtime_error("Undefined variable: " + key.dump()));
     }
     virtual bool contains(const Value & key) {
+        if (key.is_string()) return contains(string_key(key));
         if (values_.contains(key)) return true;
         if (parent_) return parent_->contains(key);
         return false;
     }
     virtual void set(const Value & key, const Value & value) {
+        if (key.is_string()) return set(string_key(key), value);
+        values_.set(key, value);
+    }
+
+    // String key overloads, used for variable lookups as they don't allocate a key. Subclasses intercepting variables
+    // (e.g. to resolve them lazily or record their reads) override these: the Value-keyed overloads above only handle other keys.
+    virtual Value get(std::string_view key) {
+        if (auto value = values_.find(key)) return *value;
+        if (parent_) return parent_->get(key);
+        return Value();
+    }
+    virtual Value & at(std::string_view key) {
+        if (auto value = values_.find(key)) return *value;
+        if (parent_) return parent_->at(key);
+        MINJA_THROW_OR_ABORT(std::runtime_error("Undefined variable: " + Value(std::string(key)).dump()));
+    }
+    virtual bool contains(std::string_view key) {
+        if (values_.find(key)) return true;
+        if (parent_) return parent_->contains(key);
+        return false;
+    }
+    virtual void set(std::string_view key, const Value & value) {
         values_.set(key, value);
     }
+    Value get(const std::string & key) { return get(std::string_view(key)); }
+    Value & at(const std::string & key) { return at(std::string_view(key)); }
+    bool contains(const std::string & key) { return contains(std::string_view(key)); }
+    void set(const std::string & key, const Value & value) { set(std::string_view(key), value); }
+    template <size_t N> Value get(const char (&key)[N]) { return get(std::string_view(key)); }
+    template <size_t N> Value & at(const char (&key)[N]) { return at(std::string_view(key)); }
+    template <size_t N> bool contains(const char (&key)[N]) { return contains(std::string_view(key)); }
+    template <size_t N> void set(const char (&key)[N], const Value & value) { set(std::string_view(key), value); }
 };
 
 struct Location {
@@ -653,6 +1387,21 @@ struct Location {
     size_t pos;
 };
 
+class Expression;
+
+// Receives the direct children of template nodes and expressions (see visit_children), e.g. for static analyses of templates.
+struct AstVisitor {
+    virtual ~AstVisitor() = default;
+    virtual void visit(const TemplateNode & node) = 0;
+    virtual void visit(const Expression & expr) = 0;
+
+    // Skips null children (e.g. an absent for loop condition).
+    template <typename T>
+    void visit(const std::shared_ptr<T> & child) {
+        if (child) visit(*child);
+    }
+};
+
 class Expression {
 protected:
     virtual Value do_evaluate(const std::shared_ptr<Context> & context) const = 0;
@@ -664,51 +1413,1118 @@ public:
     Expression(const Location & location) : location(location) {}
     virtual ~Expression() = default;
 
-    Value evaluate(const std::shared_ptr<Context> & context) const {
-        try {
-            return do_evaluate(context);
-        } catch (const std::exception & e) {
-            std::ostringstream out;
-            out << e.what();
-            if (location.source) out << error_location_suffix(*location.source, location.pos);
-            throw std::runtime_error(out.str());
-        }
-    }
+    // Without exceptions, the value can't be read without checking whether the evaluation failed (see MINJA_TRY).
+    detail::Evaluated<Value> evaluate(const std::shared_ptr<Context> & context) const;
+    // Visits the sub-expressions, in evaluation order.
+    virtual void visit_children(AstVisitor &) const {}
 };
 
-class VariableExpr : public Expression {
-    std::string name;
+/* Destination of the rendered text. */
+class OutputSink {
+    size_t size_ = 0;
+protected:
+    virtual void do_write(std::string_view text) = 0;
+    virtual void do_write_static(std::string_view text) { do_write(text); }
+    virtual void do_write_owned(std::string && text) { do_write(text); }
 public:
-    VariableExpr(const Location & loc, const std::string& n)
-      : Expression(loc), name(n) {}
-    std::string get_name() const { return name; }
-    Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        if (!context->contains(name)) {
-            return Value();
-        }
-        return context->at(name);
+    virtual ~OutputSink() = default;
+
+    // Number of bytes written so far.
+    size_t size() const { return size_; }
+
+    void write(std::string_view text) {
+        size_ += text.size();
+        do_write(text);
+    }
+    // Text owned by the template (e.g. its literal text), which stays valid as long as the template root.
+    void write_static(std::string_view text) {
+        size_ += text.size();
+        do_write_static(text);
+    }
+    // Temporary text, which the sink may keep instead of copying.
+    void write_owned(std::string && text) {
+        size_ += text.size();
+        do_write_owned(std::move(text));
     }
 };
 
-static void destructuring_assign(const std::vector<std::string> & var_names, const std::shared_ptr<Context> & context, Value& item) {
-  if (var_names.size() == 1) {
-      Value name(var_names[0]);
-      context->set(name, item);
-  } else {
-      if (!item.is_array() || item.size() != var_names.size()) {
-          throw std::runtime_error("Mismatched number of variables and items in destructuring assignment");
-      }
-      for (size_t i = 0; i < var_names.size(); ++i) {
-          context->set(var_names[i], item.at(i));
-      }
-  }
+class StringSink : public OutputSink {
+    std::string & out_;
+protected:
+    void do_write(std::string_view text) override { out_ += text; }
+public:
+    // Appends to out.
+    StringSink(std::string & out) : out_(out) {}
+};
+
+/*
+    Renders to a list of (pointer, length) segments instead of one contiguous string, e.g. to pass to writev or to a tokenizer that takes fragments.
+    The template's text is referenced in place and large strings are moved in rather than copied; small pieces are copied
+    (and coalesced) in an arena. Segments stay valid as long as both the sink and the rendered template root are alive.
+    Strings of the inputs aren't referenced in place: as Values hold their strings, evaluating `{{ content }}` copies it once,
+    and that copy is then moved in.
+*/
+class SegmentSink : public OutputSink {
+public:
+    // Same layout as struct iovec.
+    struct Segment {
+        const char * data;
+        size_t size;
+    };
+
+private:
+    static constexpr size_t block_size_ = 4096;
+
+    size_t min_reference_size_;
+    std::vector<Segment> segments_;
+    // Strings moved in (their data must not move, even for short strings).
+    std::vector<std::unique_ptr<std::string>> owned_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char * block_pos_ = nullptr;
+    char * block_end_ = nullptr;
+
+    void append(const char * data, size_t size) {
+        if (!segments_.empty() && segments_.back().data + segments_.back().size == data) {
+            segments_.back().size += size;
+        } else {
+            segments_.push_back({data, size});
+        }
+    }
+
+protected:
+    void do_write(std::string_view text) override {
+        if (text.empty()) return;
+        if ((size_t) (block_end_ - block_pos_) < text.size()) {
+            if (text.size() >= min_reference_size_) {
+                owned_.push_back(std::make_unique<std::string>(text));
+                append(owned_.back()->data(), text.size());
+                return;
+            }
+            blocks_.push_back(std::make_unique<char[]>(block_size_));
+            block_pos_ = blocks_.back().get();
+            block_end_ = block_pos_ + block_size_;
+        }
+        std::memcpy(block_pos_, text.data(), text.size());
+        append(block_pos_, text.size());
+        block_pos_ += text.size();
+    }
+    void do_write_static(std::string_view text) override {
+        if (text.size() < min_reference_size_) return do_write(text);
+        append(text.data(), text.size());
+    }
+    void do_write_owned(std::string && text) override {
+        if (text.size() < min_reference_size_) return do_write(text);
+        owned_.push_back(std::make_unique<std::string>(std::move(text)));
+        append(owned_.back()->data(), owned_.back()->size());
+    }
+
+public:
+    // Pieces shorter than min_reference_size are copied to the arena (fewer, larger segments).
+    explicit SegmentSink(size_t min_reference_size = 64) : min_reference_size_(std::min(min_reference_size, block_size_)) {}
+    SegmentSink(const SegmentSink &) = delete;
+    SegmentSink & operator=(const SegmentSink &) = delete;
+
+    const std::vector<Segment> & segments() const { return segments_; }
+
+    std::string str() const {
+        std::string res;
+        res.reserve(size());
+        for (const auto & segment : segments_) res.append(segment.data, segment.size);
+        return res;
+    }
+};
+
+/*
+    Validates the UTF-8 of the output as it's written, forwarding it to another sink, e.g. to skip a separate validation
+    pass before tokenization (byte-wise string slicing and truncation in templates can split multi-byte characters):
+
+        minja::Utf8Sink utf8(out, minja::Utf8Sink::Mode::Repair);
+        root->render(utf8, context);
+        utf8.finish();
+
+    Report mode forwards the output unchanged and records its first error; Repair mode replaces each invalid sequence (its
+    maximal prefix that could start a valid one, or a single invalid byte) with U+FFFD, holding back the bytes of a
+    character split across writes until it's complete. size() counts the bytes written to this sink, before repairs.
+    Runs of ASCII are skipped 8 bytes at a time.
+*/
+class Utf8Sink : public OutputSink {
+public:
+    enum class Mode { Report, Repair };
+
+private:
+    OutputSink & out_;
+    Mode mode_;
+    // Continuation bytes still expected by the current sequence, and the range of the next one.
+    size_t needed_ = 0;
+    unsigned char lower_ = 0x80, upper_ = 0xBF;
+    // Offset of the current sequence, and its bytes written before the current text (Repair mode).
+    size_t sequence_offset_ = 0;
+    std::string pending_;
+    // Bytes validated so far.
+    size_t offset_ = 0;
+    size_t errors_ = 0;
+    size_t first_error_ = std::string::npos;
+
+    static constexpr std::string_view replacement_ = "\xEF\xBF\xBD";
+
+    // Starts a sequence with byte c, returning false if it can't start one.
+    bool start(unsigned char c) {
+        lower_ = 0x80;
+        upper_ = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            needed_ = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            needed_ = 2;
+            if (c == 0xE0) lower_ = 0xA0;       // Overlong.
+            else if (c == 0xED) upper_ = 0x9F;  // Surrogates.
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            needed_ = 3;
+            if (c == 0xF0) lower_ = 0x90;       // Overlong.
+            else if (c == 0xF4) upper_ = 0x8F;  // Above U+10FFFF.
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    void error(size_t offset) {
+        if (!errors_++) first_error_ = offset;
+        if (mode_ == Mode::Repair) out_.write(replacement_);
+    }
+
+    // Validates text, calling emit(begin, end) with its ranges to forward, in order with the errors (Repair mode).
+    template <typename Emit>
+    void validate(std::string_view text, Emit && emit) {
+        const auto * data = reinterpret_cast<const unsigned char *>(text.data());
+        size_t i = 0, n = text.size();
+        // Start of the bytes not forwarded yet, and of the current sequence (if it started in this text).
+        size_t clean = 0, sequence = 0;
+        bool carried = needed_ > 0;
+        while (i < n) {
+            if (needed_ == 0) {
+                while (i + 8 <= n) {
+                    uint64_t word;
+                    std::memcpy(&word, data + i, 8);
+                    if (word & 0x8080808080808080ULL) break;
+                    i += 8;
+                }
+                if (i == n) break;
+                auto c = data[i];
+                if (c < 0x80) {
+                    i++;
+                } else if (start(c)) {
+                    sequence = i;
+                    sequence_offset_ = offset_ + i;
+                    i++;
+                } else {
+                    emit(clean, i);
+                    error(offset_ + i);
+                    clean = ++i;
+                }
+                continue;
+            }
+            auto c = data[i];
+            if (c >= lower_ && c <= upper_) {
+                lower_ = 0x80;
+                upper_ = 0xBF;
+                i++;
+                if (--needed_ == 0 && carried) {
+                    // Completes a character split across writes.
+                    if (mode_ == Mode::Repair) {
+                        pending_.append(text.data(), i);
+                        out_.write(pending_);
+                        pending_.clear();
+                    }
+                    carried = false;
+                    clean = i;
+                }
+                continue;
+            }
+            // Truncated sequence: c is then validated as the start of the next one.
+            needed_ = 0;
+            if (!carried) emit(clean, sequence);
+            error(sequence_offset_);
+            pending_.clear();
+            carried = false;
+            clean = i;
+        }
+        if (!needed_) {
+            emit(clean, n);
+        } else if (carried) {
+            if (mode_ == Mode::Repair) pending_.append(text.data(), n);
+        } else {
+            emit(clean, sequence);
+            if (mode_ == Mode::Repair) pending_.assign(text.data() + sequence, n - sequence);
+        }
+    }
+
+    // write_whole forwards the whole text, if it's valid.
+    template <typename WriteWhole>
+    void process(std::string_view text, WriteWhole && write_whole) {
+        auto n = text.size();
+        if (mode_ == Mode::Report) {
+            validate(text, [](size_t, size_t) {});
+            write_whole();
+        } else {
+            validate(text, [&](size_t begin, size_t end) {
+                if (begin == 0 && end == n) {
+                    // Last call: text may be moved.
+                    write_whole();
+                } else if (begin < end) {
+                    out_.write(text.substr(begin, end - begin));
+                }
+            });
+        }
+        offset_ += n;
+    }
+
+protected:
+    void do_write(std::string_view text) override { process(text, [&]() { out_.write(text); }); }
+    void do_write_static(std::string_view text) override { process(text, [&]() { out_.write_static(text); }); }
+    void do_write_owned(std::string && text) override { process(text, [&]() { out_.write_owned(std::move(text)); }); }
+
+public:
+    explicit Utf8Sink(OutputSink & out, Mode mode = Mode::Report) : out_(out), mode_(mode) {}
+
+    // Ends the output: a character it ends with is truncated.
+    void finish() {
+        if (!needed_) return;
+        needed_ = 0;
+        pending_.clear();
+        error(sequence_offset_);
+    }
+    // Whether the output so far is valid (call finish first to account for a truncated character at its end).
+    bool valid() const { return errors_ == 0; }
+    // Number of invalid sequences (each replaced by U+FFFD in Repair mode).
+    size_t errors() const { return errors_; }
+    // Offset of the first invalid sequence in the output written to this sink, or std::string::npos.
+    size_t first_error() const { return first_error_; }
+};
+
+/*
+    Render state saved before a given message of a template's top-level `{% for ... in messages %}` loop (see
+    TemplateNode::render_checkpoint), so that inputs sharing the same first messages (e.g. the same system prompt,
+    tools and few-shot examples) can be rendered without re-rendering them (see TemplateNode::render_from).
+*/
+struct RenderCheckpoint {
+    // Output up to (excluding) messages[message_index].
+    std::string output;
+    size_t message_index = 0;
+
+    // What the rendering depended on, to check the checkpoint applies to other inputs.
+    size_t preamble_size = 0;
+    size_t messages_offset = 0;
+    std::vector<Value> messages;
+    std::vector<std::pair<Value, Value>> inputs;
+    std::vector<std::pair<Value, Value>> variables_before_loop;
+    // State of the loop: variables (re)defined by its first iterations, in its scope and out of it (e.g. namespaces).
+    std::vector<std::pair<Value, Value>> variables;
+    std::vector<std::pair<Value, Value>> loop_variables;
+    size_t cycle_index = 0;
+};
+
+// Range of a render's output [begin, end) (in bytes) produced by one of its messages (see TemplateNode::render_message_spans).
+struct MessageSpan {
+    size_t message_index = 0;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+// Range of a render's output [begin, end) (in bytes), e.g. produced by a `{% generation %}` block (see TemplateNode::render_generation_spans).
+struct OutputSpan {
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+namespace detail {
+
+inline Value deep_copy(const Value & value) {
+    if (value.is_callable()) return value;
+    if (value.is_array()) {
+        auto res = Value::array();
+        for (size_t i = 0, n = value.size(); i < n; i++) res.push_back(deep_copy(value.get(Value((int64_t) i))));
+        return res;
+    }
+    if (value.is_object()) {
+        auto res = Value::object();
+        for (const auto & key : Value(value).keys()) res.set(key, deep_copy(value.get(key)));
+        return res;
+    }
+    return value;
+}
+
+// Structural equality (unlike Value::operator==, which is Python-like on falsy items), callables being all alike.
+inline bool same_value(const Value & a, const Value & b) {
+    if (a.is_callable() || b.is_callable()) return a.is_callable() && b.is_callable();
+    if (a.is_array() || b.is_array()) {
+        if (!a.is_array() || !b.is_array() || a.size() != b.size()) return false;
+        for (size_t i = 0, n = a.size(); i < n; i++) {
+            if (!same_value(a.get(Value((int64_t) i)), b.get(Value((int64_t) i)))) return false;
+        }
+        return true;
+    }
+    if (a.is_object() || b.is_object()) {
+        if (!a.is_object() || !b.is_object() || a.size() != b.size()) return false;
+        for (const auto & key : Value(a).keys()) {
+            if (!b.contains(key) || !same_value(a.get(key), b.get(key))) return false;
+        }
+        return true;
+    }
+    return a == b;
+}
+
+// Exact textual key of a value (callables being all alike).
+inline void fingerprint(const Value & value, std::string & out) {
+    if (value.is_callable()) {
+        // Two callables bound to the same name (e.g. macros defined in different branches) must not match.
+        char identity[32];
+        std::snprintf(identity, sizeof(identity), "%p", value.callable_identity());
+        out += "<callable ";
+        out += identity;
+        out += '>';
+    } else if (value.is_array()) {
+        out += '[';
+        for (size_t i = 0, n = value.size(); i < n; i++) {
+            fingerprint(value.get(Value((int64_t) i)), out);
+            out += ',';
+        }
+        out += ']';
+    } else if (value.is_object()) {
+        out += '{';
+        for (const auto & key : Value(value).keys()) {
+            out += key.dump(-1, /* to_json= */ true);
+            out += ':';
+            fingerprint(value.get(key), out);
+            out += ',';
+        }
+        out += '}';
+    } else {
+        out += value.dump(-1, /* to_json= */ true);
+    }
+}
+
+}  // namespace detail
+
+// Approximate memory held by a parsed template (see TemplateNode::memory_usage), in bytes unless noted.
+struct TemplateMemoryUsage {
+    // Number of nodes and expressions, in total and by class (e.g. "ForNode", "VariableExpr").
+    size_t nodes = 0;
+    size_t expressions = 0;
+    std::map<std::string, size_t> counts_by_type;
+    // The nodes and expressions themselves, of which their locations (a reference to the source and an offset).
+    size_t node_bytes = 0;
+    size_t location_bytes = 0;
+    // Text, string literals and variable names.
+    size_t literal_bytes = 0;
+    // The template source, kept for error messages (and for the bodies that aren't parsed yet, see Options::lazy_bodies).
+    size_t source_bytes = 0;
+    // Iterations memoized so far (see Options::memoize_loops).
+    size_t loop_memo_bytes = 0;
+    size_t total_bytes = 0;
+};
+
+class TemplateNode {
+    Location location_;
+protected:
+    // Nodes override one of these. The std::ostringstream overload is the former interface, kept for existing subclasses:
+    // their output is buffered, then moved to the sink.
+    virtual void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const {
+        std::ostringstream buffer;
+        do_render(buffer, context);
+        MINJA_CHECK_VOID();
+        out.write_owned(buffer.str());
+    }
+    virtual void do_render(std::ostringstream &, const std::shared_ptr<Context> &) const {
+        MINJA_THROW_VOID(std::runtime_error("TemplateNode subclasses must override do_render"));
+    }
+
+public:
+    TemplateNode(const Location & location) : location_(location) {}
+    // Callables that rendering defines (macros, caller) own the parts of the AST they render, so they may outlive the template.
+#ifdef MINJA_NO_EXCEPTIONS
+    // Returns false if it failed (see MINJA_NO_EXCEPTIONS).
+    bool render(OutputSink & out, const std::shared_ptr<Context> & context) const;
+#else
+    void render(OutputSink & out, const std::shared_ptr<Context> & context) const;
+#endif
+    const Location & location() const { return location_; }
+    virtual ~TemplateNode() = default;
+    // Visits the child nodes and expressions, in rendering order (the bodies of lazily parsed branches only once they're parsed).
+    virtual void visit_children(AstVisitor &) const {}
+    // Walks the whole template: call it on the root, e.g. for capacity planning of template caches.
+    TemplateMemoryUsage memory_usage() const;
+    std::string render(const std::shared_ptr<Context> & context) const {
+        std::string res;
+        StringSink out(res);
+        MINJA_CHECKED(render(out, context));
+        return res;
+    }
+    void render(std::ostringstream & out, const std::shared_ptr<Context> & context) const {
+        out << render(context);
+    }
+    Result<std::string> try_render(const std::shared_ptr<Context> & context) const {
+        return detail::try_call([&]() { return render(context); });
+    }
+
+    // Renders like render(context), also capturing the state before messages[message_index] is rendered by the
+    // template's top-level `{% for ... in messages %}` loop (the loop may also iterate over a suffix of messages, as in
+    // `{% set loop_messages = messages[1:] %}{% for message in loop_messages %}`). checkpoint is left null when the
+    // template has no such loop, when its body may see other messages than its current and previous ones (it reads messages,
+    // the iterated variable, loop.length, loop.revindex or loop.nextitem, directly or through macros) or when messages[message_index]
+    // is its last message.
+    std::string render_checkpoint(const std::shared_ptr<Context> & context, size_t message_index, std::shared_ptr<RenderCheckpoint> & checkpoint) const;
+    // Renders inputs that start with the same messages as the checkpoint's, rendering only the following ones.
+    // Returns false, without writing anything, if the checkpoint doesn't apply: the other inputs or the variables set by the
+    // template before the loop differ, or there are no more messages.
+    bool render_from(const RenderCheckpoint & checkpoint, OutputSink & out, const std::shared_ptr<Context> & context) const;
+    // Renders like render(out, context), also returning the range of the output each message produced, as rendered by the
+    // template's top-level loop over messages (see render_checkpoint), in rendering order. Iterations are matched to the
+    // messages they render by identity (see Value::identity), so loops over a slice or a filtered subset of the messages are
+    // also covered; messages rendered out of the loop (e.g. a system message rendered before it), not rendered or that aren't
+    // objects have no span.
+    void render_message_spans(OutputSink & out, const std::shared_ptr<Context> & context, std::vector<MessageSpan> & spans) const;
+    // Renders like render(out, context), also returning the range of the output produced by each (outermost) `{% generation %}`
+    // block, in rendering order, for templates parsed with Options::generation_spans (otherwise there are none). Loops aren't
+    // memoized nor rendered in parallel while recording.
+    void render_generation_spans(OutputSink & out, const std::shared_ptr<Context> & context, std::vector<OutputSpan> & spans) const;
+};
+
+class Parser {
+public:
+    // Without exceptions, aborts on error unless called within a try_* call, which then fails (see MINJA_NO_EXCEPTIONS).
+    static std::shared_ptr<TemplateNode> parse(const std::string& template_str, const Options & options);
+    static Result<std::shared_ptr<TemplateNode>> try_parse(const std::string& template_str, const Options & options) {
+        return detail::try_call([&]() { return parse(template_str, options); });
+    }
+};
+
+}  // namespace minja
+
+#if !defined(MINJA_COMPILED_LIB) || defined(MINJA_IMPLEMENTATION)
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <regex>
+#include <thread>
+
+namespace minja {
+
+#ifdef MINJA_NO_EXCEPTIONS
+MINJA_INLINE detail::ErrorFrame *& detail::ErrorFrame::innermost_slot() {
+    static thread_local ErrorFrame * innermost = nullptr;
+    return innermost;
+}
+#endif
+
+class Value::StreamedString {
+    ChunkProvider provider_;
+    std::once_flag once_;
+    std::atomic<bool> materialized_ {false};
+    detail::Primitive str_;
+public:
+    StreamedString(ChunkProvider provider) : provider_(std::move(provider)) {}
+
+    const detail::Primitive & materialize() {
+        std::call_once(once_, [&]() {
+            std::string str;
+            provider_([&](std::string_view chunk) { str.append(chunk.data(), chunk.size()); });
+            str_ = std::move(str);
+            materialized_ = true;
+        });
+        return str_;
+    }
+    void for_each_chunk(const ChunkCallback & callback) {
+        if (materialized_) {
+            callback(str_.get_ref<const std::string &>());
+        } else {
+            provider_(callback);
+        }
+    }
+    // 0 until materialized.
+    size_t materialized_size() const { return materialized_ ? str_.get_ref<const std::string &>().size() : 0; }
+};
+
+MINJA_INLINE Value Value::stream(ChunkProvider provider) {
+    Value res;
+    res.stream_ = std::make_shared<StreamedString>(std::move(provider));
+    return res;
+}
+
+MINJA_INLINE const detail::Primitive & Value::materialize_stream() const {
+    return stream_->materialize();
+}
+
+MINJA_INLINE void Value::for_each_chunk(const ChunkCallback & callback) const {
+    if (stream_) {
+        stream_->for_each_chunk(callback);
+    } else if (primitive_.is_string()) {
+        callback(primitive_.get_ref<const std::string &>());
+    } else {
+        MINJA_THROW_VOID(std::runtime_error("Value is not a string: " + dump()));
+    }
+}
+
+struct PersistentArray::Buffer {
+    std::mutex mutex;
+    std::shared_ptr<Value::ArrayType> items = make_items();
+};
+
+MINJA_INLINE std::shared_ptr<Value::ArrayType> PersistentArray::make_items() {
+    return std::shared_ptr<Value::ArrayType>(new Value::ArrayType(), Value::SharedArrayDeleter());
+}
+
+MINJA_INLINE PersistentArray::PersistentArray() : buffer_(std::make_shared<Buffer>()) {}
+
+MINJA_INLINE PersistentArray PersistentArray::push_back(const Value & item) const {
+    std::lock_guard<std::mutex> lock(buffer_->mutex);
+    auto & items = buffer_->items;
+    if (items->size() != size_) {
+        auto buffer = std::make_shared<Buffer>();
+        buffer->items->reserve(size_ + 1);
+        buffer->items->assign(items->begin(), items->begin() + size_);
+        buffer->items->push_back(item);
+        return PersistentArray(std::move(buffer), size_ + 1);
+    }
+    if (items.use_count() > 1) {
+        // Values of to_value() hold the items: they keep them as they are, and the versions move to a copy.
+        auto copy = make_items();
+        copy->reserve(items->capacity());
+        copy->assign(items->begin(), items->end());
+        items = std::move(copy);
+    } else {
+        // Pairs with the release of the last value that held the items.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    items->push_back(item);
+    return PersistentArray(buffer_, size_ + 1);
+}
+
+MINJA_INLINE Value PersistentArray::at(size_t index) const {
+    if (index >= size_) MINJA_THROW(std::out_of_range("PersistentArray index out of range"));
+    std::lock_guard<std::mutex> lock(buffer_->mutex);
+    return (*buffer_->items)[index];
+}
+
+MINJA_INLINE Value PersistentArray::to_value() const {
+    std::lock_guard<std::mutex> lock(buffer_->mutex);
+    const auto & items = buffer_->items;
+    if (items->size() == size_) return Value(items);
+    auto prefix = make_items();
+    prefix->assign(items->begin(), items->begin() + size_);
+    return Value(prefix);
+}
+
+namespace detail {
+
+// Checkpoint being captured or resumed from by the render on this thread (only used by the loop node it designates).
+struct CheckpointState {
+    const TemplateNode * loop = nullptr;
+    RenderCheckpoint * capture = nullptr;
+    const std::string * output = nullptr;
+    const RenderCheckpoint * resume = nullptr;
+    bool done = false;
+};
+inline CheckpointState & checkpoint_state() {
+    static thread_local CheckpointState state;
+    return state;
+}
+
+// Message spans being recorded by the render on this thread (only by the loop node it designates).
+struct MessageSpanState {
+    const TemplateNode * loop = nullptr;
+    std::vector<MessageSpan> * spans = nullptr;
+    // First message without a span yet of each identity (see Value::identity), and next message of the same identity.
+    std::unordered_map<const void *, size_t> next_message;
+    std::vector<size_t> next_same;
+    // Size of the output when the render started.
+    size_t offset = 0;
+};
+inline MessageSpanState & message_span_state() {
+    static thread_local MessageSpanState state;
+    return state;
+}
+
+// Generation spans being recorded by the render on this thread (see Options::generation_spans).
+struct GenerationSpanState {
+    std::vector<OutputSpan> * spans = nullptr;
+    // Size of the output when the render started.
+    size_t offset = 0;
+    // Nesting of the generation blocks being rendered (only the outermost ones are recorded).
+    size_t depth = 0;
+};
+inline GenerationSpanState & generation_span_state() {
+    static thread_local GenerationSpanState state;
+    return state;
+}
+
+}  // namespace detail
+
+#ifdef MINJA_NO_EXCEPTIONS
+namespace detail {
+// Without exceptions, break / continue are propagated by returning up to the innermost for loop being rendered on this thread.
+struct LoopState {
+    size_t depth = 0;
+    bool pending = false;
+    LoopControlType control = LoopControlType::Break;
+};
+inline LoopState & loop_state() {
+    static thread_local LoopState state;
+    return state;
+}
+// Macro and caller() bodies are rendered outside of the loops they're called from: break / continue can't cross them
+// (with exceptions, the call expression turns them into errors).
+struct OutsideLoopScope {
+    size_t depth;
+    OutsideLoopScope() : depth(loop_state().depth) { loop_state().depth = 0; }
+    ~OutsideLoopScope() { loop_state().depth = depth; }
+    OutsideLoopScope(const OutsideLoopScope &) = delete;
+    OutsideLoopScope & operator=(const OutsideLoopScope &) = delete;
+};
+}  // namespace detail
+#endif
+
+namespace detail {
+enum class IterationEnd { Done, Break, Continue, Failed };
+
+// Renders a loop body with render(), telling how the iteration ended.
+template <typename F>
+IterationEnd render_iteration(F && render) {
+#ifdef MINJA_NO_EXCEPTIONS
+    if (!render()) return IterationEnd::Failed;
+    auto & loop = loop_state();
+    if (!loop.pending) return IterationEnd::Done;
+    loop.pending = false;
+    return loop.control == LoopControlType::Break ? IterationEnd::Break : IterationEnd::Continue;
+#else
+    try {
+        render();
+        return IterationEnd::Done;
+    } catch (const LoopControlException & e) {
+        return e.control_type == LoopControlType::Break ? IterationEnd::Break : IterationEnd::Continue;
+    }
+#endif
+}
+}  // namespace detail
+
+inline std::string normalize_newlines(const std::string & s) {
+#ifdef _WIN32
+  static const std::regex nl_regex("\r\n");
+  return std::regex_replace(s, nl_regex, "\n");
+#else
+  return s;
+#endif
+}
+
+inline std::string error_location_suffix(const std::string & source, size_t pos) {
+  auto get_line = [&](size_t line) {
+    auto start = source.begin();
+    for (size_t i = 1; i < line; ++i) {
+      start = std::find(start, source.end(), '\n') + 1;
+    }
+    auto end = std::find(start, source.end(), '\n');
+    return std::string(start, end);
+  };
+  auto start = source.begin();
+  auto end = source.end();
+  auto it = start + pos;
+  auto line = std::count(start, it, '\n') + 1;
+  auto max_line = std::count(start, end, '\n') + 1;
+  auto col = pos - std::string(start, it).rfind('\n');
+  std::ostringstream out;
+  out << " at row " << line << ", column " << col << ":\n";
+  if (line > 1) out << get_line(line - 1) << "\n";
+  out << get_line(line) << "\n";
+  out << std::string(col - 1, ' ') << "^\n";
+  if (line < max_line) out << get_line(line + 1) << "\n";
+
+  return out.str();
+}
+
+// Parses a JSON number (the whole string, with JSON's syntax). Integers that don't fit in an int64_t are read as floats.
+inline bool parse_json_number(std::string_view str, Value & out) {
+  auto begin = str.data();
+  auto end = begin + str.size();
+  auto it = begin;
+  auto skip_digits = [&]() {
+    auto start = it;
+    while (it != end && *it >= '0' && *it <= '9') ++it;
+    return it != start;
+  };
+  if (it != end && *it == '-') ++it;
+  if (it != end && *it == '0') {
+    ++it;
+  } else if (!skip_digits()) {
+    return false;
+  }
+  bool is_float = false;
+  if (it != end && *it == '.') {
+    ++it;
+    if (!skip_digits()) return false;
+    is_float = true;
+  }
+  if (it != end && (*it == 'e' || *it == 'E')) {
+    ++it;
+    if (it != end && (*it == '-' || *it == '+')) ++it;
+    if (!skip_digits()) return false;
+    is_float = true;
+  }
+  if (it != end) return false;
+
+  if (!is_float) {
+    int64_t value;
+    auto res = std::from_chars(begin, end, value);
+    if (res.ec == std::errc() && res.ptr == end) {
+      out = Value(value);
+      return true;
+    }
+  }
+  // strtod expects the decimal point of the current C locale.
+  std::string buf(str);
+  auto point = *std::localeconv()->decimal_point;
+  if (point != '.') std::replace(buf.begin(), buf.end(), '.', point);
+  out = Value(std::strtod(buf.c_str(), nullptr));
+  return true;
+}
+
+class Value::JsonReader {
+  // Arrays and objects are read recursively: deeper inputs are rejected rather than overflowing the stack.
+  static constexpr size_t max_depth = 512;
+
+  std::string_view str_;
+  const char * it_;
+  const char * end_;
+  size_t depth_ = 0;
+
+  std::runtime_error error(const std::string & message) const {
+    return std::runtime_error("Invalid JSON at offset " + std::to_string(it_ - str_.data()) + ": " + message);
+  }
+
+  void skip_spaces() {
+    while (it_ != end_ && (*it_ == ' ' || *it_ == '\t' || *it_ == '\n' || *it_ == '\r')) ++it_;
+  }
+
+  bool consume(std::string_view token) {
+    if ((size_t) (end_ - it_) < token.size() || std::string_view(it_, token.size()) != token) return false;
+    it_ += token.size();
+    return true;
+  }
+
+  uint32_t read_hex4() {
+    if (end_ - it_ < 4) MINJA_THROW(error("truncated \\u escape"));
+    uint32_t res = 0;
+    for (int i = 0; i < 4; i++, it_++) {
+      auto c = *it_;
+      res <<= 4;
+      if (c >= '0' && c <= '9') res |= c - '0';
+      else if (c >= 'a' && c <= 'f') res |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') res |= c - 'A' + 10;
+      else MINJA_THROW(error("invalid \\u escape"));
+    }
+    return res;
+  }
+
+  static void append_utf8(std::string & out, uint32_t cp) {
+    if (cp < 0x80) {
+      out += (char) cp;
+    } else if (cp < 0x800) {
+      out += (char) (0xC0 | (cp >> 6));
+      out += (char) (0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      out += (char) (0xE0 | (cp >> 12));
+      out += (char) (0x80 | ((cp >> 6) & 0x3F));
+      out += (char) (0x80 | (cp & 0x3F));
+    } else {
+      out += (char) (0xF0 | (cp >> 18));
+      out += (char) (0x80 | ((cp >> 12) & 0x3F));
+      out += (char) (0x80 | ((cp >> 6) & 0x3F));
+      out += (char) (0x80 | (cp & 0x3F));
+    }
+  }
+
+  std::string read_string() {
+    ++it_;
+    std::string res;
+    while (true) {
+      auto start = it_;
+      while (it_ != end_ && *it_ != '"' && *it_ != '\\' && (unsigned char) *it_ >= 0x20) ++it_;
+      res.append(start, it_);
+      if (it_ == end_) MINJA_THROW(error("unterminated string"));
+      if (*it_ == '"') {
+        ++it_;
+        return res;
+      }
+      if (*it_ != '\\') MINJA_THROW(error("control character in string"));
+      if (++it_ == end_) MINJA_THROW(error("unterminated string"));
+      switch (*it_++) {
+        case '"': res += '"'; break;
+        case '\\': res += '\\'; break;
+        case '/': res += '/'; break;
+        case 'b': res += '\b'; break;
+        case 'f': res += '\f'; break;
+        case 'n': res += '\n'; break;
+        case 'r': res += '\r'; break;
+        case 't': res += '\t'; break;
+        case 'u': {
+          auto cp = read_hex4();
+          MINJA_CHECK();
+          if (cp >= 0xD800 && cp <= 0xDBFF) {
+            if (!consume("\\u")) MINJA_THROW(error("missing low surrogate"));
+            auto low = read_hex4();
+            MINJA_CHECK();
+            if (low < 0xDC00 || low > 0xDFFF) MINJA_THROW(error("invalid low surrogate"));
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+          } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+            MINJA_THROW(error("unexpected low surrogate"));
+          }
+          append_utf8(res, cp);
+          break;
+        }
+        default:
+          --it_;
+          MINJA_THROW(error("invalid escape"));
+      }
+    }
+  }
+
+  Value read_number() {
+    auto start = it_;
+    while (it_ != end_ && ((*it_ >= '0' && *it_ <= '9') || *it_ == '-' || *it_ == '+' || *it_ == '.' || *it_ == 'e' || *it_ == 'E')) ++it_;
+    Value res;
+    if (!parse_json_number(std::string_view(start, it_ - start), res)) {
+      it_ = start;
+      MINJA_THROW(error("invalid number"));
+    }
+    return res;
+  }
+
+  Value read_array() {
+    ++it_;
+    auto array = std::make_shared<ArrayType>();
+    skip_spaces();
+    if (it_ != end_ && *it_ == ']') {
+      ++it_;
+      return Value(array);
+    }
+    while (true) {
+      array->push_back(read_value());
+      MINJA_CHECK();
+      skip_spaces();
+      if (it_ != end_ && *it_ == ',') {
+        ++it_;
+      } else if (it_ != end_ && *it_ == ']') {
+        ++it_;
+        return Value(array);
+      } else {
+        MINJA_THROW(error("expected ',' or ']'"));
+      }
+    }
+  }
+
+  Value read_object() {
+    ++it_;
+    auto object = std::make_shared<ObjectType>();
+    skip_spaces();
+    if (it_ != end_ && *it_ == '}') {
+      ++it_;
+      return Value(object);
+    }
+    while (true) {
+      skip_spaces();
+      if (it_ == end_ || *it_ != '"') MINJA_THROW(error("expected string key"));
+      auto key = read_string();
+      MINJA_CHECK();
+      skip_spaces();
+      if (it_ == end_ || *it_ != ':') MINJA_THROW(error("expected ':'"));
+      ++it_;
+      auto value = read_value();
+      MINJA_CHECK();
+      // Like nlohmann::json, the last duplicate key wins (at the position of the first one).
+      (*object)[detail::Primitive(std::move(key))] = std::move(value);
+      skip_spaces();
+      if (it_ != end_ && *it_ == ',') {
+        ++it_;
+      } else if (it_ != end_ && *it_ == '}') {
+        ++it_;
+        return Value(object);
+      } else {
+        MINJA_THROW(error("expected ',' or '}'"));
+      }
+    }
+  }
+
+  Value read_value() {
+    skip_spaces();
+    if (it_ == end_) MINJA_THROW(error("unexpected end of input"));
+    switch (*it_) {
+      case '{':
+      case '[': {
+        if (depth_ == max_depth) MINJA_THROW(error("nesting too deep"));
+        depth_++;
+        auto res = *it_ == '{' ? read_object() : read_array();
+        depth_--;
+        return res;
+      }
+      case '"': {
+        auto str = read_string();
+        MINJA_CHECK();
+        return Value(str);
+      }
+      case 't': if (consume("true")) return Value(true); break;
+      case 'f': if (consume("false")) return Value(false); break;
+      case 'n': if (consume("null")) return Value(); break;
+      default:
+        if (*it_ == '-' || (*it_ >= '0' && *it_ <= '9')) return read_number();
+    }
+    MINJA_THROW(error(std::string("unexpected character '") + *it_ + "'"));
+  }
+
+public:
+  JsonReader(std::string_view str) : str_(str), it_(str.data()), end_(str.data() + str.size()) {}
+
+  Value read() {
+    consume("\xEF\xBB\xBF");
+    auto res = read_value();
+    MINJA_CHECK();
+    skip_spaces();
+    if (it_ != end_) MINJA_THROW(error("unexpected trailing characters"));
+    return res;
+  }
+};
+
+MINJA_INLINE Value Value::parse_json(std::string_view str) {
+  return JsonReader(str).read();
+}
+
+#ifdef MINJA_NO_EXCEPTIONS
+MINJA_INLINE detail::Evaluated<Value> Expression::evaluate(const std::shared_ptr<Context> & context) const {
+    if (detail::failed()) return {Value(), false};
+    auto result = do_evaluate(context);
+    if (detail::failed()) {
+        if (location.source) detail::ErrorFrame::innermost()->append(error_location_suffix(*location.source, location.pos));
+        return {Value(), false};
+    }
+    return {std::move(result), true};
+}
+
+MINJA_INLINE bool TemplateNode::render(OutputSink & out, const std::shared_ptr<Context> & context) const {
+    detail::ErrorScope error_scope;
+    if (detail::failed()) return false;
+    do_render(out, context);
+    if (!detail::failed()) return true;
+    if (location_.source) detail::ErrorFrame::innermost()->append(error_location_suffix(*location_.source, location_.pos));
+    return false;
+}
+#else
+MINJA_INLINE Value Expression::evaluate(const std::shared_ptr<Context> & context) const {
+    try {
+        return do_evaluate(context);
+    } catch (const std::exception & e) {
+        std::ostringstream out;
+        out << e.what();
+        if (location.source) out << error_location_suffix(*location.source, location.pos);
+        throw std::runtime_error(out.str());
+    }
+}
+
+MINJA_INLINE void TemplateNode::render(OutputSink & out, const std::shared_ptr<Context> & context) const {
+    try {
+        do_render(out, context);
+    } catch (const LoopControlException & e) {
+        std::ostringstream err;
+        err << e.what();
+        if (location_.source) err << error_location_suffix(*location_.source, location_.pos);
+        throw LoopControlException(err.str(), e.control_type);
+    } catch (const std::exception & e) {
+        std::ostringstream err;
+        err << e.what();
+        if (location_.source) err << error_location_suffix(*location_.source, location_.pos);
+        throw std::runtime_error(err.str());
+    }
+}
+#endif
+
+MINJA_INLINE ValueMemoryUsage Value::memory_usage() const {
+    ValueMemoryUsage usage;
+    std::unordered_set<const void *> visited;
+    auto add = [&](size_t * field, size_t bytes, bool shared) {
+        if (field) *field += bytes;
+        usage.total_bytes += bytes;
+        (shared ? usage.shared_bytes : usage.unique_bytes) += bytes;
+    };
+    auto string_size = [](const detail::Primitive & primitive) -> size_t {
+        return primitive.is_string() ? primitive.get_ref<const std::string &>().size() : 0;
+    };
+    // shared: whether the value is only reachable through containers also referenced from outside.
+    std::function<void(const Value &, bool)> visit = [&](const Value & value, bool shared) {
+        usage.values++;
+        if (value.callable_) {
+            if (visited.insert(value.callable_.get()).second) {
+                usage.callables++;
+                add(nullptr, sizeof(CallableType), shared || value.callable_.use_count() > 1);
+            }
+        } else if (value.array_) {
+            if (!visited.insert(value.array_.get()).second) return;
+            shared = shared || value.array_.use_count() > 1;
+            usage.arrays++;
+            add(&usage.array_bytes, sizeof(ArrayType) + value.array_->capacity() * sizeof(Value), shared);
+            for (const auto & item : *value.array_) visit(item, shared);
+        } else if (value.object_) {
+            if (!visited.insert(value.object_.get()).second) return;
+            shared = shared || value.object_.use_count() > 1;
+            usage.objects++;
+            auto bytes = sizeof(ObjectType) + value.object_->capacity() * sizeof(ObjectType::value_type);
+            for (const auto & entry : *value.object_) bytes += string_size(entry.first);
+            add(&usage.object_bytes, bytes, shared);
+            for (const auto & entry : *value.object_) visit(entry.second, shared);
+        } else if (value.stream_) {
+            if (!visited.insert(value.stream_.get()).second) return;
+            usage.strings++;
+            add(&usage.string_bytes, value.stream_->materialized_size(), shared || value.stream_.use_count() > 1);
+        } else if (value.primitive_.is_string()) {
+            usage.strings++;
+            add(&usage.string_bytes, string_size(value.primitive_), shared);
+        }
+    };
+    add(nullptr, sizeof(Value), false);
+    visit(*this, false);
+    return usage;
+}
+
+class VariableExpr : public Expression {
+    std::string name;
+public:
+    VariableExpr(const Location & loc, const std::string& n)
+      : Expression(loc), name(n) {}
+    const std::string & get_name() const { return name; }
+    Value do_evaluate(const std::shared_ptr<Context> & context) const override {
+        if (!context->contains(name)) {
+            return Value();
+        }
+        return context->at(name);
+    }
+};
+
+inline void destructuring_assign(const std::vector<std::string> & var_names, const std::shared_ptr<Context> & context, Value& item) {
+  if (var_names.size() == 1) {
+      context->set(var_names[0], item);
+  } else {
+      if (!item.is_array() || item.size() != var_names.size()) {
+          MINJA_THROW_VOID(std::runtime_error("Mismatched number of variables and items in destructuring assignment"));
+      }
+      for (size_t i = 0; i < var_names.size(); ++i) {
+          context->set(var_names[i], item.at(i));
+      }
+  }
 }
 
 enum SpaceHandling { Keep, Strip, StripSpaces, StripNewline };
 
 class TemplateToken {
 public:
-    enum class Type { Text, Expression, If, Else, Elif, EndIf, For, EndFor, Generation, EndGeneration, Set, EndSet, Comment, Macro, EndMacro, Filter, EndFilter, Break, Continue, Call, EndCall };
+    enum class Type { Text, Expression, If, Else, Elif, EndIf, For, EndFor, Generation, EndGeneration, Set, EndSet, Comment, Macro, EndMacro, Filter, EndFilter, Break, Continue, Call, EndCall, LazyBody };
 
     static std::string typeToString(Type t) {
         switch (t) {
@@ -733,6 +2549,7 @@ public:
             case Type::Continue: return "continue";
             case Type::Call: return "call";
             case Type::EndCall: return "endcall";
+            case Type::LazyBody: return "lazy body";
         }
         return "Unknown";
     }
@@ -834,17 +2651,6 @@ struct CommentTemplateToken : public TemplateToken {
     CommentTemplateToken(const Location & loc, SpaceHandling pre, SpaceHandling post, const std::string& t) : TemplateToken(Type::Comment, loc, pre, post), text(t) {}
 };
 
-enum class LoopControlType { Break, Continue };
-
-class LoopControlException : public std::runtime_error {
-public:
-    LoopControlType control_type;
-    LoopControlException(const std::string & message, LoopControlType control_type) : std::runtime_error(message), control_type(control_type) {}
-    LoopControlException(LoopControlType control_type)
-      : std::runtime_error((control_type == LoopControlType::Continue ? "continue" : "break") + std::string(" outside of a loop")),
-        control_type(control_type) {}
-};
-
 struct LoopControlTemplateToken : public TemplateToken {
     LoopControlType control_type;
     LoopControlTemplateToken(const Location & loc, SpaceHandling pre, SpaceHandling post, LoopControlType control_type) : TemplateToken(Type::Break, loc, pre, post), control_type(control_type) {}
@@ -861,45 +2667,36 @@ struct EndCallTemplateToken : public TemplateToken {
         : TemplateToken(Type::EndCall, loc, pre, post) {}
 };
 
-class TemplateNode {
-    Location location_;
-protected:
-    virtual void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const = 0;
-
-public:
-    TemplateNode(const Location & location) : location_(location) {}
-    void render(std::ostringstream & out, const std::shared_ptr<Context> & context) const {
-        try {
-            do_render(out, context);
-        } catch (const LoopControlException & e) {
-            // TODO: make stack creation lazy. Only needed if it was thrown outside of a loop.
-            std::ostringstream err;
-            err << e.what();
-            if (location_.source) err << error_location_suffix(*location_.source, location_.pos);
-            throw LoopControlException(err.str(), e.control_type);
-        } catch (const std::exception & e) {
-            std::ostringstream err;
-            err << e.what();
-            if (location_.source) err << error_location_suffix(*location_.source, location_.pos);
-            throw std::runtime_error(err.str());
-        }
-    }
-    const Location & location() const { return location_; }
-    virtual ~TemplateNode() = default;
-    std::string render(const std::shared_ptr<Context> & context) const {
-        std::ostringstream out;
-        render(out, context);
-        return out.str();
-    }
+// Unparsed body of a block, from its location to end_pos (see Options::lazy_bodies).
+struct LazyBodyTemplateToken : public TemplateToken {
+    size_t end_pos;
+    SpaceHandling body_pre_space;  // post_space of the opening tag
+    SpaceHandling body_post_space;  // pre_space of the closing tag
+    LazyBodyTemplateToken(const Location & loc, size_t end_pos, SpaceHandling body_pre, SpaceHandling body_post)
+        : TemplateToken(Type::LazyBody, loc, SpaceHandling::Keep, SpaceHandling::Keep), end_pos(end_pos), body_pre_space(body_pre), body_post_space(body_post) {}
 };
 
+
 class SequenceNode : public TemplateNode {
     std::vector<std::shared_ptr<TemplateNode>> children;
 public:
     SequenceNode(const Location & loc, std::vector<std::shared_ptr<TemplateNode>> && c)
       : TemplateNode(loc), children(std::move(c)) {}
-    void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+    const std::vector<std::shared_ptr<TemplateNode>> & get_children() const { return children; }
+    void visit_children(AstVisitor & visitor) const override {
+        for (const auto & child : children) visitor.visit(child);
+    }
+    void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const override {
+#ifdef MINJA_NO_EXCEPTIONS
+        auto & loop = detail::loop_state();
+        for (const auto& child : children) {
+            MINJA_CHECKED_VOID(child->render(out, context));
+            // Skip the rest of the loop body after a break / continue.
+            if (loop.pending) return;
+        }
+#else
         for (const auto& child : children) child->render(out, context);
+#endif
     }
 };
 
@@ -907,8 +2704,9 @@ class TextNode : public TemplateNode {
     std::string text;
 public:
     TextNode(const Location & loc, const std::string& t) : TemplateNode(loc), text(t) {}
-    void do_render(std::ostringstream & out, const std::shared_ptr<Context> &) const override {
-      out << text;
+    const std::string & get_text() const { return text; }
+    void do_render(OutputSink & out, const std::shared_ptr<Context> &) const override {
+      out.write_static(text);
     }
 };
 
@@ -916,15 +2714,18 @@ class ExpressionNode : public TemplateNode {
     std::shared_ptr<Expression> expr;
 public:
     ExpressionNode(const Location & loc, std::shared_ptr<Expression> && e) : TemplateNode(loc), expr(std::move(e)) {}
-    void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
-      if (!expr) throw std::runtime_error("ExpressionNode.expr is null");
-      auto result = expr->evaluate(context);
-      if (result.is_string()) {
-          out << result.get<std::string>();
+    void visit_children(AstVisitor & visitor) const override { visitor.visit(expr); }
+    void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const override {
+      if (!expr) MINJA_THROW_VOID(std::runtime_error("ExpressionNode.expr is null"));
+      MINJA_TRY_VOID(result, expr->evaluate(context));
+      if (result.is_streamed()) {
+          result.for_each_chunk([&](std::string_view chunk) { out.write(chunk); });
+      } else if (result.is_string()) {
+          out.write_owned(result.take_string());
       } else if (result.is_boolean()) {
-          out << (result.get<bool>() ? "True" : "False");
+          out.write(result.get<bool>() ? "True" : "False");
       } else if (!result.is_null()) {
-          out << result.dump();
+          out.write_owned(result.dump());
       }
   }
 };
@@ -934,14 +2735,21 @@ class IfNode : public TemplateNode {
 public:
     IfNode(const Location & loc, std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> && c)
         : TemplateNode(loc), cascade(std::move(c)) {}
-    void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+    void visit_children(AstVisitor & visitor) const override {
+        for (const auto & [condition, body] : cascade) {
+            visitor.visit(condition);
+            visitor.visit(body);
+        }
+    }
+    void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const override {
       for (const auto& branch : cascade) {
           auto enter_branch = true;
           if (branch.first) {
-            enter_branch = branch.first->evaluate(context).to_bool();
+            MINJA_TRY_VOID(condition, branch.first->evaluate(context));
+            enter_branch = condition.to_bool();
           }
           if (enter_branch) {
-            if (!branch.second) throw std::runtime_error("IfNode.cascade.second is null");
+            if (!branch.second) MINJA_THROW_VOID(std::runtime_error("IfNode.cascade.second is null"));
               branch.second->render(out, context);
               return;
           }
@@ -953,11 +2761,251 @@ class LoopControlNode : public TemplateNode {
     LoopControlType control_type_;
   public:
     LoopControlNode(const Location & loc, LoopControlType control_type) : TemplateNode(loc), control_type_(control_type) {}
-    void do_render(std::ostringstream &, const std::shared_ptr<Context> &) const override {
+    LoopControlType get_control_type() const { return control_type_; }
+    void do_render(OutputSink &, const std::shared_ptr<Context> &) const override {
+#ifdef MINJA_NO_EXCEPTIONS
+      auto & loop = detail::loop_state();
+      if (!loop.depth) {
+        MINJA_THROW_VOID(std::runtime_error((control_type_ == LoopControlType::Continue ? "continue" : "break") + std::string(" outside of a loop")));
+      }
+      loop.pending = true;
+      loop.control = control_type_;
+#else
       throw LoopControlException(control_type_);
+#endif
+    }
+};
+
+namespace detail {
+
+// Output of a loop iteration, reused by later ones with the same item and the same values read (see Options::memoize_loops).
+struct MemoizedIteration {
+    // Fingerprints of the variables read by the body, and values of the ones it set.
+    std::vector<std::pair<std::string, std::string>> reads;
+    std::vector<std::pair<std::string, Value>> writes;
+    std::string output;
+};
+
+class LoopMemo {
+    struct Added {
+        const std::string * key;
+        const MemoizedIteration * iteration;
+        size_t bytes;
+    };
+    const size_t max_bytes_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::vector<std::shared_ptr<const MemoizedIteration>>> entries_;
+    // In the order they were added, to drop the oldest ones first.
+    std::deque<Added> added_;
+    size_t bytes_ = 0;
+
+    static size_t bytes_of(const std::string & item_key, const MemoizedIteration & iteration) {
+        size_t bytes = item_key.size() + sizeof(std::shared_ptr<const MemoizedIteration>) + sizeof(Added) + sizeof(MemoizedIteration) + iteration.output.size();
+        for (const auto & [name, fingerprint] : iteration.reads) bytes += sizeof(name) * 2 + name.size() + fingerprint.size();
+        for (const auto & [name, value] : iteration.writes) bytes += sizeof(name) + name.size() + value.memory_usage().total_bytes;
+        return bytes;
+    }
+    void drop_oldest() {
+        auto oldest = added_.front();
+        added_.pop_front();
+        auto it = entries_.find(*oldest.key);
+        auto & iterations = it->second;
+        iterations.erase(std::find_if(iterations.begin(), iterations.end(), [&](const auto & iteration) { return iteration.get() == oldest.iteration; }));
+        if (iterations.empty()) entries_.erase(it);
+        bytes_ -= oldest.bytes;
+    }
+public:
+    explicit LoopMemo(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+    std::vector<std::shared_ptr<const MemoizedIteration>> find(const std::string & item_key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(item_key);
+        return it == entries_.end() ? std::vector<std::shared_ptr<const MemoizedIteration>>() : it->second;
+    }
+    void add(const std::string & item_key, std::shared_ptr<const MemoizedIteration> entry) {
+        auto bytes = bytes_of(item_key, *entry);
+        if (bytes > max_bytes_) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (bytes_ + bytes > max_bytes_) drop_oldest();
+        auto it = entries_.try_emplace(item_key).first;
+        added_.push_back({&it->first, entry.get(), bytes});
+        it->second.push_back(std::move(entry));
+        bytes_ += bytes;
+    }
+    size_t memory_usage() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_;
+    }
+};
+
+// Scope of a memoized loop, recording the variables read and set by the current iteration (besides the loop variables).
+class RecordingContext : public Context {
+    bool recording_ = false;
+    const std::vector<std::string> * ignored_ = nullptr;
+    std::vector<std::pair<std::string, std::string>> reads_;
+    std::vector<std::string> writes_;
+
+    bool is_tracked(std::string_view name) const {
+        if (std::find(ignored_->begin(), ignored_->end(), name) != ignored_->end()) return false;
+        if (std::find(writes_.begin(), writes_.end(), name) != writes_.end()) return false;
+        for (const auto & read : reads_) {
+            if (read.first == name) return false;
+        }
+        return true;
+    }
+    void record_read(std::string_view name, const Value * value) {
+        if (!recording_ || !is_tracked(name)) return;
+        std::string fp;
+        if (value) fingerprint(*value, fp);
+        reads_.emplace_back(std::string(name), std::move(fp));
+    }
+    void record_write(std::string_view name) {
+        if (recording_ && std::find(writes_.begin(), writes_.end(), name) == writes_.end()) {
+            writes_.emplace_back(name);
+        }
+    }
+    std::string current_fingerprint(const std::string & name) {
+        std::string fp;
+        if (Context::contains(std::string_view(name))) fingerprint(Context::get(std::string_view(name)), fp);
+        return fp;
+    }
+
+public:
+    RecordingContext(Value && values, const std::shared_ptr<Context> & parent) : Context(std::move(values), parent) {}
+    using Context::get;
+    using Context::at;
+    using Context::contains;
+    using Context::set;
+
+    Value get(std::string_view key) override { auto value = Context::get(key); record_read(key, &value); return value; }
+    Value & at(std::string_view key) override { auto & value = Context::at(key); record_read(key, &value); return value; }
+    bool contains(std::string_view key) override {
+        auto res = Context::contains(key);
+        if (!res) record_read(key, nullptr);
+        return res;
+    }
+    void set(std::string_view key, const Value & value) override { Context::set(key, value); record_write(key); }
+
+    bool reads_match(const MemoizedIteration & entry) {
+        for (const auto & [name, fp] : entry.reads) {
+            if (current_fingerprint(name) != fp) return false;
+        }
+        return true;
+    }
+    void start_recording(const std::vector<std::string> & ignored) {
+        ignored_ = &ignored;
+        reads_.clear();
+        writes_.clear();
+        recording_ = true;
+    }
+    // Returns what the iteration read and set, unless it changed values it read (e.g. a namespace's attributes).
+    std::shared_ptr<MemoizedIteration> stop_recording() {
+        recording_ = false;
+        auto entry = std::make_shared<MemoizedIteration>();
+        for (auto & [name, fp] : reads_) {
+            if (std::find(writes_.begin(), writes_.end(), name) == writes_.end() && current_fingerprint(name) != fp) return nullptr;
+        }
+        entry->reads = std::move(reads_);
+        for (const auto & name : writes_) {
+            entry->writes.emplace_back(name, deep_copy(Context::get(std::string_view(name))));
+        }
+        return entry;
+    }
+    void stop() { recording_ = false; }
+};
+
+// Threads the iterations of parallel loops are rendered on (see Options::parallel_loop_min_items).
+class ThreadPool {
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&]() { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t n_threads) {
+        for (size_t i = 0; i < n_threads; i++) {
+            threads_.emplace_back([this]() { work(); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto & thread : threads_) thread.join();
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return threads_.size(); }
+
+    // Calls fn(0) ... fn(n - 1) on the calling thread and on the pool's idle threads, and returns once they're all done.
+    // Indices are claimed one at a time by whichever thread is free, so a thread stuck on a slow one (or on an enclosing
+    // parallel loop) leaves the others to the rest, and nested calls never wait for a busy pool.
+    void run(size_t n, const std::function<void(size_t)> & fn) {
+        struct Batch {
+            std::atomic<size_t> next {0};
+            std::mutex mutex;
+            std::condition_variable cv;
+            size_t done = 0;
+        };
+        auto batch = std::make_shared<Batch>();
+        // fn is only called for claimed indices, which run() waits for: helpers that start late don't touch it.
+        auto drain = [batch, n, &fn]() {
+            size_t count = 0;
+            for (size_t i; (i = batch->next++) < n; count++) fn(i);
+            if (count) {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                batch->done += count;
+                if (batch->done == n) batch->cv.notify_all();
+            }
+        };
+        auto n_helpers = std::min(threads_.size(), n > 0 ? n - 1 : 0);
+        if (n_helpers) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (size_t i = 0; i < n_helpers; i++) tasks_.push_back(drain);
+            }
+            cv_.notify_all();
+        }
+        drain();
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->cv.wait(lock, [&]() { return batch->done == n; });
+    }
+
+    // One thread per core, besides the rendering one.
+    static ThreadPool & shared() {
+        static ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()) - 1);
+        return pool;
     }
 };
 
+class IterationIndependence;
+class CheckpointIndependence;
+class MemoizationSafety;
+
+}  // namespace detail
+
+class MacroNode;
+// Macros defined so far by the template being parsed, by name.
+using MacroDefinitions = std::unordered_map<std::string, std::vector<const MacroNode *>>;
+
 class ForNode : public TemplateNode {
     std::vector<std::string> var_names;
     std::shared_ptr<Expression> iterable;
@@ -965,33 +3013,271 @@ class ForNode : public TemplateNode {
     std::shared_ptr<TemplateNode> body;
     bool recursive;
     std::shared_ptr<TemplateNode> else_body;
+    std::shared_ptr<detail::LoopMemo> memo_;
+    size_t parallel_min_items_ = 0;
+    friend class detail::IterationIndependence;
+    friend class detail::CheckpointIndependence;
+    friend class detail::MemoizationSafety;
 public:
     ForNode(const Location & loc, std::vector<std::string> && var_names, std::shared_ptr<Expression> && iterable,
       std::shared_ptr<Expression> && condition, std::shared_ptr<TemplateNode> && body, bool recursive, std::shared_ptr<TemplateNode> && else_body)
             : TemplateNode(loc), var_names(var_names), iterable(std::move(iterable)), condition(std::move(condition)), body(std::move(body)), recursive(recursive), else_body(std::move(else_body)) {}
 
-    void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(iterable);
+        visitor.visit(condition);
+        visitor.visit(body);
+        visitor.visit(else_body);
+    }
+
+    // See Options::memoize_loops (macros: the ones defined before the loop).
+    void enable_memoization(size_t max_bytes, const MacroDefinitions & macros);
+    // See Options::parallel_loop_min_items (macros: the ones defined before the loop).
+    void enable_parallelism(size_t min_items, const MacroDefinitions & macros);
+    bool is_parallel() const { return parallel_min_items_ > 0; }
+    size_t memo_memory_usage() const { return memo_ ? memo_->memory_usage() : 0; }
+
+    // Name of the variable iterated over by simple loops (with no condition and not recursive), if any.
+    const std::string * get_iterated_variable(bool allow_condition = false) const {
+        auto var = dynamic_cast<VariableExpr*>(iterable.get());
+        return var && (allow_condition || !condition) && !recursive ? &var->get_name() : nullptr;
+    }
+
+private:
+    // See TemplateNode::render_checkpoint: sets up the capture, returning false if it's not possible.
+    bool start_capture(RenderCheckpoint & checkpoint, const std::shared_ptr<Context> & context, size_t n, const std::string & output) const {
+        auto messages = context->get("messages");
+        if (!messages.is_array() || messages.size() < n) return false;
+        checkpoint.messages_offset = messages.size() - n;
+        if (checkpoint.message_index < checkpoint.messages_offset || checkpoint.message_index >= messages.size()) return false;
+        checkpoint.preamble_size = output.size();
+        for (const auto & key : context->keys()) {
+            auto value = context->get(key);
+            if (!value.is_callable() && !is_input(checkpoint, key)) {
+                checkpoint.variables_before_loop.emplace_back(key, detail::deep_copy(value));
+            }
+        }
+        return true;
+    }
+    void capture(RenderCheckpoint & checkpoint, const std::shared_ptr<Context> & context, const std::shared_ptr<Context> & loop_context, size_t cycle_index, const std::string & output) const {
+        checkpoint.output = output;
+        auto messages = context->get("messages");
+        for (size_t i = 0; i < checkpoint.message_index; i++) {
+            checkpoint.messages.push_back(messages.get(Value((int64_t) i)));
+        }
+        for (const auto & key : context->keys()) {
+            auto value = context->get(key);
+            if (value.is_callable() || is_input(checkpoint, key)) continue;
+            auto it = std::find_if(checkpoint.variables_before_loop.begin(), checkpoint.variables_before_loop.end(), [&](const auto & p) { return p.first == key; });
+            if (it == checkpoint.variables_before_loop.end() || !detail::same_value(it->second, value)) {
+                checkpoint.variables.emplace_back(key, detail::deep_copy(value));
+            }
+        }
+        for (const auto & key : loop_context->keys()) {
+            auto value = loop_context->get(key);
+            if (!value.is_callable() && key.get<std::string>() != "loop") {
+                checkpoint.loop_variables.emplace_back(key, detail::deep_copy(value));
+            }
+        }
+        checkpoint.cycle_index = cycle_index;
+    }
+    // See TemplateNode::render_from: restores the state and output of the first iterations, returning the next one's index
+    // (or n if the checkpoint doesn't apply).
+    size_t resume(const RenderCheckpoint & checkpoint, OutputSink & out, const std::shared_ptr<Context> & context, const std::shared_ptr<Context> & loop_context, size_t n, size_t & cycle_index) const {
+        auto messages = context->get("messages");
+        if (!messages.is_array() || messages.size() <= checkpoint.message_index || messages.size() != n + checkpoint.messages_offset) return n;
+        for (size_t i = 0; i < checkpoint.messages.size(); i++) {
+            if (!detail::same_value(messages.get(Value((int64_t) i)), checkpoint.messages[i])) return n;
+        }
+        for (const auto & [key, value] : checkpoint.variables_before_loop) {
+            if (!detail::same_value(context->get(key), value)) return n;
+        }
+        for (const auto & [key, value] : checkpoint.variables) {
+            context->set(key, detail::deep_copy(value));
+        }
+        for (const auto & [key, value] : checkpoint.loop_variables) {
+            loop_context->set(key, detail::deep_copy(value));
+        }
+        cycle_index = checkpoint.cycle_index;
+        out.write(checkpoint.output);
+        detail::checkpoint_state().done = true;
+        return checkpoint.message_index - checkpoint.messages_offset;
+    }
+    // Renders the body for the current item, or reuses the output of an iteration that had the same item and read the same values.
+    detail::IterationEnd render_memoized(OutputSink & out, const std::shared_ptr<detail::RecordingContext> & loop_context, const Value & item, const size_t & cycle_calls) const {
+        std::string item_key;
+        detail::fingerprint(item, item_key);
+        for (const auto & entry : memo_->find(item_key)) {
+            if (loop_context->reads_match(*entry)) {
+                out.write(entry->output);
+                for (const auto & [name, value] : entry->writes) {
+                    loop_context->set(name, detail::deep_copy(value));
+                }
+                return detail::IterationEnd::Done;
+            }
+        }
+
+        std::string output;
+        StringSink capture(output);
+        auto cycle_calls_before = cycle_calls;
+        struct RecordingScope {
+            detail::RecordingContext & context;
+            ~RecordingScope() { context.stop(); }
+        } scope {*loop_context};
+        loop_context->start_recording(var_names);
+        auto end = detail::render_iteration([&]() { return body->render(capture, loop_context); });
+        if (end == detail::IterationEnd::Failed) return end;
+        auto entry = loop_context->stop_recording();
+        out.write(output);
+        // Iterations that break / continue or use loop.cycle() aren't memoized.
+        if (entry && end == detail::IterationEnd::Done && cycle_calls == cycle_calls_before) {
+            entry->output = std::move(output);
+            memo_->add(item_key, std::move(entry));
+        }
+        return end;
+    }
+
+    static void set_loop_variables(Value & loop, Value & items, size_t i) {
+        auto n = items.size();
+        loop.set("index", (int64_t) i + 1);
+        loop.set("index0", (int64_t) i);
+        loop.set("revindex", (int64_t) (n - i));
+        loop.set("revindex0", (int64_t) (n - i - 1));
+        loop.set("length", (int64_t) n);
+        loop.set("first", i == 0);
+        loop.set("last", i == (n - 1));
+        loop.set("previtem", i > 0 ? items.at(i - 1) : Value());
+        loop.set("nextitem", i < n - 1 ? items.at(i + 1) : Value());
+    }
+
+#ifdef MINJA_NO_EXCEPTIONS
+    // Lets break / continue reach the loop.
+    struct LoopScope {
+        detail::LoopState & state = detail::loop_state();
+        LoopScope() { state.depth++; }
+        ~LoopScope() { state.depth--; state.pending = false; }
+    };
+#endif
+
+    // Renders contiguous chunks of the iterations on the shared pool, each in its own loop context, then writes their outputs in order.
+    // The first failing chunk's error is reported, as the sequential rendering would have (its output is dropped).
+    void render_parallel(OutputSink & out, const std::shared_ptr<Context> & context, Value & items) const {
+        auto & pool = detail::ThreadPool::shared();
+        auto n = items.size();
+        // A few chunks per thread, to balance uneven iterations.
+        auto n_chunks = std::min(n, (pool.size() + 1) * 4);
+        struct Chunk {
+            std::string output;
+#ifdef MINJA_NO_EXCEPTIONS
+            bool failed = false;
+            std::string error;
+#else
+            std::exception_ptr error;
+#endif
+        };
+        std::vector<Chunk> chunks(n_chunks);
+        pool.run(n_chunks, [&](size_t c) {
+            auto & chunk = chunks[c];
+            auto render_chunk = [&]() {
+                StringSink chunk_out(chunk.output);
+                auto loop = Value::object();
+                auto loop_context = Context::make(Value::object(), context);
+                loop_context->set("loop", loop);
+#ifdef MINJA_NO_EXCEPTIONS
+                // For continue, in case this isn't the rendering thread.
+                LoopScope scope;
+#endif
+                for (size_t i = c * n / n_chunks, end = (c + 1) * n / n_chunks; i < end; i++) {
+                    auto item = items.at(i);
+                    destructuring_assign(var_names, loop_context, item);
+                    MINJA_CHECK_VOID();
+                    set_loop_variables(loop, items, i);
+                    // The loop has no break (see detail::IterationIndependence).
+                    auto iteration = detail::render_iteration([&]() { return body->render(chunk_out, loop_context); });
+                    if (iteration == detail::IterationEnd::Failed) return;
+                }
+            };
+#ifdef MINJA_NO_EXCEPTIONS
+            // Chunks may run on other threads, or run after a failed one on this thread.
+            detail::ErrorFrame frame;
+            render_chunk();
+            if (frame.failed()) {
+                chunk.failed = true;
+                chunk.error = frame.error();
+            }
+#else
+            try {
+                render_chunk();
+            } catch (...) {
+                chunk.error = std::current_exception();
+            }
+#endif
+        });
+        for (auto & chunk : chunks) {
+#ifdef MINJA_NO_EXCEPTIONS
+            if (chunk.failed) MINJA_THROW_VOID(std::runtime_error(chunk.error));
+#else
+            if (chunk.error) std::rethrow_exception(chunk.error);
+#endif
+        }
+        for (auto & chunk : chunks) {
+            out.write_owned(std::move(chunk.output));
+        }
+    }
+
+    // Records the output of an iteration as the span of the message it iterated over (slices and filters keep the messages'
+    // identity), if any.
+    static void add_message_span(detail::MessageSpanState & state, const Value & item, size_t begin, size_t end) {
+        auto it = state.next_message.find(item.identity());
+        if (it == state.next_message.end() || it->second == std::string::npos) return;
+        state.spans->push_back({it->second, begin - state.offset, end - state.offset});
+        it->second = state.next_same[it->second];
+    }
+
+    // Whether a variable of the outer scope is an input or set by the loop itself (its variables are set there when filtering items).
+    bool is_input(const RenderCheckpoint & checkpoint, const Value & key) const {
+        const auto & name = key.get<std::string>();
+        if (name == "messages" || name == *get_iterated_variable()) return true;
+        if (std::find(var_names.begin(), var_names.end(), name) != var_names.end()) return true;
+        for (const auto & input : checkpoint.inputs) {
+            if (input.first == key) return true;
+        }
+        return false;
+    }
+
+public:
+
+    void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const override {
       // https://jinja.palletsprojects.com/en/3.0.x/templates/#for
-      if (!iterable) throw std::runtime_error("ForNode.iterable is null");
-      if (!body) throw std::runtime_error("ForNode.body is null");
+      if (!iterable) MINJA_THROW_VOID(std::runtime_error("ForNode.iterable is null"));
+      if (!body) MINJA_THROW_VOID(std::runtime_error("ForNode.body is null"));
 
-      auto iterable_value = iterable->evaluate(context);
+      MINJA_TRY_VOID(iterable_value, iterable->evaluate(context));
       Value::CallableType loop_function;
 
       std::function<void(Value&)> visit = [&](Value& iter) {
           auto filtered_items = Value::array();
           if (!iter.is_null()) {
             if (!iterable_value.is_iterable()) {
-              throw std::runtime_error("For loop iterable must be iterable: " + iterable_value.dump());
+              MINJA_THROW_VOID(std::runtime_error("For loop iterable must be iterable: " + iterable_value.dump()));
             }
             iterable_value.for_each([&](Value & item) {
                 destructuring_assign(var_names, context, item);
-                if (!condition || condition->evaluate(context).to_bool()) {
-                  filtered_items.push_back(item);
+                MINJA_CHECK_VOID();
+                if (condition) {
+                  MINJA_TRY_VOID(keep, condition->evaluate(context));
+                  if (!keep.to_bool()) return;
                 }
+                filtered_items.push_back(item);
             });
+            MINJA_CHECK_VOID();
           }
           if (filtered_items.empty()) {
+            auto & checkpoint = detail::checkpoint_state();
+            if (checkpoint.loop == this && checkpoint.resume) {
+              // The checkpoint doesn't apply (see TemplateNode::render_from).
+              return;
+            }
             if (else_body) {
               else_body->render(out, context);
             }
@@ -999,43 +3285,71 @@ public:
               auto loop = recursive ? Value::callable(loop_function) : Value::object();
               loop.set("length", (int64_t) filtered_items.size());
 
-              size_t cycle_index = 0;
-              loop.set("cycle", Value::callable([&](const std::shared_ptr<Context> &, ArgumentsValue & args) {
+              size_t cycle_index = 0, cycle_calls = 0;
+              loop.set("cycle", Value::callable([&](const std::shared_ptr<Context> &, ArgumentsValue & args) -> Value {
                   if (args.args.empty() || !args.kwargs.empty()) {
-                      throw std::runtime_error("cycle() expects at least 1 positional argument and no named arg");
+                      MINJA_THROW(std::runtime_error("cycle() expects at least 1 positional argument and no named arg"));
                   }
                   auto item = args.args[cycle_index];
                   cycle_index = (cycle_index + 1) % args.args.size();
+                  cycle_calls++;
                   return item;
               }));
-              auto loop_context = Context::make(Value::object(), context);
+              std::shared_ptr<detail::RecordingContext> recording_context;
+              std::shared_ptr<Context> loop_context;
+              // Memoized iterations wouldn't report the generation blocks they render.
+              if (memo_ && !detail::generation_span_state().spans) {
+                  loop_context = recording_context = std::make_shared<detail::RecordingContext>(Value::object(), context);
+              } else {
+                  loop_context = Context::make(Value::object(), context);
+              }
               loop_context->set("loop", loop);
-              for (size_t i = 0, n = filtered_items.size(); i < n; ++i) {
+#ifdef MINJA_NO_EXCEPTIONS
+              LoopScope scope;
+#endif
+
+              size_t start = 0, capture_index = filtered_items.size();
+              auto & checkpoint = detail::checkpoint_state();
+              if (checkpoint.loop == this) {
+                  checkpoint.loop = nullptr;
+                  if (checkpoint.resume) {
+                      start = resume(*checkpoint.resume, out, context, loop_context, filtered_items.size(), cycle_index);
+                  } else if (start_capture(*checkpoint.capture, context, filtered_items.size(), *checkpoint.output)) {
+                      capture_index = checkpoint.capture->message_index - checkpoint.capture->messages_offset;
+                  }
+              }
+              auto & span_state = detail::message_span_state();
+              auto spans = span_state.loop == this ? span_state.spans : nullptr;
+              if (spans) span_state.loop = nullptr;
+              if (parallel_min_items_ && filtered_items.size() >= parallel_min_items_ && start == 0 && capture_index == filtered_items.size()
+                  && !recording_context && !spans && !detail::generation_span_state().spans && detail::ThreadPool::shared().size()) {
+                  render_parallel(out, context, filtered_items);
+                  return;
+              }
+              for (size_t i = start, n = filtered_items.size(); i < n; ++i) {
+                  if (i == capture_index) {
+                      capture(*checkpoint.capture, context, loop_context, cycle_index, *checkpoint.output);
+                      checkpoint.done = true;
+                  }
                   auto & item = filtered_items.at(i);
                   destructuring_assign(var_names, loop_context, item);
-                  loop.set("index", (int64_t) i + 1);
-                  loop.set("index0", (int64_t) i);
-                  loop.set("revindex", (int64_t) (n - i));
-                  loop.set("revindex0", (int64_t) (n - i - 1));
-                  loop.set("length", (int64_t) n);
-                  loop.set("first", i == 0);
-                  loop.set("last", i == (n - 1));
-                  loop.set("previtem", i > 0 ? filtered_items.at(i - 1) : Value());
-                  loop.set("nextitem", i < n - 1 ? filtered_items.at(i + 1) : Value());
-                  try {
-                      body->render(out, loop_context);
-                  } catch (const LoopControlException & e) {
-                      if (e.control_type == LoopControlType::Break) break;
-                      if (e.control_type == LoopControlType::Continue) continue;
-                  }
+                  MINJA_CHECK_VOID();
+                  set_loop_variables(loop, filtered_items, i);
+                  auto begin = out.size();
+                  auto iteration = recording_context
+                      ? render_memoized(out, recording_context, item, cycle_calls)
+                      : detail::render_iteration([&]() { return body->render(out, loop_context); });
+                  if (iteration == detail::IterationEnd::Failed) return;
+                  if (spans) add_message_span(span_state, item, begin, out.size());
+                  if (iteration == detail::IterationEnd::Break) break;
               }
           }
       };
 
       if (recursive) {
-        loop_function = [&](const std::shared_ptr<Context> &, ArgumentsValue & args) {
+        loop_function = [&](const std::shared_ptr<Context> &, ArgumentsValue & args) -> Value {
             if (args.args.size() != 1 || !args.kwargs.empty() || !args.args[0].is_array()) {
-                throw std::runtime_error("loop() expects exactly 1 positional iterable argument");
+                MINJA_THROW(std::runtime_error("loop() expects exactly 1 positional iterable argument"));
             }
             auto & items = args.args[0];
             visit(items);
@@ -1043,36 +3357,192 @@ public:
         };
       }
 
-      visit(iterable_value);
-  }
-};
+      visit(iterable_value);
+  }
+};
+
+namespace detail {
+// Whether all the assignments of name by the root's nodes before its child loop_index set it to messages or to a suffix of it
+// (only_suffix), or else to an expression over messages (see IteratedMessages).
+inline bool iterates_over_messages(const TemplateNode & root, size_t loop_index, const std::string & name, bool only_suffix);
+}  // namespace detail
+
+// Top-level loop over messages (or over a suffix of it, set to a variable before the loop) the checkpoints are taken in, and
+// its index in the root's children. Message spans are also recorded in filtered loops and loops over any expression of
+// messages (allow_condition).
+inline const ForNode * find_checkpoint_loop(const TemplateNode & root, size_t & index, bool allow_condition = false) {
+    auto is_messages_loop = [&](const TemplateNode * node) -> const ForNode * {
+        auto loop = dynamic_cast<const ForNode *>(node);
+        auto name = loop ? loop->get_iterated_variable(allow_condition) : nullptr;
+        if (!name) return nullptr;
+        if (*name == "messages") return loop;
+        return detail::iterates_over_messages(root, index, *name, /* only_suffix= */ !allow_condition) ? loop : nullptr;
+    };
+    index = 0;
+    if (auto sequence = dynamic_cast<const SequenceNode *>(&root)) {
+        const auto & children = sequence->get_children();
+        for (index = 0; index < children.size(); index++) {
+            if (auto loop = is_messages_loop(children[index].get())) return loop;
+        }
+        return nullptr;
+    }
+    return is_messages_loop(&root);
+}
+
+namespace detail {
+// Whether the iterations of a checkpoint loop of root only depend on their own message and the previous ones (see CheckpointIndependence).
+inline bool checkpoint_independent(const ForNode & loop, const TemplateNode & root);
+}  // namespace detail
+
+struct CheckpointScope {
+    explicit CheckpointScope(const detail::CheckpointState & state) { detail::checkpoint_state() = state; }
+    ~CheckpointScope() { detail::checkpoint_state() = {}; }
+};
+
+MINJA_INLINE std::string TemplateNode::render_checkpoint(const std::shared_ptr<Context> & context, size_t message_index, std::shared_ptr<RenderCheckpoint> & checkpoint) const {
+    detail::ErrorScope error_scope;
+    checkpoint.reset();
+    std::string res;
+    StringSink out(res);
+    size_t loop_index;
+    auto loop = find_checkpoint_loop(*this, loop_index);
+    if (!loop || !detail::checkpoint_independent(*loop, *this)) {
+        render(out, context);
+        return res;
+    }
+
+    auto captured = std::make_shared<RenderCheckpoint>();
+    captured->message_index = message_index;
+    for (const auto & key : context->keys()) {
+        if (key.get<std::string>() != "messages") {
+            captured->inputs.emplace_back(key, context->get(key));
+        }
+    }
+    CheckpointScope scope({loop, captured.get(), &res, nullptr, false});
+    MINJA_CHECKED(render(out, context));
+    if (detail::checkpoint_state().done) {
+        checkpoint = std::move(captured);
+    }
+    return res;
+}
+
+MINJA_INLINE bool TemplateNode::render_from(const RenderCheckpoint & checkpoint, OutputSink & out, const std::shared_ptr<Context> & context) const {
+    detail::ErrorScope error_scope;
+    size_t loop_index;
+    auto loop = find_checkpoint_loop(*this, loop_index);
+    if (!loop) return false;
+    auto messages = context->get("messages");
+    if (!messages.is_array() || messages.size() <= checkpoint.message_index) return false;
+    auto keys = context->keys();
+    if (keys.size() != checkpoint.inputs.size() + 1) return false;
+    for (const auto & [key, value] : checkpoint.inputs) {
+        if (!context->contains(key) || !detail::same_value(context->get(key), value)) return false;
+    }
+
+    // The template's output before the loop isn't written again, but must be the same.
+    auto sequence = dynamic_cast<const SequenceNode *>(this);
+    std::string preamble;
+    StringSink preamble_out(preamble);
+    for (size_t i = 0; sequence && i < loop_index; i++) {
+        MINJA_CHECKED(sequence->get_children()[i]->render(preamble_out, context));
+    }
+    if (std::string_view(checkpoint.output).substr(0, checkpoint.preamble_size) != preamble) return false;
+
+    {
+        CheckpointScope scope({loop, nullptr, nullptr, &checkpoint, false});
+        MINJA_CHECKED(loop->render(out, context));
+        if (!detail::checkpoint_state().done) return false;
+    }
+    for (size_t i = loop_index + 1; sequence && i < sequence->get_children().size(); i++) {
+        MINJA_CHECKED(sequence->get_children()[i]->render(out, context));
+    }
+    return true;
+}
+
+MINJA_INLINE void TemplateNode::render_message_spans(OutputSink & out, const std::shared_ptr<Context> & context, std::vector<MessageSpan> & spans) const {
+    detail::ErrorScope error_scope;
+    spans.clear();
+    size_t loop_index;
+    auto loop = find_checkpoint_loop(*this, loop_index, /* allow_condition= */ true);
+    auto messages = context->get("messages");
+    if (!loop || !messages.is_array()) {
+        render(out, context);
+        return;
+    }
+    detail::MessageSpanState state;
+    state.loop = loop;
+    state.spans = &spans;
+    state.offset = out.size();
+    state.next_same.assign(messages.size(), std::string::npos);
+    for (size_t i = messages.size(); i-- > 0;) {
+        auto identity = messages.at(i).identity();
+        if (!identity) continue;
+        auto it = state.next_message.emplace(identity, i).first;
+        if (it->second != i) {
+            state.next_same[i] = it->second;
+            it->second = i;
+        }
+    }
+    struct MessageSpanScope {
+        explicit MessageSpanScope(detail::MessageSpanState && state) { detail::message_span_state() = std::move(state); }
+        ~MessageSpanScope() { detail::message_span_state() = {}; }
+    } scope(std::move(state));
+    render(out, context);
+}
+
+MINJA_INLINE void TemplateNode::render_generation_spans(OutputSink & out, const std::shared_ptr<Context> & context, std::vector<OutputSpan> & spans) const {
+    detail::ErrorScope error_scope;
+    spans.clear();
+    struct GenerationSpanScope {
+        explicit GenerationSpanScope(detail::GenerationSpanState && state) { detail::generation_span_state() = std::move(state); }
+        ~GenerationSpanScope() { detail::generation_span_state() = {}; }
+    } scope({&spans, out.size(), 0});
+    render(out, context);
+}
 
 class MacroNode : public TemplateNode {
-    std::shared_ptr<VariableExpr> name;
-    Expression::Parameters params;
-    std::shared_ptr<TemplateNode> body;
-    std::unordered_map<std::string, size_t> named_param_positions;
+    // Shared with the callables that rendering defines, so that they stay valid if they outlive the template.
+    struct Definition {
+        std::shared_ptr<VariableExpr> name;
+        Expression::Parameters params;
+        std::shared_ptr<TemplateNode> body;
+        std::unordered_map<std::string, size_t> named_param_positions;
+    };
+    std::shared_ptr<const Definition> definition_;
 public:
     MacroNode(const Location & loc, std::shared_ptr<VariableExpr> && n, Expression::Parameters && p, std::shared_ptr<TemplateNode> && b)
-        : TemplateNode(loc), name(std::move(n)), params(std::move(p)), body(std::move(b)) {
-        for (size_t i = 0; i < params.size(); ++i) {
-          const auto & name = params[i].first;
+        : TemplateNode(loc) {
+        auto definition = std::make_shared<Definition>();
+        definition->name = std::move(n);
+        definition->params = std::move(p);
+        definition->body = std::move(b);
+        for (size_t i = 0; i < definition->params.size(); ++i) {
+          const auto & name = definition->params[i].first;
           if (!name.empty()) {
-            named_param_positions[name] = i;
+            definition->named_param_positions[name] = i;
           }
         }
+        definition_ = std::move(definition);
     }
-    void do_render(std::ostringstream &, const std::shared_ptr<Context> & context) const override {
-        if (!name) throw std::runtime_error("MacroNode.name is null");
-        if (!body) throw std::runtime_error("MacroNode.body is null");
-
-        // Use init-capture to avoid dangling 'this' pointer and circular references
-        auto callable = Value::callable([weak_context = std::weak_ptr<Context>(context),
-                                         name = name, params = params, body = body,
-                                         named_param_positions = named_param_positions]
-                                        (const std::shared_ptr<Context> & call_context, ArgumentsValue & args) {
+    const std::string & get_name() const { return definition_->name->get_name(); }
+    const Expression::Parameters & get_params() const { return definition_->params; }
+    void visit_children(AstVisitor & visitor) const override {
+        for (const auto & param : definition_->params) visitor.visit(param.second);
+        visitor.visit(definition_->body);
+    }
+    void do_render(OutputSink &, const std::shared_ptr<Context> & context) const override {
+        if (!definition_->name) MINJA_THROW_VOID(std::runtime_error("MacroNode.name is null"));
+        if (!definition_->body) MINJA_THROW_VOID(std::runtime_error("MacroNode.body is null"));
+
+        // Weak context to avoid circular references. The definition is owned (one refcount per rendered definition,
+        // not per call), so the macro can be called after the template is destroyed as long as its context lives.
+        auto callable = Value::callable([weak_context = std::weak_ptr<Context>(context), definition = definition_]
+                                        (const std::shared_ptr<Context> & call_context, ArgumentsValue & args) -> Value {
+            const auto & name = definition->name;
+            const auto & params = definition->params;
+            const auto & named_param_positions = definition->named_param_positions;
             auto context_locked = weak_context.lock();
-            if (!context_locked) throw std::runtime_error("Macro context no longer valid");
+            if (!context_locked) MINJA_THROW(std::runtime_error("Macro context no longer valid"));
             auto execution_context = Context::make(Value::object(), context_locked);
 
             if (call_context->contains("caller")) {
@@ -1082,14 +3552,14 @@ public:
             std::vector<bool> param_set(params.size(), false);
             for (size_t i = 0, n = args.args.size(); i < n; i++) {
                 auto & arg = args.args[i];
-                if (i >= params.size()) throw std::runtime_error("Too many positional arguments for macro " + name->get_name());
+                if (i >= params.size()) MINJA_THROW(std::runtime_error("Too many positional arguments for macro " + name->get_name()));
                 param_set[i] = true;
                 const auto & param_name = params[i].first;
                 execution_context->set(param_name, arg);
             }
             for (auto & [arg_name, value] : args.kwargs) {
                 auto it = named_param_positions.find(arg_name);
-                if (it == named_param_positions.end()) throw std::runtime_error("Unknown parameter name for macro " + name->get_name() + ": " + arg_name);
+                if (it == named_param_positions.end()) MINJA_THROW(std::runtime_error("Unknown parameter name for macro " + name->get_name() + ": " + arg_name));
 
                 execution_context->set(arg_name, value);
                 param_set[it->second] = true;
@@ -1097,13 +3567,44 @@ public:
             // Set default values for parameters that were not passed
             for (size_t i = 0, n = params.size(); i < n; i++) {
                 if (!param_set[i] && params[i].second != nullptr) {
-                    auto val = params[i].second->evaluate(call_context);
+                    MINJA_TRY(val, params[i].second->evaluate(call_context));
                     execution_context->set(params[i].first, val);
                 }
             }
-            return body->render(execution_context);
-        });
-        context->set(name->get_name(), callable);
+#ifdef MINJA_NO_EXCEPTIONS
+            detail::OutsideLoopScope outside_loop;
+#endif
+            return definition->body->render(execution_context);
+        }, definition_.get());
+        context->set(definition_->name->get_name(), callable);
+    }
+};
+
+// `{% generation %}` block (see Options::generation_spans).
+class GenerationNode : public TemplateNode {
+    std::shared_ptr<TemplateNode> body;
+public:
+    GenerationNode(const Location & loc, std::shared_ptr<TemplateNode> && b) : TemplateNode(loc), body(std::move(b)) {}
+    void visit_children(AstVisitor & visitor) const override { visitor.visit(body); }
+    void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const override {
+        if (!body) MINJA_THROW_VOID(std::runtime_error("GenerationNode.body is null"));
+        auto & state = detail::generation_span_state();
+        if (!state.spans) {
+            body->render(out, context);
+            return;
+        }
+        auto begin = out.size();
+        {
+            struct NestingScope {
+                size_t & depth;
+                explicit NestingScope(size_t & depth) : depth(depth) { depth++; }
+                ~NestingScope() { depth--; }
+            } nesting(state.depth);
+            MINJA_CHECKED_VOID(body->render(out, context));
+        }
+        if (state.depth == 0) {
+            state.spans->push_back({begin - state.offset, out.size() - state.offset});
+        }
     }
 };
 
@@ -1114,19 +3615,26 @@ class FilterNode : public TemplateNode {
 public:
     FilterNode(const Location & loc, std::shared_ptr<Expression> && f, std::shared_ptr<TemplateNode> && b)
         : TemplateNode(loc), filter(std::move(f)), body(std::move(b)) {}
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(filter);
+        visitor.visit(body);
+    }
 
-    void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
-        if (!filter) throw std::runtime_error("FilterNode.filter is null");
-        if (!body) throw std::runtime_error("FilterNode.body is null");
-        auto filter_value = filter->evaluate(context);
+    void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const override {
+        if (!filter) MINJA_THROW_VOID(std::runtime_error("FilterNode.filter is null"));
+        if (!body) MINJA_THROW_VOID(std::runtime_error("FilterNode.body is null"));
+        MINJA_TRY_VOID(filter_value, filter->evaluate(context));
         if (!filter_value.is_callable()) {
-            throw std::runtime_error("Filter must be a callable: " + filter_value.dump());
+            MINJA_THROW_VOID(std::runtime_error("Filter must be a callable: " + filter_value.dump()));
         }
-        std::string rendered_body = body->render(context);
+        std::string rendered_body;
+        StringSink body_out(rendered_body);
+        MINJA_CHECKED_VOID(body->render(body_out, context));
 
         ArgumentsValue filter_args = {{Value(rendered_body)}, {}};
         auto result = filter_value.call(context, filter_args);
-        out << result.to_str();
+        MINJA_CHECK_VOID();
+        out.write_owned(result.take_str());
     }
 };
 
@@ -1137,18 +3645,23 @@ class SetNode : public TemplateNode {
 public:
     SetNode(const Location & loc, const std::string & ns, const std::vector<std::string> & vns, std::shared_ptr<Expression> && v)
         : TemplateNode(loc), ns(ns), var_names(vns), value(std::move(v)) {}
-    void do_render(std::ostringstream &, const std::shared_ptr<Context> & context) const override {
-      if (!value) throw std::runtime_error("SetNode.value is null");
+    const std::string & get_ns() const { return ns; }
+    const std::vector<std::string> & get_var_names() const { return var_names; }
+    const std::shared_ptr<Expression> & get_value() const { return value; }
+    void visit_children(AstVisitor & visitor) const override { visitor.visit(value); }
+    void do_render(OutputSink &, const std::shared_ptr<Context> & context) const override {
+      if (!value) MINJA_THROW_VOID(std::runtime_error("SetNode.value is null"));
       if (!ns.empty()) {
         if (var_names.size() != 1) {
-          throw std::runtime_error("Namespaced set only supports a single variable name");
+          MINJA_THROW_VOID(std::runtime_error("Namespaced set only supports a single variable name"));
         }
         auto & name = var_names[0];
         auto ns_value = context->get(ns);
-        if (!ns_value.is_object()) throw std::runtime_error("Namespace '" + ns + "' is not an object");
-        ns_value.set(name, this->value->evaluate(context));
+        if (!ns_value.is_object()) MINJA_THROW_VOID(std::runtime_error("Namespace '" + ns + "' is not an object"));
+        MINJA_TRY_VOID(val, this->value->evaluate(context));
+        ns_value.set(name, val);
       } else {
-        auto val = value->evaluate(context);
+        MINJA_TRY_VOID(val, value->evaluate(context));
         destructuring_assign(var_names, context, val);
       }
     }
@@ -1160,10 +3673,14 @@ class SetTemplateNode : public TemplateNode {
 public:
     SetTemplateNode(const Location & loc, const std::string & name, std::shared_ptr<TemplateNode> && tv)
         : TemplateNode(loc), name(name), template_value(std::move(tv)) {}
-    void do_render(std::ostringstream &, const std::shared_ptr<Context> & context) const override {
-      if (!template_value) throw std::runtime_error("SetTemplateNode.template_value is null");
-      Value value { template_value->render(context) };
-      context->set(name, value);
+    const std::string & get_name() const { return name; }
+    void visit_children(AstVisitor & visitor) const override { visitor.visit(template_value); }
+    void do_render(OutputSink &, const std::shared_ptr<Context> & context) const override {
+      if (!template_value) MINJA_THROW_VOID(std::runtime_error("SetTemplateNode.template_value is null"));
+      std::string rendered;
+      StringSink rendered_out(rendered);
+      MINJA_CHECKED_VOID(template_value->render(rendered_out, context));
+      context->set(name, Value(rendered));
     }
 };
 
@@ -1174,14 +3691,22 @@ class IfExpr : public Expression {
 public:
     IfExpr(const Location & loc, std::shared_ptr<Expression> && c, std::shared_ptr<Expression> && t, std::shared_ptr<Expression> && e)
         : Expression(loc), condition(std::move(c)), then_expr(std::move(t)), else_expr(std::move(e)) {}
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(condition);
+        visitor.visit(then_expr);
+        visitor.visit(else_expr);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-      if (!condition) throw std::runtime_error("IfExpr.condition is null");
-      if (!then_expr) throw std::runtime_error("IfExpr.then_expr is null");
-      if (condition->evaluate(context).to_bool()) {
-        return then_expr->evaluate(context);
+      if (!condition) MINJA_THROW(std::runtime_error("IfExpr.condition is null"));
+      if (!then_expr) MINJA_THROW(std::runtime_error("IfExpr.then_expr is null"));
+      MINJA_TRY(condition_value, condition->evaluate(context));
+      if (condition_value.to_bool()) {
+        MINJA_TRY(then_value, then_expr->evaluate(context));
+        return then_value;
       }
       if (else_expr) {
-        return else_expr->evaluate(context);
+        MINJA_TRY(else_value, else_expr->evaluate(context));
+        return else_value;
       }
       return nullptr;
     }
@@ -1192,6 +3717,7 @@ class LiteralExpr : public Expression {
 public:
     LiteralExpr(const Location & loc, const Value& v)
       : Expression(loc), value(v) {}
+    const Value & get_value() const { return value; }
     Value do_evaluate(const std::shared_ptr<Context> &) const override { return value; }
 };
 
@@ -1200,11 +3726,15 @@ class ArrayExpr : public Expression {
 public:
     ArrayExpr(const Location & loc, std::vector<std::shared_ptr<Expression>> && e)
       : Expression(loc), elements(std::move(e)) {}
+    void visit_children(AstVisitor & visitor) const override {
+        for (const auto & e : elements) visitor.visit(e);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         auto result = Value::array();
         for (const auto& e : elements) {
-            if (!e) throw std::runtime_error("Array element is null");
-            result.push_back(e->evaluate(context));
+            if (!e) MINJA_THROW(std::runtime_error("Array element is null"));
+            MINJA_TRY(element, e->evaluate(context));
+            result.push_back(element);
         }
         return result;
     }
@@ -1215,12 +3745,21 @@ class DictExpr : public Expression {
 public:
     DictExpr(const Location & loc, std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>>> && e)
       : Expression(loc), elements(std::move(e)) {}
+    void visit_children(AstVisitor & visitor) const override {
+        for (const auto & [key, value] : elements) {
+            visitor.visit(key);
+            visitor.visit(value);
+        }
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         auto result = Value::object();
         for (const auto& [key, value] : elements) {
-            if (!key) throw std::runtime_error("Dict key is null");
-            if (!value) throw std::runtime_error("Dict value is null");
-            result.set(key->evaluate(context), value->evaluate(context));
+            if (!key) MINJA_THROW(std::runtime_error("Dict key is null"));
+            if (!value) MINJA_THROW(std::runtime_error("Dict value is null"));
+            MINJA_TRY(key_value, key->evaluate(context));
+            MINJA_TRY(value_value, value->evaluate(context));
+            result.set(key_value, value_value);
+            MINJA_CHECK();
         }
         return result;
     }
@@ -1231,8 +3770,13 @@ public:
     std::shared_ptr<Expression> start, end, step;
     SliceExpr(const Location & loc, std::shared_ptr<Expression> && s, std::shared_ptr<Expression> && e, std::shared_ptr<Expression> && st = nullptr)
       : Expression(loc), start(std::move(s)), end(std::move(e)), step(std::move(st)) {}
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(start);
+        visitor.visit(end);
+        visitor.visit(step);
+    }
     Value do_evaluate(const std::shared_ptr<Context> &) const override {
-        throw std::runtime_error("SliceExpr not implemented");
+        MINJA_THROW(std::runtime_error("SliceExpr not implemented"));
     }
 };
 
@@ -1242,24 +3786,38 @@ class SubscriptExpr : public Expression {
 public:
     SubscriptExpr(const Location & loc, std::shared_ptr<Expression> && b, std::shared_ptr<Expression> && i)
         : Expression(loc), base(std::move(b)), index(std::move(i)) {}
+    const std::shared_ptr<Expression> & get_base() const { return base; }
+    const std::shared_ptr<Expression> & get_index() const { return index; }
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(base);
+        visitor.visit(index);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        if (!base) throw std::runtime_error("SubscriptExpr.base is null");
-        if (!index) throw std::runtime_error("SubscriptExpr.index is null");
-        auto target_value = base->evaluate(context);
+        if (!base) MINJA_THROW(std::runtime_error("SubscriptExpr.base is null"));
+        if (!index) MINJA_THROW(std::runtime_error("SubscriptExpr.index is null"));
+        MINJA_TRY(target_value, base->evaluate(context));
         if (auto slice = dynamic_cast<SliceExpr*>(index.get())) {
           auto len = target_value.size();
+          MINJA_CHECK();
           auto wrap = [len](int64_t i) -> int64_t {
             if (i < 0) {
               return i + len;
             }
             return i;
           };
-          int64_t step = slice->step ? slice->step->evaluate(context).get<int64_t>() : 1;
+          auto bound = [&](const std::shared_ptr<Expression> & expr, int64_t default_value) -> detail::Evaluated<int64_t> {
+            if (!expr) return detail::checked(default_value);
+            MINJA_TRY(value, expr->evaluate(context));
+            return detail::checked(value.get<int64_t>());
+          };
+          MINJA_TRY(step, bound(slice->step, 1));
           if (!step) {
-            throw std::runtime_error("slice step cannot be zero");
+            MINJA_THROW(std::runtime_error("slice step cannot be zero"));
           }
-          int64_t start = slice->start ? wrap(slice->start->evaluate(context).get<int64_t>()) : (step < 0 ? len - 1 : 0);
-          int64_t end = slice->end ? wrap(slice->end->evaluate(context).get<int64_t>()) : (step < 0 ? -1 : len);
+          MINJA_TRY(start, bound(slice->start, step < 0 ? len - 1 : 0));
+          MINJA_TRY(end, bound(slice->end, step < 0 ? -1 : len));
+          if (slice->start) start = wrap(start);
+          if (slice->end) end = wrap(end);
           if (target_value.is_string()) {
             std::string s = target_value.get<std::string>();
 
@@ -1276,19 +3834,20 @@ public:
           } else if (target_value.is_array()) {
             auto result = Value::array();
             for (int64_t i = start; step > 0 ? i < end : i > end; i += step) {
-              result.push_back(target_value.at(i));
+              result.push_back(target_value.get(Value(i)));
+              MINJA_CHECK();
             }
             return result;
           } else {
-            throw std::runtime_error(target_value.is_null() ? "Cannot subscript null" : "Subscripting only supported on arrays and strings");
+            MINJA_THROW(std::runtime_error(target_value.is_null() ? "Cannot subscript null" : "Subscripting only supported on arrays and strings"));
           }
         } else {
-          auto index_value = index->evaluate(context);
+          MINJA_TRY(index_value, index->evaluate(context));
           if (target_value.is_null()) {
             if (auto t = dynamic_cast<VariableExpr*>(base.get())) {
-              throw std::runtime_error("'" + t->get_name() + "' is " + (context->contains(t->get_name()) ? "null" : "not defined"));
+              MINJA_THROW(std::runtime_error("'" + t->get_name() + "' is " + (context->contains(t->get_name()) ? "null" : "not defined")));
             }
-            throw std::runtime_error("Trying to access property '" +  index_value.dump() + "' on null!");
+            MINJA_THROW(std::runtime_error("Trying to access property '" +  index_value.dump() + "' on null!"));
           }
           return target_value.get(index_value);
         }
@@ -1302,23 +3861,24 @@ public:
     Op op;
     UnaryOpExpr(const Location & loc, std::shared_ptr<Expression> && e, Op o)
       : Expression(loc), expr(std::move(e)), op(o) {}
+    void visit_children(AstVisitor & visitor) const override { visitor.visit(expr); }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        if (!expr) throw std::runtime_error("UnaryOpExpr.expr is null");
-        auto e = expr->evaluate(context);
+        if (!expr) MINJA_THROW(std::runtime_error("UnaryOpExpr.expr is null"));
+        MINJA_TRY(e, expr->evaluate(context));
         switch (op) {
             case Op::Plus: return e;
             case Op::Minus: return -e;
             case Op::LogicalNot: return !e.to_bool();
             case Op::Expansion:
             case Op::ExpansionDict:
-                throw std::runtime_error("Expansion operator is only supported in function calls and collections");
+                MINJA_THROW(std::runtime_error("Expansion operator is only supported in function calls and collections"));
 
         }
-        throw std::runtime_error("Unknown unary operator");
+        MINJA_THROW(std::runtime_error("Unknown unary operator"));
     }
 };
 
-static bool in(const Value & value, const Value & container) {
+inline bool in(const Value & value, const Value & container) {
   return (((container.is_array() || container.is_object()) && container.contains(value)) ||
       (value.is_string() && container.is_string() &&
         container.to_str().find(value.to_str()) != std::string::npos));
@@ -1334,17 +3894,21 @@ private:
 public:
     BinaryOpExpr(const Location & loc, std::shared_ptr<Expression> && l, std::shared_ptr<Expression> && r, Op o)
         : Expression(loc), left(std::move(l)), right(std::move(r)), op(o) {}
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(left);
+        visitor.visit(right);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        if (!left) throw std::runtime_error("BinaryOpExpr.left is null");
-        if (!right) throw std::runtime_error("BinaryOpExpr.right is null");
-        auto l = left->evaluate(context);
+        if (!left) MINJA_THROW(std::runtime_error("BinaryOpExpr.left is null"));
+        if (!right) MINJA_THROW(std::runtime_error("BinaryOpExpr.right is null"));
+        MINJA_TRY(l, left->evaluate(context));
 
         auto do_eval = [&](const Value & l) -> Value {
           if (op == Op::Is || op == Op::IsNot) {
             auto t = dynamic_cast<VariableExpr*>(right.get());
-            if (!t) throw std::runtime_error("Right side of 'is' operator must be a variable");
+            if (!t) MINJA_THROW(std::runtime_error("Right side of 'is' operator must be a variable"));
 
-            auto eval = [&]() {
+            auto eval = [&]() -> bool {
               const auto & name = t->get_name();
               if (name == "none") return l.is_null();
               if (name == "boolean") return l.is_boolean();
@@ -1358,7 +3922,7 @@ public:
               if (name == "defined") return !l.is_null();
               if (name == "true") return l.to_bool();
               if (name == "false") return !l.to_bool();
-              throw std::runtime_error("Unknown type for 'is' operator: " + name);
+              MINJA_THROW(std::runtime_error("Unknown type for 'is' operator: " + name));
             };
             auto value = eval();
             return Value(op == Op::Is ? value : !value);
@@ -1366,13 +3930,15 @@ public:
 
           if (op == Op::And) {
             if (!l.to_bool()) return Value(false);
-            return right->evaluate(context).to_bool();
+            MINJA_TRY(r, right->evaluate(context));
+            return r.to_bool();
           } else if (op == Op::Or) {
             if (l.to_bool()) return l;
-            return right->evaluate(context);
+            MINJA_TRY(r, right->evaluate(context));
+            return r;
           }
 
-          auto r = right->evaluate(context);
+          MINJA_TRY(r, right->evaluate(context));
           switch (op) {
               case Op::StrConcat: return l.to_str() + r.to_str();
               case Op::Add:       return l + r;
@@ -1380,8 +3946,8 @@ public:
               case Op::Mul:       return l * r;
               case Op::Div:       return l / r;
               case Op::MulMul:    return std::pow(l.get<double>(), r.get<double>());
-              case Op::DivDiv:    return l.get<int64_t>() / r.get<int64_t>();
-              case Op::Mod:       return l.get<int64_t>() % r.get<int64_t>();
+              case Op::DivDiv:    return Value(l.get<int64_t>()) / Value(r.get<int64_t>());
+              case Op::Mod:       return l % r;
               case Op::Eq:        return l == r;
               case Op::Ne:        return l != r;
               case Op::Lt:        return l < r;
@@ -1392,12 +3958,13 @@ public:
               case Op::NotIn:     return !in(l, r);
               default:            break;
           }
-          throw std::runtime_error("Unknown binary operator");
+          MINJA_THROW(std::runtime_error("Unknown binary operator"));
         };
 
         if (l.is_callable()) {
-          return Value::callable([l, do_eval](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
+          return Value::callable([l, do_eval](const std::shared_ptr<Context> & context, ArgumentsValue & args) -> Value {
             auto ll = l.call(context, args);
+            MINJA_CHECK();
             return do_eval(ll); //args[0].second);
           });
         } else {
@@ -1410,23 +3977,28 @@ struct ArgumentsExpression {
     std::vector<std::shared_ptr<Expression>> args;
     std::vector<std::pair<std::string, std::shared_ptr<Expression>>> kwargs;
 
-    ArgumentsValue evaluate(const std::shared_ptr<Context> & context) const {
+    void visit_children(AstVisitor & visitor) const {
+        for (const auto & arg : args) visitor.visit(arg);
+        for (const auto & kwarg : kwargs) visitor.visit(kwarg.second);
+    }
+
+    detail::Evaluated<ArgumentsValue> evaluate(const std::shared_ptr<Context> & context) const {
         ArgumentsValue vargs;
         for (const auto& arg : this->args) {
-            if (auto un_expr = std::dynamic_pointer_cast<UnaryOpExpr>(arg)) {
+            if (auto un_expr = dynamic_cast<UnaryOpExpr*>(arg.get())) {
                 if (un_expr->op == UnaryOpExpr::Op::Expansion) {
-                    auto array = un_expr->expr->evaluate(context);
+                    MINJA_TRY(array, un_expr->expr->evaluate(context));
                     if (!array.is_array()) {
-                        throw std::runtime_error("Expansion operator only supported on arrays");
+                        MINJA_THROW(std::runtime_error("Expansion operator only supported on arrays"));
                     }
                     array.for_each([&](Value & value) {
                         vargs.args.push_back(value);
                     });
                     continue;
                 } else if (un_expr->op == UnaryOpExpr::Op::ExpansionDict) {
-                    auto dict = un_expr->expr->evaluate(context);
+                    MINJA_TRY(dict, un_expr->expr->evaluate(context));
                     if (!dict.is_object()) {
-                        throw std::runtime_error("ExpansionDict operator only supported on objects");
+                        MINJA_THROW(std::runtime_error("ExpansionDict operator only supported on objects"));
                     }
                     dict.for_each([&](const Value & key) {
                         vargs.kwargs.push_back({key.get<std::string>(), dict.at(key)});
@@ -1434,16 +4006,18 @@ struct ArgumentsExpression {
                     continue;
                 }
             }
-            vargs.args.push_back(arg->evaluate(context));
+            MINJA_TRY(value, arg->evaluate(context));
+            vargs.args.push_back(value);
         }
         for (const auto& [name, value] : this->kwargs) {
-            vargs.kwargs.push_back({name, value->evaluate(context)});
+            MINJA_TRY(kwarg, value->evaluate(context));
+            vargs.kwargs.push_back({name, kwarg});
         }
-        return vargs;
+        return detail::checked(std::move(vargs));
     }
 };
 
-static std::string strip(const std::string & s, const std::string & chars = "", bool left = true, bool right = true) {
+inline std::string strip(const std::string & s, const std::string & chars = "", bool left = true, bool right = true) {
   auto charset = chars.empty() ? " \t\n\r" : chars;
   auto start = left ? s.find_first_not_of(charset) : 0;
   if (start == std::string::npos) return "";
@@ -1451,7 +4025,7 @@ static std::string strip(const std::string & s, const std::string & chars = "",
   return s.substr(start, end - start + 1);
 }
 
-static std::vector<std::string> split(const std::string & s, const std::string & sep) {
+inline std::vector<std::string> split(const std::string & s, const std::string & sep) {
   std::vector<std::string> result;
   size_t start = 0;
   size_t end = s.find(sep);
@@ -1464,7 +4038,7 @@ static std::vector<std::string> split(const std::string & s, const std::string &
   return result;
 }
 
-static std::string capitalize(const std::string & s) {
+inline std::string capitalize(const std::string & s) {
   if (s.empty()) return s;
   auto result = s;
   std::transform(result.begin(), result.end(), result.begin(), ::tolower);
@@ -1472,7 +4046,7 @@ static std::string capitalize(const std::string & s) {
   return result;
 }
 
-static std::string html_escape(const std::string & s) {
+inline std::string html_escape(const std::string & s) {
   std::string result;
   result.reserve(s.size());
   for (const auto & c : s) {
@@ -1495,32 +4069,43 @@ class MethodCallExpr : public Expression {
 public:
     MethodCallExpr(const Location & loc, std::shared_ptr<Expression> && obj, std::shared_ptr<VariableExpr> && m, ArgumentsExpression && a)
         : Expression(loc), object(std::move(obj)), method(std::move(m)), args(std::move(a)) {}
+    const std::string & get_method_name() const { return method->get_name(); }
+    const std::shared_ptr<Expression> & get_object() const { return object; }
+    // The method name isn't visited: it's not looked up in the context.
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(object);
+        args.visit_children(visitor);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        if (!object) throw std::runtime_error("MethodCallExpr.object is null");
-        if (!method) throw std::runtime_error("MethodCallExpr.method is null");
-        auto obj = object->evaluate(context);
-        auto vargs = args.evaluate(context);
+        if (!object) MINJA_THROW(std::runtime_error("MethodCallExpr.object is null"));
+        if (!method) MINJA_THROW(std::runtime_error("MethodCallExpr.method is null"));
+        MINJA_TRY(obj, object->evaluate(context));
+        MINJA_TRY(vargs, args.evaluate(context));
         if (obj.is_null()) {
-          throw std::runtime_error("Trying to call method '" + method->get_name() + "' on null");
+          MINJA_THROW(std::runtime_error("Trying to call method '" + method->get_name() + "' on null"));
         }
         if (obj.is_array()) {
           if (method->get_name() == "append") {
               vargs.expectArgs("append method", {1, 1}, {0, 0});
+              MINJA_CHECK();
               obj.push_back(vargs.args[0]);
               return Value();
           } else if (method->get_name() == "pop") {
               vargs.expectArgs("pop method", {0, 1}, {0, 0});
+              MINJA_CHECK();
               return obj.pop(vargs.args.empty() ? Value() : vargs.args[0]);
           } else if (method->get_name() == "insert") {
               vargs.expectArgs("insert method", {2, 2}, {0, 0});
+              MINJA_CHECK();
               auto index = vargs.args[0].get<int64_t>();
-              if (index < 0 || index > (int64_t) obj.size()) throw std::runtime_error("Index out of range for insert method");
+              if (index < 0 || index > (int64_t) obj.size()) MINJA_THROW(std::runtime_error("Index out of range for insert method"));
               obj.insert(index, vargs.args[1]);
               return Value();
           }
         } else if (obj.is_object()) {
           if (method->get_name() == "items") {
             vargs.expectArgs("items method", {0, 0}, {0, 0});
+            MINJA_CHECK();
             auto result = Value::array();
             for (const auto& key : obj.keys()) {
               result.push_back(Value::array({key, obj.at(key)}));
@@ -1528,9 +4113,11 @@ public:
             return result;
           } else if (method->get_name() == "pop") {
             vargs.expectArgs("pop method", {1, 1}, {0, 0});
+            MINJA_CHECK();
             return obj.pop(vargs.args[0]);
           } else if (method->get_name() == "keys") {
             vargs.expectArgs("keys method", {0, 0}, {0, 0});
+            MINJA_CHECK();
             auto result = Value::array();
             for (const auto& key : obj.keys()) {
               result.push_back(Value(key));
@@ -1538,6 +4125,7 @@ public:
             return result;
           } else if (method->get_name() == "get") {
             vargs.expectArgs("get method", {1, 2}, {0, 0});
+            MINJA_CHECK();
             auto key = vargs.args[0];
             if (vargs.args.size() == 1) {
               return obj.contains(key) ? obj.at(key) : Value();
@@ -1547,7 +4135,7 @@ public:
           } else if (obj.contains(method->get_name())) {
             auto callable = obj.at(method->get_name());
             if (!callable.is_callable()) {
-              throw std::runtime_error("Property '" + method->get_name() + "' is not callable");
+              MINJA_THROW(std::runtime_error("Property '" + method->get_name() + "' is not callable"));
             }
             return callable.call(context, vargs);
           }
@@ -1555,18 +4143,22 @@ public:
           auto str = obj.get<std::string>();
           if (method->get_name() == "strip") {
             vargs.expectArgs("strip method", {0, 1}, {0, 0});
+            MINJA_CHECK();
             auto chars = vargs.args.empty() ? "" : vargs.args[0].get<std::string>();
             return Value(strip(str, chars));
           } else if (method->get_name() == "lstrip") {
             vargs.expectArgs("lstrip method", {0, 1}, {0, 0});
+            MINJA_CHECK();
             auto chars = vargs.args.empty() ? "" : vargs.args[0].get<std::string>();
             return Value(strip(str, chars, /* left= */ true, /* right= */ false));
           } else if (method->get_name() == "rstrip") {
             vargs.expectArgs("rstrip method", {0, 1}, {0, 0});
+            MINJA_CHECK();
             auto chars = vargs.args.empty() ? "" : vargs.args[0].get<std::string>();
             return Value(strip(str, chars, /* left= */ false, /* right= */ true));
           } else if (method->get_name() == "split") {
             vargs.expectArgs("split method", {1, 1}, {0, 0});
+            MINJA_CHECK();
             auto sep = vargs.args[0].get<std::string>();
             auto parts = split(str, sep);
             Value result = Value::array();
@@ -1576,27 +4168,33 @@ public:
             return result;
           } else if (method->get_name() == "capitalize") {
             vargs.expectArgs("capitalize method", {0, 0}, {0, 0});
+            MINJA_CHECK();
             return Value(capitalize(str));
           } else if (method->get_name() == "upper") {
             vargs.expectArgs("upper method", {0, 0}, {0, 0});
+            MINJA_CHECK();
             auto result = str;
             std::transform(result.begin(), result.end(), result.begin(), ::toupper);
             return Value(result);
           } else if (method->get_name() == "lower") {
             vargs.expectArgs("lower method", {0, 0}, {0, 0});
+            MINJA_CHECK();
             auto result = str;
             std::transform(result.begin(), result.end(), result.begin(), ::tolower);
             return Value(result);
           } else if (method->get_name() == "endswith") {
             vargs.expectArgs("endswith method", {1, 1}, {0, 0});
+            MINJA_CHECK();
             auto suffix = vargs.args[0].get<std::string>();
             return suffix.length() <= str.length() && std::equal(suffix.rbegin(), suffix.rend(), str.rbegin());
           } else if (method->get_name() == "startswith") {
             vargs.expectArgs("startswith method", {1, 1}, {0, 0});
+            MINJA_CHECK();
             auto prefix = vargs.args[0].get<std::string>();
             return prefix.length() <= str.length() && std::equal(prefix.begin(), prefix.end(), str.begin());
           } else if (method->get_name() == "title") {
             vargs.expectArgs("title method", {0, 0}, {0, 0});
+            MINJA_CHECK();
             auto res = str;
             for (size_t i = 0, n = res.size(); i < n; ++i) {
               if (i == 0 || std::isspace(res[i - 1])) res[i] = std::toupper(res[i]);
@@ -1605,6 +4203,7 @@ public:
             return res;
           } else if (method->get_name() == "replace") {
             vargs.expectArgs("replace method", {2, 3}, {0, 0});
+            MINJA_CHECK();
             auto before = vargs.args[0].get<std::string>();
             auto after = vargs.args[1].get<std::string>();
             auto count = vargs.args.size() == 3 ? vargs.args[2].get<int64_t>()
@@ -1618,7 +4217,7 @@ public:
             return str;
           }
         }
-        throw std::runtime_error("Unknown method: " + method->get_name());
+        MINJA_THROW(std::runtime_error("Unknown method: " + method->get_name()));
     }
 };
 
@@ -1628,13 +4227,17 @@ public:
     ArgumentsExpression args;
     CallExpr(const Location & loc, std::shared_ptr<Expression> && obj, ArgumentsExpression && a)
         : Expression(loc), object(std::move(obj)), args(std::move(a)) {}
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(object);
+        args.visit_children(visitor);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        if (!object) throw std::runtime_error("CallExpr.object is null");
-        auto obj = object->evaluate(context);
+        if (!object) MINJA_THROW(std::runtime_error("CallExpr.object is null"));
+        MINJA_TRY(obj, object->evaluate(context));
         if (!obj.is_callable()) {
-          throw std::runtime_error("Object is not callable: " + obj.dump(2));
+          MINJA_THROW(std::runtime_error("Object is not callable: " + obj.dump(2)));
         }
-        auto vargs = args.evaluate(context);
+        MINJA_TRY(vargs, args.evaluate(context));
         return obj.call(context, vargs);
     }
 };
@@ -1646,16 +4249,23 @@ class CallNode : public TemplateNode {
 public:
     CallNode(const Location & loc, std::shared_ptr<Expression> && e, std::shared_ptr<TemplateNode> && b)
         : TemplateNode(loc), expr(std::move(e)), body(std::move(b)) {}
+    void visit_children(AstVisitor & visitor) const override {
+        visitor.visit(expr);
+        visitor.visit(body);
+    }
 
-    void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
-        if (!expr) throw std::runtime_error("CallNode.expr is null");
-        if (!body) throw std::runtime_error("CallNode.body is null");
+    void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const override {
+        if (!expr) MINJA_THROW_VOID(std::runtime_error("CallNode.expr is null"));
+        if (!body) MINJA_THROW_VOID(std::runtime_error("CallNode.body is null"));
 
-        // Use init-capture to avoid dangling 'this' pointer and circular references
-        auto caller = Value::callable([weak_context = std::weak_ptr<Context>(context), body=body]
+        // Weak context to avoid circular references, owned body (see MacroNode)
+        auto caller = Value::callable([weak_context = std::weak_ptr<Context>(context), body = body]
                                       (const std::shared_ptr<Context> &, ArgumentsValue &) -> Value {
             auto context_locked = weak_context.lock();
-            if (!context_locked) throw std::runtime_error("Caller context no longer valid");
+            if (!context_locked) MINJA_THROW(std::runtime_error("Caller context no longer valid"));
+#ifdef MINJA_NO_EXCEPTIONS
+            detail::OutsideLoopScope outside_loop;
+#endif
             return Value(body->render(context_locked));
         });
 
@@ -1663,17 +4273,18 @@ public:
 
         auto call_expr = dynamic_cast<CallExpr*>(expr.get());
         if (!call_expr) {
-            throw std::runtime_error("Invalid call block syntax - expected function call");
+            MINJA_THROW_VOID(std::runtime_error("Invalid call block syntax - expected function call"));
         }
 
-        Value function = call_expr->object->evaluate(context);
+        MINJA_TRY_VOID(function, call_expr->object->evaluate(context));
         if (!function.is_callable()) {
-            throw std::runtime_error("Call target must be callable: " + function.dump());
+            MINJA_THROW_VOID(std::runtime_error("Call target must be callable: " + function.dump()));
         }
-        ArgumentsValue args = call_expr->args.evaluate(context);
+        MINJA_TRY_VOID(args, call_expr->args.evaluate(context));
 
         Value result = function.call(context, args);
-        out << result.to_str();
+        MINJA_CHECK_VOID();
+        out.write_owned(result.take_str());
     }
 };
 
@@ -1682,26 +4293,32 @@ class FilterExpr : public Expression {
 public:
     FilterExpr(const Location & loc, std::vector<std::shared_ptr<Expression>> && p)
       : Expression(loc), parts(std::move(p)) {}
+    const std::vector<std::shared_ptr<Expression>> & get_parts() const { return parts; }
+    void visit_children(AstVisitor & visitor) const override {
+        for (const auto & part : parts) visitor.visit(part);
+    }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
         Value result;
         bool first = true;
         for (const auto& part : parts) {
-          if (!part) throw std::runtime_error("FilterExpr.part is null");
+          if (!part) MINJA_THROW(std::runtime_error("FilterExpr.part is null"));
           if (first) {
             first = false;
-            result = part->evaluate(context);
+            MINJA_TRY(value, part->evaluate(context));
+            result = value;
           } else {
             if (auto ce = dynamic_cast<CallExpr*>(part.get())) {
-              auto target = ce->object->evaluate(context);
-              ArgumentsValue args = ce->args.evaluate(context);
+              MINJA_TRY(target, ce->object->evaluate(context));
+              MINJA_TRY(args, ce->args.evaluate(context));
               args.args.insert(args.args.begin(), result);
               result = target.call(context, args);
             } else {
-              auto callable = part->evaluate(context);
+              MINJA_TRY(callable, part->evaluate(context));
               ArgumentsValue args;
               args.args.insert(args.args.begin(), result);
               result = callable.call(context, args);
             }
+            MINJA_CHECK();
           }
         }
         return result;
@@ -1712,16 +4329,588 @@ public:
     }
 };
 
-class Parser {
+// Body of a block that is only parsed when first rendered (see Options::lazy_bodies).
+class LazyTemplateNode : public TemplateNode {
+    std::shared_ptr<std::string> source_;
+    size_t end_pos_;
+    Options options_;
+    SpaceHandling body_pre_space_;
+    SpaceHandling body_post_space_;
+    mutable std::mutex parse_mutex_;
+    mutable std::atomic<bool> parsed_ {false};
+    mutable std::shared_ptr<TemplateNode> body_;
+public:
+    // Parse errors are already located, and so are render errors of the body's nodes: use a null source to not add our own location.
+    LazyTemplateNode(const Location & loc, size_t end_pos, const Options & options, SpaceHandling body_pre_space, SpaceHandling body_post_space)
+      : TemplateNode({nullptr, loc.pos}), source_(loc.source), end_pos_(end_pos), options_(options), body_pre_space_(body_pre_space), body_post_space_(body_post_space) {}
+    // Parses the body if needed (thread-safe). A failed parse is retried on the next call.
+    const std::shared_ptr<TemplateNode> & body() const;
+    bool is_parsed() const { return parsed_; }
+    const std::shared_ptr<std::string> & source() const { return source_; }
+    void visit_children(AstVisitor & visitor) const override {
+        if (parsed_) visitor.visit(body_);
+    }
+    void do_render(OutputSink & out, const std::shared_ptr<Context> & context) const override {
+      const auto & body = this->body();
+      MINJA_CHECK_VOID();
+      body->render(out, context);
+    }
+};
+
+namespace detail {
+
+/*
+    Checks that the calls of a part of a template only go to builtins and to the template's macros, whose bodies are checked in
+    turn (see visit_macro): callables from the context (e.g. strftime_now or a per-request helper) may have side effects or
+    depend on more than their arguments.
+*/
+class CallCheck : public AstVisitor {
+  protected:
+    const MacroDefinitions & macros_;
+    std::unordered_set<const MacroNode *> checked_macros_;
+    bool valid_ = true;
+
+    explicit CallCheck(const MacroDefinitions & macros) : macros_(macros) {}
+
+    static const std::unordered_set<std::string> & builtin_names() {
+        static const std::unordered_set<std::string> names = []() {
+            std::unordered_set<std::string> names;
+            for (const auto & key : Context::builtins()->keys()) names.insert(key.get<std::string>());
+            return names;
+        }();
+        return names;
+    }
+
+    // Visits the parameters and body of a macro called from the checked part (once per macro).
+    virtual void visit_macro(const MacroNode & macro) = 0;
+
+    void check_callable(const std::string & name) {
+        // Macros shadow builtins.
+        auto it = macros_.find(name);
+        if (it == macros_.end()) {
+            if (!builtin_names().count(name)) valid_ = false;
+            return;
+        }
+        for (auto macro : it->second) {
+            if (checked_macros_.insert(macro).second) visit_macro(*macro);
+        }
+    }
+
+    // Checks the call made by an expression, if it's one (its sub-expressions are still to be visited).
+    void check_call(const Expression & expr) {
+        if (auto call = dynamic_cast<const CallExpr *>(&expr)) {
+            auto callee = dynamic_cast<const VariableExpr *>(call->object.get());
+            if (!callee) {
+                valid_ = false;
+                return;
+            }
+            check_callable(callee->get_name());
+        } else if (auto call = dynamic_cast<const MethodCallExpr *>(&expr)) {
+            // Methods that don't mutate their object (others may also be callables stored in a dict, e.g. loop.cycle).
+            static const std::unordered_set<std::string> pure_methods {
+                "items", "keys", "get", "strip", "lstrip", "rstrip", "split", "capitalize", "upper", "lower", "endswith", "startswith", "title", "replace",
+            };
+            if (!pure_methods.count(call->get_method_name())) valid_ = false;
+        } else if (auto filter = dynamic_cast<const FilterExpr *>(&expr)) {
+            const auto & parts = filter->get_parts();
+            for (size_t i = 1; i < parts.size(); i++) {
+                if (auto name = dynamic_cast<const VariableExpr *>(parts[i].get())) check_callable(name->get_name());
+            }
+        }
+    }
+};
+
+/*
+    Checks that the iterations of a loop can be rendered independently of each other, each in its own copy of the loop context (see
+    Options::parallel_loop_min_items). Iterations only share state through the outer scope (which the body can't write to without
+    namespace writes nor list / dict mutations), through variables set in the loop context and read by later iterations (so variables
+    the body sets must be set, unconditionally, before they're read) and through loop.cycle() and break. Calls are only allowed to
+    builtins and to the template's macros, whose bodies are checked in turn (their own variables are local to each call).
+*/
+class IterationIndependence : public CallCheck {
+    // Variables the body sets in the loop context, and those already set on every path at the current point.
+    std::unordered_set<std::string> written_;
+    std::vector<std::string> assigned_;
+    std::vector<std::string> unassigned_reads_;
+    // Nesting in branches, and in scopes with their own context (nested loops, macro bodies).
+    size_t conditional_ = 0;
+    size_t local_ = 0;
+    size_t nested_loops_ = 0;
+
+    explicit IterationIndependence(const MacroDefinitions & macros) : CallCheck(macros) {}
+
+    void read(const std::string & name) {
+        if (std::find(assigned_.begin(), assigned_.end(), name) == assigned_.end()) {
+            unassigned_reads_.push_back(name);
+        }
+    }
+    void write(const std::string & name) {
+        if (local_) return;
+        written_.insert(name);
+        if (!conditional_) assigned_.push_back(name);
+    }
+
+    void visit_macro(const MacroNode & macro) override {
+        // break / continue can't leave a macro body (see detail::OutsideLoopScope): they don't affect the calling loop.
+        local_++;
+        nested_loops_++;
+        macro.visit_children(*this);
+        nested_loops_--;
+        local_--;
+    }
+
+    void visit_loop(const ForNode & loop) {
+        AstVisitor::visit(loop.iterable);
+        // Set in the enclosing context when filtering the items, if there are any.
+        conditional_++;
+        for (const auto & name : loop.var_names) write(name);
+        conditional_--;
+
+        auto assigned = assigned_.size();
+        assigned_.insert(assigned_.end(), loop.var_names.begin(), loop.var_names.end());
+        assigned_.push_back("loop");
+        local_++;
+        nested_loops_++;
+        AstVisitor::visit(loop.condition);
+        AstVisitor::visit(loop.body);
+        nested_loops_--;
+        local_--;
+        assigned_.resize(assigned);
+
+        conditional_++;
+        AstVisitor::visit(loop.else_body);
+        conditional_--;
+    }
+
+public:
+    static bool check(const ForNode & loop, const MacroDefinitions & macros) {
+        if (loop.recursive || !loop.body) return false;
+        IterationIndependence analysis(macros);
+        analysis.assigned_ = loop.var_names;
+        analysis.assigned_.push_back("loop");
+        analysis.visit(*loop.body);
+        if (!analysis.valid_) return false;
+        for (const auto & name : analysis.unassigned_reads_) {
+            if (analysis.written_.count(name)) return false;
+        }
+        return true;
+    }
+
+    void visit(const TemplateNode & node) override {
+        if (!valid_) return;
+        if (auto loop = dynamic_cast<const ForNode *>(&node)) {
+            visit_loop(*loop);
+        } else if (auto set = dynamic_cast<const SetNode *>(&node)) {
+            if (!set->get_ns().empty()) {
+                valid_ = false;
+                return;
+            }
+            set->visit_children(*this);
+            for (const auto & name : set->get_var_names()) write(name);
+        } else if (auto set = dynamic_cast<const SetTemplateNode *>(&node)) {
+            set->visit_children(*this);
+            write(set->get_name());
+        } else if (auto control = dynamic_cast<const LoopControlNode *>(&node)) {
+            if (!nested_loops_ && control->get_control_type() == LoopControlType::Break) valid_ = false;
+        } else if (auto lazy = dynamic_cast<const LazyTemplateNode *>(&node)) {
+            if (!lazy->is_parsed()) valid_ = false;
+            lazy->visit_children(*this);
+        } else if (dynamic_cast<const MacroNode *>(&node) || dynamic_cast<const CallNode *>(&node)) {
+            valid_ = false;
+        } else if (dynamic_cast<const IfNode *>(&node) || dynamic_cast<const FilterNode *>(&node)) {
+            conditional_++;
+            node.visit_children(*this);
+            conditional_--;
+        } else {
+            node.visit_children(*this);
+        }
+    }
+
+    void visit(const Expression & expr) override {
+        if (!valid_) return;
+        if (auto var = dynamic_cast<const VariableExpr *>(&expr)) {
+            read(var->get_name());
+            return;
+        }
+        check_call(expr);
+        if (!valid_) return;
+        expr.visit_children(*this);
+    }
+};
+
+/*
+    Checks that the output of a loop's iterations only depends on their item and on the variables the body reads from the loop's
+    scope, which are all that memoized iterations are keyed on (see Options::memoize_loops): calls only go to builtins and to the
+    template's macros, and these macros only read their parameters and their own variables (variables they read from the scope
+    they were defined in aren't recorded).
+*/
+class MemoizationSafety : public CallCheck {
+    // Names bound in each macro body being checked, innermost last.
+    std::vector<std::unordered_set<std::string>> macro_scopes_;
+
+    explicit MemoizationSafety(const MacroDefinitions & macros) : CallCheck(macros) {}
+
+    // Collects the names a macro body binds: its parameters and the variables, loop variables and macros it defines.
+    struct BoundNames : AstVisitor {
+        std::unordered_set<std::string> & names;
+        explicit BoundNames(std::unordered_set<std::string> & names) : names(names) {}
+        void visit(const TemplateNode & node) override {
+            if (auto set = dynamic_cast<const SetNode *>(&node)) {
+                if (set->get_ns().empty()) names.insert(set->get_var_names().begin(), set->get_var_names().end());
+            } else if (auto set = dynamic_cast<const SetTemplateNode *>(&node)) {
+                names.insert(set->get_name());
+            } else if (auto loop = dynamic_cast<const ForNode *>(&node)) {
+                MemoizationSafety::bind_loop(*loop, names);
+            } else if (auto macro = dynamic_cast<const MacroNode *>(&node)) {
+                names.insert(macro->get_name());
+            }
+            node.visit_children(*this);
+        }
+        void visit(const Expression &) override {}
+    };
+    static void bind_loop(const ForNode & loop, std::unordered_set<std::string> & names) {
+        names.insert(loop.var_names.begin(), loop.var_names.end());
+        names.insert("loop");
+    }
+
+    bool is_bound(const std::string & name) const {
+        const auto & scope = macro_scopes_.back();
+        return scope.count(name) || macros_.count(name) || builtin_names().count(name);
+    }
+
+    void visit_macro(const MacroNode & macro) override {
+        std::unordered_set<std::string> names {"caller", "varargs", "kwargs"};
+        for (const auto & param : macro.get_params()) names.insert(param.first);
+        BoundNames bound(names);
+        macro.visit_children(bound);
+        macro_scopes_.push_back(std::move(names));
+        macro.visit_children(*this);
+        macro_scopes_.pop_back();
+    }
+
+public:
+    static bool check(const ForNode & loop, const MacroDefinitions & macros) {
+        if (loop.recursive || !loop.body) return false;
+        MemoizationSafety analysis(macros);
+        analysis.visit(*loop.body);
+        return analysis.valid_;
+    }
+
+    void visit(const TemplateNode & node) override {
+        if (!valid_) return;
+        if (auto lazy = dynamic_cast<const LazyTemplateNode *>(&node)) {
+            if (!lazy->is_parsed()) valid_ = false;
+        } else if (auto set = dynamic_cast<const SetNode *>(&node)) {
+            // Namespace attributes set from a macro body.
+            if (!set->get_ns().empty() && !macro_scopes_.empty() && !is_bound(set->get_ns())) valid_ = false;
+        }
+        node.visit_children(*this);
+    }
+
+    void visit(const Expression & expr) override {
+        if (!valid_) return;
+        if (auto var = dynamic_cast<const VariableExpr *>(&expr)) {
+            if (!macro_scopes_.empty() && !is_bound(var->get_name())) valid_ = false;
+            return;
+        }
+        check_call(expr);
+        if (!valid_) return;
+        expr.visit_children(*this);
+    }
+};
+
+}  // namespace detail
+
+inline void ForNode::enable_memoization(size_t max_bytes, const MacroDefinitions & macros) {
+    if (detail::MemoizationSafety::check(*this, macros)) memo_ = std::make_shared<detail::LoopMemo>(max_bytes);
+}
+
+inline void ForNode::enable_parallelism(size_t min_items, const MacroDefinitions & macros) {
+    if (!memo_ && detail::IterationIndependence::check(*this, macros)) parallel_min_items_ = min_items;
+}
+
+namespace detail {
+
+/*
+    Checks that the iterations of a loop over the messages render the same whatever messages follow them, so a checkpoint taken
+    before one of them can be resumed with more messages (see TemplateNode::render_checkpoint). The body (and the template's
+    macros it uses) may only see the messages through the loop variables, loop.previtem and the other loop attributes that don't
+    depend on the number of messages: it can't read messages or the iterated variable, nor loop.length, loop.revindex(0) or
+    loop.nextitem, nor use loop as a whole.
+*/
+class CheckpointIndependence : public AstVisitor {
+    const std::string & iterated_;
+    MacroDefinitions macros_;
+    std::unordered_set<const MacroNode *> checked_macros_;
+    // Nesting in loops of the body, in which `loop` is their own.
+    size_t nested_loops_ = 0;
+    // The object of a loop.cycle(...) call being visited.
+    const Expression * cycled_loop_ = nullptr;
+    bool independent_ = true;
+
+    explicit CheckpointIndependence(const std::string & iterated) : iterated_(iterated) {}
+
+    // Collects the template's macros, wherever they're defined.
+    struct MacroCollector : AstVisitor {
+        MacroDefinitions & macros;
+        explicit MacroCollector(MacroDefinitions & macros) : macros(macros) {}
+        void visit(const TemplateNode & node) override {
+            if (auto macro = dynamic_cast<const MacroNode *>(&node)) macros[macro->get_name()].push_back(macro);
+            node.visit_children(*this);
+        }
+        void visit(const Expression &) override {}
+    };
+
+    // An access to the checkpoint loop's own `loop` variable, if expr is one.
+    bool is_loop_variable(const std::shared_ptr<Expression> & expr) const {
+        auto var = dynamic_cast<const VariableExpr *>(expr.get());
+        return !nested_loops_ && var && var->get_name() == "loop";
+    }
+
+public:
+    static bool check(const ForNode & loop, const TemplateNode & root) {
+        auto iterated = loop.get_iterated_variable();
+        if (!iterated || !loop.body) return false;
+        CheckpointIndependence analysis(*iterated);
+        MacroCollector collector(analysis.macros_);
+        collector.visit(root);
+        analysis.visit(*loop.body);
+        return analysis.independent_;
+    }
+
+    void visit(const TemplateNode & node) override {
+        if (!independent_) return;
+        if (auto loop = dynamic_cast<const ForNode *>(&node)) {
+            AstVisitor::visit(loop->iterable);
+            nested_loops_++;
+            AstVisitor::visit(loop->condition);
+            AstVisitor::visit(loop->body);
+            nested_loops_--;
+            AstVisitor::visit(loop->else_body);
+        } else if (auto lazy = dynamic_cast<const LazyTemplateNode *>(&node)) {
+            if (!lazy->is_parsed()) independent_ = false;
+            lazy->visit_children(*this);
+        } else {
+            node.visit_children(*this);
+        }
+    }
+
+    void visit(const Expression & expr) override {
+        if (!independent_) return;
+        if (auto var = dynamic_cast<const VariableExpr *>(&expr)) {
+            const auto & name = var->get_name();
+            if (name == "messages" || name == iterated_ || (name == "loop" && !nested_loops_ && &expr != cycled_loop_)) {
+                independent_ = false;
+                return;
+            }
+            // Macros, whether called, used as filters or passed around.
+            auto it = macros_.find(name);
+            if (it == macros_.end()) return;
+            for (auto macro : it->second) {
+                if (checked_macros_.insert(macro).second) visit(*macro);
+            }
+            return;
+        }
+        if (auto subscript = dynamic_cast<const SubscriptExpr *>(&expr)) {
+            if (is_loop_variable(subscript->get_base())) {
+                auto attr = dynamic_cast<const LiteralExpr *>(subscript->get_index().get());
+                if (!attr || !attr->get_value().is_string()) {
+                    independent_ = false;
+                    return;
+                }
+                static const std::unordered_set<std::string> length_dependent {"length", "revindex", "revindex0", "nextitem"};
+                if (length_dependent.count(attr->get_value().get<std::string>())) independent_ = false;
+                return;
+            }
+        } else if (auto call = dynamic_cast<const MethodCallExpr *>(&expr)) {
+            // loop.cycle(...)
+            if (is_loop_variable(call->get_object())) {
+                if (call->get_method_name() != "cycle") {
+                    independent_ = false;
+                    return;
+                }
+                cycled_loop_ = call->get_object().get();
+                call->visit_children(*this);
+                cycled_loop_ = nullptr;
+                return;
+            }
+        }
+        expr.visit_children(*this);
+    }
+};
+
+inline bool checkpoint_independent(const ForNode & loop, const TemplateNode & root) {
+    return CheckpointIndependence::check(loop, root);
+}
+
+/*
+    Resolves the variable a top-level loop iterates over through the `set` statements before it, wherever they are (e.g.
+    `{% if messages[0].role == 'system' %}{% set loop_messages = messages[1:] %}{% else %}{% set loop_messages = messages %}{% endif %}`),
+    except in loops and macros, whose variables are their own. It's resolved if it's assigned, and only to messages or
+    `messages[start:]` (only_suffix), or else to expressions using messages (e.g. `messages | selectattr('role', 'ne', 'tool') | list`).
+*/
+class IteratedMessages : public AstVisitor {
+    const std::string & name_;
+    bool only_suffix_;
+    bool assigned_ = false;
+    bool resolved_ = true;
+
+    IteratedMessages(const std::string & name, bool only_suffix) : name_(name), only_suffix_(only_suffix) {}
+
+    static bool is_messages(const std::shared_ptr<Expression> & expr) {
+        auto var = dynamic_cast<const VariableExpr *>(expr.get());
+        return var && var->get_name() == "messages";
+    }
+
+    // Finds a reference to messages in an expression.
+    struct MessagesReference : AstVisitor {
+        bool found = false;
+        void visit(const TemplateNode &) override {}
+        void visit(const Expression & expr) override {
+            if (auto var = dynamic_cast<const VariableExpr *>(&expr)) found = found || var->get_name() == "messages";
+            expr.visit_children(*this);
+        }
+    };
+
+    bool resolves(const std::shared_ptr<Expression> & value) const {
+        if (is_messages(value)) return true;
+        if (only_suffix_) {
+            auto subscript = dynamic_cast<const SubscriptExpr *>(value.get());
+            auto slice = subscript ? dynamic_cast<const SliceExpr *>(subscript->get_index().get()) : nullptr;
+            return slice && is_messages(subscript->get_base()) && !slice->end && !slice->step;
+        }
+        MessagesReference reference;
+        reference.AstVisitor::visit(value);
+        return reference.found;
+    }
+
+public:
+    static bool check(const TemplateNode & root, size_t loop_index, const std::string & name, bool only_suffix) {
+        auto sequence = dynamic_cast<const SequenceNode *>(&root);
+        if (!sequence) return false;
+        IteratedMessages analysis(name, only_suffix);
+        for (size_t i = 0; i < loop_index && analysis.resolved_; i++) analysis.AstVisitor::visit(sequence->get_children()[i]);
+        return analysis.assigned_ && analysis.resolved_;
+    }
+
+    void visit(const TemplateNode & node) override {
+        if (!resolved_) return;
+        if (dynamic_cast<const ForNode *>(&node) || dynamic_cast<const MacroNode *>(&node)) return;
+        if (auto set = dynamic_cast<const SetNode *>(&node)) {
+            const auto & names = set->get_var_names();
+            if (!set->get_ns().empty() || std::find(names.begin(), names.end(), name_) == names.end()) return;
+            assigned_ = true;
+            resolved_ = names.size() == 1 && resolves(set->get_value());
+        } else if (auto set_template = dynamic_cast<const SetTemplateNode *>(&node)) {
+            if (set_template->get_name() == name_) resolved_ = false;
+        } else if (auto lazy = dynamic_cast<const LazyTemplateNode *>(&node)) {
+            // Branches that weren't rendered yet are parsed to find their assignments.
+            auto body = try_call([&]() { return lazy->body(); });
+            if (!body.value) {
+                resolved_ = false;
+                return;
+            }
+            AstVisitor::visit(body.value);
+        } else {
+            node.visit_children(*this);
+        }
+    }
+    void visit(const Expression &) override {}
+};
+
+inline bool iterates_over_messages(const TemplateNode & root, size_t loop_index, const std::string & name, bool only_suffix) {
+    return IteratedMessages::check(root, loop_index, name, only_suffix);
+}
+
+}  // namespace detail
+
+namespace detail {
+
+class MemoryUsageVisitor : public AstVisitor {
+    TemplateMemoryUsage & usage_;
+    std::unordered_set<const std::string *> sources_;
+
+    template <typename T, typename Base>
+    const T * count(const Base & node, const char * type) {
+        auto typed = dynamic_cast<const T *>(&node);
+        if (typed) {
+            usage_.counts_by_type[type]++;
+            usage_.node_bytes += sizeof(T);
+        }
+        return typed;
+    }
+    void add_source(const std::shared_ptr<std::string> & source) {
+        if (source && sources_.insert(source.get()).second) usage_.source_bytes += source->size();
+    }
+
+public:
+    explicit MemoryUsageVisitor(TemplateMemoryUsage & usage) : usage_(usage) {}
+
+    void visit(const TemplateNode & node) override {
+        usage_.nodes++;
+        usage_.location_bytes += sizeof(Location);
+        add_source(node.location().source);
+        if (auto text = count<TextNode>(node, "TextNode")) {
+            usage_.literal_bytes += text->get_text().size();
+        } else if (auto loop = count<ForNode>(node, "ForNode")) {
+            usage_.loop_memo_bytes += loop->memo_memory_usage();
+        } else if (auto lazy = count<LazyTemplateNode>(node, "LazyTemplateNode")) {
+            add_source(lazy->source());
+        } else if (!count<SequenceNode>(node, "SequenceNode") && !count<ExpressionNode>(node, "ExpressionNode") && !count<IfNode>(node, "IfNode")
+            && !count<LoopControlNode>(node, "LoopControlNode") && !count<MacroNode>(node, "MacroNode") && !count<FilterNode>(node, "FilterNode")
+            && !count<SetNode>(node, "SetNode") && !count<SetTemplateNode>(node, "SetTemplateNode") && !count<CallNode>(node, "CallNode")
+            && !count<GenerationNode>(node, "GenerationNode")) {
+            usage_.counts_by_type["TemplateNode"]++;
+            usage_.node_bytes += sizeof(TemplateNode);
+        }
+        node.visit_children(*this);
+    }
+
+    void visit(const Expression & expr) override {
+        usage_.expressions++;
+        usage_.location_bytes += sizeof(Location);
+        add_source(expr.location.source);
+        if (auto var = count<VariableExpr>(expr, "VariableExpr")) {
+            usage_.literal_bytes += var->get_name().size();
+        } else if (auto literal = count<LiteralExpr>(expr, "LiteralExpr")) {
+            usage_.literal_bytes += literal->get_value().memory_usage().total_bytes - sizeof(Value);
+        } else if (auto call = count<MethodCallExpr>(expr, "MethodCallExpr")) {
+            usage_.literal_bytes += call->get_method_name().size();
+            // The method's VariableExpr isn't visited.
+            usage_.node_bytes += sizeof(VariableExpr);
+        } else if (!count<IfExpr>(expr, "IfExpr") && !count<ArrayExpr>(expr, "ArrayExpr") && !count<DictExpr>(expr, "DictExpr")
+            && !count<SliceExpr>(expr, "SliceExpr") && !count<SubscriptExpr>(expr, "SubscriptExpr") && !count<UnaryOpExpr>(expr, "UnaryOpExpr")
+            && !count<BinaryOpExpr>(expr, "BinaryOpExpr") && !count<CallExpr>(expr, "CallExpr") && !count<FilterExpr>(expr, "FilterExpr")) {
+            usage_.counts_by_type["Expression"]++;
+            usage_.node_bytes += sizeof(Expression);
+        }
+        expr.visit_children(*this);
+    }
+};
+
+}  // namespace detail
+
+MINJA_INLINE TemplateMemoryUsage TemplateNode::memory_usage() const {
+    TemplateMemoryUsage usage;
+    detail::MemoryUsageVisitor visitor(usage);
+    visitor.visit(*this);
+    usage.total_bytes = usage.node_bytes + usage.literal_bytes + usage.source_bytes + usage.loop_memo_bytes;
+    return usage;
+}
+
+class ParserImpl {
 private:
+    friend class LazyTemplateNode;
     using CharIterator = std::string::const_iterator;
 
     std::shared_ptr<std::string> template_str;
     CharIterator start, end, it;
     Options options;
+    // See Options::parallel_loop_min_items.
+    mutable MacroDefinitions macros;
 
-    Parser(const std::shared_ptr<std::string>& template_str, const Options & options) : template_str(template_str), options(options) {
-      if (!template_str) throw std::runtime_error("Template string is null");
+    ParserImpl(const std::shared_ptr<std::string>& template_str, const Options & options) : template_str(template_str), options(options) {
+      if (!template_str) MINJA_THROW_VOID(std::runtime_error("Template string is null"));
       start = it = this->template_str->begin();
       end = this->template_str->end();
     }
@@ -1775,7 +4964,7 @@ private:
       return nullptr;
     }
 
-    json parseNumber(CharIterator& it, const CharIterator& end) {
+    Value parseNumber(CharIterator& it, const CharIterator& end) {
         auto before = it;
         consumeSpaces();
         auto start = it;
@@ -1788,11 +4977,11 @@ private:
           if (std::isdigit(*it)) {
             ++it;
           } else if (*it == '.') {
-            if (hasDecimal) throw std::runtime_error("Multiple decimal points");
+            if (hasDecimal) MINJA_THROW(std::runtime_error("Multiple decimal points"));
             hasDecimal = true;
             ++it;
           } else if (it != start && (*it == 'e' || *it == 'E')) {
-            if (hasExponent) throw std::runtime_error("Multiple exponents");
+            if (hasExponent) MINJA_THROW(std::runtime_error("Multiple exponents"));
             hasExponent = true;
             ++it;
           } else {
@@ -1801,16 +4990,13 @@ private:
         }
         if (start == it) {
           it = before;
-          return json(); // No valid characters found
+          return Value(); // No valid characters found
         }
 
         std::string str(start, it);
-        try {
-          return json::parse(str);
-        } catch (json::parse_error& e) {
-          throw std::runtime_error("Failed to parse number: '" + str + "' (" + std::string(e.what()) + ")");
-          return json();
-        }
+        Value number;
+        if (!parse_json_number(str, number)) MINJA_THROW(std::runtime_error("Failed to parse number: '" + str + "'"));
+        return number;
     }
 
     /** integer, float, bool, string */
@@ -1828,11 +5014,11 @@ private:
         if (token == "true" || token == "True") return std::make_shared<Value>(true);
         if (token == "false" || token == "False") return std::make_shared<Value>(false);
         if (token == "None") return std::make_shared<Value>(nullptr);
-        throw std::runtime_error("Unknown constant token: " + token);
+        MINJA_THROW(std::runtime_error("Unknown constant token: " + token));
       }
 
       auto number = parseNumber(it, end);
-      if (!number.is_null()) return std::make_shared<Value>(number);
+      if (!number.is_null()) return std::make_shared<Value>(std::move(number));
 
       it = start;
       return nullptr;
@@ -1849,6 +5035,7 @@ private:
     };
 
     bool peekSymbols(const std::vector<std::string> & symbols) const {
+        MINJA_CHECK();
         for (const auto & symbol : symbols) {
             if (std::distance(it, end) >= (int64_t) symbol.size() && std::string(it, it + symbol.size()) == symbol) {
                 return true;
@@ -1857,7 +5044,9 @@ private:
         return false;
     }
 
+    // (without exceptions, nothing more is consumed after an error, so that parsing loops end)
     std::vector<std::string> consumeTokenGroups(const std::regex & regex, SpaceHandling space_handling = SpaceHandling::Strip) {
+        MINJA_CHECK();
         auto start = it;
         consumeSpaces(space_handling);
         std::smatch match;
@@ -1873,6 +5062,7 @@ private:
         return {};
     }
     std::string consumeToken(const std::regex & regex, SpaceHandling space_handling = SpaceHandling::Strip) {
+        MINJA_CHECK();
         auto start = it;
         consumeSpaces(space_handling);
         std::smatch match;
@@ -1885,6 +5075,7 @@ private:
     }
 
     std::string consumeToken(const std::string & token, SpaceHandling space_handling = SpaceHandling::Strip) {
+        MINJA_CHECK();
         auto start = it;
         consumeSpaces(space_handling);
         if (std::distance(it, end) >= (int64_t) token.size() && std::string(it, it + token.size()) == token) {
@@ -1917,26 +5108,26 @@ private:
 
     std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>> parseIfExpression() {
         auto condition = parseLogicalOr();
-        if (!condition) throw std::runtime_error("Expected condition expression");
+        if (!condition) MINJA_THROW(std::runtime_error("Expected condition expression"));
 
         static std::regex else_tok(R"(else\b)");
         std::shared_ptr<Expression> else_expr;
         if (!consumeToken(else_tok).empty()) {
           else_expr = parseExpression();
-          if (!else_expr) throw std::runtime_error("Expected 'else' expression");
+          if (!else_expr) MINJA_THROW(std::runtime_error("Expected 'else' expression"));
         }
         return std::pair(std::move(condition), std::move(else_expr));
     }
 
     std::shared_ptr<Expression> parseLogicalOr() {
         auto left = parseLogicalAnd();
-        if (!left) throw std::runtime_error("Expected left side of 'logical or' expression");
+        if (!left) MINJA_THROW(std::runtime_error("Expected left side of 'logical or' expression"));
 
         static std::regex or_tok(R"(or\b)");
         auto location = get_location();
         while (!consumeToken(or_tok).empty()) {
             auto right = parseLogicalAnd();
-            if (!right) throw std::runtime_error("Expected right side of 'or' expression");
+            if (!right) MINJA_THROW(std::runtime_error("Expected right side of 'or' expression"));
             left = std::make_shared<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::Or);
         }
         return left;
@@ -1948,7 +5139,7 @@ private:
 
         if (!consumeToken(not_tok).empty()) {
           auto sub = parseLogicalNot();
-          if (!sub) throw std::runtime_error("Expected expression after 'not' keyword");
+          if (!sub) MINJA_THROW(std::runtime_error("Expected expression after 'not' keyword"));
           return std::make_shared<UnaryOpExpr>(location, std::move(sub), UnaryOpExpr::Op::LogicalNot);
         }
         return parseLogicalCompare();
@@ -1956,13 +5147,13 @@ private:
 
     std::shared_ptr<Expression> parseLogicalAnd() {
         auto left = parseLogicalNot();
-        if (!left) throw std::runtime_error("Expected left side of 'logical and' expression");
+        if (!left) MINJA_THROW(std::runtime_error("Expected left side of 'logical and' expression"));
 
         static std::regex and_tok(R"(and\b)");
         auto location = get_location();
         while (!consumeToken(and_tok).empty()) {
             auto right = parseLogicalNot();
-            if (!right) throw std::runtime_error("Expected right side of 'and' expression");
+            if (!right) MINJA_THROW(std::runtime_error("Expected right side of 'and' expression"));
             left = std::make_shared<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::And);
         }
         return left;
@@ -1970,7 +5161,7 @@ private:
 
     std::shared_ptr<Expression> parseLogicalCompare() {
         auto left = parseStringConcat();
-        if (!left) throw std::runtime_error("Expected left side of 'logical compare' expression");
+        if (!left) MINJA_THROW(std::runtime_error("Expected left side of 'logical compare' expression"));
 
         static std::regex compare_tok(R"(==|!=|<=?|>=?|in\b|is\b|not\s+in\b)");
         static std::regex not_tok(R"(not\b)");
@@ -1981,7 +5172,7 @@ private:
               auto negated = !consumeToken(not_tok).empty();
 
               auto identifier = parseIdentifier();
-              if (!identifier) throw std::runtime_error("Expected identifier after 'is' keyword");
+              if (!identifier) MINJA_THROW(std::runtime_error("Expected identifier after 'is' keyword"));
 
               return std::make_shared<BinaryOpExpr>(
                   left->location,
@@ -1989,7 +5180,7 @@ private:
                   negated ? BinaryOpExpr::Op::IsNot : BinaryOpExpr::Op::Is);
             }
             auto right = parseStringConcat();
-            if (!right) throw std::runtime_error("Expected right side of 'logical compare' expression");
+            if (!right) MINJA_THROW(std::runtime_error("Expected right side of 'logical compare' expression"));
             BinaryOpExpr::Op op;
             if (op_str == "==") op = BinaryOpExpr::Op::Eq;
             else if (op_str == "!=") op = BinaryOpExpr::Op::Ne;
@@ -1999,7 +5190,7 @@ private:
             else if (op_str == ">=") op = BinaryOpExpr::Op::Ge;
             else if (op_str == "in") op = BinaryOpExpr::Op::In;
             else if (op_str.substr(0, 3) == "not") op = BinaryOpExpr::Op::NotIn;
-            else throw std::runtime_error("Unknown comparison operator: " + op_str);
+            else MINJA_THROW(std::runtime_error("Unknown comparison operator: " + op_str));
             left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
         }
         return left;
@@ -2007,7 +5198,7 @@ private:
 
     Expression::Parameters parseParameters() {
         consumeSpaces();
-        if (consumeToken("(").empty()) throw std::runtime_error("Expected opening parenthesis in param list");
+        if (consumeToken("(").empty()) MINJA_THROW(std::runtime_error("Expected opening parenthesis in param list"));
 
         Expression::Parameters result;
 
@@ -2016,12 +5207,12 @@ private:
                 return result;
             }
             auto expr = parseExpression();
-            if (!expr) throw std::runtime_error("Expected expression in call args");
+            if (!expr) MINJA_THROW(std::runtime_error("Expected expression in call args"));
 
             if (auto ident = dynamic_cast<VariableExpr*>(expr.get())) {
                 if (!consumeToken("=").empty()) {
                     auto value = parseExpression();
-                    if (!value) throw std::runtime_error("Expected expression in for named arg");
+                    if (!value) MINJA_THROW(std::runtime_error("Expected expression in for named arg"));
                     result.emplace_back(ident->get_name(), std::move(value));
                 } else {
                     result.emplace_back(ident->get_name(), nullptr);
@@ -2031,17 +5222,17 @@ private:
             }
             if (consumeToken(",").empty()) {
               if (consumeToken(")").empty()) {
-                throw std::runtime_error("Expected closing parenthesis in call args");
+                MINJA_THROW(std::runtime_error("Expected closing parenthesis in call args"));
               }
               return result;
             }
         }
-        throw std::runtime_error("Expected closing parenthesis in call args");
+        MINJA_THROW(std::runtime_error("Expected closing parenthesis in call args"));
     }
 
     ArgumentsExpression parseCallArgs() {
         consumeSpaces();
-        if (consumeToken("(").empty()) throw std::runtime_error("Expected opening parenthesis in call args");
+        if (consumeToken("(").empty()) MINJA_THROW(std::runtime_error("Expected opening parenthesis in call args"));
 
         ArgumentsExpression result;
 
@@ -2050,12 +5241,12 @@ private:
                 return result;
             }
             auto expr = parseExpression();
-            if (!expr) throw std::runtime_error("Expected expression in call args");
+            if (!expr) MINJA_THROW(std::runtime_error("Expected expression in call args"));
 
             if (auto ident = dynamic_cast<VariableExpr*>(expr.get())) {
                 if (!consumeToken("=").empty()) {
                     auto value = parseExpression();
-                    if (!value) throw std::runtime_error("Expected expression in for named arg");
+                    if (!value) MINJA_THROW(std::runtime_error("Expected expression in for named arg"));
                     result.kwargs.emplace_back(ident->get_name(), std::move(value));
                 } else {
                     result.args.emplace_back(std::move(expr));
@@ -2065,12 +5256,12 @@ private:
             }
             if (consumeToken(",").empty()) {
               if (consumeToken(")").empty()) {
-                throw std::runtime_error("Expected closing parenthesis in call args");
+                MINJA_THROW(std::runtime_error("Expected closing parenthesis in call args"));
               }
               return result;
             }
         }
-        throw std::runtime_error("Expected closing parenthesis in call args");
+        MINJA_THROW(std::runtime_error("Expected closing parenthesis in call args"));
     }
 
     std::shared_ptr<VariableExpr> parseIdentifier() {
@@ -2084,12 +5275,12 @@ private:
 
     std::shared_ptr<Expression> parseStringConcat() {
         auto left = parseMathPow();
-        if (!left) throw std::runtime_error("Expected left side of 'string concat' expression");
+        if (!left) MINJA_THROW(std::runtime_error("Expected left side of 'string concat' expression"));
 
         static std::regex concat_tok(R"(~(?!\}))");
         if (!consumeToken(concat_tok).empty()) {
             auto right = parseLogicalAnd();
-            if (!right) throw std::runtime_error("Expected right side of 'string concat' expression");
+            if (!right) MINJA_THROW(std::runtime_error("Expected right side of 'string concat' expression"));
             left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::StrConcat);
         }
         return left;
@@ -2097,11 +5288,11 @@ private:
 
     std::shared_ptr<Expression> parseMathPow() {
         auto left = parseMathPlusMinus();
-        if (!left) throw std::runtime_error("Expected left side of 'math pow' expression");
+        if (!left) MINJA_THROW(std::runtime_error("Expected left side of 'math pow' expression"));
 
         while (!consumeToken("**").empty()) {
             auto right = parseMathPlusMinus();
-            if (!right) throw std::runtime_error("Expected right side of 'math pow' expression");
+            if (!right) MINJA_THROW(std::runtime_error("Expected right side of 'math pow' expression"));
             left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::MulMul);
         }
         return left;
@@ -2111,11 +5302,11 @@ private:
         static std::regex plus_minus_tok(R"(\+|-(?![}%#]\}))");
 
         auto left = parseMathMulDiv();
-        if (!left) throw std::runtime_error("Expected left side of 'math plus/minus' expression");
+        if (!left) MINJA_THROW(std::runtime_error("Expected left side of 'math plus/minus' expression"));
         std::string op_str;
         while (!(op_str = consumeToken(plus_minus_tok)).empty()) {
             auto right = parseMathMulDiv();
-            if (!right) throw std::runtime_error("Expected right side of 'math plus/minus' expression");
+            if (!right) MINJA_THROW(std::runtime_error("Expected right side of 'math plus/minus' expression"));
             auto op = op_str == "+" ? BinaryOpExpr::Op::Add : BinaryOpExpr::Op::Sub;
             left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
         }
@@ -2124,13 +5315,13 @@ private:
 
     std::shared_ptr<Expression> parseMathMulDiv() {
         auto left = parseMathUnaryPlusMinus();
-        if (!left) throw std::runtime_error("Expected left side of 'math mul/div' expression");
+        if (!left) MINJA_THROW(std::runtime_error("Expected left side of 'math mul/div' expression"));
 
         static std::regex mul_div_tok(R"(\*\*?|//?|%(?!\}))");
         std::string op_str;
         while (!(op_str = consumeToken(mul_div_tok)).empty()) {
             auto right = parseMathUnaryPlusMinus();
-            if (!right) throw std::runtime_error("Expected right side of 'math mul/div' expression");
+            if (!right) MINJA_THROW(std::runtime_error("Expected right side of 'math mul/div' expression"));
             auto op = op_str == "*" ? BinaryOpExpr::Op::Mul
                 : op_str == "**" ? BinaryOpExpr::Op::MulMul
                 : op_str == "/" ? BinaryOpExpr::Op::Div
@@ -2162,7 +5353,7 @@ private:
         static std::regex unary_plus_minus_tok(R"(\+|-(?![}%#]\}))");
         auto op_str = consumeToken(unary_plus_minus_tok);
         auto expr = parseExpansion();
-        if (!expr) throw std::runtime_error("Expected expr of 'unary plus/minus/expansion' expression");
+        if (!expr) MINJA_THROW(std::runtime_error("Expected expr of 'unary plus/minus/expansion' expression"));
 
         if (!op_str.empty()) {
             auto op = op_str == "+" ? UnaryOpExpr::Op::Plus : UnaryOpExpr::Op::Minus;
@@ -2176,7 +5367,7 @@ private:
       auto op_str = consumeToken(expansion_tok);
       auto expr = parseValueExpression();
       if (op_str.empty()) return expr;
-      if (!expr) throw std::runtime_error("Expected expr of 'expansion' expression");
+      if (!expr) MINJA_THROW(std::runtime_error("Expected expr of 'expansion' expression"));
       return std::make_shared<UnaryOpExpr>(get_location(), std::move(expr), op_str == "*" ? UnaryOpExpr::Op::Expansion : UnaryOpExpr::Op::ExpansionDict);
     }
 
@@ -2201,7 +5392,7 @@ private:
         auto dictionary = parseDictionary();
         if (dictionary) return dictionary;
 
-        throw std::runtime_error("Expected value expression");
+        MINJA_THROW(std::runtime_error("Expected value expression"));
       };
 
       auto value = parseValue();
@@ -2235,13 +5426,13 @@ private:
           } else {
             index = std::move(start);
           }
-          if (!index) throw std::runtime_error("Empty index in subscript");
-          if (consumeToken("]").empty()) throw std::runtime_error("Expected closing bracket in subscript");
+          if (!index) MINJA_THROW(std::runtime_error("Empty index in subscript"));
+          if (consumeToken("]").empty()) MINJA_THROW(std::runtime_error("Expected closing bracket in subscript"));
 
           value = std::make_shared<SubscriptExpr>(value->location, std::move(value), std::move(index));
         } else if (!consumeToken(".").empty()) {
             auto identifier = parseIdentifier();
-            if (!identifier) throw std::runtime_error("Expected identifier in subscript");
+            if (!identifier) MINJA_THROW(std::runtime_error("Expected identifier in subscript"));
 
             consumeSpaces();
             if (peekSymbols({ "(" })) {
@@ -2265,7 +5456,7 @@ private:
         if (consumeToken("(").empty()) return nullptr;
 
         auto expr = parseExpression();
-        if (!expr) throw std::runtime_error("Expected expression in braced expression");
+        if (!expr) MINJA_THROW(std::runtime_error("Expected expression in braced expression"));
 
         if (!consumeToken(")").empty()) {
             return expr;  // Drop the parentheses
@@ -2275,16 +5466,16 @@ private:
         tuple.emplace_back(std::move(expr));
 
         while (it != end) {
-          if (consumeToken(",").empty()) throw std::runtime_error("Expected comma in tuple");
+          if (consumeToken(",").empty()) MINJA_THROW(std::runtime_error("Expected comma in tuple"));
           auto next = parseExpression();
-          if (!next) throw std::runtime_error("Expected expression in tuple");
+          if (!next) MINJA_THROW(std::runtime_error("Expected expression in tuple"));
           tuple.push_back(std::move(next));
 
           if (!consumeToken(")").empty()) {
               return std::make_shared<ArrayExpr>(get_location(), std::move(tuple));
           }
         }
-        throw std::runtime_error("Expected closing parenthesis");
+        MINJA_THROW(std::runtime_error("Expected closing parenthesis"));
     }
 
     std::shared_ptr<Expression> parseArray() {
@@ -2295,21 +5486,21 @@ private:
             return std::make_shared<ArrayExpr>(get_location(), std::move(elements));
         }
         auto first_expr = parseExpression();
-        if (!first_expr) throw std::runtime_error("Expected first expression in array");
+        if (!first_expr) MINJA_THROW(std::runtime_error("Expected first expression in array"));
         elements.push_back(std::move(first_expr));
 
         while (it != end) {
             if (!consumeToken(",").empty()) {
               auto expr = parseExpression();
-              if (!expr) throw std::runtime_error("Expected expression in array");
+              if (!expr) MINJA_THROW(std::runtime_error("Expected expression in array"));
               elements.push_back(std::move(expr));
             } else if (!consumeToken("]").empty()) {
                 return std::make_shared<ArrayExpr>(get_location(), std::move(elements));
             } else {
-                throw std::runtime_error("Expected comma or closing bracket in array");
+                MINJA_THROW(std::runtime_error("Expected comma or closing bracket in array"));
             }
         }
-        throw std::runtime_error("Expected closing bracket");
+        MINJA_THROW(std::runtime_error("Expected closing bracket"));
     }
 
     std::shared_ptr<Expression> parseDictionary() {
@@ -2322,10 +5513,10 @@ private:
 
         auto parseKeyValuePair = [&]() {
             auto key = parseExpression();
-            if (!key) throw std::runtime_error("Expected key in dictionary");
-            if (consumeToken(":").empty()) throw std::runtime_error("Expected colon betweek key & value in dictionary");
+            if (!key) MINJA_THROW_VOID(std::runtime_error("Expected key in dictionary"));
+            if (consumeToken(":").empty()) MINJA_THROW_VOID(std::runtime_error("Expected colon betweek key & value in dictionary"));
             auto value = parseExpression();
-            if (!value) throw std::runtime_error("Expected value in dictionary");
+            if (!value) MINJA_THROW_VOID(std::runtime_error("Expected value in dictionary"));
             elements.emplace_back(std::pair(std::move(key), std::move(value)));
         };
 
@@ -2337,10 +5528,10 @@ private:
             } else if (!consumeToken("}").empty()) {
                 return std::make_shared<DictExpr>(get_location(), std::move(elements));
             } else {
-                throw std::runtime_error("Expected comma or closing brace in dictionary");
+                MINJA_THROW(std::runtime_error("Expected comma or closing brace in dictionary"));
             }
         }
-        throw std::runtime_error("Expected closing brace");
+        MINJA_THROW(std::runtime_error("Expected closing brace"));
     }
 
     SpaceHandling parsePreSpace(const std::string& s) const {
@@ -2361,7 +5552,7 @@ private:
       static std::regex varnames_regex(R"(((?:\w+)(?:\s*,\s*(?:\w+))*)\s*)");
 
       std::vector<std::string> group;
-      if ((group = consumeTokenGroups(varnames_regex)).empty()) throw std::runtime_error("Expected variable names");
+      if ((group = consumeTokenGroups(varnames_regex)).empty()) MINJA_THROW(std::runtime_error("Expected variable names"));
       std::vector<std::string> varnames;
       std::istringstream iss(group[1]);
       std::string varname;
@@ -2380,7 +5571,108 @@ private:
         + error_location_suffix(*template_str, token.location.pos));
     }
 
+    /*
+      Finds the end of the block body starting at `it` without parsing it: that's the first elif / else / end* tag at the same nesting level
+      (or the end of the template), whose pre space handling is returned in end_pre_space.
+      Throws if the block tags nested in the body are unbalanced.
+    */
+    CharIterator findBodyEnd(SpaceHandling & end_pre_space) {
+      static const std::unordered_set<std::string> block_openers { "if", "for", "generation", "set", "macro", "filter", "call" };
+
+      auto find_tag_close = [&](CharIterator p, char c) -> CharIterator {
+        while (p != end) {
+          if (*p == '"' || *p == '\'') {
+            auto quote = *(p++);
+            for (; p != end && *p != quote; ++p) {
+              if (*p == '\\' && ++p == end) break;
+            }
+            if (p != end) ++p;
+          } else if (*p == c && p + 1 != end && *(p + 1) == '}') {
+            return p;
+          } else {
+            ++p;
+          }
+        }
+        return end;
+      };
+
+      std::vector<std::pair<std::string, CharIterator>> stack;
+      auto unterminated = [&]() {
+        it = stack.back().second;
+        return std::runtime_error("Unterminated " + stack.back().first);
+      };
+
+      end_pre_space = SpaceHandling::Keep;
+      for (auto p = it; (p = std::find(p, end, '{')) != end;) {
+        auto tag_start = p++;
+        if (p == end) break;
+        if (*p == '#') {
+          static const std::string comment_close = "#}";
+          p = std::search(p + 1, end, comment_close.begin(), comment_close.end());
+          if (p == end) {
+            it = tag_start;
+            MINJA_THROW(std::runtime_error("Missing end of comment tag"));
+          }
+          p += 2;
+        } else if (*p == '{') {
+          p = find_tag_close(p + 1, '}');
+          if (p == end) {
+            it = tag_start;
+            MINJA_THROW(std::runtime_error("Expected closing expression tag"));
+          }
+          p += 2;
+        } else if (*p == '%') {
+          auto pre_space = ++p != end && *p == '-' ? SpaceHandling::Strip : SpaceHandling::Keep;
+          if (p != end && (*p == '-' || *p == '~')) ++p;
+          while (p != end && std::isspace(*p)) ++p;
+          auto keyword_start = p;
+          while (p != end && (std::isalnum(*p) || *p == '_')) ++p;
+          std::string keyword(keyword_start, p);
+          auto tag_close = find_tag_close(p, '%');
+          if (tag_close == end) {
+            it = tag_start;
+            MINJA_THROW(std::runtime_error("Expected closing block tag"));
+          }
+
+          auto is_else = keyword == "elif" || keyword == "else";
+          auto is_end = keyword.size() > 3 && keyword.compare(0, 3, "end") == 0 && block_openers.count(keyword.substr(3));
+          if ((is_else || is_end) && stack.empty()) {
+            end_pre_space = pre_space;
+            return tag_start;
+          }
+          if (is_else) {
+            if (stack.back().first != "if" && !(keyword == "else" && stack.back().first == "for")) MINJA_THROW(unterminated());
+          } else if (is_end) {
+            if (stack.back().first != keyword.substr(3)) MINJA_THROW(unterminated());
+            stack.pop_back();
+          } else if (block_openers.count(keyword)) {
+            // Only `{% set var_names %}` opens a block (as opposed to `{% set ns.var = value %}`, `{% set a, b = value %}`...)
+            if (keyword != "set" || std::all_of(p, tag_close, [](char c) { return c == '_' || c == ',' || c == '-' || c == '~' || std::isalnum(c) || std::isspace(c); })) {
+              stack.emplace_back(keyword, tag_start);
+            }
+          }
+          p = tag_close + 2;
+        }
+      }
+      if (!stack.empty()) MINJA_THROW(unterminated());
+      return end;
+    }
+
     TemplateTokenVector tokenize() {
+#ifdef MINJA_NO_EXCEPTIONS
+      auto tokens = doTokenize();
+      if (detail::failed()) detail::ErrorFrame::innermost()->append(error_location_suffix(*template_str, std::distance(start, it)));
+      return tokens;
+#else
+      try {
+        return doTokenize();
+      } catch (const std::exception & e) {
+        throw std::runtime_error(e.what() + error_location_suffix(*template_str, std::distance(start, it)));
+      }
+#endif
+    }
+
+    TemplateTokenVector doTokenize() {
       static std::regex comment_tok(R"(\{#([-~]?)([\s\S]*?)([-~]?)#\})");
       static std::regex expr_open_regex(R"(\{\{([-~])?)");
       static std::regex block_open_regex(R"(^\{%([-~])?\s*)");
@@ -2394,163 +5686,173 @@ private:
       std::string text;
       std::smatch match;
 
-      try {
-        while (it != end) {
-          auto location = get_location();
-
-          if (!(group = consumeTokenGroups(comment_tok, SpaceHandling::Keep)).empty()) {
-            auto pre_space = parsePreSpace(group[1]);
-            auto content = group[2];
-            auto post_space = parsePostSpace(group[3]);
-            tokens.push_back(std::make_unique<CommentTemplateToken>(location, pre_space, post_space, content));
-          } else if (!(group = consumeTokenGroups(expr_open_regex, SpaceHandling::Keep)).empty()) {
-            auto pre_space = parsePreSpace(group[1]);
-            auto expr = parseExpression();
+      auto maybeDeferBody = [&](bool always, SpaceHandling body_pre_space) {
+        if (!options.lazy_bodies) return;
+        SpaceHandling body_post_space;
+        auto body_end = findBodyEnd(body_post_space);
+        if (!always && (size_t) std::distance(it, body_end) < options.lazy_branch_min_size) return;
+        tokens.push_back(std::make_unique<LazyBodyTemplateToken>(get_location(), std::distance(start, body_end), body_pre_space, body_post_space));
+        it = body_end;
+      };
 
-            if ((group = consumeTokenGroups(expr_close_regex)).empty()) {
-              throw std::runtime_error("Expected closing expression tag");
-            }
+      while (it != end) {
+        MINJA_CHECK();
+        auto location = get_location();
 
-            auto post_space = parsePostSpace(group[1]);
-            tokens.push_back(std::make_unique<ExpressionTemplateToken>(location, pre_space, post_space, std::move(expr)));
-          } else if (!(group = consumeTokenGroups(block_open_regex, SpaceHandling::Keep)).empty()) {
-            auto pre_space = parsePreSpace(group[1]);
+        if (!(group = consumeTokenGroups(comment_tok, SpaceHandling::Keep)).empty()) {
+          auto pre_space = parsePreSpace(group[1]);
+          auto content = group[2];
+          auto post_space = parsePostSpace(group[3]);
+          tokens.push_back(std::make_unique<CommentTemplateToken>(location, pre_space, post_space, content));
+        } else if (!(group = consumeTokenGroups(expr_open_regex, SpaceHandling::Keep)).empty()) {
+          auto pre_space = parsePreSpace(group[1]);
+          auto expr = parseExpression();
+
+          if ((group = consumeTokenGroups(expr_close_regex)).empty()) {
+            MINJA_THROW(std::runtime_error("Expected closing expression tag"));
+          }
 
-            std::string keyword;
+          auto post_space = parsePostSpace(group[1]);
+          tokens.push_back(std::make_unique<ExpressionTemplateToken>(location, pre_space, post_space, std::move(expr)));
+        } else if (!(group = consumeTokenGroups(block_open_regex, SpaceHandling::Keep)).empty()) {
+          auto pre_space = parsePreSpace(group[1]);
 
-            auto parseBlockClose = [&]() -> SpaceHandling {
-              if ((group = consumeTokenGroups(block_close_regex)).empty()) throw std::runtime_error("Expected closing block tag");
-              return parsePostSpace(group[1]);
-            };
+          std::string keyword;
 
-            if ((keyword = consumeToken(block_keyword_tok)).empty()) throw std::runtime_error("Expected block keyword");
-
-            if (keyword == "if") {
-              auto condition = parseExpression();
-              if (!condition) throw std::runtime_error("Expected condition in if block");
-
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<IfTemplateToken>(location, pre_space, post_space, std::move(condition)));
-            } else if (keyword == "elif") {
-              auto condition = parseExpression();
-              if (!condition) throw std::runtime_error("Expected condition in elif block");
-
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<ElifTemplateToken>(location, pre_space, post_space, std::move(condition)));
-            } else if (keyword == "else") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<ElseTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "endif") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<EndIfTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "for") {
-              static std::regex recursive_tok(R"(recursive\b)");
-              static std::regex if_tok(R"(if\b)");
-
-              auto varnames = parseVarNames();
-              static std::regex in_tok(R"(in\b)");
-              if (consumeToken(in_tok).empty()) throw std::runtime_error("Expected 'in' keyword in for block");
-              auto iterable = parseExpression(/* allow_if_expr = */ false);
-              if (!iterable) throw std::runtime_error("Expected iterable in for block");
-
-              std::shared_ptr<Expression> condition;
-              if (!consumeToken(if_tok).empty()) {
-                condition = parseExpression();
-              }
-              auto recursive = !consumeToken(recursive_tok).empty();
-
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<ForTemplateToken>(location, pre_space, post_space, std::move(varnames), std::move(iterable), std::move(condition), recursive));
-            } else if (keyword == "endfor") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<EndForTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "generation") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<GenerationTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "endgeneration") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<EndGenerationTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "set") {
-              static std::regex namespaced_var_regex(R"((\w+)\s*\.\s*(\w+))");
-
-              std::string ns;
-              std::vector<std::string> var_names;
-              std::shared_ptr<Expression> value;
-              if (!(group = consumeTokenGroups(namespaced_var_regex)).empty()) {
-                ns = group[1];
-                var_names.push_back(group[2]);
-
-                if (consumeToken("=").empty()) throw std::runtime_error("Expected equals sign in set block");
+          auto parseBlockClose = [&]() -> SpaceHandling {
+            if ((group = consumeTokenGroups(block_close_regex)).empty()) MINJA_THROW(std::runtime_error("Expected closing block tag"));
+            return parsePostSpace(group[1]);
+          };
 
-                value = parseExpression();
-                if (!value) throw std::runtime_error("Expected value in set block");
-              } else {
-                var_names = parseVarNames();
+          if ((keyword = consumeToken(block_keyword_tok)).empty()) MINJA_THROW(std::runtime_error("Expected block keyword"));
+
+          if (keyword == "if") {
+            auto condition = parseExpression();
+            if (!condition) MINJA_THROW(std::runtime_error("Expected condition in if block"));
+
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<IfTemplateToken>(location, pre_space, post_space, std::move(condition)));
+            maybeDeferBody(/* always= */ false, post_space);
+          } else if (keyword == "elif") {
+            auto condition = parseExpression();
+            if (!condition) MINJA_THROW(std::runtime_error("Expected condition in elif block"));
+
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<ElifTemplateToken>(location, pre_space, post_space, std::move(condition)));
+            maybeDeferBody(/* always= */ false, post_space);
+          } else if (keyword == "else") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<ElseTemplateToken>(location, pre_space, post_space));
+            maybeDeferBody(/* always= */ false, post_space);
+          } else if (keyword == "endif") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<EndIfTemplateToken>(location, pre_space, post_space));
+          } else if (keyword == "for") {
+            static std::regex recursive_tok(R"(recursive\b)");
+            static std::regex if_tok(R"(if\b)");
+
+            auto varnames = parseVarNames();
+            static std::regex in_tok(R"(in\b)");
+            if (consumeToken(in_tok).empty()) MINJA_THROW(std::runtime_error("Expected 'in' keyword in for block"));
+            auto iterable = parseExpression(/* allow_if_expr = */ false);
+            if (!iterable) MINJA_THROW(std::runtime_error("Expected iterable in for block"));
+
+            std::shared_ptr<Expression> condition;
+            if (!consumeToken(if_tok).empty()) {
+              condition = parseExpression();
+            }
+            auto recursive = !consumeToken(recursive_tok).empty();
+
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<ForTemplateToken>(location, pre_space, post_space, std::move(varnames), std::move(iterable), std::move(condition), recursive));
+          } else if (keyword == "endfor") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<EndForTemplateToken>(location, pre_space, post_space));
+          } else if (keyword == "generation") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<GenerationTemplateToken>(location, pre_space, post_space));
+          } else if (keyword == "endgeneration") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<EndGenerationTemplateToken>(location, pre_space, post_space));
+          } else if (keyword == "set") {
+            static std::regex namespaced_var_regex(R"((\w+)\s*\.\s*(\w+))");
+
+            std::string ns;
+            std::vector<std::string> var_names;
+            std::shared_ptr<Expression> value;
+            if (!(group = consumeTokenGroups(namespaced_var_regex)).empty()) {
+              ns = group[1];
+              var_names.push_back(group[2]);
+
+              if (consumeToken("=").empty()) MINJA_THROW(std::runtime_error("Expected equals sign in set block"));
+
+              value = parseExpression();
+              if (!value) MINJA_THROW(std::runtime_error("Expected value in set block"));
+            } else {
+              var_names = parseVarNames();
 
-                if (!consumeToken("=").empty()) {
-                  value = parseExpression();
-                  if (!value) throw std::runtime_error("Expected value in set block");
-                }
+              if (!consumeToken("=").empty()) {
+                value = parseExpression();
+                if (!value) MINJA_THROW(std::runtime_error("Expected value in set block"));
               }
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<SetTemplateToken>(location, pre_space, post_space, ns, var_names, std::move(value)));
-            } else if (keyword == "endset") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<EndSetTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "macro") {
-              auto macroname = parseIdentifier();
-              if (!macroname) throw std::runtime_error("Expected macro name in macro block");
-              auto params = parseParameters();
-
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<MacroTemplateToken>(location, pre_space, post_space, std::move(macroname), std::move(params)));
-            } else if (keyword == "endmacro") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<EndMacroTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "call") {
-              auto expr = parseExpression();
-              if (!expr) throw std::runtime_error("Expected expression in call block");
-
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<CallTemplateToken>(location, pre_space, post_space, std::move(expr)));
-            } else if (keyword == "endcall") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<EndCallTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "filter") {
-              auto filter = parseExpression();
-              if (!filter) throw std::runtime_error("Expected expression in filter block");
-
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<FilterTemplateToken>(location, pre_space, post_space, std::move(filter)));
-            } else if (keyword == "endfilter") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<EndFilterTemplateToken>(location, pre_space, post_space));
-            } else if (keyword == "break" || keyword == "continue") {
-              auto post_space = parseBlockClose();
-              tokens.push_back(std::make_unique<LoopControlTemplateToken>(location, pre_space, post_space, keyword == "break" ? LoopControlType::Break : LoopControlType::Continue));
-            } else {
-              throw std::runtime_error("Unexpected block: " + keyword);
-            }
-          } else if (std::regex_search(it, end, match, non_text_open_regex)) {
-            if (!match.position()) {
-                if (match[0] != "{#")
-                    throw std::runtime_error("Internal error: Expected a comment");
-                throw std::runtime_error("Missing end of comment tag");
-            }
-            auto text_end = it + match.position();
-            text = std::string(it, text_end);
-            it = text_end;
-            tokens.push_back(std::make_unique<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
+            }
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<SetTemplateToken>(location, pre_space, post_space, ns, var_names, std::move(value)));
+          } else if (keyword == "endset") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<EndSetTemplateToken>(location, pre_space, post_space));
+          } else if (keyword == "macro") {
+            auto macroname = parseIdentifier();
+            if (!macroname) MINJA_THROW(std::runtime_error("Expected macro name in macro block"));
+            auto params = parseParameters();
+
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<MacroTemplateToken>(location, pre_space, post_space, std::move(macroname), std::move(params)));
+            maybeDeferBody(/* always= */ true, post_space);
+          } else if (keyword == "endmacro") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<EndMacroTemplateToken>(location, pre_space, post_space));
+          } else if (keyword == "call") {
+            auto expr = parseExpression();
+            if (!expr) MINJA_THROW(std::runtime_error("Expected expression in call block"));
+
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<CallTemplateToken>(location, pre_space, post_space, std::move(expr)));
+          } else if (keyword == "endcall") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<EndCallTemplateToken>(location, pre_space, post_space));
+          } else if (keyword == "filter") {
+            auto filter = parseExpression();
+            if (!filter) MINJA_THROW(std::runtime_error("Expected expression in filter block"));
+
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<FilterTemplateToken>(location, pre_space, post_space, std::move(filter)));
+          } else if (keyword == "endfilter") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<EndFilterTemplateToken>(location, pre_space, post_space));
+          } else if (keyword == "break" || keyword == "continue") {
+            auto post_space = parseBlockClose();
+            tokens.push_back(std::make_unique<LoopControlTemplateToken>(location, pre_space, post_space, keyword == "break" ? LoopControlType::Break : LoopControlType::Continue));
           } else {
-            text = std::string(it, end);
-            it = end;
-            tokens.push_back(std::make_unique<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
+            MINJA_THROW(std::runtime_error("Unexpected block: " + keyword));
+          }
+        } else if (std::regex_search(it, end, match, non_text_open_regex)) {
+          if (!match.position()) {
+              if (match[0] != "{#")
+                  MINJA_THROW(std::runtime_error("Internal error: Expected a comment"));
+              MINJA_THROW(std::runtime_error("Missing end of comment tag"));
           }
+          auto text_end = it + match.position();
+          text = std::string(it, text_end);
+          it = text_end;
+          tokens.push_back(std::make_unique<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
+        } else {
+          text = std::string(it, end);
+          it = end;
+          tokens.push_back(std::make_unique<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
         }
-        return tokens;
-      } catch (const std::exception & e) {
-        throw std::runtime_error(e.what() + error_location_suffix(*template_str, std::distance(start, it)));
       }
+      return tokens;
     }
 
     std::shared_ptr<TemplateNode> parseTemplate(
@@ -2560,6 +5862,7 @@ private:
           bool fully = false) const {
         std::vector<std::shared_ptr<TemplateNode>> children;
         while (it != end) {
+          MINJA_CHECK();
           const auto start = it;
           const auto & token = *(it++);
           if (auto if_token = dynamic_cast<IfTemplateToken*>(token.get())) {
@@ -2575,7 +5878,7 @@ private:
                 cascade.emplace_back(nullptr, parseTemplate(begin, ++it, end));
               }
               if (it == end || (*(it++))->type != TemplateToken::Type::EndIf) {
-                  throw unterminated(**start);
+                  MINJA_THROW(unterminated(**start));
               }
               children.emplace_back(std::make_shared<IfNode>(token->location, std::move(cascade)));
           } else if (auto for_token = dynamic_cast<ForTemplateToken*>(token.get())) {
@@ -2585,16 +5888,27 @@ private:
                 else_body = parseTemplate(begin, ++it, end);
               }
               if (it == end || (*(it++))->type != TemplateToken::Type::EndFor) {
-                  throw unterminated(**start);
+                  MINJA_THROW(unterminated(**start));
+              }
+              auto for_node = std::make_shared<ForNode>(token->location, std::move(for_token->var_names), std::move(for_token->iterable), std::move(for_token->condition), std::move(body), for_token->recursive, std::move(else_body));
+              if (options.memoize_loops) {
+                  for_node->enable_memoization(options.loop_memo_max_bytes, macros);
               }
-              children.emplace_back(std::make_shared<ForNode>(token->location, std::move(for_token->var_names), std::move(for_token->iterable), std::move(for_token->condition), std::move(body), for_token->recursive, std::move(else_body)));
+              if (options.parallel_loop_min_items) {
+                  for_node->enable_parallelism(options.parallel_loop_min_items, macros);
+              }
+              children.emplace_back(std::move(for_node));
           } else if (dynamic_cast<GenerationTemplateToken*>(token.get())) {
               auto body = parseTemplate(begin, it, end);
               if (it == end || (*(it++))->type != TemplateToken::Type::EndGeneration) {
-                  throw unterminated(**start);
+                  MINJA_THROW(unterminated(**start));
+              }
+              // Otherwise a no-op: `{% generation %}` wraps generated tokens for masking, only used for training.
+              if (options.generation_spans) {
+                  children.emplace_back(std::make_shared<GenerationNode>(token->location, std::move(body)));
+              } else {
+                  children.emplace_back(std::move(body));
               }
-              // Treat as a no-op, as our scope is templates for inference, not training (`{% generation %}` wraps generated tokens for masking).
-              children.emplace_back(std::move(body));
           } else if (auto text_token = dynamic_cast<TextTemplateToken*>(token.get())) {
               SpaceHandling pre_space = (it - 1) != begin ? (*(it - 2))->post_space : SpaceHandling::Keep;
               SpaceHandling post_space = it != end ? (*it)->pre_space : SpaceHandling::Keep;
@@ -2634,31 +5948,35 @@ private:
             } else {
               auto value_template = parseTemplate(begin, it, end);
               if (it == end || (*(it++))->type != TemplateToken::Type::EndSet) {
-                  throw unterminated(**start);
+                  MINJA_THROW(unterminated(**start));
               }
-              if (!set_token->ns.empty()) throw std::runtime_error("Namespaced set not supported in set with template value");
-              if (set_token->var_names.size() != 1) throw std::runtime_error("Structural assignment not supported in set with template value");
+              if (!set_token->ns.empty()) MINJA_THROW(std::runtime_error("Namespaced set not supported in set with template value"));
+              if (set_token->var_names.size() != 1) MINJA_THROW(std::runtime_error("Structural assignment not supported in set with template value"));
               auto & name = set_token->var_names[0];
               children.emplace_back(std::make_shared<SetTemplateNode>(token->location, name, std::move(value_template)));
             }
           } else if (auto macro_token = dynamic_cast<MacroTemplateToken*>(token.get())) {
               auto body = parseTemplate(begin, it, end);
               if (it == end || (*(it++))->type != TemplateToken::Type::EndMacro) {
-                  throw unterminated(**start);
+                  MINJA_THROW(unterminated(**start));
               }
-              children.emplace_back(std::make_shared<MacroNode>(token->location, std::move(macro_token->name), std::move(macro_token->params), std::move(body)));
+              auto macro_node = std::make_shared<MacroNode>(token->location, std::move(macro_token->name), std::move(macro_token->params), std::move(body));
+              macros[macro_node->get_name()].push_back(macro_node.get());
+              children.emplace_back(std::move(macro_node));
           } else if (auto call_token = dynamic_cast<CallTemplateToken*>(token.get())) {
             auto body = parseTemplate(begin, it, end);
             if (it == end || (*(it++))->type != TemplateToken::Type::EndCall) {
-                throw unterminated(**start);
+                MINJA_THROW(unterminated(**start));
             }
             children.emplace_back(std::make_shared<CallNode>(token->location, std::move(call_token->expr), std::move(body)));
           } else if (auto filter_token = dynamic_cast<FilterTemplateToken*>(token.get())) {
               auto body = parseTemplate(begin, it, end);
               if (it == end || (*(it++))->type != TemplateToken::Type::EndFilter) {
-                  throw unterminated(**start);
+                  MINJA_THROW(unterminated(**start));
               }
               children.emplace_back(std::make_shared<FilterNode>(token->location, std::move(filter_token->filter), std::move(body)));
+          } else if (auto lazy_token = dynamic_cast<LazyBodyTemplateToken*>(token.get())) {
+              children.emplace_back(std::make_shared<LazyTemplateNode>(token->location, lazy_token->end_pos, options, lazy_token->body_pre_space, lazy_token->body_post_space));
           } else if (dynamic_cast<CommentTemplateToken*>(token.get())) {
               // Ignore comments
           } else if (auto ctrl_token = dynamic_cast<LoopControlTemplateToken*>(token.get())) {
@@ -2675,11 +5993,11 @@ private:
               it--;  // unconsume the token
               break;  // exit the loop
           } else {
-              throw unexpected(**(it-1));
+              MINJA_THROW(unexpected(**(it-1)));
           }
         }
         if (fully && it != end) {
-            throw unexpected(**it);
+            MINJA_THROW(unexpected(**it));
         }
         if (children.empty()) {
           return std::make_shared<TextNode>(Location { template_str, 0 }, std::string());
@@ -2693,16 +6011,65 @@ private:
 public:
 
     static std::shared_ptr<TemplateNode> parse(const std::string& template_str, const Options & options) {
-        Parser parser(std::make_shared<std::string>(normalize_newlines(template_str)), options);
+        ParserImpl parser(std::make_shared<std::string>(normalize_newlines(template_str)), options);
         auto tokens = parser.tokenize();
+        MINJA_CHECK();
         TemplateTokenIterator begin = tokens.begin();
         auto it = begin;
         TemplateTokenIterator end = tokens.end();
-        return parser.parseTemplate(begin, it, end, /* fully= */ true);
+        auto root = parser.parseTemplate(begin, it, end, /* fully= */ true);
+        MINJA_CHECK();
+        return root;
+    }
+
+private:
+    static std::shared_ptr<TemplateNode> parseLazyBody(const std::shared_ptr<std::string> & template_str, const Options & options,
+                                                       size_t begin_pos, size_t end_pos, SpaceHandling body_pre_space, SpaceHandling body_post_space) {
+        ParserImpl parser(template_str, options);
+        parser.it = parser.start + begin_pos;
+        parser.end = parser.start + end_pos;
+        auto body_tokens = parser.tokenize();
+        MINJA_CHECK();
+
+        // Surround the body with stand-ins for its opening and closing tags, so that whitespace control applies as in an eager parse.
+        TemplateTokenVector tokens;
+        tokens.reserve(body_tokens.size() + 2);
+        tokens.push_back(std::make_unique<CommentTemplateToken>(Location { template_str, begin_pos }, SpaceHandling::Keep, body_pre_space, std::string()));
+        for (auto & token : body_tokens) tokens.push_back(std::move(token));
+        tokens.push_back(std::make_unique<EndIfTemplateToken>(Location { template_str, end_pos }, body_post_space, SpaceHandling::Keep));
+
+        TemplateTokenIterator begin = tokens.begin();
+        auto it = begin + 1;
+        TemplateTokenIterator end = tokens.end();
+        auto body = parser.parseTemplate(begin, it, end);
+        MINJA_CHECK();
+        if (it != end - 1) {
+            MINJA_THROW(parser.unexpected(**it));
+        }
+        return body;
     }
 };
 
-static Value simple_function(const std::string & fn_name, const std::vector<std::string> & params, const std::function<Value(const std::shared_ptr<Context> &, Value & args)> & fn) {
+MINJA_INLINE std::shared_ptr<TemplateNode> Parser::parse(const std::string& template_str, const Options & options) {
+    detail::ErrorScope error_scope;
+    return ParserImpl::parse(template_str, options);
+}
+
+inline const std::shared_ptr<TemplateNode> & LazyTemplateNode::body() const {
+    if (!parsed_) {
+        std::lock_guard<std::mutex> lock(parse_mutex_);
+        if (!parsed_) {
+            auto body = ParserImpl::parseLazyBody(source_, options_, location().pos, end_pos_, body_pre_space_, body_post_space_);
+            if (body) {
+                body_ = std::move(body);
+                parsed_ = true;
+            }
+        }
+    }
+    return body_;
+}
+
+inline Value simple_function(const std::string & fn_name, const std::vector<std::string> & params, const std::function<Value(const std::shared_ptr<Context> &, Value & args)> & fn) {
   std::map<std::string, size_t> named_positions;
   for (size_t i = 0, n = params.size(); i < n; i++) named_positions[params[i]] = i;
 
@@ -2715,13 +6082,13 @@ static Value simple_function(const std::string & fn_name, const std::vector<std:
         args_obj.set(params[i], arg);
         provided_args[i] = true;
       } else {
-        throw std::runtime_error("Too many positional params for " + fn_name);
+        MINJA_THROW(std::runtime_error("Too many positional params for " + fn_name));
       }
     }
     for (auto & [name, value] : args.kwargs) {
       auto named_pos_it = named_positions.find(name);
       if (named_pos_it == named_positions.end()) {
-        throw std::runtime_error("Unknown argument " + name + " for function " + fn_name);
+        MINJA_THROW(std::runtime_error("Unknown argument " + name + " for function " + fn_name));
       }
       provided_args[named_pos_it->second] = true;
       args_obj.set(name, value);
@@ -2730,21 +6097,21 @@ static Value simple_function(const std::string & fn_name, const std::vector<std:
   });
 }
 
-inline std::shared_ptr<Context> Context::builtins() {
+MINJA_INLINE std::shared_ptr<Context> Context::builtins() {
   auto globals = Value::object();
 
   globals.set("raise_exception", simple_function("raise_exception", { "message" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-    throw std::runtime_error(args.at("message").get<std::string>());
+    MINJA_THROW(std::runtime_error(args.get("message").get<std::string>()));
   }));
   globals.set("tojson", simple_function("tojson", { "value", "indent", "ensure_ascii" }, [](const std::shared_ptr<Context> &, Value & args) {
-    return Value(args.at("value").dump(args.get<int64_t>("indent", -1), /* to_json= */ true));
+    return Value(args.get("value").dump(args.get<int64_t>("indent", -1), /* to_json= */ true));
   }));
-  globals.set("items", simple_function("items", { "object" }, [](const std::shared_ptr<Context> &, Value & args) {
+  globals.set("items", simple_function("items", { "object" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
     auto items = Value::array();
     if (args.contains("object")) {
-      auto & obj = args.at("object");
+      auto obj = args.get("object");
       if (!obj.is_object()) {
-        throw std::runtime_error("Can only get item pairs from a mapping");
+        MINJA_THROW(std::runtime_error("Can only get item pairs from a mapping"));
       }
       for (auto & key : obj.keys()) {
         items.push_back(Value::array({key, obj.at(key)}));
@@ -2752,29 +6119,29 @@ inline std::shared_ptr<Context> Context::builtins() {
     }
     return items;
   }));
-  globals.set("first", simple_function("first", { "items" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto items = args.at("items");
-    if (!items.is_array()) throw std::runtime_error("object is not a list");
+  globals.set("first", simple_function("first", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
+    auto items = args.get("items");
+    if (!items.is_array()) MINJA_THROW(std::runtime_error("object is not a list"));
     if (items.empty()) return Value();
     return items.at(0);
   }));
-  globals.set("last", simple_function("last", { "items" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto items = args.at("items");
-    if (!items.is_array()) throw std::runtime_error("object is not a list");
+  globals.set("last", simple_function("last", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
+    auto items = args.get("items");
+    if (!items.is_array()) MINJA_THROW(std::runtime_error("object is not a list"));
     if (items.empty()) return Value();
     return items.at(items.size() - 1);
   }));
   globals.set("trim", simple_function("trim", { "text" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto & text = args.at("text");
+    auto text = args.get("text");
     return text.is_null() ? text : Value(strip(text.get<std::string>()));
   }));
   globals.set("capitalize", simple_function("capitalize", { "text" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto & text = args.at("text");
+    auto text = args.get("text");
     return text.is_null() ? text : Value(capitalize(text.get<std::string>()));
   }));
   auto char_transform_function = [](const std::string & name, const std::function<char(char)> & fn) {
     return simple_function(name, { "text" }, [=](const std::shared_ptr<Context> &, Value & args) {
-      auto text = args.at("text");
+      auto text = args.get("text");
       if (text.is_null()) return text;
       std::string res;
       auto str = text.get<std::string>();
@@ -2784,8 +6151,9 @@ inline std::shared_ptr<Context> Context::builtins() {
   };
   globals.set("lower", char_transform_function("lower", ::tolower));
   globals.set("upper", char_transform_function("upper", ::toupper));
-  globals.set("default", Value::callable([=](const std::shared_ptr<Context> &, ArgumentsValue & args) {
+  globals.set("default", Value::callable([=](const std::shared_ptr<Context> &, ArgumentsValue & args) -> Value {
     args.expectArgs("default", {2, 3}, {0, 1});
+    MINJA_CHECK();
     auto & value = args.args[0];
     auto & default_value = args.args[1];
     bool boolean = false;
@@ -2800,7 +6168,7 @@ inline std::shared_ptr<Context> Context::builtins() {
     return boolean ? (value.to_bool() ? value : default_value) : value.is_null() ? default_value : value;
   }));
   auto escape = simple_function("escape", { "text" }, [](const std::shared_ptr<Context> &, Value & args) {
-    return Value(html_escape(args.at("text").get<std::string>()));
+    return Value(html_escape(args.get("text").get<std::string>()));
   });
   globals.set("e", escape);
   globals.set("escape", escape);
@@ -2814,14 +6182,14 @@ inline std::shared_ptr<Context> Context::builtins() {
       }
       return sep;
     });
-    return Value(html_escape(args.at("text").get<std::string>()));
+    return Value(html_escape(args.get("text").get<std::string>()));
   }));
   globals.set("count", simple_function("count", { "items" }, [](const std::shared_ptr<Context> &, Value & args) {
-    return Value((int64_t) args.at("items").size());
+    return Value((int64_t) args.get("items").size());
   }));
-  globals.set("dictsort", simple_function("dictsort", { "value" }, [](const std::shared_ptr<Context> &, Value & args) {
-    if (args.size() != 1) throw std::runtime_error("dictsort expects exactly 1 argument (TODO: fix implementation)");
-    auto & value = args.at("value");
+  globals.set("dictsort", simple_function("dictsort", { "value" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
+    if (args.size() != 1) MINJA_THROW(std::runtime_error("dictsort expects exactly 1 argument (TODO: fix implementation)"));
+    auto value = args.get("value");
     auto keys = value.keys();
     std::sort(keys.begin(), keys.end());
     auto res = Value::array();
@@ -2831,8 +6199,8 @@ inline std::shared_ptr<Context> Context::builtins() {
     return res;
   }));
   globals.set("join", simple_function("join", { "items", "d" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto do_join = [](Value & items, const std::string & sep) {
-      if (!items.is_array()) throw std::runtime_error("object is not iterable: " + items.dump());
+    auto do_join = [](Value & items, const std::string & sep) -> Value {
+      if (!items.is_array()) MINJA_THROW(std::runtime_error("object is not iterable: " + items.dump()));
       std::ostringstream oss;
       auto first = true;
       for (size_t i = 0, n = items.size(); i < n; ++i) {
@@ -2844,53 +6212,54 @@ inline std::shared_ptr<Context> Context::builtins() {
     };
     auto sep = args.get<std::string>("d", "");
     if (args.contains("items")) {
-        auto & items = args.at("items");
+        auto items = args.get("items");
         return do_join(items, sep);
     } else {
-      return simple_function("", {"items"}, [sep, do_join](const std::shared_ptr<Context> &, Value & args) {
-        auto & items = args.at("items");
-        if (!items.to_bool() || !items.is_array()) throw std::runtime_error("join expects an array for items, got: " + items.dump());
+      return simple_function("", {"items"}, [sep, do_join](const std::shared_ptr<Context> &, Value & args) -> Value {
+        auto items = args.get("items");
+        if (!items.to_bool() || !items.is_array()) MINJA_THROW(std::runtime_error("join expects an array for items, got: " + items.dump()));
         return do_join(items, sep);
       });
     }
   }));
-  globals.set("namespace", Value::callable([=](const std::shared_ptr<Context> &, ArgumentsValue & args) {
+  globals.set("namespace", Value::callable([=](const std::shared_ptr<Context> &, ArgumentsValue & args) -> Value {
     auto ns = Value::object();
     args.expectArgs("namespace", {0, 0}, {0, (std::numeric_limits<size_t>::max)()});
+    MINJA_CHECK();
     for (auto & [name, value] : args.kwargs) {
       ns.set(name, value);
     }
     return ns;
   }));
   auto equalto = simple_function("equalto", { "expected", "actual" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return args.at("actual") == args.at("expected");
+      return args.get("actual") == args.get("expected");
   });
   globals.set("equalto", equalto);
   globals.set("==", equalto);
   globals.set("length", simple_function("length", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      auto & items = args.at("items");
+      auto items = args.get("items");
       return (int64_t) items.size();
   }));
   globals.set("safe", simple_function("safe", { "value" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return args.at("value").to_str();
+      return args.get("value").to_str();
   }));
   globals.set("string", simple_function("string", { "value" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return args.at("value").to_str();
+      return args.get("value").to_str();
   }));
   globals.set("int", simple_function("int", { "value" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return args.at("value").to_int();
+      return args.get("value").to_int();
   }));
   globals.set("list", simple_function("list", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      auto & items = args.at("items");
-      if (!items.is_array()) throw std::runtime_error("object is not iterable");
+      auto items = args.get("items");
+      if (!items.is_array()) MINJA_THROW(std::runtime_error("object is not iterable"));
       return items;
   }));
   globals.set("in", simple_function("in", { "item", "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return in(args.at("item"), args.at("items"));
+      return in(args.get("item"), args.get("items"));
   }));
   globals.set("unique", simple_function("unique", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      auto & items = args.at("items");
-      if (!items.is_array()) throw std::runtime_error("object is not iterable");
+      auto items = args.get("items");
+      if (!items.is_array()) MINJA_THROW(std::runtime_error("object is not iterable"));
       std::unordered_set<Value> seen;
       auto result = Value::array();
       for (size_t i = 0, n = items.size(); i < n; i++) {
@@ -2903,7 +6272,7 @@ inline std::shared_ptr<Context> Context::builtins() {
   }));
   auto make_filter = [](const Value & filter, Value & extra_args) -> Value {
     return simple_function("", { "value" }, [=](const std::shared_ptr<Context> & context, Value & args) {
-      auto & value = args.at("value");
+      auto value = args.get("value");
       ArgumentsValue actual_args;
       actual_args.args.emplace_back(value);
       for (size_t i = 0, n = extra_args.size(); i < n; i++) {
@@ -2913,19 +6282,20 @@ inline std::shared_ptr<Context> Context::builtins() {
     });
   };
   auto select_or_reject = [make_filter](bool is_select) {
-    return Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
+    return Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) -> Value {
       args.expectArgs(is_select ? "select" : "reject", {2, (std::numeric_limits<size_t>::max)()}, {0, 0});
+      MINJA_CHECK();
       auto & items = args.args[0];
       if (items.is_null()) {
         return Value::array();
       }
       if (!items.is_array()) {
-        throw std::runtime_error("object is not iterable: " + items.dump());
+        MINJA_THROW(std::runtime_error("object is not iterable: " + items.dump()));
       }
 
       auto filter_fn = context->get(args.args[1]);
       if (filter_fn.is_null()) {
-        throw std::runtime_error("Undefined filter: " + args.args[1].dump());
+        MINJA_THROW(std::runtime_error("Undefined filter: " + args.args[1].dump()));
       }
 
       auto filter_args = Value::array();
@@ -2940,6 +6310,7 @@ inline std::shared_ptr<Context> Context::builtins() {
         ArgumentsValue filter_args;
         filter_args.args.emplace_back(item);
         auto pred_res = filter.call(context, filter_args);
+        MINJA_CHECK();
         if (pred_res.to_bool() == (is_select ? true : false)) {
           res.push_back(item);
         }
@@ -2949,11 +6320,12 @@ inline std::shared_ptr<Context> Context::builtins() {
   };
   globals.set("select", select_or_reject(/* is_select= */ true));
   globals.set("reject", select_or_reject(/* is_select= */ false));
-  globals.set("map", Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
+  globals.set("map", Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) -> Value {
     auto res = Value::array();
     if (args.args.size() == 1 &&
       ((args.has_named("attribute") && args.kwargs.size() == 1) || (args.has_named("default") && args.kwargs.size() == 2))) {
       auto & items = args.args[0];
+      if (!items.is_array()) MINJA_THROW(std::runtime_error("object is not iterable: " + items.dump()));
       auto attr_name = args.get_named("attribute");
       auto default_value = args.get_named("default");
       for (size_t i = 0, n = items.size(); i < n; i++) {
@@ -2963,23 +6335,25 @@ inline std::shared_ptr<Context> Context::builtins() {
       }
     } else if (args.kwargs.empty() && args.args.size() >= 2) {
       auto fn = context->get(args.args[1]);
-      if (fn.is_null()) throw std::runtime_error("Undefined filter: " + args.args[1].dump());
+      if (fn.is_null()) MINJA_THROW(std::runtime_error("Undefined filter: " + args.args[1].dump()));
       ArgumentsValue filter_args { {Value()}, {} };
       for (size_t i = 2, n = args.args.size(); i < n; i++) {
         filter_args.args.emplace_back(args.args[i]);
       }
-      for (size_t i = 0, n = args.args[0].size(); i < n; i++) {
-        auto & item = args.args[0].at(i);
-        filter_args.args[0] = item;
+      auto & items = args.args[0];
+      if (!items.is_array()) MINJA_THROW(std::runtime_error("object is not iterable: " + items.dump()));
+      for (size_t i = 0, n = items.size(); i < n; i++) {
+        filter_args.args[0] = items.at(i);
         res.push_back(fn.call(context, filter_args));
+        MINJA_CHECK();
       }
     } else {
-      throw std::runtime_error("Invalid or unsupported arguments for map");
+      MINJA_THROW(std::runtime_error("Invalid or unsupported arguments for map"));
     }
     return res;
   }));
   globals.set("indent", simple_function("indent", { "text", "indent", "first" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto text = args.at("text").get<std::string>();
+    auto text = args.get("text").get<std::string>();
     auto first = args.get<bool>("first", false);
     std::string out;
     std::string indent(args.get<int64_t>("indent", 0), ' ');
@@ -2997,12 +6371,13 @@ inline std::shared_ptr<Context> Context::builtins() {
     return out;
   }));
   auto select_or_reject_attr = [](bool is_select) {
-    return Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
+    return Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) -> Value {
       args.expectArgs(is_select ? "selectattr" : "rejectattr", {2, (std::numeric_limits<size_t>::max)()}, {0, 0});
+      MINJA_CHECK();
       auto & items = args.args[0];
       if (items.is_null())
         return Value::array();
-      if (!items.is_array()) throw std::runtime_error("object is not iterable: " + items.dump());
+      if (!items.is_array()) MINJA_THROW(std::runtime_error("object is not iterable: " + items.dump()));
       auto attr_name = args.args[1].get<std::string>();
 
       bool has_test = false;
@@ -3011,7 +6386,7 @@ inline std::shared_ptr<Context> Context::builtins() {
       if (args.args.size() >= 3) {
         has_test = true;
         test_fn = context->get(args.args[2]);
-        if (test_fn.is_null()) throw std::runtime_error("Undefined test: " + args.args[2].dump());
+        if (test_fn.is_null()) MINJA_THROW(std::runtime_error("Undefined test: " + args.args[2].dump()));
         for (size_t i = 3, n = args.args.size(); i < n; i++) {
           test_args.args.emplace_back(args.args[i]);
         }
@@ -3024,7 +6399,9 @@ inline std::shared_ptr<Context> Context::builtins() {
         auto attr = item.get(attr_name);
         if (has_test) {
           test_args.args[0] = attr;
-          if (test_fn.call(context, test_args).to_bool() == (is_select ? true : false)) {
+          auto test_res = test_fn.call(context, test_args);
+          MINJA_CHECK();
+          if (test_res.to_bool() == (is_select ? true : false)) {
             res.push_back(item);
           }
         } else {
@@ -3036,7 +6413,7 @@ inline std::shared_ptr<Context> Context::builtins() {
   };
   globals.set("selectattr", select_or_reject_attr(/* is_select= */ true));
   globals.set("rejectattr", select_or_reject_attr(/* is_select= */ false));
-  globals.set("range", Value::callable([=](const std::shared_ptr<Context> &, ArgumentsValue & args) {
+  globals.set("range", Value::callable([=](const std::shared_ptr<Context> &, ArgumentsValue & args) -> Value {
     std::vector<int64_t> startEndStep(3);
     std::vector<bool> param_set(3);
     if (args.args.size() == 1) {
@@ -3059,17 +6436,17 @@ inline std::shared_ptr<Context> Context::builtins() {
       } else if (name == "step") {
         i = 2;
       } else {
-        throw std::runtime_error("Unknown argument " + name + " for function range");
+        MINJA_THROW(std::runtime_error("Unknown argument " + name + " for function range"));
       }
 
       if (param_set[i]) {
-        throw std::runtime_error("Duplicate argument " + name + " for function range");
+        MINJA_THROW(std::runtime_error("Duplicate argument " + name + " for function range"));
       }
       startEndStep[i] = value.get<int64_t>();
       param_set[i] = true;
     }
     if (!param_set[1]) {
-      throw std::runtime_error("Missing required argument 'end' for function range");
+      MINJA_THROW(std::runtime_error("Missing required argument 'end' for function range"));
     }
     int64_t start = param_set[0] ? startEndStep[0] : 0;
     int64_t end = startEndStep[1];
@@ -3091,8 +6468,10 @@ inline std::shared_ptr<Context> Context::builtins() {
   return std::make_shared<Context>(std::move(globals));
 }
 
-inline std::shared_ptr<Context> Context::make(Value && values, const std::shared_ptr<Context> & parent) {
+MINJA_INLINE std::shared_ptr<Context> Context::make(Value && values, const std::shared_ptr<Context> & parent) {
   return std::make_shared<Context>(values.is_null() ? Value::object() : std::move(values), parent);
 }
 
 }  // namespace minja
+
+#endif  // !defined(MINJA_COMPILED_LIB) || defined(MINJA_IMPLEMENTATION)
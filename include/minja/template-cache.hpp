@@ -0,0 +1,201 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "minja.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace minja {
+
+/*
+    Thread-safe cache of parsed templates, keyed by (source, Options), to use instead of calling
+    Parser::parse on every render:
+
+        static minja::TemplateCache cache;
+        auto root = cache.get_or_parse(source, options);
+        root->render(context);
+
+    Entries are spread over independently locked shards, each evicting its least recently used
+    entries beyond its share of the capacity. Templates are parsed outside of the locks, so a slow parse
+    never blocks lookups of other templates (concurrent misses on the same template may parse it twice,
+    the first one to finish wins). Parse errors are propagated as by Parser::parse and not cached
+    (without exceptions, get_or_parse returns null within a try_* call).
+
+    Returned roots are immutable and may be rendered concurrently; they stay valid after eviction.
+*/
+class TemplateCache {
+  public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        // Cumulated time spent in Parser::parse on misses (including failed parses).
+        std::chrono::nanoseconds parse_time {0};
+        size_t size = 0;
+    };
+
+  private:
+    struct Entry {
+        size_t hash;
+        std::string source;
+        Options options;
+        std::shared_ptr<TemplateNode> root;
+    };
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used first.
+        std::list<Entry> lru;
+        std::unordered_multimap<size_t, std::list<Entry>::iterator> index;
+    };
+
+    size_t shard_capacity_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    std::atomic<uint64_t> hits_ {0};
+    std::atomic<uint64_t> misses_ {0};
+    std::atomic<uint64_t> evictions_ {0};
+    std::atomic<int64_t> parse_time_ns_ {0};
+
+    static size_t hash(const std::string & source, const Options & options) {
+        auto h = std::hash<std::string>()(source);
+        size_t flags = (options.trim_blocks ? 1 : 0)
+                     | (options.lstrip_blocks ? 2 : 0)
+                     | (options.keep_trailing_newline ? 4 : 0)
+                     | (options.memoize_loops ? 8 : 0)
+                     | (options.lazy_bodies ? 16 | (options.lazy_branch_min_size << 5) : 0);
+        flags = (flags * 31 + options.parallel_loop_min_items) * 2 + (options.generation_spans ? 1 : 0);
+        return h ^ (std::hash<size_t>()(flags) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    }
+
+    Shard & shard_for(size_t h) {
+        // Use the high bits: the low ones also pick the buckets of the shard's index.
+        return *shards_[(h >> 16) % shards_.size()];
+    }
+
+    static std::list<Entry>::iterator find(Shard & shard, size_t h, const std::string & source, const Options & options) {
+        auto range = shard.index.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it) {
+            auto & entry = *it->second;
+            if (entry.options == options && entry.source == source) {
+                return it->second;
+            }
+        }
+        return shard.lru.end();
+    }
+
+  public:
+    // capacity: max number of cached templates (rounded up to a multiple of n_shards).
+    explicit TemplateCache(size_t capacity = 256, size_t n_shards = 16)
+        : shard_capacity_(std::max<size_t>(1, (capacity + std::max<size_t>(1, n_shards) - 1) / std::max<size_t>(1, n_shards)))
+    {
+        n_shards = std::max<size_t>(1, n_shards);
+        shards_.reserve(n_shards);
+        for (size_t i = 0; i < n_shards; i++) {
+            shards_.push_back(std::make_unique<Shard>());
+        }
+    }
+
+    TemplateCache(const TemplateCache &) = delete;
+    TemplateCache & operator=(const TemplateCache &) = delete;
+
+    std::shared_ptr<TemplateNode> get_or_parse(const std::string & source, const Options & options) {
+        auto h = hash(source, options);
+        auto & shard = shard_for(h);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = find(shard, h, source, options);
+            if (it != shard.lru.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it);
+                hits_++;
+                return it->root;
+            }
+        }
+        misses_++;
+
+        std::shared_ptr<TemplateNode> root;
+        {
+            // Also counts failed parses.
+            struct ParseTimer {
+                std::atomic<int64_t> & total_ns;
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                ~ParseTimer() { total_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(); }
+            } timer {parse_time_ns_};
+            root = Parser::parse(source, options);
+        }
+        if (!root) {
+            // Parse error within a try_* call without exceptions (see MINJA_NO_EXCEPTIONS): not cached.
+            return root;
+        }
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = find(shard, h, source, options);
+        if (it != shard.lru.end()) {
+            // Parsed concurrently by another thread: share its root.
+            shard.lru.splice(shard.lru.begin(), shard.lru, it);
+            return it->root;
+        }
+        shard.lru.push_front({h, source, options, root});
+        shard.index.emplace(h, shard.lru.begin());
+        while (shard.lru.size() > shard_capacity_) {
+            auto & victim = shard.lru.back();
+            auto range = shard.index.equal_range(victim.hash);
+            for (auto jt = range.first; jt != range.second; ++jt) {
+                if (&*jt->second == &victim) {
+                    shard.index.erase(jt);
+                    break;
+                }
+            }
+            shard.lru.pop_back();
+            evictions_++;
+        }
+        return root;
+    }
+
+    Stats stats() const {
+        Stats stats;
+        stats.hits = hits_;
+        stats.misses = misses_;
+        stats.evictions = evictions_;
+        stats.parse_time = std::chrono::nanoseconds(parse_time_ns_.load());
+        stats.size = size();
+        return stats;
+    }
+
+    size_t size() const {
+        size_t res = 0;
+        for (const auto & shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            res += shard->lru.size();
+        }
+        return res;
+    }
+
+    size_t capacity() const { return shard_capacity_ * shards_.size(); }
+
+    void clear() {
+        for (auto & shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->lru.clear();
+            shard->index.clear();
+        }
+    }
+};
+
+}  // namespace minja
@@ -0,0 +1,15 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+
+// Implementation of minja.hpp for the minja_impl library (see MINJA_COMPILED_LIB in minja.hpp).
+#ifndef MINJA_COMPILED_LIB
+#define MINJA_COMPILED_LIB
+#endif
+#define MINJA_IMPLEMENTATION
+#include "minja/minja.hpp"
@@ -8,13 +8,17 @@
 */
 // SPDX-License-Identifier: MIT
 #include "minja/chat-template.hpp"
+#include "minja/chat-template-registry.hpp"
 #include "gtest/gtest.h"
 #include <gtest/gtest.h>
 #include <gmock/gmock-matchers.h>
 
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
 
 using namespace minja;
 using namespace testing;
@@ -67,3 +71,435 @@ static std::string render(const std::string & template_str, const chat_template_
 TEST(ChatTemplateTest, SimpleCases) {
     EXPECT_THAT(render("{{ strftime_now('%Y-%m-%d %H:%M:%S') }}", {}, {}), MatchesRegex(R"([0-9]{4}-[0-9]{2}-[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2})"));
 }
+
+TEST(ChatTemplateTest, ApplyToSink) {
+    chat_template tmpl("{% for m in messages %}<|{{ m.role }}|>{{ m.content }}<|end|>\n{% endfor %}", "", "");
+    chat_template_inputs inputs;
+    inputs.messages = json::array({
+        {{"role", "user"}, {"content", std::string(500, 'u')}},
+        {{"role", "assistant"}, {"content", "ok"}},
+    });
+    minja::SegmentSink sink;
+    tmpl.apply(inputs, sink);
+    EXPECT_EQ(tmpl.apply(inputs), sink.str());
+    EXPECT_EQ(3u, sink.segments().size());
+}
+
+TEST(ChatTemplateTest, Placeholders) {
+    chat_template tmpl("{% for m in messages %}<|{{ m.role }}|>{{ m.content }}<|end|>\n{% endfor %}", "", "");
+    chat_template_inputs inputs;
+    inputs.messages = json::array({
+        {{"role", "user"}, {"content", "<attachment>"}},
+    });
+    inputs.placeholders["<attachment>"] = minja::Value::stream([](const minja::Value::ChunkCallback & callback) {
+        callback("a");
+        callback("b");
+    });
+    EXPECT_EQ("<|user|>ab<|end|>\n", tmpl.apply(inputs));
+}
+
+TEST(ChatTemplateTest, History) {
+    chat_template tmpl("{% for m in messages %}<|{{ m.role }}|>{{ m.content }}<|end|>\n{% endfor %}", "", "");
+    chat_template_inputs inputs;
+    inputs.messages = json::array();
+    PersistentArray history;
+    for (int i = 0; i < 3; i++) {
+        json message {{"role", i % 2 ? "assistant" : "user"}, {"content", "message " + std::to_string(i)}};
+        inputs.messages.push_back(message);
+        history = history.push_back(to_value(message));
+    }
+    auto expected = tmpl.apply(inputs);
+    inputs.history = history;
+    EXPECT_THAT([&]() { tmpl.apply(inputs); },
+        testing::Throws<std::runtime_error>(Property(&std::runtime_error::what, testing::HasSubstr("both messages and history"))));
+    inputs.messages = json();
+    EXPECT_EQ(expected, tmpl.apply(inputs));
+
+    // Polyfilled like messages.
+    chat_template no_system("{% for m in messages %}{% if m.role == 'system' %}{{ raise_exception('no system') }}{% endif %}<|{{ m.role }}|>{{ m.content }}\n{% endfor %}", "", "");
+    inputs.history = PersistentArray().push_back(to_value({{"role", "system"}, {"content", "sys"}})).push_back(to_value({{"role", "user"}, {"content", "hi"}}));
+    EXPECT_EQ("<|user|>sys\nhi\n", no_system.apply(inputs));
+
+    // Polyfills don't change the history's messages.
+    json messages {
+        {{"role", "user"}, {"content", "hi"}},
+        {{"role", "assistant"}, {"tool_calls", {{{"type", "function"}, {"function", {{"name", "f"}, {"arguments", "{\"x\": {}}"}}}}}}},
+    };
+    inputs.history = PersistentArray().push_back(to_value(messages[0])).push_back(to_value(messages[1]));
+    EXPECT_EQ("<|user|>hi\n<|assistant|>{\n  \"tool_calls\": [\n    {\n      \"name\": \"f\",\n      \"arguments\": {\n        \"x\": {}\n      }\n    }\n  ]\n}\n",
+        no_system.apply(inputs));
+    EXPECT_EQ("{\"x\": {}}", inputs.history.at(1).at("tool_calls").at(0).at("function").at("arguments").get<std::string>());
+    auto history_prompt = no_system.apply(inputs);
+    inputs.history = PersistentArray();
+    inputs.messages = messages;
+    EXPECT_EQ(history_prompt, no_system.apply(inputs));
+}
+
+TEST(ChatTemplateTest, ApplyFromCheckpoint) {
+    chat_template tmpl(
+        "{{ bos_token }}{% if messages[0].role == 'system' %}{% set loop_messages = messages[1:] %}<<{{ messages[0].content }}>>{% else %}{% set loop_messages = messages %}{% endif %}"
+        "{% for message in loop_messages %}<|{{ message.role }}|>{{ message.content }}<|end|>\n{% endfor %}"
+        "{% if add_generation_prompt %}<|assistant|>{% endif %}", "<s>", "</s>");
+    chat_template_inputs inputs;
+    inputs.messages = json::array({{{"role", "system"}, {"content", "sys"}}});
+    for (int i = 0; i < 6; i++) {
+        inputs.messages.push_back({{"role", i % 2 ? "assistant" : "user"}, {"content", "message " + std::to_string(i)}});
+    }
+    std::shared_ptr<RenderCheckpoint> checkpoint;
+    EXPECT_EQ(tmpl.apply(inputs), tmpl.apply_checkpoint(inputs, 5, checkpoint));
+    ASSERT_TRUE(checkpoint);
+
+    auto next = inputs;
+    next.messages.erase(next.messages.begin() + 5, next.messages.end());
+    next.messages.push_back({{"role", "user"}, {"content", "other"}});
+    std::string out;
+    minja::StringSink sink(out);
+    EXPECT_TRUE(tmpl.apply_from(*checkpoint, next, sink));
+    EXPECT_EQ(tmpl.apply(next), out);
+
+    // Different system prompt or extra context.
+    auto other_system = next;
+    other_system.messages[0]["content"] = "other";
+    auto other_context = next;
+    other_context.extra_context = {{"x", 1}};
+    for (const auto & other : {other_system, other_context}) {
+        out.clear();
+        EXPECT_FALSE(tmpl.apply_from(*checkpoint, other, sink));
+        EXPECT_EQ("", out);
+    }
+}
+
+TEST(ChatTemplateTest, ApplyTruncated) {
+    chat_template tmpl("{% for m in messages %}<|{{ m.role }}|>{{ m.content }}<|end|>\n{% endfor %}", "", "");
+    chat_template_inputs inputs;
+    inputs.messages = json::array({{{"role", "system"}, {"content", "sys"}}});
+    for (int i = 0; i < 20; i++) {
+        inputs.messages.push_back({{"role", "user"}, {"content", "question " + std::string(i * 7 % 30, 'q')}});
+        inputs.messages.push_back({{"role", "assistant"}, {"content", "answer " + std::string(i * 13 % 50, 'a')}});
+    }
+    inputs.messages.push_back({{"role", "user"}, {"content", "last"}});
+    const auto full = tmpl.apply(inputs);
+
+    auto expected_for = [&](size_t budget, const std::function<size_t(const std::string &)> & length) {
+        // Oldest turns dropped one at a time until it fits.
+        for (size_t start = 1; start < inputs.messages.size(); start += 2) {
+            auto truncated = inputs;
+            truncated.messages = json::array({inputs.messages[0]});
+            for (size_t i = start; i < inputs.messages.size(); i++) {
+                truncated.messages.push_back(inputs.messages[i]);
+            }
+            auto prompt = tmpl.apply(truncated);
+            if (length(prompt) <= budget) {
+                return std::make_pair(prompt, start - 1);
+            }
+        }
+        return std::make_pair(std::string(), (size_t) 0);
+    };
+
+    chat_template_truncation truncation;
+    for (size_t budget : {full.size(), full.size() / 2, (size_t) 300, (size_t) 100}) {
+        truncation.budget = budget;
+        auto res = tmpl.apply_truncated(inputs, truncation);
+        auto expected = expected_for(budget, [](const std::string & prompt) { return prompt.size(); });
+        EXPECT_TRUE(res.fits);
+        EXPECT_EQ(expected.first, res.prompt) << budget;
+        EXPECT_EQ(expected.second, res.dropped_messages) << budget;
+        EXPECT_EQ(res.prompt.size(), res.length);
+        EXPECT_LE(res.renders, 7u) << budget;
+    }
+
+    // System and last user messages are kept even if they don't fit.
+    truncation.budget = 10;
+    auto res = tmpl.apply_truncated(inputs, truncation);
+    EXPECT_FALSE(res.fits);
+    EXPECT_EQ("<|system|>sys<|end|>\n<|user|>last<|end|>\n", res.prompt);
+    EXPECT_EQ(40u, res.dropped_messages);
+
+    // Budget in tokens (here, words).
+    truncation.budget = 12;
+    truncation.count_tokens = [](const std::string & prompt) {
+        return (size_t) std::count(prompt.begin(), prompt.end(), ' ') + 1;
+    };
+    res = tmpl.apply_truncated(inputs, truncation);
+    auto expected = expected_for(truncation.budget, truncation.count_tokens);
+    EXPECT_TRUE(res.fits);
+    EXPECT_EQ(expected.first, res.prompt);
+    EXPECT_EQ(expected.second, res.dropped_messages);
+    EXPECT_EQ(truncation.count_tokens(res.prompt), res.length);
+
+    // Histories are truncated the same way.
+    auto history_inputs = inputs;
+    history_inputs.messages = json();
+    for (const auto & message : inputs.messages) {
+        history_inputs.history = history_inputs.history.push_back(minja::Value(message));
+    }
+    truncation.count_tokens = nullptr;
+    for (size_t budget : {full.size(), (size_t) 300, (size_t) 10}) {
+        truncation.budget = budget;
+        auto from_messages = tmpl.apply_truncated(inputs, truncation);
+        auto from_history = tmpl.apply_truncated(history_inputs, truncation);
+        EXPECT_EQ(from_messages.prompt, from_history.prompt) << budget;
+        EXPECT_EQ(from_messages.dropped_messages, from_history.dropped_messages) << budget;
+        EXPECT_EQ(from_messages.fits, from_history.fits) << budget;
+    }
+    EXPECT_EQ(inputs.messages.size(), history_inputs.history.size());
+}
+
+TEST(ChatTemplateTest, MessageSpans) {
+    chat_template_inputs inputs;
+    inputs.messages = json::array({
+        {{"role", "system"}, {"content", "sys"}},
+        {{"role", "user"}, {"content", "hi"}},
+        {{"role", "assistant"}, {"content", "hello"}},
+        {{"role", "user"}, {"content", "hi"}},
+    });
+    auto spans_of = [&](const std::string & source) {
+        chat_template tmpl(source, "<s>", "</s>");
+        std::vector<MessageSpan> spans;
+        auto prompt = tmpl.apply_message_spans(inputs, spans);
+        EXPECT_EQ(tmpl.apply(inputs), prompt);
+        std::vector<std::string> res;
+        for (const auto & span : spans) {
+            res.push_back(std::to_string(span.message_index) + ":" + prompt.substr(span.begin, span.end - span.begin));
+        }
+        return res;
+    };
+    EXPECT_EQ((std::vector<std::string> {"0:[system]sys", "1:[user]hi", "2:[assistant]hello", "3:[user]hi"}),
+              spans_of("{{ bos_token }}{% for m in messages %}[{{ m.role }}]{{ m.content }}{% endfor %}{{ eos_token }}"));
+    EXPECT_EQ((std::vector<std::string> {"1:<user>hi", "2:<assistant>hello", "3:<user>hi"}),
+              spans_of("{% if messages[0].role == 'system' %}{{ messages[0].content }}|{% set loop_messages = messages[1:] %}{% else %}{% set loop_messages = messages %}{% endif %}"
+                       "{% for m in loop_messages %}<{{ m.role }}>{{ m.content }}{% endfor %}"));
+    // Without system role support, the system message is merged into the first user message by the polyfills.
+    EXPECT_EQ((std::vector<std::string> {"0:sys\nhi", "2:hi"}),
+              spans_of("{% for m in messages if m.role == 'user' %}{{ m.content }}{% endfor %}"));
+    EXPECT_EQ((std::vector<std::string> {}), spans_of("{{ messages | length }}"));
+    // Messages equal to previous ones keep their own index.
+    EXPECT_EQ((std::vector<std::string> {"3:<user>hi"}),
+              spans_of("{{ messages[0].content }}|{% set loop_messages = messages[2:] %}{% for m in loop_messages if m.role == 'user' %}<{{ m.role }}>{{ m.content }}{% endfor %}"));
+}
+
+TEST(ChatTemplateTest, GenerationSpans) {
+    chat_template tmpl(
+        "{% for m in messages %}<|{{ m.role }}|>\n"
+        "{% if m.role == 'assistant' %}{% generation %}{{ m.content }}<|end|>{% endgeneration %}{% else %}{{ m.content }}<|end|>{% endif %}\n"
+        "{% endfor %}", "", "");
+    chat_template_inputs inputs;
+    inputs.messages = json::array({
+        {{"role", "user"}, {"content", "hi"}},
+        {{"role", "assistant"}, {"content", "hello"}},
+        {{"role", "user"}, {"content", "bye"}},
+        {{"role", "assistant"}, {"content", "ciao"}},
+    });
+    std::vector<OutputSpan> spans;
+    auto prompt = tmpl.apply_generation_spans(inputs, spans);
+    EXPECT_EQ(tmpl.apply(inputs), prompt);
+    ASSERT_EQ(2u, spans.size());
+    EXPECT_EQ("hello<|end|>", prompt.substr(spans[0].begin, spans[0].end - spans[0].begin));
+    EXPECT_EQ("ciao<|end|>", prompt.substr(spans[1].begin, spans[1].end - spans[1].begin));
+}
+
+TEST(ChatTemplateTest, PrepareAndRender) {
+    chat_template tmpl("{% set n_messages = messages | length %}{{ bos_token }}{% for m in messages %}<|{{ m.role }}|>{{ m.content }}\n{% endfor %}{{ n_messages }}", "<s>", "</s>");
+    chat_template_inputs inputs;
+    inputs.messages = json::array({{{"role", "system"}, {"content", "sys"}}, {{"role", "user"}, {"content", "hi"}}});
+    auto expected = tmpl.apply(inputs);
+
+    auto prepared = tmpl.prepare(inputs);
+    ASSERT_TRUE(prepared);
+    std::vector<std::string> outputs(4);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < outputs.size(); i++) {
+        threads.emplace_back([&, i]() { outputs[i] = tmpl.render(prepared); });
+    }
+    for (auto & thread : threads) thread.join();
+    for (const auto & output : outputs) {
+        EXPECT_EQ(expected, output);
+    }
+    EXPECT_FALSE(prepared.context()->contains("n_messages"));
+
+    chat_template other("{{ messages | length }}", "", "");
+    EXPECT_THROW(other.render(prepared), std::runtime_error);
+    EXPECT_THROW(other.render(chat_template_prepared()), std::runtime_error);
+
+    // Renders of prepared inputs are captured too.
+    std::stringstream file;
+    tmpl.set_capture(std::make_shared<chat_template_capture>(file));
+    tmpl.render(tmpl.prepare(inputs));
+    auto replay = chat_template_replay::load(file);
+    ASSERT_EQ(1u, replay.requests.size());
+    EXPECT_EQ(chat_template_capture::hash(expected), replay.requests[0].output_hash);
+}
+
+TEST(ChatTemplateTest, Observer) {
+    struct recorder : chat_template_observer {
+        std::vector<std::string> events;
+        size_t output_bytes = 0;
+        void on_parse_begin(const chat_template &) override { events.push_back("parse_begin"); }
+        void on_parse_end(const chat_template &, std::chrono::nanoseconds) override { events.push_back("parse_end"); }
+        void on_caps_probe(const chat_template &, const char * probe, std::chrono::nanoseconds) override { events.push_back(std::string("probe:") + probe); }
+        void on_polyfill(const chat_template &, const char * polyfill) override { events.push_back(std::string("polyfill:") + polyfill); }
+        void on_render_begin(const chat_template &) override { events.push_back("render_begin"); }
+        void on_render_end(const chat_template &, size_t bytes, std::chrono::nanoseconds) override {
+            events.push_back("render_end");
+            output_bytes = bytes;
+        }
+        void on_error(const chat_template &, const std::string & error) override { events.push_back("error:" + error.substr(0, error.find(" at row"))); }
+    };
+    const std::string source = "{% for m in messages %}{% if m.role == 'system' %}{{ raise_exception('no system') }}{% endif %}<|{{ m.role }}|>{{ m.content }}\n{% endfor %}";
+    auto observer = std::make_shared<recorder>();
+    chat_template tmpl(source, "", "", observer);
+    ASSERT_GE(observer->events.size(), 4u);
+    EXPECT_EQ("parse_begin", observer->events[0]);
+    EXPECT_EQ("parse_end", observer->events[1]);
+    EXPECT_EQ("probe:requires_typed_content", observer->events[2]);
+    EXPECT_THAT(observer->events, Contains("probe:supports_tools"));
+    EXPECT_THAT(observer->events, Not(Contains("render_begin")));
+
+    observer->events.clear();
+    chat_template_inputs inputs;
+    inputs.messages = json::array({{{"role", "system"}, {"content", "sys"}}, {{"role", "user"}, {"content", "hi"}}});
+    auto prompt = tmpl.apply(inputs);
+    EXPECT_EQ((std::vector<std::string> {"render_begin", "polyfill:polyfill_system_role", "render_end"}), observer->events);
+    EXPECT_EQ(prompt.size(), observer->output_bytes);
+
+    observer->events.clear();
+    chat_template_options opts;
+    opts.apply_polyfills = false;
+    EXPECT_THROW(tmpl.apply(inputs, opts), std::runtime_error);
+    EXPECT_EQ((std::vector<std::string> {"render_begin", "error:no system"}), observer->events);
+
+    // The global observer also gets the parse errors, and the events of templates without their own observer.
+    auto global = std::make_shared<recorder>();
+    chat_template::set_global_observer(global);
+    EXPECT_THROW(chat_template("{% if messages %}", "", ""), std::runtime_error);
+    chat_template("{{ messages[0].content }}", "", "").apply(inputs);
+    observer->events.clear();
+    tmpl.apply(inputs);
+    chat_template::set_global_observer(nullptr);
+    tmpl.apply(inputs);
+    EXPECT_EQ("parse_begin", global->events[0]);
+    EXPECT_THAT(global->events[1], StartsWith("error:Unterminated if"));
+    EXPECT_EQ(2u, std::count(global->events.begin(), global->events.end(), "render_end"));
+    EXPECT_EQ(6u, observer->events.size());
+}
+
+TEST(ChatTemplateTest, CaptureAndReplay) {
+    chat_template tmpl("{{ bos_token }}{% for m in messages %}<|{{ m.role }}|>{{ m.content }}\n{% endfor %}{{ strftime_now('%Y') }}", "<s>", "</s>");
+    std::stringstream file;
+    tmpl.set_capture(std::make_shared<chat_template_capture>(file));
+
+    chat_template_inputs inputs;
+    inputs.messages = json::array({{{"role", "user"}, {"content", "hi"}}});
+    inputs.now = std::chrono::system_clock::from_time_t(0);
+    auto first = tmpl.apply(inputs);
+    inputs.messages.push_back({{"role", "assistant"}, {"content", "hello"}});
+    chat_template_options opts;
+    opts.use_bos_token = false;
+    auto second = tmpl.apply(inputs, opts);
+
+    auto redacted = std::make_shared<chat_template_capture>(file, chat_template_capture::redact_content);
+    tmpl.set_capture(redacted);
+    tmpl.apply(inputs, opts);
+    redacted->min_duration = std::chrono::hours(1);
+    tmpl.apply(inputs, opts);
+    tmpl.set_capture(nullptr);
+    tmpl.apply(inputs, opts);
+
+    auto replay = chat_template_replay::load(file);
+    ASSERT_EQ(3u, replay.requests.size());
+    EXPECT_EQ(1u, replay.templates.size());
+    for (const auto & expected : {std::make_pair(0, first), std::make_pair(1, second)}) {
+        const auto & request = replay.requests[expected.first];
+        EXPECT_EQ(expected.second, request.tmpl->apply(request.inputs, request.options));
+        EXPECT_EQ(chat_template_capture::hash(expected.second), request.output_hash);
+        EXPECT_EQ(expected.second.size(), request.output_bytes);
+    }
+    const auto & request = replay.requests[2];
+    EXPECT_EQ("xxxxx", request.inputs.messages[1]["content"]);
+    EXPECT_EQ("", request.output_hash);
+    EXPECT_EQ(second.size(), request.tmpl->apply(request.inputs, request.options).size());
+
+    std::stringstream unknown_template(R"({"template": "0123", "inputs": {}})");
+    EXPECT_THROW(chat_template_replay::load(unknown_template), std::runtime_error);
+}
+
+static void write_file(const std::filesystem::path & path, const std::string & content) {
+    std::ofstream of(path, std::ios_base::binary);
+    of << content;
+}
+
+TEST(ChatTemplateRegistryTest, LoadSources) {
+    chat_template_registry registry;
+    std::vector<chat_template_source> sources;
+    for (int i = 0; i < 8; i++) {
+        sources.push_back({"tmpl" + std::to_string(i), "{{ bos_token }}{% for m in messages %}" + std::to_string(i) + ":{{ m.content }}{% endfor %}", "<s>", "</s>"});
+    }
+    sources.push_back({"broken", "{% for m in messages %}", "", ""});
+
+    auto results = registry.load(sources, 4);
+    ASSERT_EQ(results.size(), sources.size());
+    for (size_t i = 0; i < 8; i++) {
+        EXPECT_EQ(results[i].name, sources[i].name);
+        EXPECT_EQ(results[i].error, "");
+        EXPECT_TRUE(results[i].tmpl);
+    }
+    EXPECT_EQ(results[8].name, "broken");
+    EXPECT_FALSE(results[8].tmpl);
+    EXPECT_THAT(results[8].error, HasSubstr("Unterminated for"));
+
+    EXPECT_EQ(registry.size(), 8u);
+    EXPECT_FALSE(registry.contains("broken"));
+    auto tmpl = registry.get("tmpl3");
+    ASSERT_TRUE(tmpl);
+    chat_template_inputs inputs;
+    inputs.messages = json::array({{{"role", "user"}, {"content", "Hi"}}});
+    EXPECT_EQ(tmpl->apply(inputs), "<s>3:Hi");
+    EXPECT_FALSE(registry.get("nope"));
+}
+
+TEST(ChatTemplateRegistryTest, LoadDirectoryAndManifest) {
+    auto dir = std::filesystem::temp_directory_path() / "minja-test-chat-template-registry";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "sub");
+    write_file(dir / "a.jinja", "{{ bos_token }}a");
+    write_file(dir / "a.json", R"({"bos_token": "<s>", "eos_token": "</s>"})");
+    write_file(dir / "b.jinja", "{{ eos_token }}b");
+    write_file(dir / "b.json", R"({"bos_token": null, "eos_token": {"__type": "AddedToken", "content": "<|end|>", "lstrip": false}})");
+    write_file(dir / "ab.jinja", "ab");
+    write_file(dir / "ab.json", "{");
+    write_file(dir / "ignored.txt", "{{");
+    write_file(dir / "sub" / "c.jinja", "c");
+    write_file(dir / "manifest.json", R"([
+        {"name": "c", "template": "sub/c.jinja"},
+        {"name": "d", "template": "sub/missing.jinja"},
+        {"name": "e", "template": "a.jinja", "bos_token": "[BOS]"},
+        "not an entry",
+        {"name": "c", "template": "b.jinja"}
+    ])");
+
+    chat_template_registry registry;
+    auto results = registry.load_directory(dir.string());
+    ASSERT_EQ(results.size(), 3u);
+    EXPECT_EQ(results[1].name, "ab");
+    EXPECT_THAT(results[1].error, HasSubstr("Invalid JSON"));
+    EXPECT_EQ(registry.names(), std::vector<std::string>({"a", "b"}));
+    EXPECT_EQ(registry.get("a")->bos_token(), "<s>");
+    EXPECT_EQ(registry.get("a")->eos_token(), "</s>");
+    EXPECT_EQ(registry.get("b")->bos_token(), "");
+    EXPECT_EQ(registry.get("b")->eos_token(), "<|end|>");
+
+    results = registry.load_manifest((dir / "manifest.json").string());
+    ASSERT_EQ(results.size(), 5u);
+    EXPECT_EQ(results[1].name, "d");
+    EXPECT_THAT(results[1].error, HasSubstr("Failed to open file"));
+    EXPECT_EQ(results[3].name, "");
+    EXPECT_THAT(results[3].error, HasSubstr("Manifest entry has no name"));
+    EXPECT_EQ(results[4].name, "c");
+    EXPECT_THAT(results[4].error, HasSubstr("Duplicate chat template name"));
+    EXPECT_FALSE(results[4].tmpl);
+    EXPECT_EQ(registry.get("c")->source(), "c");
+    EXPECT_EQ(registry.names(), std::vector<std::string>({"a", "b", "c", "e"}));
+    EXPECT_EQ(registry.get("e")->bos_token(), "[BOS]");
+
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,87 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+// Built with MINJA_NO_NLOHMANN_JSON.
+#include "minja/minja.hpp"
+#ifdef INCLUDE_NLOHMANN_JSON_HPP_
+#error "minja.hpp shouldn't include nlohmann/json.hpp with MINJA_NO_NLOHMANN_JSON"
+#endif
+// Only used to check the output matches nlohmann::json's, and for the chat_template inputs.
+#include "minja/chat-template.hpp"
+#include <gtest/gtest.h>
+#include <gmock/gmock-matchers.h>
+
+#include <string>
+#include <vector>
+
+static std::string render(const std::string & template_str, const std::string & bindings) {
+    auto root = minja::Parser::parse(template_str, {});
+    return root->render(minja::Context::make(minja::Value::parse_json(bindings)));
+}
+
+TEST(JsonFreeTest, Render) {
+    EXPECT_EQ("1, 2.5, a, True, ", render("{{ x }}, {{ y }}, {{ s }}, {{ b }}, {{ n }}", R"({"x": 1, "y": 2.5, "s": "a", "b": true, "n": null})"));
+    EXPECT_EQ("a=1;b=2;", render("{% for k, v in d | items %}{{ k }}={{ v }};{% endfor %}", R"({"d": {"a": 1, "b": 2}})"));
+    EXPECT_EQ("True", render("{{ 1 == 1.0 and 'x' in ['x'] and d['k'] == 2 }}", R"({"d": {"k": 2}})"));
+    EXPECT_EQ("{'a': [1, 'b', null, False]}", render("{{ x }}", R"({"x": {"a": [1, "b", null, false]}})"));
+    EXPECT_EQ(R"({"a": [1, "b\n\"", null, false, 0.5]})", render("{{ x | tojson }}", R"({"x": {"a": [1, "b\n\"", null, false, 0.5]}})"));
+    EXPECT_EQ("[1, 2]", render("{{ x | unique | list }}", R"({"x": [1, 2, 1]})"));
+}
+
+TEST(JsonFreeTest, ParseJson) {
+    EXPECT_EQ(R"({"a": 1, "b": [true, null, "\u0001\t\\"]})", minja::Value::parse_json(R"( {"a" : 1 , "b":[ true,null , "\u0001\t\\" ]} )").dump(-1, true));
+    EXPECT_EQ("\xC3\xA9\xF0\x9F\x98\x80/", minja::Value::parse_json(R"("\u00e9\ud83d\ude00\/")").get<std::string>());
+    EXPECT_EQ(R"({"a": 3, "b": 2})", minja::Value::parse_json(R"({"a": 1, "b": 2, "a": 3})").dump(-1, true));
+    EXPECT_EQ(-12, minja::Value::parse_json("-12").get<int64_t>());
+    EXPECT_TRUE(minja::Value::parse_json("9223372036854775808").is_number_float());
+
+    auto ThrowsWithSubstr = [](const std::string & expected_substr) {
+        return testing::Throws<std::runtime_error>(Property(&std::runtime_error::what, testing::HasSubstr(expected_substr)));
+    };
+    EXPECT_THAT([]() { minja::Value::parse_json(""); }, ThrowsWithSubstr("unexpected end of input"));
+    EXPECT_THAT([]() { minja::Value::parse_json("[1,]"); }, ThrowsWithSubstr("Invalid JSON at offset 3"));
+    EXPECT_THAT([]() { minja::Value::parse_json("{\"a\" 1}"); }, ThrowsWithSubstr("expected ':'"));
+    EXPECT_THAT([]() { minja::Value::parse_json("01"); }, ThrowsWithSubstr("invalid number"));
+    EXPECT_THAT([]() { minja::Value::parse_json("1 2"); }, ThrowsWithSubstr("unexpected trailing characters"));
+    EXPECT_THAT([]() { minja::Value::parse_json("\"a\nb\""); }, ThrowsWithSubstr("control character in string"));
+    EXPECT_THAT([]() { minja::Value::parse_json("\"\\ud83d\""); }, ThrowsWithSubstr("missing low surrogate"));
+    EXPECT_THAT([]() { minja::Value::parse_json("tru"); }, ThrowsWithSubstr("unexpected character 't'"));
+
+    // Deep nesting is rejected instead of overflowing the stack.
+    EXPECT_EQ(512u, []() {
+        auto value = minja::Value::parse_json(std::string(512, '[') + std::string(512, ']'));
+        size_t depth = 0;
+        for (; value.is_array(); value = value.size() ? value.at(0) : minja::Value()) depth++;
+        return depth;
+    }());
+    EXPECT_THAT([]() { minja::Value::parse_json(std::string(513, '[') + std::string(513, ']')); }, ThrowsWithSubstr("nesting too deep"));
+    EXPECT_THAT([]() { minja::Value::parse_json(std::string(1000000, '[')); }, ThrowsWithSubstr("Invalid JSON at offset 512: nesting too deep"));
+    EXPECT_THAT([]() { minja::Value::parse_json(R"({"a": )" + std::string(600, '[')); }, ThrowsWithSubstr("nesting too deep"));
+}
+
+TEST(JsonFreeTest, DumpMatchesNlohmannJson) {
+    for (double d : {0.0, -0.0, 1.0, -1.5, 0.1, 1.0 / 3, 100.0, 1e15, 1e16, 123456789012345680.0, 1e-4, 1e-5, 0.00012345, 1.5e300, -2.5e-300, 5e-324,
+                     std::numeric_limits<double>::max(), std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN()}) {
+        EXPECT_EQ(nlohmann::ordered_json(d).dump(), minja::Value(d).dump(-1, true)) << d;
+    }
+    for (const std::string s : {"", "abc", "quote\"back\\slash", "\b\f\n\r\t\x01\x1f\x7f", "caf\xC3\xA9"}) {
+        EXPECT_EQ(nlohmann::ordered_json(s).dump(), minja::Value(s).dump(-1, true));
+    }
+    const std::string doc = R"({"a": [1, -2, 3.25, "x", {"y": null}], "b": true, "c": {}, "d": []})";
+    EXPECT_EQ(minja::to_value(nlohmann::ordered_json::parse(doc)).dump(2, true), minja::Value::parse_json(doc).dump(2, true));
+}
+
+TEST(JsonFreeTest, ChatTemplate) {
+    minja::chat_template tmpl("{% for m in messages %}<{{ m.role }}>{{ m.content }}{% endfor %}{{ tools | tojson }}", "", "");
+    minja::chat_template_inputs inputs;
+    inputs.messages = nlohmann::ordered_json::parse(R"([{"role": "user", "content": "hi"}])");
+    inputs.tools = nlohmann::ordered_json::parse(R"([{"type": "function", "function": {"name": "f", "parameters": {"x": 1.5}}}])");
+    minja::chat_template_options opts;
+    opts.apply_polyfills = false;
+    EXPECT_EQ(R"(<user>hi[{"type": "function", "function": {"name": "f", "parameters": {"x": 1.5}}}])", tmpl.apply(inputs, opts));
+}
@@ -0,0 +1,176 @@
+/*
+    Copyright 2024 Google LLC
+
+    Use of this source code is governed by an MIT-style
+    license that can be found in the LICENSE file or at
+    https://opensource.org/licenses/MIT.
+*/
+// SPDX-License-Identifier: MIT
+// Built with -fno-exceptions (see MINJA_NO_EXCEPTIONS), but also passes with exceptions.
+#include "minja/minja.hpp"
+#include "minja/chat-template.hpp"
+#include <gtest/gtest.h>
+#include <gmock/gmock-matchers.h>
+
+#include <string>
+
+using testing::HasSubstr;
+
+static std::string render(const std::string & template_str, const json & bindings, const minja::Options & options = {}) {
+    auto root = minja::Parser::try_parse(template_str, options);
+    EXPECT_TRUE(root) << root.error;
+    if (!root) {
+        return "";
+    }
+    auto res = root.value->try_render(minja::Context::make(bindings));
+    EXPECT_TRUE(res) << res.error;
+    return res.value;
+}
+
+static std::string render_error(const std::string & template_str, const json & bindings, const minja::Options & options = {}) {
+    auto root = minja::Parser::try_parse(template_str, options);
+    if (!root) {
+        return root.error;
+    }
+    auto res = root.value->try_render(minja::Context::make(bindings));
+    EXPECT_FALSE(res) << res.value;
+    return res.error;
+}
+
+TEST(NoExceptionsTest, Renders) {
+    EXPECT_EQ("1,2,3", render("{{ items | join(',') }}", {{"items", {1, 2, 3}}}));
+    EXPECT_EQ("013", render("{% for i in range(10) %}{% if i == 2 %}{% continue %}{% endif %}{% if i == 4 %}{% break %}{% endif %}{{ i }}{% endfor %}", {}));
+    EXPECT_EQ("0[0]1[0][1]", render("{% for i in range(3) %}{{ i }}{% for j in range(3) %}{% if j > i %}{% break %}{% endif %}[{{ j }}]{% endfor %}{% if i == 1 %}{% break %}{% endif %}{% endfor %}", {}));
+    EXPECT_EQ("[a]", render("{% macro m(x) %}[{{ x }}]{% endmacro %}{{ m('a') }}", {}));
+    EXPECT_EQ("3", render("{{ 7 % 4 }}", {}));
+    EXPECT_EQ("4", render("{{ '3' | int + 1 }}", {}));
+}
+
+TEST(NoExceptionsTest, ParseErrors) {
+    EXPECT_THAT(render_error("{% if 1 %}", {}), HasSubstr("Unterminated if"));
+    EXPECT_THAT(render_error("{# ", {}), HasSubstr("Missing end of comment tag"));
+    EXPECT_THAT(render_error("{{ 1 + }}", {}), HasSubstr("Expected value expression"));
+    EXPECT_THAT(render_error("{{ x", {}), HasSubstr("Expected closing expression tag"));
+    EXPECT_THAT(render_error("{{ 1e }}", {}), HasSubstr("at row 1, column"));
+}
+
+TEST(NoExceptionsTest, RenderErrors) {
+    EXPECT_THAT(render_error("{{ raise_exception('hey') }}", {}), HasSubstr("hey"));
+    EXPECT_THAT(render_error("{% break %}", {}), HasSubstr("break outside of a loop"));
+    EXPECT_THAT(render_error("{% macro m() %}{% break %}{% endmacro %}{% for x in [1, 2] %}{{ x }}{{ m() }}{% endfor %}", {}), HasSubstr("break outside of a loop"));
+    EXPECT_THAT(render_error("{{ [].pop() }}", {}), HasSubstr("pop from empty list"));
+    EXPECT_THAT(render_error("{{ x[3] }}", {{"x", {1}}}), HasSubstr("list index out of range"));
+    EXPECT_THAT(render_error("{{ 'a'.upper(1) }}", {}), HasSubstr("upper method must have between 0 and 0 positional arguments"));
+    EXPECT_THAT(render_error("{{ 1 % 0 }}", {}), HasSubstr("Modulo by zero"));
+    EXPECT_THAT(render_error("{% for x in 1 %}{% endfor %}", {}), HasSubstr("For loop iterable must be iterable"));
+    EXPECT_THAT(render_error("a{% for i in [1] %}{{ foo(i) }}{% endfor %}", {}), HasSubstr("at row 1, column"));
+
+    // Errors don't leak into the next render, nor into the loop state.
+    EXPECT_EQ("ok", render("ok", {}));
+    EXPECT_THAT(render_error("{% for i in [1] %}{{ raise_exception('in loop') }}{% endfor %}", {}), HasSubstr("in loop"));
+    EXPECT_THAT(render_error("{% continue %}", {}), HasSubstr("continue outside of a loop"));
+    EXPECT_EQ("12", render("{% for i in [1, 2] %}{{ i }}{% endfor %}", {}));
+}
+
+TEST(NoExceptionsTest, LoopControl) {
+    auto nested = "{% for i in range(5) %}{% for j in range(5) %}{% if j > i %}{% break %}{% endif %}{{ j }}{% endfor %};{% if i == 2 %}{% break %}{% endif %}{% endfor %}";
+    auto skip_odd = "{% for i in range(20) %}{% if i % 2 %}{% continue %}{% endif %}{{ i }},{% endfor %}";
+    minja::Options memoized {};
+    memoized.memoize_loops = true;
+    minja::Options parallel {};
+    parallel.parallel_loop_min_items = 2;
+    for (const auto & options : {minja::Options {}, memoized, parallel}) {
+        EXPECT_EQ("0;01;012;", render(nested, {}, options));
+        EXPECT_EQ("0,2,4,6,8,10,12,14,16,18,", render(skip_odd, {}, options));
+    }
+
+    // Loops in macro and caller() bodies.
+    EXPECT_EQ("[01][01]", render("{% macro m() %}[{% for i in range(5) %}{% if i == 2 %}{% break %}{% endif %}{{ i }}{% endfor %}]{% endmacro %}{% for x in [1, 2] %}{{ m() }}{% endfor %}", {}));
+    EXPECT_EQ("<13>", render("{% macro m() %}<{{ caller() }}>{% endmacro %}{% call m() %}{% for i in range(4) %}{% if i % 2 == 0 %}{% continue %}{% endif %}{{ i }}{% endfor %}{% endcall %}", {}));
+
+    // break / continue don't reach the loops macros and caller() bodies are called from.
+    EXPECT_THAT(render_error("{% macro m() %}{% continue %}{% endmacro %}{% for x in [1, 2] %}{{ m() }}{% endfor %}", {}), HasSubstr("continue outside of a loop"));
+    EXPECT_THAT(render_error("{% macro m() %}{{ caller() }}{% endmacro %}{% for x in [1, 2] %}{% call m() %}{% break %}{% endcall %}{% endfor %}", {}), HasSubstr("break outside of a loop"));
+}
+
+TEST(NoExceptionsTest, NestedCalls) {
+    // A callable's error fails the render that called it.
+    auto fail = minja::Value::callable([](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue & args) -> minja::Value {
+        args.expectArgs("fail", {0, 0}, {0, 0});
+        MINJA_CHECK();
+        return "unreachable";
+    });
+    auto root = minja::Parser::try_parse("a{{ fail(1) }}b", {});
+    ASSERT_TRUE(root) << root.error;
+    auto context = minja::Context::make(json::object());
+    context->set("fail", fail);
+    auto res = root.value->try_render(context);
+    EXPECT_FALSE(res);
+    EXPECT_THAT(res.error, HasSubstr("fail must have between 0 and 0 positional arguments"));
+
+    // Errors caught by a try_* call inside a callable don't fail the outer render.
+    auto inner = minja::Parser::try_parse("{{ raise_exception('inner') }}", {});
+    ASSERT_TRUE(inner) << inner.error;
+    context->set("probe", minja::Value::callable([&](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue &) -> minja::Value {
+        auto res = inner.value->try_render(minja::Context::make(json::object()));
+        return res ? "ok" : "caught: " + res.error.substr(0, 5);
+    }));
+    auto outer = minja::Parser::try_parse("{{ probe() }}, {{ probe() }}", {});
+    ASSERT_TRUE(outer) << outer.error;
+    res = outer.value->try_render(context);
+    ASSERT_TRUE(res) << res.error;
+    EXPECT_EQ("caught: inner, caught: inner", res.value);
+
+    // Failed calls don't affect the next ones.
+    EXPECT_FALSE(root.value->try_render(context));
+    EXPECT_EQ("ok", render("ok", {}));
+}
+
+#ifdef MINJA_NO_EXCEPTIONS
+TEST(NoExceptionsDeathTest, ThrowingEntryPointsAbort) {
+    // Outside of try_* calls, errors abort like uncaught exceptions would.
+    EXPECT_DEATH(minja::Parser::parse("{% if 1 %}", {}), "Unterminated if");
+    auto root = minja::Parser::parse("{{ raise_exception('failed') }}", {});
+    EXPECT_DEATH(root->render(minja::Context::make(json::object())), "failed");
+}
+#endif
+
+TEST(NoExceptionsTest, LazyBodies) {
+    minja::Options options {};
+    options.lazy_bodies = true;
+    options.lazy_branch_min_size = 0;
+    auto root = minja::Parser::try_parse("{% if x %}{{ 1 + }}{% else %}ok{% endif %}", options);
+    ASSERT_TRUE(root) << root.error;
+    EXPECT_EQ("ok", root.value->try_render(minja::Context::make(json {{"x", false}})).value);
+    for (int i = 0; i < 2; i++) {
+        auto res = root.value->try_render(minja::Context::make(json {{"x", true}}));
+        EXPECT_FALSE(res);
+        EXPECT_THAT(res.error, HasSubstr("Expected value expression"));
+    }
+}
+
+TEST(NoExceptionsTest, ChatTemplate) {
+    auto broken = minja::chat_template::try_create("{% if messages %}", "<s>", "</s>");
+    EXPECT_FALSE(broken);
+    EXPECT_THAT(broken.error, HasSubstr("Unterminated if"));
+
+    auto tmpl = minja::chat_template::try_create(
+        "{% for m in messages %}{{ m.role }}: {{ m.content }}\n{% endfor %}{% if messages | length > 2 %}{{ raise_exception('too long') }}{% endif %}",
+        "<s>", "</s>");
+    ASSERT_TRUE(tmpl) << tmpl.error;
+
+    minja::chat_template_inputs inputs;
+    inputs.messages = json::array({{{"role", "user"}, {"content", "hi"}}});
+    auto res = tmpl.value->try_apply(inputs);
+    ASSERT_TRUE(res) << res.error;
+    EXPECT_EQ("user: hi\n", res.value);
+
+    inputs.messages = json::array({
+        {{"role", "user"}, {"content", "a"}},
+        {{"role", "assistant"}, {"content", "b"}},
+        {{"role", "user"}, {"content", "c"}},
+    });
+    res = tmpl.value->try_apply(inputs);
+    EXPECT_FALSE(res);
+    EXPECT_THAT(res.error, HasSubstr("too long"));
+}
@@ -7,11 +7,15 @@
 */
 // SPDX-License-Identifier: MIT
 #include "minja/minja.hpp"
+#include "minja/template-cache.hpp"
 #include <gtest/gtest.h>
 #include <gmock/gmock-matchers.h>
 
 #include <fstream>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
 
 static std::string render_python(const std::string & template_str, const json & bindings, const minja::Options & options) {
     json data {
@@ -608,6 +612,15 @@ TEST(SyntaxTest, SimpleCases) {
     EXPECT_EQ(
         "0,2,4,6,8,",
         render("{% for i in range(10) %}{% if i % 2 %}{% continue %}{% endif %}{{ i }},{% endfor %}", {}, {}));
+    EXPECT_EQ(
+        "0;01;012;",
+        render("{% for i in range(5) %}{% for j in range(5) %}{% if j > i %}{% break %}{% endif %}{{ j }}{% endfor %};{% if i == 2 %}{% break %}{% endif %}{% endfor %}", {}, {}));
+    EXPECT_EQ(
+        "[01][01]",
+        render("{% macro m() %}[{% for i in range(5) %}{% if i == 2 %}{% break %}{% endif %}{{ i }}{% endfor %}]{% endmacro %}{% for x in [1, 2] %}{{ m() }}{% endfor %}", {}, {}));
+    EXPECT_EQ(
+        "<13>",
+        render("{% macro m() %}<{{ caller() }}>{% endmacro %}{% call m() %}{% for i in range(4) %}{% if i % 2 == 0 %}{% continue %}{% endif %}{{ i }}{% endfor %}{% endcall %}", {}, {}));
 
     if (!getenv("USE_JINJA2")) {
         // TODO: capture stderr from jinja2 and test these.
@@ -618,6 +631,8 @@ TEST(SyntaxTest, SimpleCases) {
 
         EXPECT_THAT([]() { render("{% break %}", {}, {}); }, ThrowsWithSubstr("break outside of a loop"));
         EXPECT_THAT([]() { render("{% continue %}", {}, {}); }, ThrowsWithSubstr("continue outside of a loop"));
+        EXPECT_THAT([]() { render("{% macro m() %}{% break %}{% endmacro %}{% for x in [1, 2, 3] %}{{ x }}{{ m() }}{% endfor %}", {}, {}); }, ThrowsWithSubstr("break outside of a loop"));
+        EXPECT_THAT([]() { render("{% macro m() %}{{ caller() }}{% endmacro %}{% for x in [1, 2, 3] %}{% call m() %}{% continue %}{% endcall %}{{ x }}{% endfor %}", {}, {}); }, ThrowsWithSubstr("continue outside of a loop"));
 
         EXPECT_THAT([]() { render("{%- set _ = [].pop() -%}", {}, {}); }, ThrowsWithSubstr("pop from empty list"));
         EXPECT_THAT([]() { render("{%- set _ = {}.pop() -%}", {}, {}); }, ThrowsWithSubstr("pop"));
@@ -655,3 +670,716 @@ TEST(SyntaxTest, SimpleCases) {
     // expect_throws_with_message_substr([]() { render("{{ a.b }}", {}, {}); }, "'a' is not defined");
     // expect_throws_with_message_substr([]() { render("{{ raise_exception('hey') }}", {}, {}); }, "hey");
 }
+
+TEST(SyntaxTest, LazyBodies) {
+    auto ThrowsWithSubstr = [](const std::string & expected_substr) {
+        return testing::Throws<std::runtime_error>(Property(&std::runtime_error::what, testing::HasSubstr(expected_substr)));
+    };
+    auto lazy = [](minja::Options options) {
+        options.lazy_bodies = true;
+        options.lazy_branch_min_size = 0;
+        return options;
+    };
+    const json bindings {{"x", 1}, {"y", 0}, {"items", {1, 2, 3}}};
+
+    for (const auto & options : {minja::Options {}, lstrip_blocks, trim_blocks, lstrip_trim_blocks}) {
+        for (const std::string tmpl : {
+            "{% macro m(a, b='{% endmacro %}') %}\n  [{{ a }}{{ b }}]\n{% endmacro %}{{ m(1) }}|{{ m(2, 3) }}",
+            "{%- macro m() -%}  \n  x  \n  {%- endmacro -%}  {{ m() }}",
+            "{% if x %}\n  a {# {% endif %} #}\n{% elif y %}\n  b\n{% else %}\n  c\n{% endif %}\n",
+            "{% if y %}a{% else -%}  \n  {% for i in items %}{% if i == 2 %}{% continue %}{% endif %}{{ i }}{% else %}none{% endfor %}  {%- endif %}",
+            "{% if x %}{% set v %}{% if y %}{% endif %}[{{ '%}' }}]{% endset %}{% set w = 1 %}{{ v }}{{ w }}{% endif %}",
+            "{% if x %}{% macro m() %}{% if x %}{{ caller() }}{% endif %}{% endmacro %}{% call m() %}c{% endcall %}{% endif %}",
+            "  {% if x %}\n    {% if y %}a{% elif x %}{% filter upper %}b{% endfilter %}{% endif %}\n  {% endif %}\n",
+        }) {
+            EXPECT_EQ(render(tmpl, bindings, options), render(tmpl, bindings, lazy(options))) << tmpl;
+        }
+    }
+
+    // Small branches are still parsed eagerly, macro bodies and large branches are only parsed when rendered.
+    minja::Options options {};
+    options.lazy_bodies = true;
+    options.lazy_branch_min_size = 10;
+    auto root = minja::Parser::parse("{% macro m() %}{{ 1 + }}{% endmacro %}{% if x %}short{% else %}{{ 'long enough' | upper }}{% endif %}", options);
+    EXPECT_EQ("short", root->render(minja::Context::make(bindings)));
+    EXPECT_EQ("LONG ENOUGH", root->render(minja::Context::make(json {{"x", false}})));
+    EXPECT_THAT([&]() { minja::Parser::parse("{% macro m() %}{{ 1 + }}{% endmacro %}{{ m() }}", options)->render(minja::Context::make(bindings)); },
+        ThrowsWithSubstr("Expected value expression"));
+    EXPECT_EQ("1", minja::Parser::parse("{% macro m() %}{{ x }}{% endmacro %}{{ m() }}", options)->render(minja::Context::make(bindings)));
+
+    // Tag balance is still checked upfront.
+    options.lazy_branch_min_size = 0;
+    EXPECT_THAT([&]() { minja::Parser::parse("{% macro m() %}{% if 1 %}{% endmacro %}", options); }, ThrowsWithSubstr("Unterminated if"));
+    EXPECT_THAT([&]() { minja::Parser::parse("{% macro m() %}{% for x in [] %}{% elif 1 %}{% endfor %}{% endmacro %}", options); }, ThrowsWithSubstr("Unterminated for"));
+    EXPECT_THAT([&]() { minja::Parser::parse("{% macro m() %}", options); }, ThrowsWithSubstr("Unterminated macro"));
+    EXPECT_THAT([&]() { minja::Parser::parse("{% macro m() %}{% endif %}", options); }, ThrowsWithSubstr("Unterminated macro"));
+    EXPECT_THAT([&]() { minja::Parser::parse("{% if 1 %}{% else %}{% else %}{% endif %}", options); }, ThrowsWithSubstr("Unterminated if"));
+    EXPECT_THAT([&]() { minja::Parser::parse("{% if 1 %}{# ", options); }, ThrowsWithSubstr("Missing end of comment tag"));
+}
+
+TEST(SyntaxTest, CallablesOutliveTemplate) {
+    minja::Options lazy {};
+    lazy.lazy_bodies = true;
+    for (const auto & options : {minja::Options {}, lazy}) {
+        auto context = minja::Context::make(json::object());
+        minja::Value caller;
+        context->set("keep", minja::Value::callable([&](const std::shared_ptr<minja::Context> & call_context, minja::ArgumentsValue &) {
+            caller = call_context->get("caller");
+            return minja::Value("");
+        }));
+        auto root = minja::Parser::parse("{% macro m(x, y='b') %}[{{ x }}{{ y }}]{% endmacro %}{% call keep() %}<{{ 1 + 1 }}>{% endcall %}", options);
+        EXPECT_EQ("", root->render(context));
+        root.reset();
+
+        minja::ArgumentsValue args;
+        args.args.emplace_back("a");
+        EXPECT_EQ("[ab]", context->get("m").call(context, args).get<std::string>());
+        minja::ArgumentsValue no_args;
+        EXPECT_EQ("<2>", caller.call(context, no_args).get<std::string>());
+    }
+}
+
+TEST(ValueTest, StringKeyLookups) {
+    minja::Value obj(json {{"a", 1}, {"1", "one"}});
+    obj.set(minja::Value((int64_t) 1), "int key");
+    const std::string a = "a";
+    const std::string_view b = "b";
+
+    EXPECT_TRUE(obj.contains(a));
+    EXPECT_TRUE(obj.contains("1"));
+    EXPECT_FALSE(obj.contains(b));
+    EXPECT_EQ(1, obj.at(a).get<int64_t>());
+    EXPECT_EQ("one", obj.get("1").get<std::string>());
+    EXPECT_EQ("int key", obj.get(minja::Value((int64_t) 1)).get<std::string>());
+    EXPECT_TRUE(obj.get(b).is_null());
+    EXPECT_EQ(2, obj.get<int64_t>(b, 2));
+    EXPECT_THROW(obj.at(b), std::out_of_range);
+
+    obj.set(b, (int64_t) 2);
+    obj.set("a", (int64_t) 3);
+    EXPECT_EQ("{'a': 3, '1': 'one', '1': 'int key', 'b': 2}", obj.dump());
+
+    auto parent = minja::Context::make(json {{"x", 1}});
+    auto context = minja::Context::make(json::object(), parent);
+    context->set("y", (int64_t) 2);
+    EXPECT_TRUE(context->contains("x"));
+    EXPECT_TRUE(context->contains(std::string("y")));
+    EXPECT_FALSE(context->contains(b));
+    EXPECT_EQ(1, context->get("x").get<int64_t>());
+    EXPECT_EQ(2, context->at(std::string_view("y")).get<int64_t>());
+    EXPECT_THROW(context->at(b), std::runtime_error);
+    EXPECT_EQ(nullptr, obj.find(std::string_view("missing")));
+    ASSERT_NE(nullptr, obj.find(b));
+    EXPECT_EQ(2, obj.find(b)->get<int64_t>());
+
+    // Subclasses override the string key overloads, which Value keys and variable lookups both go through.
+    struct LazyContext : public minja::Context {
+        int resolved = 0;
+        LazyContext() : minja::Context(minja::Value::object(), minja::Context::builtins()) {}
+        void resolve(std::string_view key) {
+            if (key != "lazy" || values_.find(key)) return;
+            resolved++;
+            values_.set(key, "resolved");
+        }
+        using minja::Context::get;
+        using minja::Context::at;
+        using minja::Context::contains;
+        minja::Value get(std::string_view key) override { resolve(key); return minja::Context::get(key); }
+        minja::Value & at(std::string_view key) override { resolve(key); return minja::Context::at(key); }
+        bool contains(std::string_view key) override { resolve(key); return minja::Context::contains(key); }
+    };
+    auto lazy = std::make_shared<LazyContext>();
+    EXPECT_TRUE(lazy->contains(minja::Value("lazy")));
+    EXPECT_EQ("resolved", lazy->get(minja::Value("lazy")).get<std::string>());
+    EXPECT_EQ("resolved!", minja::Parser::parse("{{ lazy }}!", {})->render(lazy));
+    EXPECT_EQ(1, lazy->resolved);
+
+    auto other = std::make_shared<LazyContext>();
+    EXPECT_EQ("resolved!", minja::Parser::parse("{{ lazy }}!", {})->render(other));
+    EXPECT_EQ(1, other->resolved);
+}
+
+TEST(ValueTest, ParseJson) {
+    for (const std::string doc : {
+        "null", "true", "-0", "12", "-3.5e2", "1E-2", "\"caf\u00e9\\n\"",
+        R"({"a": [1, {"b": null}, "c"], "d": {}, "e": [], "a": 2})",
+        " [ 0.5 , 9223372036854775807, -9223372036854775808 ] ",
+    }) {
+        EXPECT_EQ(minja::Value(json::parse(doc)).dump(-1, true), minja::Value::parse_json(doc).dump(-1, true)) << doc;
+    }
+    EXPECT_THROW(minja::Value::parse_json("[1, 2"), std::runtime_error);
+    EXPECT_THROW(minja::Value::parse_json("{'a': 1}"), std::runtime_error);
+
+    // Number literals in templates are read the same way.
+    EXPECT_EQ("[0.5, -12, 100.0]", render("{{ [0.5, -12, 1e2] }}", {}, {}));
+    EXPECT_THROW(render("{{ 01 }}", {}, {}), std::runtime_error);
+}
+
+TEST(OutputSinkTest, Segments) {
+    const std::string text(100, 't');
+    const std::string big(1000, 'b');
+    auto root = minja::Parser::parse(text + "{{ x }}{% for i in range(50) %}{{ i }},{% endfor %}{{ big }}" + text, {});
+    auto context = minja::Context::make(json {{"x", "small"}, {"big", big}});
+
+    minja::SegmentSink sink;
+    root->render(sink, context);
+    auto expected = root->render(context);
+    EXPECT_EQ(expected, sink.str());
+    EXPECT_EQ(expected.size(), sink.size());
+
+    // Literal text and large strings are referenced, small pieces coalesced: text, small pieces, big, text.
+    const auto & segments = sink.segments();
+    ASSERT_EQ(4u, segments.size());
+    EXPECT_EQ(text.size(), segments[0].size);
+    EXPECT_EQ(big.size(), segments[2].size);
+    EXPECT_EQ(text.size(), segments[3].size);
+
+    // Everything is copied below the reference threshold.
+    minja::SegmentSink copying_sink(/* min_reference_size= */ 4096);
+    root->render(copying_sink, context);
+    EXPECT_EQ(expected, copying_sink.str());
+    EXPECT_EQ(1u, copying_sink.segments().size());
+
+    std::string appended = "prefix:";
+    minja::StringSink string_sink(appended);
+    root->render(string_sink, context);
+    EXPECT_EQ("prefix:" + expected, appended);
+    EXPECT_EQ(expected.size(), string_sink.size());
+
+    minja::Value value(big);
+    EXPECT_EQ(big, value.take_string());
+    EXPECT_EQ("", value.get<std::string>());
+    EXPECT_EQ("1", minja::Value((int64_t) 1).take_str());
+}
+
+TEST(OutputSinkTest, StreamNodes) {
+    // Nodes written against the std::ostringstream interface still render, to any sink.
+    struct StreamNode : public minja::TemplateNode {
+        std::shared_ptr<minja::TemplateNode> child;
+        StreamNode(std::shared_ptr<minja::TemplateNode> child) : minja::TemplateNode({}), child(std::move(child)) {}
+        void do_render(std::ostringstream & out, const std::shared_ptr<minja::Context> & context) const override {
+            out << "<";
+            child->render(out, context);
+            out << ">";
+        }
+    };
+    auto node = std::make_shared<StreamNode>(minja::Parser::parse("{{ x }}", {}));
+    auto context = minja::Context::make(json {{"x", "y"}});
+    EXPECT_EQ("<y>", node->render(context));
+
+    minja::SegmentSink sink;
+    node->render(sink, context);
+    EXPECT_EQ("<y>", sink.str());
+}
+
+TEST(OutputSinkTest, Utf8) {
+    auto repair = [](const std::vector<std::string> & pieces, size_t * errors = nullptr, size_t * first_error = nullptr) {
+        std::string res;
+        minja::StringSink out(res);
+        minja::Utf8Sink sink(out, minja::Utf8Sink::Mode::Repair);
+        for (const auto & piece : pieces) sink.write(piece);
+        sink.finish();
+        if (errors) *errors = sink.errors();
+        if (first_error) *first_error = sink.first_error();
+        return res;
+    };
+    const std::string r = "\xEF\xBF\xBD";
+
+    // Valid characters split across writes at any byte.
+    const std::string valid = "ascii text, caf\xC3\xA9 \xE4\xB8\xAD\xE6\x96\x87 \xF0\x9F\x98\x80!";
+    for (size_t i = 0; i <= valid.size(); i++) {
+        size_t errors;
+        EXPECT_EQ(valid, repair({valid.substr(0, i), valid.substr(i)}, &errors)) << i;
+        EXPECT_EQ(0u, errors);
+    }
+
+    size_t errors, first_error;
+    EXPECT_EQ("a" + r + "b", repair({"a\xFF" "b"}, &errors, &first_error));
+    EXPECT_EQ(1u, errors);
+    EXPECT_EQ(1u, first_error);
+    EXPECT_EQ("xy" + r + "a", repair({"xy\xE4\xB8", "a"}, &errors, &first_error));
+    EXPECT_EQ(2u, first_error);
+    EXPECT_EQ(r + r, repair({"\xC0\xAF"}));                 // Overlong.
+    EXPECT_EQ(r + r + r, repair({"\xED\xA0\x80"}));          // Surrogate.
+    EXPECT_EQ(r + r + r + r, repair({"\xF4\x90\x80\x80"}));  // Above U+10FFFF.
+    EXPECT_EQ("ok" + r, repair({"ok\xF0", "\x9F"}));         // Truncated at the end.
+
+    // Byte-wise slicing can split characters.
+    auto root = minja::Parser::parse("{{ s[:1] }}|{{ s[1:] }}", {});
+    auto context = minja::Context::make(json {{"s", "\xC3\xA9t"}});
+    std::string res;
+    minja::StringSink out(res);
+    minja::Utf8Sink report(out);
+    root->render(report, context);
+    report.finish();
+    EXPECT_EQ(root->render(context), res);
+    EXPECT_EQ(res.size(), report.size());
+    EXPECT_FALSE(report.valid());
+    EXPECT_EQ(2u, report.errors());
+    EXPECT_EQ(0u, report.first_error());
+    EXPECT_EQ(r + "|" + r + "t", repair({res}));
+
+    // Repairs don't depend on how the output is split.
+    std::mt19937 rng(42);
+    for (int iter = 0; iter < 200; iter++) {
+        std::string text;
+        for (int i = 0; i < 40; i++) {
+            static const unsigned char bytes[] = {'a', 0x80, 0xBF, 0xC3, 0xA9, 0xE0, 0xA0, 0xED, 0x9F, 0xF0, 0x9F, 0x90, 0xF4, 0x8F, 0xFF};
+            text += (char) bytes[rng() % sizeof(bytes)];
+        }
+        std::vector<std::string> bytes;
+        for (char c : text) bytes.emplace_back(1, c);
+        size_t whole_errors, split_errors;
+        auto whole = repair({text}, &whole_errors);
+        EXPECT_EQ(whole, repair(bytes, &split_errors));
+        EXPECT_EQ(whole_errors, split_errors);
+        minja::Utf8Sink check(out);
+        check.write(whole);
+        check.finish();
+        EXPECT_TRUE(check.valid());
+    }
+}
+
+TEST(LoopMemoizationTest, SameOutput) {
+    minja::Options memoized {};
+    memoized.memoize_loops = true;
+    const std::vector<std::string> templates {
+        "{% for tool in tools %}<tool>{{ tool | tojson }}</tool>{% endfor %}",
+        "{% for tool in tools %}{{ loop.index }}:{{ tool.name }}{% if not loop.last %}, {% endif %}{% endfor %}",
+        "{% for tool in tools %}{{ prefix }}{{ tool.name }}{% endfor %}",
+        "{% for tool in tools %}{% if prev is defined %}{{ prev }}>{% endif %}{{ tool.name }};{% set prev = tool.name %}{% endfor %}",
+        "{% set ns = namespace(n=0) %}{% for tool in tools %}{% set ns.n = ns.n + 1 %}{{ ns.n }}{{ tool.name }}{% endfor %}{{ ns.n }}",
+        "{% for tool in tools %}{{ loop.cycle('a', 'b') }}{{ tool.name }}{% endfor %}",
+        "{% for tool in tools %}{% if tool.name == 'b' %}{% continue %}{% endif %}{% for k, v in tool | items %}{{ k }}={{ v }},{% endfor %}{% endfor %}{{ k }}",
+        "{% macro fmt(t) %}[{{ t.name }}]{% endmacro %}{% for tool in tools %}{{ fmt(tool) }}{% endfor %}",
+    };
+    const std::vector<json> bindings {
+        {{"tools", json::array({{{"name", "a"}}, {{"name", "b"}, {"x", 1}}, {{"name", "c"}}})}, {"prefix", "-"}},
+        {{"tools", json::array({{{"name", "a"}}, {{"name", "b"}, {"x", 1}}, {{"name", "c"}}, {{"name", "d"}}})}, {"prefix", "-"}},
+        {{"tools", json::array({{{"name", "b"}, {"x", 1}}, {{"name", "a"}}, {{"name", "c"}}})}, {"prefix", "+"}},
+    };
+    for (const auto & tmpl : templates) {
+        auto plain_root = minja::Parser::parse(tmpl, {});
+        auto memoized_root = minja::Parser::parse(tmpl, memoized);
+        for (int pass = 0; pass < 2; pass++) {
+            for (const auto & b : bindings) {
+                EXPECT_EQ(plain_root->render(minja::Context::make(b)), memoized_root->render(minja::Context::make(b))) << tmpl << " " << b.dump();
+            }
+        }
+    }
+}
+
+TEST(LoopMemoizationTest, ReusesIterations) {
+    minja::Options options {};
+    options.memoize_loops = true;
+    auto root = minja::Parser::parse("{% macro describe(t) %}{{ t.name | upper }}{% endmacro %}{% for tool in tools %}<{{ describe(tool) }}>{% endfor %}", options);
+    auto render = [&](const json & tools) {
+        return root->render(minja::Context::make(json {{"tools", tools}}));
+    };
+    auto tools = json::array();
+    for (int i = 0; i < 100; i++) tools.push_back({{"name", "tool" + std::to_string(i)}});
+    auto expected = render(tools);
+    auto memo_bytes = root->memory_usage().loop_memo_bytes;
+    EXPECT_GT(memo_bytes, 0u);
+    EXPECT_EQ(expected, render(tools));
+    EXPECT_EQ(memo_bytes, root->memory_usage().loop_memo_bytes);
+    tools[50]["name"] = "changed";
+    EXPECT_THAT(render(tools), testing::HasSubstr("<CHANGED>"));
+    EXPECT_GT(root->memory_usage().loop_memo_bytes, memo_bytes);
+
+    // Beyond its byte budget, the memo drops its oldest iterations.
+    options.loop_memo_max_bytes = memo_bytes / 4;
+    root = minja::Parser::parse("{% macro describe(t) %}{{ t.name | upper }}{% endmacro %}{% for tool in tools %}<{{ describe(tool) }}>{% endfor %}", options);
+    tools[50]["name"] = "tool50";
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(expected, render(tools));
+        EXPECT_GT(root->memory_usage().loop_memo_bytes, 0u);
+        EXPECT_LE(root->memory_usage().loop_memo_bytes, options.loop_memo_max_bytes);
+    }
+}
+
+TEST(LoopMemoizationTest, MacrosOfTheSameName) {
+    minja::Options options {};
+    options.memoize_loops = true;
+    auto root = minja::Parser::parse(
+        "{% if x %}{% macro m(t) %}A{{ t }}{% endmacro %}{% else %}{% macro m(t) %}B{{ t }}{% endmacro %}{% endif %}"
+        "{% for t in tools %}{{ m(t) }}{% endfor %}", options);
+    for (auto x : {true, false, true}) {
+        auto expected = x ? "A1A2" : "B1B2";
+        EXPECT_EQ(expected, root->render(minja::Context::make(json {{"x", x}, {"tools", {1, 2}}}))) << x;
+    }
+}
+
+TEST(LoopMemoizationTest, NotReusedAcrossRequests) {
+    minja::Options options {};
+    options.memoize_loops = true;
+    // Loops calling callables from the context, or macros reading globals, aren't memoized: their output may change with the request.
+    auto with_callable = minja::Parser::parse("{% for tool in tools %}<{{ describe(tool) }}>{% endfor %}", options);
+    auto with_global = minja::Parser::parse("{% macro describe(t) %}{{ prefix }}{{ t.name }}{% endmacro %}{% for tool in tools %}<{{ describe(tool) }}>{% endfor %}", options);
+    const json tools = json::array({{{"name", "a"}}, {{"name", "b"}}});
+    for (const auto & prefix : {"x", "y"}) {
+        auto context = minja::Context::make(json {{"tools", tools}, {"prefix", prefix}});
+        context->set("describe", minja::Value::callable([&](const std::shared_ptr<minja::Context> &, minja::ArgumentsValue & args) {
+            return prefix + args.args[0].at("name").get<std::string>();
+        }));
+        auto expected = std::string("<") + prefix + "a><" + prefix + "b>";
+        EXPECT_EQ(expected, with_callable->render(context));
+        EXPECT_EQ(expected, with_global->render(minja::Context::make(json {{"tools", tools}, {"prefix", prefix}})));
+    }
+    EXPECT_EQ(0u, with_callable->memory_usage().loop_memo_bytes);
+    EXPECT_EQ(0u, with_global->memory_usage().loop_memo_bytes);
+}
+
+TEST(ParallelLoopsTest, SameOutput) {
+    minja::Options parallel {};
+    parallel.parallel_loop_min_items = 2;
+    // Whether each template's loop is rendered in parallel.
+    const std::vector<std::pair<std::string, bool>> templates {
+        {"{% for tool in tools %}<tool>{{ tool | tojson }}</tool>{% endfor %}", true},
+        {"{% for tool in tools %}{{ loop.index }}:{{ tool.name }}{% if not loop.last %}, {% endif %}{% if loop.previtem %}<{{ loop.previtem.name }}{% endif %}{% endfor %}", true},
+        {"{% for tool in tools %}{% set name = tool.name | upper %}{{ prefix }}{{ name }}{% endfor %}", true},
+        {"{% for tool in tools %}{% if tool.name == 'b' %}{% continue %}{% endif %}{% for k, v in tool | items %}{{ k }}={{ v }},{% endfor %}{% endfor %}{{ k }}", true},
+        {"{% macro fmt(t) %}{% set n = t.name %}[{{ n }}]{% endmacro %}{% for tool in tools %}{{ fmt(tool) }}{{ tool | fmt }}{% endfor %}", true},
+        {"{% for tool in tools %}{% for x in tool.xs %}{{ x }}{% endfor %}{% endfor %}", true},
+        {"{% for tool in tools %}{% if prev is defined %}{{ prev }}>{% endif %}{{ tool.name }};{% set prev = tool.name %}{% endfor %}", false},
+        {"{% for tool in tools %}{% if tool.x %}{% set last_x = tool.x %}{% endif %}{{ last_x }}{% endfor %}", false},
+        {"{% for tool in tools %}{% for x in tool.xs %}{% endfor %}{{ x }}{% endfor %}", false},
+        {"{% set ns = namespace(n=0) %}{% for tool in tools %}{% set ns.n = ns.n + 1 %}{{ ns.n }}{{ tool.name }}{% endfor %}{{ ns.n }}", false},
+        {"{% set seen = [] %}{% for tool in tools %}{{ seen.append(tool.name) }}{{ seen | length }}{% endfor %}", false},
+        {"{% for tool in tools %}{{ loop.cycle('a', 'b') }}{{ tool.name }}{% endfor %}", false},
+        {"{% for tool in tools %}{% if tool.x %}{% break %}{% endif %}{{ tool.name }}{% endfor %}", false},
+        {"{% macro count() %}{% set ns.n = ns.n + 1 %}{% endmacro %}{% set ns = namespace(n=0) %}{% for tool in tools %}{{ count() }}{% endfor %}{{ ns.n }}", false},
+        {"{% for tool in tools %}{{ describe(tool) }}{% endfor %}", false},
+    };
+    auto tools = json::array();
+    for (int i = 0; i < 100; i++) {
+        tools.push_back({{"name", std::string(1, 'a' + i % 26)}, {"x", i % 7 == 6 ? json(i) : json()}, {"xs", json::array({i, i + 1})}});
+    }
+    const json bindings {{"tools", tools}, {"prefix", "-"}, {"describe", nullptr}};
+    for (const auto & [tmpl, expect_parallel] : templates) {
+        auto plain_root = minja::Parser::parse(tmpl, {});
+        auto parallel_root = minja::Parser::parse(tmpl, parallel);
+
+#ifndef MINJA_COMPILED_LIB
+        // Node classes are only declared with the implementation.
+        bool is_parallel = false;
+        auto sequence = std::dynamic_pointer_cast<minja::SequenceNode>(parallel_root);
+        for (const auto & child : sequence ? sequence->get_children() : std::vector<std::shared_ptr<minja::TemplateNode>> {parallel_root}) {
+            if (auto loop = std::dynamic_pointer_cast<minja::ForNode>(child)) is_parallel = loop->is_parallel();
+        }
+        EXPECT_EQ(expect_parallel, is_parallel) << tmpl;
+#else
+        (void) expect_parallel;
+#endif
+        if (tmpl.find("describe") == std::string::npos) {
+            EXPECT_EQ(plain_root->render(minja::Context::make(bindings)), parallel_root->render(minja::Context::make(bindings))) << tmpl;
+        }
+    }
+}
+
+TEST(ParallelLoopsTest, Errors) {
+    minja::Options options {};
+    options.parallel_loop_min_items = 2;
+    auto root = minja::Parser::parse("{% for i in range(1000) %}{% for j in range(i % 50) %}{{ j }}{% endfor %}{% if i in [420, 900] %}{{ raise_exception('at ' ~ i) }}{% endif %}{% endfor %}", options);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_THAT([&]() { root->render(minja::Context::make(json::object())); },
+                    testing::Throws<std::runtime_error>(Property(&std::runtime_error::what, testing::HasSubstr("at 420"))));
+    }
+}
+
+TEST(GenerationSpansTest, RecordsGenerationBlocks) {
+    const std::string tmpl =
+        "{% for m in messages %}<{{ m.role }}>"
+        "{% if m.role == 'assistant' %}{% generation %}{{ m.content }}{% generation %}!{% endgeneration %}{% endgeneration %}{% else %}{{ m.content }}{% endif %}"
+        "</{{ m.role }}>{% endfor %}";
+    auto messages = json::array();
+    for (int i = 0; i < 6; i++) {
+        messages.push_back({{"role", i % 2 ? "assistant" : "user"}, {"content", std::string(i + 1, 'a' + i)}});
+    }
+    const json bindings {{"messages", messages}};
+    minja::Options options {};
+    options.generation_spans = true;
+    auto expected = minja::Parser::parse(tmpl, {})->render(minja::Context::make(bindings));
+
+    minja::Options memoized = options, parallel = options;
+    memoized.memoize_loops = true;
+    parallel.parallel_loop_min_items = 2;
+    for (const auto & opts : {options, memoized, parallel}) {
+        auto root = minja::Parser::parse(tmpl, opts);
+        // Warms up the memoized iterations.
+        EXPECT_EQ(expected, root->render(minja::Context::make(bindings)));
+
+        std::string res = "prefix";
+        minja::StringSink out(res);
+        std::vector<minja::OutputSpan> spans;
+        root->render_generation_spans(out, minja::Context::make(bindings), spans);
+        EXPECT_EQ("prefix" + expected, res);
+        std::vector<std::string> generated;
+        for (const auto & span : spans) generated.push_back(res.substr(6 + span.begin, span.end - span.begin));
+        EXPECT_EQ((std::vector<std::string> {"bb!", "dddd!", "ffffff!"}), generated);
+    }
+
+    std::vector<minja::OutputSpan> spans;
+    std::string res;
+    minja::StringSink out(res);
+    minja::Parser::parse(tmpl, {})->render_generation_spans(out, minja::Context::make(bindings), spans);
+    EXPECT_EQ(expected, res);
+    EXPECT_TRUE(spans.empty());
+}
+
+TEST(MemoryUsageTest, Template) {
+    const std::string source = "{% for tool in tools %}{{ tool.name | upper }}, {% endfor %}";
+    auto root = minja::Parser::parse(source, {});
+    auto usage = root->memory_usage();
+    EXPECT_EQ(1u, usage.counts_by_type["ForNode"]);
+    EXPECT_EQ(1u, usage.counts_by_type["TextNode"]);
+    EXPECT_EQ(1u, usage.counts_by_type["FilterExpr"]);
+    size_t counted = 0;
+    for (const auto & [type, count] : usage.counts_by_type) counted += count;
+    EXPECT_EQ(usage.nodes + usage.expressions, counted);
+    EXPECT_EQ((usage.nodes + usage.expressions) * sizeof(minja::Location), usage.location_bytes);
+    EXPECT_EQ(source.size(), usage.source_bytes);
+    // ", ", "tools", "tool", "name", "upper"
+    EXPECT_EQ(2u + 5 + 4 + 4 + 5, usage.literal_bytes);
+    EXPECT_EQ(usage.node_bytes + usage.literal_bytes + usage.source_bytes, usage.total_bytes);
+
+    minja::Options generation_options {};
+    generation_options.generation_spans = true;
+    auto generation = minja::Parser::parse("{% generation %}{{ x }}{% endgeneration %}", generation_options)->memory_usage();
+    EXPECT_EQ(1u, generation.counts_by_type["GenerationNode"]);
+    EXPECT_EQ(0u, generation.counts_by_type["TemplateNode"]);
+
+    minja::Options options {};
+    options.memoize_loops = true;
+    auto memoized = minja::Parser::parse(source, options);
+    EXPECT_EQ(0u, memoized->memory_usage().loop_memo_bytes);
+    memoized->render(minja::Context::make(json {{"tools", json::array({{{"name", "a"}}, {{"name", "b"}}})}}));
+    EXPECT_GT(memoized->memory_usage().loop_memo_bytes, 2 * sizeof("A, "));
+}
+
+TEST(MemoryUsageTest, Value) {
+    auto inner = minja::Value::array();
+    inner.push_back(minja::Value("abc"));
+    auto value = minja::Value::array();
+    value.push_back(inner);
+    value.push_back(inner);
+    value.push_back(minja::Value(std::string(1000, 'x')));
+    auto object = minja::Value::object();
+    object.set("key", minja::Value((int64_t) 1));
+    value.push_back(object);
+    inner = minja::Value();
+
+    auto usage = value.memory_usage();
+    EXPECT_EQ(2u, usage.arrays);
+    EXPECT_EQ(1u, usage.objects);
+    EXPECT_EQ(2u, usage.strings);
+    EXPECT_EQ(1003u, usage.string_bytes);
+    EXPECT_GE(usage.array_bytes, 5 * sizeof(minja::Value));
+    EXPECT_GE(usage.object_bytes, 3u);
+    EXPECT_EQ(sizeof(minja::Value) + usage.array_bytes + usage.object_bytes + usage.string_bytes, usage.total_bytes);
+    EXPECT_EQ(usage.total_bytes, usage.unique_bytes + usage.shared_bytes);
+    // The inner array is referenced twice, by the outer one.
+    EXPECT_GT(usage.shared_bytes, 0u);
+    EXPECT_GT(usage.unique_bytes, 1000u);
+
+    auto copy = value;
+    EXPECT_EQ(usage.total_bytes - sizeof(minja::Value), value.memory_usage().shared_bytes);
+}
+
+TEST(PersistentArrayTest, SharesItems) {
+    auto a = minja::PersistentArray().push_back("x").push_back("y");
+    auto b = a.push_back("z");
+    auto c = b.push_back("w");
+    EXPECT_EQ(2u, a.size());
+    EXPECT_EQ(3u, b.size());
+    EXPECT_EQ(minja::Value("z"), c.at(2));
+
+    // Appending to an older version branches off without changing the others.
+    auto d = a.push_back("branch");
+    EXPECT_EQ(R"(["x", "y", "branch"])", d.to_value().dump(-1, true));
+    EXPECT_EQ(R"(["x", "y", "z", "w"])", c.to_value().dump(-1, true));
+    EXPECT_EQ(R"(["x", "y"])", a.to_value().dump(-1, true));
+
+    // Templates can't resize the arrays, only copies of them.
+    auto context = minja::Context::make(minja::Value::object());
+    for (const auto & version : {b, c}) {
+        context->set("items", version.to_value());
+        EXPECT_THAT([&]() { minja::Parser::parse("{{ items.append('t') }}", {})->render(context); },
+            testing::Throws<std::runtime_error>(Property(&std::runtime_error::what, testing::HasSubstr("Cannot resize an array shared by a PersistentArray"))));
+        EXPECT_EQ(std::to_string(version.size() + 1), minja::Parser::parse("{% set copy = items[:] %}{{ copy.append('t') or copy | length }}", {})->render(context));
+        EXPECT_EQ(version.size(), version.to_value().size());
+    }
+
+    // Values of the latest version share its items: the next push_back copies them if they're still alive.
+    auto e = minja::PersistentArray().push_back("x");
+    auto held = e.to_value();
+    auto f = e.push_back("y");
+    EXPECT_EQ(1u, held.size());
+    EXPECT_EQ(R"(["x", "y"])", f.to_value().dump(-1, true));
+    EXPECT_EQ(R"(["x", "y", "z"])", f.push_back("z").to_value().dump(-1, true));
+}
+
+TEST(RenderCheckpointTest, ResumesAfterSharedMessages) {
+    auto root = minja::Parser::parse(
+        "{%- set ns = namespace(n=0) -%}<s>{% for m in messages %}{% set ns.n = ns.n + 1 %}{% if not loop.first %}({{ last }}){% endif %}{% set last = m.content %}"
+        "[{{ loop.index }}:{{ m.content }}:{{ ns.n }}:{{ loop.cycle('a', 'b', 'c') }}]{% endfor %}</s>{{ ns.n }}", {});
+    auto make_messages = [](const std::vector<std::string> & contents) {
+        auto messages = json::array();
+        for (const auto & content : contents) messages.push_back({{"role", "user"}, {"content", content}});
+        return json {{"messages", messages}};
+    };
+    std::shared_ptr<minja::RenderCheckpoint> checkpoint;
+    auto first = make_messages({"a", "b", "c", "d"});
+    EXPECT_EQ(root->render(minja::Context::make(first)), root->render_checkpoint(minja::Context::make(first), 2, checkpoint));
+    ASSERT_TRUE(checkpoint);
+    EXPECT_EQ("<s>[1:a:1:a](a)[2:b:2:b]", checkpoint->output);
+
+    for (const auto & bindings : {make_messages({"a", "b", "x"}), make_messages({"a", "b", "c", "d", "e", "f"})}) {
+        std::string out;
+        minja::StringSink sink(out);
+        EXPECT_TRUE(root->render_from(*checkpoint, sink, minja::Context::make(bindings)));
+        EXPECT_EQ(root->render(minja::Context::make(bindings)), out);
+    }
+
+    // Doesn't apply to other messages, other inputs or when there are no more messages.
+    auto other_inputs = make_messages({"a", "b", "c"});
+    other_inputs["extra"] = 1;
+    for (const auto & bindings : {make_messages({"a", "x", "c"}), make_messages({"a", "b"}), other_inputs}) {
+        std::string out;
+        minja::StringSink sink(out);
+        EXPECT_FALSE(root->render_from(*checkpoint, sink, minja::Context::make(bindings))) << bindings.dump();
+        EXPECT_EQ("", out);
+    }
+
+    // The loop depends on the number of messages, or on the following ones.
+    for (const auto & tmpl : {
+        "{% for m in messages %}{{ loop.revindex }}{% endfor %}",
+        "{% for m in messages %}[{{ m.content }}/{{ messages | length }}]{% endfor %}",
+        "{% set loop_messages = messages[1:] %}{% for m in loop_messages %}{{ m.content }}{% if m == loop_messages[-1] %}!{% endif %}{% endfor %}",
+        "{% for m in messages %}{{ loop['next' ~ 'item'] }}{% endfor %}",
+        "{% macro last() %}{{ messages[-1].content }}{% endmacro %}{% for m in messages %}{{ m.content }}{{ last() }}{% endfor %}",
+        "{% macro show(l) %}{{ l.length }}{% endmacro %}{% for m in messages %}{{ show(loop) }}{% endfor %}",
+    }) {
+        auto length_dependent = minja::Parser::parse(tmpl, {});
+        length_dependent->render_checkpoint(minja::Context::make(first), 2, checkpoint);
+        EXPECT_FALSE(checkpoint) << tmpl;
+    }
+
+    // Loops over a variable are resolved through its assignments, whatever its name: only suffixes of messages qualify.
+    auto renamed = minja::Parser::parse("{% set msgs = messages[1:] %}{% for m in msgs %}[{{ m.content }}]{% endfor %}", {});
+    EXPECT_EQ(renamed->render(minja::Context::make(first)), renamed->render_checkpoint(minja::Context::make(first), 2, checkpoint));
+    ASSERT_TRUE(checkpoint);
+    EXPECT_EQ("[b]", checkpoint->output);
+    for (const auto & tmpl : {
+        "{% set loop_messages = messages[:-1] %}{% for m in loop_messages %}[{{ m.content }}]{% endfor %}",
+        "{% set loop_messages = messages[1:] %}{% if extra %}{% set loop_messages = messages[::2] %}{% endif %}{% for m in loop_messages %}[{{ m.content }}]{% endfor %}",
+        "{% set other_messages = ['x', 'y', 'z'] %}{% for m in other_messages %}[{{ m }}]{% endfor %}",
+        "{% for m in loop_messages %}[{{ m.content }}]{% endfor %}",
+    }) {
+        auto not_messages = minja::Parser::parse(tmpl, {});
+        not_messages->render_checkpoint(minja::Context::make(first), 2, checkpoint);
+        EXPECT_FALSE(checkpoint) << tmpl;
+    }
+
+    // Loop attributes of nested loops and macros that only see their arguments are fine.
+    auto nested = minja::Parser::parse(
+        "{% macro fmt(m) %}<{{ m.content }}>{% endmacro %}{% for m in messages %}{% for c in m.content %}{{ loop.length }}{% endfor %}"
+        "{{ fmt(m) }}{{ m | fmt }}{{ loop.last }}{% endfor %}", {});
+    auto three = make_messages({"a", "b", "c"});
+    EXPECT_EQ(nested->render(minja::Context::make(three)), nested->render_checkpoint(minja::Context::make(three), 2, checkpoint));
+    ASSERT_TRUE(checkpoint);
+    std::string out;
+    minja::StringSink sink(out);
+    auto more = make_messages({"a", "b", "c", "d"});
+    EXPECT_TRUE(nested->render_from(*checkpoint, sink, minja::Context::make(more)));
+    EXPECT_EQ(nested->render(minja::Context::make(more)), out);
+}
+
+TEST(ValueTest, Streamed) {
+    int calls = 0;
+    auto content = minja::Value::stream([&](const minja::Value::ChunkCallback & callback) {
+        calls++;
+        for (int i = 0; i < 3; i++) {
+            callback("chunk" + std::to_string(i) + ";");
+        }
+    });
+    EXPECT_TRUE(content.is_string());
+    EXPECT_TRUE(content.is_streamed());
+
+    // Chunks go straight to the sink when the value is printed as is.
+    struct ChunksSink : public minja::OutputSink {
+        std::vector<std::string> chunks;
+        void do_write(std::string_view text) override { chunks.emplace_back(text); }
+    };
+    auto root = minja::Parser::parse("[{{ content }}]", {});
+    auto context = minja::Context::make(minja::Value::object());
+    context->set("content", content);
+    ChunksSink sink;
+    root->render(sink, context);
+    EXPECT_EQ(std::vector<std::string>({"[", "chunk0;", "chunk1;", "chunk2;", "]"}), sink.chunks);
+    EXPECT_EQ(1, calls);
+    EXPECT_EQ("[chunk0;chunk1;chunk2;]", root->render(context));
+    EXPECT_EQ(2, calls);
+
+    // Other uses materialize it, once.
+    EXPECT_EQ("CHUNK0;CHUNK1;CHUNK2;|21|True|\"chunk0;chunk1;chunk2;\"|chunk0;chunk1;chunk2;!",
+        minja::Parser::parse("{{ content | upper }}|{{ content | length }}|{{ 'chunk1' in content }}|{{ content | tojson }}|{{ content + '!' }}", {})->render(context));
+    EXPECT_EQ(3, calls);
+    EXPECT_EQ("[chunk0;chunk1;chunk2;]", root->render(context));
+    EXPECT_EQ(3, calls);
+    EXPECT_EQ(minja::Value("chunk0;chunk1;chunk2;"), content);
+}
+
+TEST(TemplateCacheTest, SharesParsedTemplates) {
+    minja::TemplateCache cache(/* capacity= */ 2, /* n_shards= */ 1);
+    auto context = minja::Context::make(json {{"x", 1}});
+
+    auto a = cache.get_or_parse("{% if x %}\n{{ x }}{% endif %}", {});
+    EXPECT_EQ(a, cache.get_or_parse("{% if x %}\n{{ x }}{% endif %}", {}));
+    auto a_trimmed = cache.get_or_parse("{% if x %}\n{{ x }}{% endif %}", trim_blocks);
+    EXPECT_NE(a, a_trimmed);
+    EXPECT_EQ("\n1", a->render(context));
+    EXPECT_EQ("1", a_trimmed->render(context));
+
+    auto stats = cache.stats();
+    EXPECT_EQ(1u, stats.hits);
+    EXPECT_EQ(2u, stats.misses);
+    EXPECT_EQ(2u, stats.size);
+    EXPECT_GT(stats.parse_time.count(), 0);
+
+    // Touch a so that a_trimmed is the least recently used.
+    cache.get_or_parse("{% if x %}\n{{ x }}{% endif %}", {});
+    cache.get_or_parse("{{ x + 1 }}", {});
+    stats = cache.stats();
+    EXPECT_EQ(1u, stats.evictions);
+    EXPECT_EQ(2u, stats.size);
+    EXPECT_EQ(a, cache.get_or_parse("{% if x %}\n{{ x }}{% endif %}", {}));
+    EXPECT_EQ("1", a_trimmed->render(context));
+
+    EXPECT_THROW(cache.get_or_parse("{% if x %}", {}), std::runtime_error);
+    EXPECT_EQ(2u, cache.size());
+
+    cache.clear();
+    EXPECT_EQ(0u, cache.size());
+}
+
+TEST(TemplateCacheTest, ConcurrentAccess) {
+    minja::TemplateCache cache(/* capacity= */ 8);
+    std::vector<std::thread> threads;
+    std::vector<std::string> outputs(8);
+    for (size_t t = 0; t < outputs.size(); t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < 100; i++) {
+                auto root = cache.get_or_parse("{{ " + std::to_string(i % 16) + " }}", {});
+                outputs[t] += root->render(minja::Context::make(json::object()));
+            }
+        });
+    }
+    for (auto & thread : threads) thread.join();
+    for (const auto & out : outputs) {
+        EXPECT_EQ(outputs[0], out);
+    }
+    auto stats = cache.stats();
+    EXPECT_EQ(800u, stats.hits + stats.misses);
+    EXPECT_LE(stats.size, cache.capacity());
+}